@@ -0,0 +1,219 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "footprint.h"
+
+/* Stack guards are a page or a few; arena reserves run to megabytes. */
+#define MAX_GUARD_SIZE (64 * 1024)
+
+#define RAISE_PEAK(peak, value) do { \
+    __typeof__(peak) old = __atomic_load_n(&(peak), __ATOMIC_RELAXED); \
+    while ((value) > old && !__atomic_compare_exchange_n(&(peak), &old, (value), 1, \
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) \
+        ; \
+} while (0)
+
+const char *footprint_names[FOOTPRINT_NUM_FIELDS] = {
+    [FOOTPRINT_SIZE] = "size",
+    [FOOTPRINT_RSS] = "rss",
+    [FOOTPRINT_PSS] = "pss",
+    [FOOTPRINT_SWAP] = "swap",
+    [FOOTPRINT_RSS_HWM] = "rss_hwm",
+    [FOOTPRINT_HEAP] = "heap",
+    [FOOTPRINT_STACKS] = "stacks",
+    [FOOTPRINT_FILES] = "files",
+    [FOOTPRINT_ANON] = "anon",
+};
+
+static size_t (*cache_bytes[FOOTPRINT_MAX_CACHES])(void);
+static footprint_t peaks;
+
+/* One mapping from smaps and how much of it is resident. */
+typedef struct mapping {
+    unsigned long start, end;
+    char perms[5];
+    char path[256];
+    size_t rss_kb;
+} mapping_t;
+
+void footprint_track(const char *name, size_t (*bytes)(void)) {
+    if (peaks.num_caches == FOOTPRINT_MAX_CACHES) return;
+    cache_bytes[peaks.num_caches] = bytes;
+    peaks.cache_names[peaks.num_caches++] = name;
+}
+
+static FILE *open_proc(pid_t pid, const char *name) {
+    char path[64];
+    if (pid)
+        snprintf(path, sizeof(path), "/proc/%d/%s", (int) pid, name);
+    else
+        snprintf(path, sizeof(path), "/proc/self/%s", name);
+    return fopen(path, "r");
+}
+
+/* Parses a "Name:   123 kB" line into *VALUE if it is the NAME field. */
+static int parse_field(const char *line, const char *name, size_t *value) {
+    size_t length = strlen(name);
+    if (strncmp(line, name, length) != 0 || line[length] != ':') return 0;
+    *value = strtoul(line + length + 1, NULL, 10);
+    return 1;
+}
+
+/* Parses the first line of a mapping in smaps, the same as a line of maps:
+ * "start-end perms offset dev inode [path]". */
+static int parse_mapping(const char *line, mapping_t *mapping) {
+    int path_offset = 0;
+    if (sscanf(line, "%lx-%lx %4s %*s %*s %*s %n", &mapping->start, &mapping->end,
+            mapping->perms, &path_offset) < 3 || path_offset == 0)
+        return -1;
+    snprintf(mapping->path, sizeof(mapping->path), "%s", line + path_offset);
+    mapping->path[strcspn(mapping->path, "\n")] = '\0';
+    mapping->rss_kb = 0;
+    return 0;
+}
+
+static int is_anonymous(const mapping_t *mapping) {
+    const char *path = mapping->path;
+    return path[0] == '\0' || strncmp(path, "/dev/zero", 9) == 0 ||
+        strncmp(path, "/SYSV", 5) == 0 || strncmp(path, "/memfd:", 7) == 0 ||
+        strncmp(path, "[anon", 5) == 0;
+}
+
+/* Whether MAPPING is reserved address space, neither readable nor backed. */
+static int is_reserved(const mapping_t *mapping) {
+    return strcmp(mapping->perms, "---p") == 0 && mapping->path[0] == '\0';
+}
+
+/* Sorts MAPPING by what it is and by its neighbours BELOW and ABOVE, which
+ * are NULL at either end of the address space. */
+static footprint_field_t classify(const mapping_t *below, const mapping_t *mapping,
+        const mapping_t *above) {
+    if (strcmp(mapping->path, "[heap]") == 0) return FOOTPRINT_HEAP;
+    if (strncmp(mapping->path, "[stack", 6) == 0) return FOOTPRINT_STACKS;
+    if (!is_anonymous(mapping)) return FOOTPRINT_FILES;
+    if (below && below->end == mapping->start && is_reserved(below) &&
+            below->end - below->start <= MAX_GUARD_SIZE)
+        return FOOTPRINT_STACKS;
+    if (above && above->start == mapping->end && is_reserved(above))
+        return FOOTPRINT_HEAP;
+    return FOOTPRINT_ANON;
+}
+
+static void account(footprint_t *footprint, const mapping_t *below, const mapping_t *mapping,
+        const mapping_t *above) {
+    footprint_field_t field = classify(below, mapping, above);
+    footprint->kb[field] += mapping->rss_kb;
+    if (field == FOOTPRINT_STACKS) footprint->stacks++;
+}
+
+/* Walks smaps, adding each mapping's resident size to its kind. Also sums
+ * RSS, PSS and swap in case there is no smaps_rollup. */
+static int sample_mappings(pid_t pid, footprint_t *footprint) {
+    FILE *smaps = open_proc(pid, "smaps");
+    if (!smaps) return -1;
+    char line[512];
+    mapping_t below, current, next;
+    int have_below = 0, have_current = 0;
+    size_t value;
+    while (fgets(line, sizeof(line), smaps)) {
+        if (parse_mapping(line, &next) == 0) {
+            if (have_current) {
+                account(footprint, have_below ? &below : NULL, &current, &next);
+                below = current;
+                have_below = 1;
+            }
+            current = next;
+            have_current = 1;
+        } else if (parse_field(line, "Rss", &value)) {
+            current.rss_kb = value;
+            footprint->kb[FOOTPRINT_RSS] += value;
+        } else if (parse_field(line, "Pss", &value)) {
+            footprint->kb[FOOTPRINT_PSS] += value;
+        } else if (parse_field(line, "Swap", &value)) {
+            footprint->kb[FOOTPRINT_SWAP] += value;
+        }
+    }
+    if (have_current) account(footprint, have_below ? &below : NULL, &current, NULL);
+    fclose(smaps);
+    return 0;
+}
+
+int footprint_sample(pid_t pid, footprint_t *footprint) {
+    memset(footprint, 0, sizeof(*footprint));
+    FILE *file = open_proc(pid, "statm");
+    if (!file) return -1;
+    unsigned long size;
+    int matched = fscanf(file, "%lu", &size);
+    fclose(file);
+    if (matched != 1) {
+        errno = EINVAL;
+        return -1;
+    }
+    footprint->kb[FOOTPRINT_SIZE] = size * (sysconf(_SC_PAGESIZE) / 1024);
+
+    if (sample_mappings(pid, footprint) < 0) return -1;
+
+    char line[256];
+    size_t value;
+    /* The rollup is summed in one pass by the kernel, so it agrees with
+     * itself better than the walk above does. */
+    if ((file = open_proc(pid, "smaps_rollup"))) {
+        while (fgets(line, sizeof(line), file)) {
+            if (parse_field(line, "Rss", &value)) footprint->kb[FOOTPRINT_RSS] = value;
+            else if (parse_field(line, "Pss", &value)) footprint->kb[FOOTPRINT_PSS] = value;
+            else if (parse_field(line, "Swap", &value)) footprint->kb[FOOTPRINT_SWAP] = value;
+        }
+        fclose(file);
+    }
+    if ((file = open_proc(pid, "status"))) {
+        while (fgets(line, sizeof(line), file)) {
+            if (parse_field(line, "VmHWM", &value)) footprint->kb[FOOTPRINT_RSS_HWM] = value;
+            else if (parse_field(line, "Threads", &value)) footprint->threads = value;
+        }
+        fclose(file);
+    }
+
+    if (pid != 0 && pid != getpid()) return 0;
+    footprint->num_caches = peaks.num_caches;
+    for (int i = 0; i < peaks.num_caches; i++) {
+        footprint->cache_names[i] = peaks.cache_names[i];
+        footprint->cache_kb[i] = cache_bytes[i]() / 1024;
+        RAISE_PEAK(peaks.cache_kb[i], footprint->cache_kb[i]);
+    }
+    for (int i = 0; i < FOOTPRINT_NUM_FIELDS; i++)
+        RAISE_PEAK(peaks.kb[i], footprint->kb[i]);
+    RAISE_PEAK(peaks.threads, footprint->threads);
+    RAISE_PEAK(peaks.stacks, footprint->stacks);
+    return 0;
+}
+
+void footprint_peak(footprint_t *peak) {
+    memset(peak, 0, sizeof(*peak));
+    for (int i = 0; i < FOOTPRINT_NUM_FIELDS; i++)
+        peak->kb[i] = __atomic_load_n(&peaks.kb[i], __ATOMIC_RELAXED);
+    peak->threads = __atomic_load_n(&peaks.threads, __ATOMIC_RELAXED);
+    peak->stacks = __atomic_load_n(&peaks.stacks, __ATOMIC_RELAXED);
+    peak->num_caches = peaks.num_caches;
+    for (int i = 0; i < peaks.num_caches; i++) {
+        peak->cache_names[i] = peaks.cache_names[i];
+        peak->cache_kb[i] = __atomic_load_n(&peaks.cache_kb[i], __ATOMIC_RELAXED);
+    }
+}
+
+void footprint_print(FILE *out, const footprint_t *footprint, const footprint_t *peak) {
+    for (int i = 0; i < FOOTPRINT_NUM_FIELDS; i++) {
+        fprintf(out, "%-18s %10zu KB", footprint_names[i], footprint->kb[i]);
+        if (peak && i != FOOTPRINT_RSS_HWM) fprintf(out, "  (peak %zu KB)", peak->kb[i]);
+        fprintf(out, "\n");
+    }
+    fprintf(out, "%-18s %10d\n", "threads", footprint->threads);
+    fprintf(out, "%-18s %10d\n", "stack mappings", footprint->stacks);
+    for (int i = 0; i < footprint->num_caches; i++) {
+        fprintf(out, "cache %-12s %10zu KB", footprint->cache_names[i], footprint->cache_kb[i]);
+        if (peak) fprintf(out, "  (peak %zu KB)", peak->cache_kb[i]);
+        fprintf(out, "\n");
+    }
+}
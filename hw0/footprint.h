@@ -0,0 +1,62 @@
+#ifndef __FOOTPRINT__
+#define __FOOTPRINT__
+
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+/* FOOTPRINT reports where a process's memory goes, like map does for a
+ * handful of addresses, but for every mapping. Totals come from
+ * /proc/<pid>/statm and smaps_rollup; resident memory is broken down by
+ * walking smaps and sorting each mapping into one of:
+ *
+ *   heap    the brk heap and malloc's thread arenas, which are mapped with
+ *           a reserved, inaccessible tail above them;
+ *   stacks  the main stack and thread stacks, which have a small guard
+ *           page below them (coroutine stacks included);
+ *   files   mapped files, the program and its libraries included;
+ *   anon    all other anonymous memory: large mallocs, shared memory.
+ *
+ * Samples of the calling process also raise the high-water mark of each
+ * field, and report the bytes held by caches registered with
+ * footprint_track, which are part of the heap and anon memory above. */
+
+typedef enum footprint_field {
+    FOOTPRINT_SIZE,        // Mapped address space.
+    FOOTPRINT_RSS,
+    FOOTPRINT_PSS,         // RSS with shared pages split among their users.
+    FOOTPRINT_SWAP,
+    FOOTPRINT_RSS_HWM,     // The kernel's own high-water mark of RSS.
+    FOOTPRINT_HEAP,        // Resident, by kind of mapping.
+    FOOTPRINT_STACKS,
+    FOOTPRINT_FILES,
+    FOOTPRINT_ANON,
+    FOOTPRINT_NUM_FIELDS
+} footprint_field_t;
+
+#define FOOTPRINT_MAX_CACHES 8
+
+typedef struct footprint {
+    size_t kb[FOOTPRINT_NUM_FIELDS];
+    int threads;
+    int stacks;                                // Stack mappings found.
+    int num_caches;
+    const char *cache_names[FOOTPRINT_MAX_CACHES];
+    size_t cache_kb[FOOTPRINT_MAX_CACHES];
+} footprint_t;
+
+extern const char *footprint_names[FOOTPRINT_NUM_FIELDS];
+
+/* Reports the bytes BYTES() returns as the cache NAME in samples of this
+ * process. Must be called before other threads take samples. */
+void footprint_track(const char *name, size_t (*bytes)(void));
+/* Samples process PID, or the calling process if 0, into FOOTPRINT.
+ * Returns -1 with errno set if its /proc files can't be read. */
+int footprint_sample(pid_t pid, footprint_t *footprint);
+/* Stores the largest value of each field sampled in this process so far. */
+void footprint_peak(footprint_t *peak);
+/* Prints FOOTPRINT one field per line, with high-water marks from PEAK if
+ * it is not NULL. */
+void footprint_print(FILE *out, const footprint_t *footprint, const footprint_t *peak);
+
+#endif
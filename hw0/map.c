@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "footprint.h"
+
 /* A staticly allocated variable */
 int foo;
 
@@ -44,6 +46,11 @@ int main(int argc, char *argv[]) {
     printf("Heap: malloc 2: %p\n", buf2);
     recur(3);
 
+    /* Where all of it went, mapping by mapping */
+    footprint_t footprint;
+    if (footprint_sample(0, &footprint) == 0)
+        footprint_print(stdout, &footprint, NULL);
+
     free(buf1);
     free(buf2);
     return 0;
@@ -15,6 +15,7 @@
 #include "tokenizer.h"
 #include "int_handler.h"
 #include "utils.h"
+#include "footprint.h"
 
 /* Maximun number of character of a path */
 #define MAX_PATH 1024
@@ -41,6 +42,7 @@ int cmd_cd(struct tokens *tokens);
 int cmd_exec(struct tokens *tokens);
 int cmd_wait(struct tokens *tokens);
 int cmd_foo(struct tokens *tokens);
+int cmd_mem(struct tokens *tokens);
 
 /* Built-in command functions take token array (see parse.h) and return int */
 typedef int cmd_fun_t(struct tokens *tokens);
@@ -60,6 +62,7 @@ fun_desc_t cmd_table[] = {
   {cmd_exec, "exec", "replace current process with another program"},
   {cmd_wait, "wait", "wait for all background jobs to finish"},
   {cmd_foo, "foo", "run test code"},
+  {cmd_mem, "mem", "show where the memory of the shell, or of a process id, goes"},
 };
 
 /* Prints a helpful description for the given command */
@@ -244,6 +247,21 @@ int cmd_foo(unused struct tokens *tokens) {
   return 0;
 }
 
+/* Prints the memory footprint of the shell, or of the given process */
+int cmd_mem(struct tokens *tokens) {
+  pid_t pid = 0;
+  if (tokens_get_length(tokens) > 1)
+    pid = atoi(tokens_get_token(tokens, 1));
+
+  footprint_t footprint;
+  if (footprint_sample(pid, &footprint) < 0) {
+    perror("mem");
+    return -1;
+  }
+  footprint_print(stdout, &footprint, NULL);
+  return 0;
+}
+
 /* Looks up the built-in command, if it exists. */
 int lookup(char cmd[]) {
   for (unsigned int i = 0; i < sizeof(cmd_table) / sizeof(fun_desc_t); i++)
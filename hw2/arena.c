@@ -0,0 +1,70 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+/* Heap blocks are at least this big, so spilling costs few mallocs. */
+#define ARENA_BLOCK_SIZE 16384
+
+void arena_init(arena_t *arena, void *space, size_t size) {
+  arena->space = space;
+  arena->space_size = size;
+  arena->blocks = NULL;
+  arena_reset(arena);
+}
+
+static char *arena_align(char *p) {
+  return (char *) (((uintptr_t) p + ARENA_ALIGN - 1) & ~(uintptr_t) (ARENA_ALIGN - 1));
+}
+
+void *arena_alloc(arena_t *arena, size_t size) {
+  char *p = arena_align(arena->cursor);
+  if (p <= arena->end && size <= (size_t) (arena->end - p)) {
+    arena->cursor = p + size;
+    return p;
+  }
+
+  size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+  arena_block_t *block = malloc(sizeof(arena_block_t) + block_size);
+  if (!block) {
+    fprintf(stderr, "Arena allocation of %zu bytes failed\n", size);
+    exit(ENOMEM);
+  }
+  block->size = block_size;
+  block->next = arena->blocks;
+  arena->blocks = block;
+  arena->cursor = block->data + size;
+  arena->end = block->data + block_size;
+  return block->data;
+}
+
+void *arena_calloc(arena_t *arena, size_t size) {
+  void *p = arena_alloc(arena, size);
+  memset(p, 0, size);
+  return p;
+}
+
+char *arena_strndup(arena_t *arena, const char *s, size_t size) {
+  char *copy = arena_alloc(arena, size + 1);
+  memcpy(copy, s, size);
+  copy[size] = '\0';
+  return copy;
+}
+
+void arena_reset(arena_t *arena) {
+  while (arena->blocks) {
+    arena_block_t *block = arena->blocks;
+    arena->blocks = block->next;
+    free(block);
+  }
+  arena->cursor = arena->space;
+  arena->end = arena->space + arena->space_size;
+}
+
+void arena_free(arena_t *arena) {
+  arena_reset(arena);
+  arena->cursor = arena->end = NULL;
+}
@@ -0,0 +1,42 @@
+#ifndef __ARENA__
+#define __ARENA__
+
+#include <stddef.h>
+
+/* ARENA is a bump allocator for memory that lives exactly as long as one
+ * request. Allocations are carved out of a block in turn and are never
+ * freed one by one; arena_reset releases all of them at once. The first
+ * block is supplied by the owner (e.g. embedded in the connection), so a
+ * request that fits in it never calls malloc. Larger requests spill into
+ * heap blocks, which the next reset frees. An arena is not thread-safe, but
+ * only one thread serves a connection at a time. */
+
+#define ARENA_ALIGN 16
+
+typedef struct arena_block {
+  struct arena_block *next;
+  size_t size;
+  char data[] __attribute__((aligned(ARENA_ALIGN)));
+} arena_block_t;
+
+typedef struct arena {
+  char *space;                  // The owner's first block.
+  size_t space_size;
+  char *cursor;                 // Next free byte of the current block.
+  char *end;
+  arena_block_t *blocks;        // Heap blocks, newest first.
+} arena_t;
+
+/* Starts an arena over SPACE, which must stay valid for its lifetime. */
+void arena_init(arena_t *arena, void *space, size_t size);
+/* Returns SIZE bytes aligned to ARENA_ALIGN. Exits if out of memory, like
+ * the other request-path allocations. */
+void *arena_alloc(arena_t *arena, size_t size);
+void *arena_calloc(arena_t *arena, size_t size);
+char *arena_strndup(arena_t *arena, const char *s, size_t size);
+/* Releases everything allocated since arena_init or the last reset. */
+void arena_reset(arena_t *arena);
+/* Resets the arena for the last time, before its space goes away. */
+void arena_free(arena_t *arena);
+
+#endif
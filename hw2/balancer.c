@@ -0,0 +1,240 @@
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "balancer.h"
+#include "coro.h"
+
+static balancer_backend_t *balancer_backends;
+static int balancer_num_backends;
+static int balancer_num_pools;
+static balancer_policy_t balancer_policy;
+static int balancer_max_failures;
+static int balancer_eject_seconds;
+static int balancer_connect_timeout;
+static unsigned int balancer_next;
+
+static int balancer_resolve(balancer_backend_t *backend, const char *name) {
+  char host[128];
+  snprintf(backend->name, sizeof(backend->name), "%s", name);
+  snprintf(host, sizeof(host), "%s", name);
+  char *port = "80";
+  char *colon = strchr(host, ':');
+  if (colon) {
+    *colon = '\0';
+    port = colon + 1;
+  }
+  struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM }, *addresses;
+  if (getaddrinfo(host, port, &hints, &addresses) != 0) return -1;
+  memcpy(&backend->address, addresses->ai_addr, sizeof(backend->address));
+  freeaddrinfo(addresses);
+  backend->healthy = 1;
+  return 0;
+}
+
+int balancer_init(balancer_policy_t policy, int max_failures, int eject_seconds,
+    int connect_timeout) {
+  balancer_backends = mmap(NULL, BALANCER_MAX_BACKENDS * sizeof(balancer_backend_t),
+      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (balancer_backends == MAP_FAILED) return -1;
+  balancer_policy = policy;
+  balancer_max_failures = max_failures;
+  balancer_eject_seconds = eject_seconds;
+  balancer_connect_timeout = connect_timeout;
+  return 0;
+}
+
+int balancer_add_pool(const char *list) {
+  int pool = balancer_num_pools, first = balancer_num_backends;
+  char *names = strdup(list), *saveptr;
+  for (char *name = strtok_r(names, ",", &saveptr); name; name = strtok_r(NULL, ",", &saveptr)) {
+    if (balancer_num_backends == BALANCER_MAX_BACKENDS) {
+      fprintf(stderr, "Too many backends: %s\n", name);
+      free(names);
+      return -1;
+    }
+    balancer_backend_t *backend = &balancer_backends[balancer_num_backends];
+    if (balancer_resolve(backend, name) < 0) {
+      fprintf(stderr, "Cannot find host: %s\n", name);
+      free(names);
+      return -1;
+    }
+    backend->pool = pool;
+    balancer_num_backends++;
+  }
+  free(names);
+  if (balancer_num_backends == first) return -1;
+  balancer_num_pools++;
+  return pool;
+}
+
+static int balancer_is_available(balancer_backend_t *backend, time_t now) {
+  return backend->healthy && backend->ejected_until <= now;
+}
+
+static long balancer_load(balancer_backend_t *backend) {
+  return __sync_fetch_and_add(&backend->outstanding, 0);
+}
+
+/* Picks a backend of POOL that is not in TRIED (a bit per backend),
+ * preferring available ones. Returns -1 if all have been tried. */
+static int balancer_pick(int pool, unsigned long long tried) {
+  time_t now = time(NULL);
+  int candidates[BALANCER_MAX_BACKENDS];
+  int num_candidates = 0;
+  for (int available = 1; available >= 0 && num_candidates == 0; available--) {
+    for (int i = 0; i < balancer_num_backends; i++) {
+      if (balancer_backends[i].pool != pool || (tried & (1ull << i))) continue;
+      if (!available || balancer_is_available(&balancer_backends[i], now))
+        candidates[num_candidates++] = i;
+    }
+  }
+  if (num_candidates == 0) return -1;
+
+  unsigned int start = __sync_fetch_and_add(&balancer_next, 1);
+  if (balancer_policy == BALANCER_TWO_CHOICES) {
+    /* Two picks from a cheap per-call sequence; ties go to the first. */
+    unsigned int seed = start * 2654435761u;
+    int a = candidates[rand_r(&seed) % num_candidates];
+    int b = candidates[rand_r(&seed) % num_candidates];
+    return balancer_load(&balancer_backends[b]) < balancer_load(&balancer_backends[a]) ? b : a;
+  }
+  /* Start the scan at a rotating offset, so ties are spread out. */
+  int best = -1;
+  for (int j = 0; j < num_candidates; j++) {
+    int i = candidates[(start + j) % num_candidates];
+    if (best < 0 || balancer_load(&balancer_backends[i]) < balancer_load(&balancer_backends[best]))
+      best = i;
+  }
+  return best;
+}
+
+/* Connects to ADDRESS, giving up after TIMEOUT seconds. */
+static int balancer_connect_to(struct sockaddr_in *address, int timeout) {
+  int fd = socket(PF_INET, SOCK_STREAM, 0);
+  if (fd < 0) return -1;
+  if (coro_connect(fd, (struct sockaddr *) address, sizeof(*address),
+        timeout > 0 ? timeout * 1000 : -1) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int balancer_connect(int pool, balancer_backend_t **backend) {
+  unsigned long long tried = 0;
+  int i;
+  while ((i = balancer_pick(pool, tried)) >= 0) {
+    tried |= 1ull << i;
+    balancer_backend_t *candidate = &balancer_backends[i];
+    __sync_fetch_and_add(&candidate->outstanding, 1);
+    __sync_fetch_and_add(&candidate->requests, 1);
+    int fd = balancer_connect_to(&candidate->address, balancer_connect_timeout);
+    if (fd >= 0) {
+      *backend = candidate;
+      return fd;
+    }
+    balancer_done(candidate, 0);
+  }
+  return -1;
+}
+
+void balancer_done(balancer_backend_t *backend, int ok) {
+  __sync_fetch_and_sub(&backend->outstanding, 1);
+  if (ok) {
+    backend->consecutive_failures = 0;
+    return;
+  }
+  __sync_fetch_and_add(&backend->failures, 1);
+  /* Failures still in flight when another ejected the backend count too, so
+   * compare with >= and start the count over for the next ejection. */
+  if (__sync_add_and_fetch(&backend->consecutive_failures, 1) >= balancer_max_failures) {
+    backend->consecutive_failures = 0;
+    backend->ejected_until = time(NULL) + balancer_eject_seconds;
+    __sync_fetch_and_add(&backend->ejections, 1);
+    fprintf(stderr, "Ejecting backend %s for %d seconds\n", backend->name,
+        balancer_eject_seconds);
+  }
+}
+
+typedef struct balancer_health_check {
+  char *path;
+  int interval;
+} balancer_health_check_t;
+
+/* Returns 1 if BACKEND answers a GET for PATH with a 2xx or 3xx status. */
+static int balancer_probe(balancer_backend_t *backend, const char *path) {
+  int fd = balancer_connect_to(&backend->address, balancer_connect_timeout);
+  if (fd < 0) return 0;
+  struct timeval timeout = { .tv_sec = balancer_connect_timeout > 0 ? balancer_connect_timeout : 5 };
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  char request[1024], response[32];
+  int size = snprintf(request, sizeof(request),
+      "GET %s HTTP/1.0\r\nHost: %s\r\nConnection: close\r\n\r\n", path, backend->name);
+  int status = 0;
+  if (write(fd, request, size) == size) {
+    ssize_t n = read(fd, response, sizeof(response) - 1);
+    if (n > 0) {
+      response[n] = '\0';
+      if (sscanf(response, "HTTP/1.%*d %d", &status) != 1) status = 0;
+      /* Read the rest, so the backend isn't reset mid-response. */
+      while (read(fd, response, sizeof(response)) > 0);
+    }
+  }
+  close(fd);
+  return status >= 200 && status < 400;
+}
+
+static void *balancer_health_work(void *arg) {
+  balancer_health_check_t *check = arg;
+  while (1) {
+    for (int i = 0; i < balancer_num_backends; i++) {
+      balancer_backend_t *backend = &balancer_backends[i];
+      int healthy = balancer_probe(backend, check->path);
+      if (healthy != backend->healthy)
+        fprintf(stderr, "Backend %s is %s\n", backend->name, healthy ? "healthy" : "unhealthy");
+      /* A passing check ends an ejection early. */
+      if (healthy && !backend->healthy) {
+        backend->consecutive_failures = 0;
+        backend->ejected_until = 0;
+      }
+      backend->healthy = healthy;
+    }
+    sleep(check->interval);
+  }
+  return NULL;
+}
+
+void balancer_start_health_checks(const char *path, int interval) {
+  balancer_health_check_t *check = malloc(sizeof(balancer_health_check_t));
+  if (!check) return;
+  check->path = strdup(path);
+  check->interval = interval;
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, balancer_health_work, check) != 0) {
+    perror("Failed to start health checks");
+    return;
+  }
+  pthread_detach(thread);
+}
+
+void balancer_format(struct http_buffer *buffer) {
+  time_t now = time(NULL);
+  for (int i = 0; i < balancer_num_backends; i++) {
+    balancer_backend_t *backend = &balancer_backends[i];
+    http_buffer_printf(buffer, "backend%d %s\n", i, backend->name);
+    http_buffer_printf(buffer, "backend%d_pool %d\n", i, backend->pool);
+    http_buffer_printf(buffer, "backend%d_available %d\n", i,
+        balancer_is_available(backend, now));
+    http_buffer_printf(buffer, "backend%d_outstanding %ld\n", i, balancer_load(backend));
+    http_buffer_printf(buffer, "backend%d_requests %lu\n", i, backend->requests);
+    http_buffer_printf(buffer, "backend%d_failures %lu\n", i, backend->failures);
+    http_buffer_printf(buffer, "backend%d_ejections %lu\n", i, backend->ejections);
+  }
+}
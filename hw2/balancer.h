@@ -0,0 +1,59 @@
+#ifndef __BALANCER__
+#define __BALANCER__
+
+#include <netinet/in.h>
+#include <time.h>
+
+#include "libhttp.h"
+
+/* BALANCER spreads proxied requests over pools of upstream backends. Each
+ * request goes to the available backend with the fewest requests in
+ * flight, or to the less loaded of two picked at random. A backend is
+ * unavailable while active health checks fail, or for a while after
+ * several connects or responses in a row failed (passive ejection). If no
+ * backend in the pool is available, all of them are tried anyway. The proxy
+ * has a pool of its own and so does every proxy route. The table lives in
+ * shared memory, so prefork workers share the counters and the master's
+ * health checks. */
+
+#define BALANCER_MAX_BACKENDS 64   // Over all pools.
+
+typedef enum balancer_policy {
+  BALANCER_LEAST_OUTSTANDING,
+  BALANCER_TWO_CHOICES,
+} balancer_policy_t;
+
+typedef struct balancer_backend {
+  char name[128];               // host:port as given.
+  int pool;
+  struct sockaddr_in address;
+  int healthy;                  // Result of the last health check.
+  int consecutive_failures;
+  time_t ejected_until;
+  long outstanding;             // Requests in flight.
+  unsigned long requests;
+  unsigned long failures;
+  unsigned long ejections;
+} balancer_backend_t;
+
+/* Maps the table. Must be called before forking. */
+int balancer_init(balancer_policy_t policy, int max_failures, int eject_seconds,
+    int connect_timeout);
+/* Resolves the comma-separated host:port list into a new pool and returns
+ * its number. Must be called before forking. Returns -1 if a backend cannot
+ * be resolved or the table is full. */
+int balancer_add_pool(const char *list);
+/* Probes every backend with "GET PATH" every INTERVAL seconds from a
+ * thread of this process. */
+void balancer_start_health_checks(const char *path, int interval);
+/* Connects to a backend of POOL, trying others if the connect fails. Returns the
+ * socket and sets *BACKEND, or returns -1. The request must be ended with
+ * balancer_done. */
+int balancer_connect(int pool, balancer_backend_t **backend);
+/* Ends a request to BACKEND, counting a failure against it unless OK. */
+void balancer_done(balancer_backend_t *backend, int ok);
+/* Appends per-backend counters as "backendN_name value" lines, if there
+ * are any backends. */
+void balancer_format(struct http_buffer *buffer);
+
+#endif
@@ -0,0 +1,194 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bufpool.h"
+#include "stats.h"
+
+/* Buffers each CPU keeps per class before returning them to the shared
+ * list. */
+#define BUFPOOL_CPU_CACHE 4
+#define BUFPOOL_ALIGN 4096
+
+/* Free buffers are linked through their first bytes. */
+typedef struct bufpool_free {
+  struct bufpool_free *next;
+} bufpool_free_t;
+
+typedef struct bufpool_cpu {
+  pthread_mutex_t lock;
+  void *cached[BUFPOOL_MAX_CLASSES][BUFPOOL_CPU_CACHE];
+  int num_cached[BUFPOOL_MAX_CLASSES];
+} __attribute__((aligned(64))) bufpool_cpu_t;
+
+static size_t bufpool_sizes[BUFPOOL_MAX_CLASSES];
+static int bufpool_num_classes;
+static bufpool_cpu_t *bufpool_cpus;
+static int bufpool_num_cpus;
+
+/* Guards everything below. */
+static pthread_mutex_t bufpool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bufpool_cv = PTHREAD_COND_INITIALIZER;
+static bufpool_free_t *bufpool_free_lists[BUFPOOL_MAX_CLASSES];
+static size_t bufpool_max_bytes;
+static size_t bufpool_bytes;      // Allocated, whether lent out or cached.
+static int bufpool_waiters;       // While set, buffers skip the CPU caches.
+
+void bufpool_init(const size_t *sizes, int num_classes, size_t max_bytes) {
+  if (num_classes > BUFPOOL_MAX_CLASSES) num_classes = BUFPOOL_MAX_CLASSES;
+  for (int i = 0; i < num_classes; i++)
+    bufpool_sizes[i] = (sizes[i] + BUFPOOL_ALIGN - 1) & ~(size_t) (BUFPOOL_ALIGN - 1);
+  bufpool_num_classes = num_classes;
+  bufpool_max_bytes = max_bytes;
+
+  bufpool_num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+  if (bufpool_num_cpus < 1) bufpool_num_cpus = 1;
+  bufpool_cpus = calloc(bufpool_num_cpus, sizeof(bufpool_cpu_t));
+  if (!bufpool_cpus) {
+    perror("Failed to allocate buffer caches");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < bufpool_num_cpus; i++) pthread_mutex_init(&bufpool_cpus[i].lock, NULL);
+}
+
+static int bufpool_class(size_t size) {
+  for (int i = 0; i < bufpool_num_classes; i++)
+    if (bufpool_sizes[i] >= size) return i;
+  return bufpool_num_classes - 1;
+}
+
+/* Returns the cache of the CPU we are running on. Threads may move right
+ * after, which only makes the cache a little less local. */
+static bufpool_cpu_t *bufpool_cpu(void) {
+  int cpu = sched_getcpu();
+  return &bufpool_cpus[cpu < 0 ? 0 : cpu % bufpool_num_cpus];
+}
+
+/* Frees cached buffers of other classes until SIZE more bytes fit under
+ * the cap. Returns 0 if they do. Must hold bufpool_lock. */
+static int bufpool_make_room(size_t size) {
+  for (int i = bufpool_num_classes - 1; i >= 0; i--) {
+    while (bufpool_bytes + size > bufpool_max_bytes && bufpool_free_lists[i]) {
+      bufpool_free_t *buffer = bufpool_free_lists[i];
+      bufpool_free_lists[i] = buffer->next;
+      free(buffer);
+      bufpool_bytes -= bufpool_sizes[i];
+    }
+  }
+  return bufpool_bytes + size <= bufpool_max_bytes ? 0 : -1;
+}
+
+/* Moves the buffers in every CPU cache to the shared lists, where waiters
+ * can find them. Must hold bufpool_lock. */
+static void bufpool_drain_cpus(void) {
+  for (int i = 0; i < bufpool_num_cpus; i++) {
+    bufpool_cpu_t *cpu = &bufpool_cpus[i];
+    pthread_mutex_lock(&cpu->lock);
+    for (int class = 0; class < bufpool_num_classes; class++) {
+      while (cpu->num_cached[class] > 0) {
+        bufpool_free_t *buffer = cpu->cached[class][--cpu->num_cached[class]];
+        buffer->next = bufpool_free_lists[class];
+        bufpool_free_lists[class] = buffer;
+      }
+    }
+    pthread_mutex_unlock(&cpu->lock);
+  }
+}
+
+size_t bufpool_memory(void) {
+  pthread_mutex_lock(&bufpool_lock);
+  size_t bytes = bufpool_bytes;
+  pthread_mutex_unlock(&bufpool_lock);
+  return bytes;
+}
+
+void *bufpool_get(size_t size, size_t *buffer_size, int wait) {
+  if (bufpool_num_classes == 0) return NULL;
+  int class = bufpool_class(size);
+  while (class > 0 && bufpool_sizes[class] > bufpool_max_bytes) class--;
+  *buffer_size = bufpool_sizes[class];
+  /* Would never fit, however long we waited. */
+  if (*buffer_size > bufpool_max_bytes) return NULL;
+
+  bufpool_cpu_t *cpu = bufpool_cpu();
+  void *buffer = NULL;
+  pthread_mutex_lock(&cpu->lock);
+  if (cpu->num_cached[class] > 0) buffer = cpu->cached[class][--cpu->num_cached[class]];
+  pthread_mutex_unlock(&cpu->lock);
+  if (buffer) return buffer;
+
+  pthread_mutex_lock(&bufpool_lock);
+  int drained = 0, waiting = 0;
+  while (1) {
+    if (bufpool_free_lists[class]) {
+      buffer = bufpool_free_lists[class];
+      bufpool_free_lists[class] = bufpool_free_lists[class]->next;
+      break;
+    }
+    if (bufpool_make_room(*buffer_size) == 0) {
+      if (posix_memalign(&buffer, BUFPOOL_ALIGN, *buffer_size) != 0) buffer = NULL;
+      if (buffer) bufpool_bytes += *buffer_size;
+      break;
+    }
+    if (!drained) {
+      /* Before giving up or waiting, claim what the CPUs hold. Puts check
+       * the waiter count under their CPU lock, so none can slip a buffer
+       * into a cache that has already been drained. */
+      __atomic_add_fetch(&bufpool_waiters, 1, __ATOMIC_SEQ_CST);
+      bufpool_drain_cpus();
+      drained = 1;
+      continue;
+    }
+    if (!wait) break;
+    if (!waiting) stats_add(STAT_BUFFER_WAITS, 1);
+    waiting = 1;
+    pthread_cond_wait(&bufpool_cv, &bufpool_lock);
+  }
+  if (drained) __atomic_sub_fetch(&bufpool_waiters, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&bufpool_lock);
+  return buffer;
+}
+
+void bufpool_put(void *buffer, size_t buffer_size) {
+  if (!buffer) return;
+  int class = bufpool_class(buffer_size);
+
+  bufpool_cpu_t *cpu = bufpool_cpu();
+  pthread_mutex_lock(&cpu->lock);
+  int cached = cpu->num_cached[class] < BUFPOOL_CPU_CACHE &&
+      __atomic_load_n(&bufpool_waiters, __ATOMIC_SEQ_CST) == 0;
+  if (cached) cpu->cached[class][cpu->num_cached[class]++] = buffer;
+  pthread_mutex_unlock(&cpu->lock);
+
+  /* A waiter counts itself before draining the CPU caches, so one that
+   * came too late to stop the caching above still finds the buffer. */
+  if (cached) return;
+
+  /* Waiters only look at the shared lists, so wake them with this one. */
+  pthread_mutex_lock(&bufpool_lock);
+  bufpool_free_t *free_buffer = buffer;
+  free_buffer->next = bufpool_free_lists[class];
+  bufpool_free_lists[class] = free_buffer;
+  pthread_cond_broadcast(&bufpool_cv);
+  pthread_mutex_unlock(&bufpool_lock);
+}
+
+int bufpool_parse_sizes(const char *list, size_t *sizes) {
+  int count = 0;
+  const char *p = list;
+  while (*p) {
+    char *end;
+    long kb = strtol(p, &end, 10);
+    if (end == p || kb <= 0 || count == BUFPOOL_MAX_CLASSES) return -1;
+    if (count > 0 && (size_t) kb << 10 <= sizes[count - 1]) return -1;
+    sizes[count++] = (size_t) kb << 10;
+    if (*end == ',') end++;
+    else if (*end) return -1;
+    p = end;
+  }
+  return count > 0 ? count : -1;
+}
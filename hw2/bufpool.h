@@ -0,0 +1,35 @@
+#ifndef __BUFPOOL__
+#define __BUFPOOL__
+
+#include <stddef.h>
+
+/* BUFPOOL lends out large page-aligned I/O buffers, so that relays and file
+ * sends can use 64-256 KB buffers without putting them on thread stacks or
+ * going through malloc for every transfer. Buffers come in a few size
+ * classes. Returned buffers are kept in a small cache per CPU and behind
+ * that in a shared free list per class. All buffers together, lent out or
+ * cached, never take more than the memory cap; when it is reached, callers
+ * either wait for a buffer to come back or make do without one. */
+
+#define BUFPOOL_MAX_CLASSES 8
+
+/* Sets up NUM_CLASSES size classes from SIZES (bytes, ascending) and a cap
+ * of MAX_BYTES. Must be called before any other bufpool function. */
+void bufpool_init(const size_t *sizes, int num_classes, size_t max_bytes);
+/* Returns a buffer of the smallest class holding SIZE, or of the largest
+ * class if none does, and stores its size in *BUFFER_SIZE. Classes larger
+ * than the whole cap are passed over for the largest one under it. At the
+ * memory cap it waits for a buffer to be returned if WAIT is set and
+ * returns NULL otherwise. Also returns NULL if even the smallest class is
+ * larger than the cap. Callers that wait must not hold buffers others are
+ * waiting for. */
+void *bufpool_get(size_t size, size_t *buffer_size, int wait);
+/* Gives back a buffer from bufpool_get along with the size it was given. */
+void bufpool_put(void *buffer, size_t buffer_size);
+/* Returns the bytes of buffers allocated, lent out or cached. */
+size_t bufpool_memory(void);
+/* Parses a comma-separated list of sizes in KB, e.g. "16,64,256", into
+ * SIZES. Returns the number of sizes, or -1 if the list is invalid. */
+int bufpool_parse_sizes(const char *list, size_t *sizes);
+
+#endif
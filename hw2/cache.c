@@ -0,0 +1,566 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "stats.h"
+#include "utlist.h"
+
+#define CACHE_BUCKETS 4096
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Broadcast whenever a fetching entry makes progress. */
+static pthread_cond_t cache_cv = PTHREAD_COND_INITIALIZER;
+static cache_entry_t *cache_buckets[CACHE_BUCKETS];
+static cache_entry_t *cache_lru;
+static size_t cache_memory_size, cache_memory_used;
+static char *cache_dir;
+static size_t cache_disk_size, cache_disk_used;
+static size_t cache_max_object_size;
+static unsigned long cache_disk_files;
+
+size_t cache_memory(void) {
+  pthread_mutex_lock(&cache_lock);
+  size_t bytes = cache_memory_used;
+  pthread_mutex_unlock(&cache_lock);
+  return bytes;
+}
+
+void cache_init(size_t memory_size, const char *dir, size_t disk_size, size_t max_object_size) {
+  cache_memory_size = memory_size;
+  cache_dir = dir ? strdup(dir) : NULL;
+  cache_disk_size = disk_size;
+  cache_max_object_size = max_object_size;
+}
+
+static unsigned int cache_hash(const char *key) {
+  uint32_t hash = 2166136261u;
+  while (*key) {
+    hash ^= (unsigned char) *key++;
+    hash *= 16777619u;
+  }
+  return hash % CACHE_BUCKETS;
+}
+
+/* Finds header KEY in a block of "Key: value\r\n" lines and copies its
+ * value into BUFFER. Returns NULL if it is missing. */
+static char *cache_find_header(const char *headers, size_t headers_size, const char *key,
+    char *buffer, size_t size) {
+  size_t key_size = strlen(key);
+  const char *line = headers, *end = headers + headers_size;
+  while (line < end) {
+    const char *line_end = memchr(line, '\n', end - line);
+    if (!line_end) line_end = end;
+    if ((size_t) (line_end - line) > key_size && line[key_size] == ':' &&
+        strncasecmp(line, key, key_size) == 0) {
+      const char *value = line + key_size + 1;
+      while (value < line_end && (*value == ' ' || *value == '\t')) value++;
+      size_t value_size = line_end - value;
+      if (value_size > 0 && value[value_size - 1] == '\r') value_size--;
+      if (value_size >= size) value_size = size - 1;
+      memcpy(buffer, value, value_size);
+      buffer[value_size] = '\0';
+      return buffer;
+    }
+    line = line_end + 1;
+  }
+  return NULL;
+}
+
+char *cache_header(cache_entry_t *entry, const char *key, char *buffer, size_t size) {
+  return cache_find_header(entry->headers, entry->headers_size, key, buffer, size);
+}
+
+/* Returns 1 if the Cache-Control VALUE has directive NAME, storing its
+ * numeric argument, if any, in *ARGUMENT. */
+static int cache_directive(const char *value, const char *name, long *argument) {
+  size_t name_size = strlen(name);
+  while (value && *value) {
+    while (*value == ' ' || *value == ',') value++;
+    if (strncasecmp(value, name, name_size) == 0) {
+      const char *after = value + name_size;
+      if (*after == '\0' || *after == ',' || *after == ' ') return 1;
+      if (*after == '=') {
+        if (argument) *argument = strtol(after + 1 + (after[1] == '"'), NULL, 10);
+        return 1;
+      }
+    }
+    value = strchr(value, ',');
+  }
+  return 0;
+}
+
+/* Parses an HTTP date. Returns -1 if it is not one. */
+static time_t cache_parse_date(const char *value) {
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+  const char *end = strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  if (!end) return -1;
+  return timegm(&tm);
+}
+
+static void cache_entry_free(cache_entry_t *entry) {
+  if (entry->disk_path) {
+    unlink(entry->disk_path);
+    free(entry->disk_path);
+  }
+  free(entry->key);
+  free(entry->headers);
+  free(entry->body);
+  free(entry->etag);
+  free(entry->last_modified);
+  free(entry);
+}
+
+/* Recomputes what ENTRY counts against the memory and disk limits. Only
+ * complete entries in the cache count. Must hold cache_lock. */
+static void cache_charge(cache_entry_t *entry) {
+  cache_memory_used -= entry->memory_charged;
+  cache_disk_used -= entry->disk_charged;
+  entry->memory_charged = entry->disk_charged = 0;
+  if (entry->stored && entry->state == CACHE_COMPLETE) {
+    entry->memory_charged = entry->headers_size + (entry->body ? entry->body_size : 0);
+    entry->disk_charged = entry->disk_path ? entry->body_size : 0;
+  }
+  cache_memory_used += entry->memory_charged;
+  cache_disk_used += entry->disk_charged;
+}
+
+/* Drops the cache's own reference to ENTRY. Must hold cache_lock. */
+static void cache_unlink(cache_entry_t *entry) {
+  if (!entry->stored) return;
+  DL_DELETE(cache_buckets[cache_hash(entry->key)], entry);
+  DL_DELETE2(cache_lru, entry, lru_prev, lru_next);
+  entry->stored = 0;
+  cache_charge(entry);
+  if (--entry->refcount == 0) cache_entry_free(entry);
+}
+
+/* Writes BODY to the new file PATH. */
+static int cache_write_file(const char *path, const char *body, size_t size) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0) return -1;
+  size_t written = 0;
+  while (written < size) {
+    ssize_t n = write(fd, body + written, size - written);
+    if (n <= 0) break;
+    written += n;
+  }
+  close(fd);
+  if (written < size) {
+    unlink(path);
+    return -1;
+  }
+  return 0;
+}
+
+/* Reads SIZE bytes of body back from PATH into a new buffer. */
+static char *cache_read_file(const char *path, size_t size) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return NULL;
+  char *body = malloc(size + 1);
+  size_t done = 0;
+  while (body && done < size) {
+    ssize_t n = pread(fd, body + done, size - done, done);
+    if (n <= 0) break;
+    done += n;
+  }
+  close(fd);
+  if (body && done < size) {
+    free(body);
+    return NULL;
+  }
+  return body;
+}
+
+/* Writes the body of ENTRY to a new file in the cache directory, with
+ * cache_lock released meanwhile. The caller's reference keeps the entry
+ * and, since it is complete, its body as they are. Must hold cache_lock. */
+static int cache_write_body(cache_entry_t *entry) {
+  char path[1024];
+  snprintf(path, sizeof(path), "%s/%08x.%d.%lu", cache_dir, cache_hash(entry->key),
+      (int) getpid(), ++cache_disk_files);
+  pthread_mutex_unlock(&cache_lock);
+  int result = cache_write_file(path, entry->body, entry->body_size);
+  pthread_mutex_lock(&cache_lock);
+  if (result < 0) return -1;
+  if (entry->disk_path || !(entry->disk_path = strdup(path))) unlink(path);
+  return entry->disk_path ? 0 : -1;
+}
+
+/* Reads the body of ENTRY back from its file, with cache_lock released
+ * meanwhile. The caller's reference keeps the file. Must hold cache_lock. */
+static int cache_read_body(cache_entry_t *entry) {
+  size_t size = entry->body_size;
+  pthread_mutex_unlock(&cache_lock);
+  char *body = cache_read_file(entry->disk_path, size);
+  pthread_mutex_lock(&cache_lock);
+  /* Another reader may have brought it back first. */
+  if (entry->body) {
+    free(body);
+    return 0;
+  }
+  if (!body) return -1;
+  entry->body = body;
+  entry->body_capacity = size;
+  return 0;
+}
+
+/* Moves bodies to disk, or drops entries, until both tiers are within their
+ * limits. Entries in use are left alone. Bodies are written out without
+ * cache_lock, with the entry pinned by a reference, so the LRU list is
+ * walked again from the start after each. Must hold cache_lock. */
+static void cache_evict(void) {
+  cache_entry_t *entry, *tmp;
+  while (cache_memory_used > cache_memory_size) {
+    DL_FOREACH2(cache_lru, entry, lru_next)
+      if (entry->refcount == 1 && entry->body) break;
+    if (!entry) break;
+    if (!cache_dir || entry->body_size > cache_disk_size) {
+      cache_unlink(entry);
+      continue;
+    }
+    if (!entry->disk_path) {
+      entry->refcount++;
+      int result = cache_write_body(entry);
+      if (--entry->refcount == 0) {
+        cache_entry_free(entry);
+        continue;
+      }
+      /* Whoever took it meanwhile is reading the body in memory. */
+      if (entry->refcount > 1) continue;
+      if (result < 0) {
+        cache_unlink(entry);
+        continue;
+      }
+    }
+    free(entry->body);
+    entry->body = NULL;
+    cache_charge(entry);
+  }
+  DL_FOREACH_SAFE2(cache_lru, entry, tmp, lru_next) {
+    if (cache_disk_used <= cache_disk_size) break;
+    if (entry->refcount > 1 || !entry->disk_path) continue;
+    if (entry->body) {
+      unlink(entry->disk_path);
+      free(entry->disk_path);
+      entry->disk_path = NULL;
+      cache_charge(entry);
+    } else {
+      cache_unlink(entry);
+    }
+  }
+}
+
+static int cache_is_fresh(cache_entry_t *entry, time_t now) {
+  return entry->state == CACHE_COMPLETE && now < entry->fresh_until;
+}
+
+static cache_entry_t *cache_entry_new(const char *key) {
+  cache_entry_t *entry = calloc(1, sizeof(cache_entry_t));
+  if (!entry) return NULL;
+  if (key && !(entry->key = strdup(key))) {
+    free(entry);
+    return NULL;
+  }
+  entry->state = CACHE_FETCHING;
+  entry->content_length = -1;
+  entry->refcount = 1;
+  return entry;
+}
+
+cache_entry_t *cache_get(const char *key, int revalidate, int only_if_cached,
+    cache_entry_t **stale, int *leader) {
+  unsigned int bucket = cache_hash(key);
+  time_t now = time(NULL);
+  cache_entry_t *entry, *old = NULL;
+  *stale = NULL;
+  *leader = 0;
+
+  pthread_mutex_lock(&cache_lock);
+  DL_FOREACH(cache_buckets[bucket], entry) {
+    if (strcmp(entry->key, key) != 0) continue;
+    /* The newest entry for a key comes first. */
+    if (entry->state == CACHE_FETCHING && !only_if_cached) {
+      /* Only a response that may be stored is shared; its head tells. */
+      entry->refcount++;
+      while (entry->status == 0 && entry->state == CACHE_FETCHING)
+        pthread_cond_wait(&cache_cv, &cache_lock);
+      if (entry->stored && entry->state != CACHE_FAILED) {
+        stats_add(STAT_CACHE_COALESCED, 1);
+        pthread_mutex_unlock(&cache_lock);
+        return entry;
+      }
+      int refcount = --entry->refcount;
+      pthread_mutex_unlock(&cache_lock);
+      if (refcount == 0) cache_entry_free(entry);
+      return NULL;
+    }
+    if (!revalidate && cache_is_fresh(entry, now)) {
+      entry->refcount++;
+      if (!entry->body && cache_read_body(entry) < 0) {
+        /* Its file is no good, so the next miss fetches it again. The
+         * bucket may have changed meanwhile, so this one goes upstream
+         * on its own. */
+        cache_unlink(entry);
+        int refcount = --entry->refcount;
+        pthread_mutex_unlock(&cache_lock);
+        if (refcount == 0) cache_entry_free(entry);
+        return NULL;
+      }
+      /* It may have been replaced while its file was read. */
+      if (entry->stored) {
+        DL_DELETE2(cache_lru, entry, lru_prev, lru_next);
+        DL_APPEND2(cache_lru, entry, lru_prev, lru_next);
+      }
+      cache_charge(entry);
+      cache_evict();
+      stats_add(STAT_CACHE_HITS, 1);
+      pthread_mutex_unlock(&cache_lock);
+      return entry;
+    }
+    if (entry->state == CACHE_COMPLETE) old = entry;
+    break;
+  }
+  if (only_if_cached) {
+    pthread_mutex_unlock(&cache_lock);
+    return NULL;
+  }
+
+  entry = cache_entry_new(key);
+  if (entry) {
+    entry->stored = 1;
+    entry->refcount++;
+    DL_PREPEND(cache_buckets[bucket], entry);
+    DL_APPEND2(cache_lru, entry, lru_prev, lru_next);
+    *leader = 1;
+    if (old && (old->etag || old->last_modified)) {
+      old->refcount++;
+      *stale = old;
+    }
+    stats_add(STAT_CACHE_MISSES, 1);
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return entry;
+}
+
+cache_entry_t *cache_get_private(void) {
+  return cache_entry_new(NULL);
+}
+
+static int cache_status_is_storable(int status) {
+  return status == 200 || status == 203 || status == 300 || status == 301 ||
+      status == 404 || status == 410;
+}
+
+/* Sets the validators and freshness of ENTRY from its headers, and takes
+ * it out of the cache if it may not be stored. Must hold cache_lock. */
+static void cache_apply_policy(cache_entry_t *entry, time_t now) {
+  char value[256];
+  free(entry->etag);
+  free(entry->last_modified);
+  entry->etag = entry->last_modified = NULL;
+  if (cache_header(entry, "ETag", value, sizeof(value))) entry->etag = strdup(value);
+  if (cache_header(entry, "Last-Modified", value, sizeof(value)))
+    entry->last_modified = strdup(value);
+
+  int storable = cache_status_is_storable(entry->status) && !cache_header(entry, "Set-Cookie",
+      value, sizeof(value));
+  int explicit = 0;
+  entry->response_time = now;
+  entry->fresh_until = now;
+  if (cache_header(entry, "Cache-Control", value, sizeof(value))) {
+    long max_age = 0;
+    if (cache_directive(value, "no-store", NULL) || cache_directive(value, "private", NULL)) {
+      storable = 0;
+    } else if (cache_directive(value, "no-cache", NULL)) {
+      explicit = 1;
+    } else if (cache_directive(value, "s-maxage", &max_age) ||
+        cache_directive(value, "max-age", &max_age)) {
+      if (max_age > 0) entry->fresh_until = now + max_age;
+      explicit = 1;
+    }
+  }
+  if (!explicit && cache_header(entry, "Expires", value, sizeof(value))) {
+    /* Expires is relative to the upstream's clock, so measure from Date. */
+    time_t expires = cache_parse_date(value);
+    time_t date = cache_header(entry, "Date", value, sizeof(value)) ?
+        cache_parse_date(value) : -1;
+    if (date < 0) date = now;
+    if (expires > date) entry->fresh_until = now + (expires - date);
+    explicit = 1;
+  }
+  /* Only responses that differ by encoding can be told apart by the key. */
+  if (cache_header(entry, "Vary", value, sizeof(value))) {
+    char *saveptr;
+    for (char *token = strtok_r(value, ", ", &saveptr); token;
+        token = strtok_r(NULL, ", ", &saveptr))
+      if (strcasecmp(token, "Accept-Encoding") != 0) storable = 0;
+  }
+  if (!explicit && !entry->etag && !entry->last_modified) storable = 0;
+  if (entry->content_length > (long long) cache_max_object_size) storable = 0;
+  if (!storable) cache_unlink(entry);
+}
+
+void cache_begin(cache_entry_t *entry, int status, const char *headers, size_t headers_size,
+    long long content_length) {
+  pthread_mutex_lock(&cache_lock);
+  entry->status = status;
+  entry->headers = malloc(headers_size + 1);
+  if (entry->headers) {
+    memcpy(entry->headers, headers, headers_size);
+    entry->headers[headers_size] = '\0';
+    entry->headers_size = headers_size;
+  }
+  entry->content_length = content_length;
+  if (entry->stored) cache_apply_policy(entry, time(NULL));
+  /* Waiters only attach to entries that may be stored, see cache_get. */
+  entry->buffering = entry->stored;
+  pthread_cond_broadcast(&cache_cv);
+  pthread_mutex_unlock(&cache_lock);
+}
+
+/* Appends the lines of STALE that HEADERS doesn't have to HEADERS. */
+static char *cache_merge_headers(cache_entry_t *stale, const char *headers, size_t headers_size,
+    size_t *merged_size) {
+  char *merged = malloc(headers_size + stale->headers_size + 1);
+  if (!merged) return NULL;
+  memcpy(merged, headers, headers_size);
+  size_t size = headers_size;
+  const char *line = stale->headers, *end = stale->headers + stale->headers_size;
+  while (line < end) {
+    const char *line_end = memchr(line, '\n', end - line);
+    line_end = line_end ? line_end + 1 : end;
+    const char *colon = memchr(line, ':', line_end - line);
+    char name[128], value[8];
+    if (colon && (size_t) (colon - line) < sizeof(name)) {
+      memcpy(name, line, colon - line);
+      name[colon - line] = '\0';
+      if (!cache_find_header(headers, headers_size, name, value, sizeof(value))) {
+        memcpy(merged + size, line, line_end - line);
+        size += line_end - line;
+      }
+    }
+    line = line_end;
+  }
+  merged[size] = '\0';
+  *merged_size = size;
+  return merged;
+}
+
+void cache_revalidated(cache_entry_t *entry, cache_entry_t *stale, const char *headers,
+    size_t headers_size) {
+  pthread_mutex_lock(&cache_lock);
+  /* Before the head is set, so nobody attaches while the lock is let go. */
+  int have_body = stale->body || cache_read_body(stale) == 0;
+  entry->status = stale->status;
+  entry->headers = cache_merge_headers(stale, headers, headers_size, &entry->headers_size);
+  if (!entry->headers) entry->headers_size = 0;
+  if (have_body) {
+    entry->body = malloc(stale->body_size + 1);
+    if (entry->body) {
+      memcpy(entry->body, stale->body, stale->body_size);
+      entry->body_size = entry->body_capacity = stale->body_size;
+    }
+  }
+  entry->content_length = entry->body_size;
+  if (!entry->headers || !entry->body) {
+    entry->state = CACHE_FAILED;
+    cache_unlink(entry);
+  } else if (entry->stored) {
+    cache_apply_policy(entry, time(NULL));
+  }
+  entry->buffering = 1;
+  stats_add(STAT_CACHE_REVALIDATED, 1);
+  pthread_cond_broadcast(&cache_cv);
+  pthread_mutex_unlock(&cache_lock);
+}
+
+int cache_append(cache_entry_t *entry, const char *data, size_t size) {
+  pthread_mutex_lock(&cache_lock);
+  /* A body past the limit isn't kept for waiters either: they fail after
+   * what was buffered, rather than have it grow without bound. */
+  if (entry->buffering && entry->body_size + size > cache_max_object_size) {
+    cache_unlink(entry);
+    entry->buffering = 0;
+    entry->state = CACHE_FAILED;
+    pthread_cond_broadcast(&cache_cv);
+  }
+  if (entry->buffering && entry->body_size + size > entry->body_capacity) {
+    size_t capacity = entry->body_capacity ? entry->body_capacity : 16384;
+    while (capacity < entry->body_size + size) capacity *= 2;
+    char *body = realloc(entry->body, capacity);
+    if (body) {
+      entry->body = body;
+      entry->body_capacity = capacity;
+    } else {
+      entry->state = CACHE_FAILED;
+      entry->buffering = 0;
+    }
+  }
+  if (entry->buffering) {
+    memcpy(entry->body + entry->body_size, data, size);
+    entry->body_size += size;
+    pthread_cond_broadcast(&cache_cv);
+  }
+  int buffering = entry->buffering;
+  pthread_mutex_unlock(&cache_lock);
+  return buffering;
+}
+
+void cache_finish(cache_entry_t *entry, int ok) {
+  pthread_mutex_lock(&cache_lock);
+  if (entry->state == CACHE_FETCHING) entry->state = ok ? CACHE_COMPLETE : CACHE_FAILED;
+  if (entry->content_length >= 0 && entry->body_size != (size_t) entry->content_length &&
+      entry->buffering)
+    entry->state = CACHE_FAILED;
+  if (entry->state == CACHE_COMPLETE && entry->stored) {
+    /* It replaces whatever was cached for the key before. */
+    cache_entry_t *old, *tmp;
+    DL_FOREACH_SAFE(cache_buckets[cache_hash(entry->key)], old, tmp) {
+      if (old != entry && strcmp(old->key, entry->key) == 0 && old->state != CACHE_FETCHING)
+        cache_unlink(old);
+    }
+    cache_charge(entry);
+    cache_evict();
+  } else {
+    cache_unlink(entry);
+  }
+  pthread_cond_broadcast(&cache_cv);
+  pthread_mutex_unlock(&cache_lock);
+}
+
+int cache_wait_head(cache_entry_t *entry) {
+  pthread_mutex_lock(&cache_lock);
+  while (entry->status == 0 && entry->state == CACHE_FETCHING)
+    pthread_cond_wait(&cache_cv, &cache_lock);
+  int result = entry->status ? 0 : -1;
+  pthread_mutex_unlock(&cache_lock);
+  return result;
+}
+
+ssize_t cache_read(cache_entry_t *entry, size_t offset, char *buffer, size_t size) {
+  pthread_mutex_lock(&cache_lock);
+  while (offset >= entry->body_size && entry->state == CACHE_FETCHING)
+    pthread_cond_wait(&cache_cv, &cache_lock);
+  ssize_t result;
+  if (offset < entry->body_size) {
+    result = entry->body_size - offset < size ? entry->body_size - offset : size;
+    memcpy(buffer, entry->body + offset, result);
+  } else {
+    result = entry->state == CACHE_COMPLETE ? 0 : -1;
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return result;
+}
+
+void cache_release(cache_entry_t *entry) {
+  pthread_mutex_lock(&cache_lock);
+  int refcount = --entry->refcount;
+  pthread_mutex_unlock(&cache_lock);
+  if (refcount == 0) cache_entry_free(entry);
+}
@@ -0,0 +1,106 @@
+#ifndef __CACHE__
+#define __CACHE__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+/* CACHE stores upstream responses for the caching proxy. Entries are keyed
+ * by request (see the proxy for what goes into a key) and kept in memory up
+ * to a byte limit; when a cache directory is given, bodies pushed out of
+ * memory go to files there, up to a second limit, and come back on the next
+ * hit. Both tiers drop their least recently used entries first.
+ *
+ * An entry is published before its response has arrived, so that concurrent
+ * misses for the same key find it and wait on it instead of going upstream
+ * themselves: one caller, the leader, fetches the response and appends it
+ * to the entry, and every other caller streams it from the entry as it
+ * grows. Callers only share a response once its head shows that it may be
+ * stored; the others fetch their own. Whether a response may be stored
+ * follows Cache-Control (no-store, private, max-age, s-maxage, no-cache),
+ * Expires, Vary and the validators ETag and Last-Modified. Stale entries
+ * with validators are revalidated by the next leader instead of being
+ * fetched again. */
+
+typedef enum cache_state {
+  CACHE_FETCHING,               // The leader is still receiving it.
+  CACHE_COMPLETE,
+  CACHE_FAILED,                 // The upstream fetch broke off.
+} cache_state_t;
+
+typedef struct cache_entry {
+  char *key;
+  cache_state_t state;
+  int status;                   // 0 until the response head is in.
+  char *headers;                // End-to-end headers, "Key: value\r\n" lines.
+  size_t headers_size;
+  long long content_length;     // -1 until known.
+  char *body;                   // NULL while only on disk.
+  size_t body_size;
+  size_t body_capacity;
+  int buffering;                // Whether the body is kept at all.
+  int stored;                   // Whether the cache holds a reference.
+  time_t response_time;         // When it was fetched or last revalidated.
+  time_t fresh_until;
+  char *etag;                   // Validators from headers, or NULL.
+  char *last_modified;
+  char *disk_path;              // Copy of the body on disk, or NULL.
+  size_t memory_charged;        // What it counts against each limit.
+  size_t disk_charged;
+  int refcount;
+  struct cache_entry *next;     // Hash bucket chain.
+  struct cache_entry *prev;
+  struct cache_entry *lru_next; // Least recently used first.
+  struct cache_entry *lru_prev;
+} cache_entry_t;
+
+/* Keeps up to MEMORY_SIZE bytes of responses in memory and, if DIR is not
+ * NULL, up to DISK_SIZE bytes of bodies in files under DIR. Responses
+ * larger than MAX_OBJECT_SIZE are passed on but not stored. */
+void cache_init(size_t memory_size, const char *dir, size_t disk_size, size_t max_object_size);
+/* Returns the bytes of responses held in memory. */
+size_t cache_memory(void);
+
+/* Returns a referenced entry for KEY, to be given back with cache_release.
+ * A fresh entry is shared, and so is a still arriving one once its head
+ * shows it may be stored; if it may not, returns NULL so that the caller
+ * fetches its own. Otherwise a new entry is
+ * published and *LEADER is set: the caller must fetch the response and
+ * fill the entry in with cache_begin, cache_append and cache_finish. If
+ * *STALE is set, it is the previous entry for the key, also referenced,
+ * whose validators the leader should send upstream. REVALIDATE treats any
+ * stored entry as stale. With ONLY_IF_CACHED, returns NULL instead of
+ * making the caller a leader. */
+cache_entry_t *cache_get(const char *key, int revalidate, int only_if_cached,
+    cache_entry_t **stale, int *leader);
+/* Returns a leader entry for a request that must not be shared or stored. */
+cache_entry_t *cache_get_private(void);
+
+/* Sets the response head of a leader entry, decides whether it can be
+ * stored and wakes the waiters. HEADERS must be end-to-end headers only. */
+void cache_begin(cache_entry_t *entry, int status, const char *headers, size_t headers_size,
+    long long content_length);
+/* Completes a leader entry from STALE after upstream answered 304 with
+ * HEADERS, whose freshness information replaces the stale one's. */
+void cache_revalidated(cache_entry_t *entry, cache_entry_t *stale, const char *headers,
+    size_t headers_size);
+/* Appends body bytes to a leader entry. Returns 0 once they aren't kept:
+ * the entry won't be stored, and waiters fail once past what was kept. */
+int cache_append(cache_entry_t *entry, const char *data, size_t size);
+/* Marks a leader entry complete, or failed if OK is 0, and stores it if it
+ * may be stored. */
+void cache_finish(cache_entry_t *entry, int ok);
+
+/* Waits for the response head. Returns 0, or -1 if the fetch failed. */
+int cache_wait_head(cache_entry_t *entry);
+/* Copies up to SIZE body bytes from OFFSET into BUFFER, waiting for the
+ * leader to receive them. Returns the number copied, 0 at the end of the
+ * body, or -1 if the fetch failed. */
+ssize_t cache_read(cache_entry_t *entry, size_t offset, char *buffer, size_t size);
+/* Returns the value of header KEY in ENTRY (case-insensitive) in a buffer
+ * of SIZE, or NULL. */
+char *cache_header(cache_entry_t *entry, const char *key, char *buffer, size_t size);
+void cache_release(cache_entry_t *entry);
+
+#endif
@@ -0,0 +1,148 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+
+/* Records are batched up to this size and written with a single write. */
+#define CAPTURE_BUFFER_SIZE (64 * 1024)
+
+static int capture_fd = -1;
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct http_buffer capture_buffer;
+static uint32_t capture_connections;
+/* Bytes sent on each fd since its last request was logged, counted only
+ * for the fds of captured connections. */
+static uint64_t *capture_sent;
+static uint8_t *capture_tracked;
+/* Body bytes of each fd's current request read after its head. Only the
+ * thread serving a connection touches them. */
+static struct http_buffer *capture_bodies;
+static int capture_max_fd;
+
+static uint64_t capture_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void capture_count_sent(int fd, size_t size) {
+  if (fd >= 0 && fd < capture_max_fd && capture_tracked[fd])
+    __sync_fetch_and_add(&capture_sent[fd], size);
+}
+
+int capture_open(const char *file, int append) {
+  struct rlimit limit;
+  int max_fd = 65536;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < (rlim_t) max_fd)
+    max_fd = limit.rlim_cur;
+  capture_sent = calloc(max_fd, sizeof(uint64_t));
+  capture_tracked = calloc(max_fd, sizeof(uint8_t));
+  capture_bodies = calloc(max_fd, sizeof(struct http_buffer));
+  if (!capture_sent || !capture_tracked || !capture_bodies) goto fail;
+
+  /* O_APPEND keeps the batches of different processes whole. */
+  int fd = open(file, O_WRONLY | O_CREAT | O_APPEND | (append ? 0 : O_TRUNC), 0644);
+  struct stat s;
+  if (fd < 0 || fstat(fd, &s) < 0 || (s.st_size == 0 && write(fd, CAPTURE_MAGIC, 8) != 8)) {
+    if (fd >= 0) close(fd);
+    goto fail;
+  }
+  capture_fd = fd;
+  capture_max_fd = max_fd;
+  http_buffer_init(&capture_buffer);
+  http_sent_hook = capture_count_sent;
+  http_keep_head = 1;
+  return 0;
+
+fail:
+  free(capture_sent);
+  free(capture_tracked);
+  free(capture_bodies);
+  capture_sent = NULL;
+  capture_tracked = NULL;
+  capture_bodies = NULL;
+  return -1;
+}
+
+uint64_t capture_connection(int fd) {
+  if (capture_fd < 0) return 0;
+  if (fd < capture_max_fd) {
+    capture_sent[fd] = 0;
+    capture_tracked[fd] = 1;
+  }
+  return (uint64_t) getpid() << 32 | __sync_add_and_fetch(&capture_connections, 1);
+}
+
+void capture_close(int fd) {
+  if (capture_fd < 0 || fd < 0 || fd >= capture_max_fd) return;
+  capture_tracked[fd] = 0;
+  http_buffer_free(&capture_bodies[fd]);
+}
+
+void capture_body(int fd, const char *data, size_t size) {
+  if (capture_fd >= 0 && fd >= 0 && fd < capture_max_fd && capture_tracked[fd])
+    http_buffer_append(&capture_bodies[fd], data, size);
+}
+
+static void capture_flush_locked(void) {
+  char *data = capture_buffer.data;
+  size_t size = capture_buffer.size;
+  while (size > 0) {
+    ssize_t n = write(capture_fd, data, size);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      perror("Failed to write capture");
+      break;
+    }
+    data += n;
+    size -= n;
+  }
+  capture_buffer.size = 0;
+}
+
+void capture_request(uint64_t conn_id, int fd, struct http_request *request, uint64_t start) {
+  if (capture_fd < 0 || conn_id == 0) return;
+
+  capture_record_t record;
+  record.time = start;
+  record.conn_id = conn_id;
+  record.response_size = 0;
+  if (fd < capture_max_fd) record.response_size = __sync_lock_test_and_set(&capture_sent[fd], 0);
+  uint64_t latency = (capture_now() - start) / 1000;
+  record.latency_us = latency > UINT32_MAX ? UINT32_MAX : latency;
+
+  /* The head, the body bytes that came with it and the rest as it was
+   * read, which is all of the body the handler took. */
+  struct http_buffer empty = { 0 };
+  struct http_buffer *body = fd < capture_max_fd ? &capture_bodies[fd] : &empty;
+  uint64_t size = (uint64_t) request->head_size + request->body_size + body->size;
+  if (size > UINT32_MAX) {
+    body->size = 0;
+    return;
+  }
+  record.request_size = size;
+
+  pthread_mutex_lock(&capture_lock);
+  http_buffer_append(&capture_buffer, (char *) &record, sizeof(record));
+  http_buffer_append(&capture_buffer, request->head, request->head_size);
+  http_buffer_append(&capture_buffer, request->body, request->body_size);
+  if (body->size > 0) http_buffer_append(&capture_buffer, body->data, body->size);
+  if (capture_buffer.size >= CAPTURE_BUFFER_SIZE) capture_flush_locked();
+  pthread_mutex_unlock(&capture_lock);
+  body->size = 0;
+}
+
+void capture_flush(void) {
+  if (capture_fd < 0) return;
+  pthread_mutex_lock(&capture_lock);
+  capture_flush_locked();
+  pthread_mutex_unlock(&capture_lock);
+}
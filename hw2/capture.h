@@ -0,0 +1,41 @@
+#ifndef __CAPTURE__
+#define __CAPTURE__
+
+#include <stdint.h>
+
+#include "libhttp.h"
+
+/* CAPTURE records the requests a server receives to a compact binary log
+ * that httpreplay can play back against another build. The log starts with
+ * CAPTURE_MAGIC and is followed by records, each a capture_record_t and then
+ * request_size bytes of request. Requests are kept byte for byte as they
+ * were received, head and body, so that they replay exactly. Records are
+ * appended a batch at a time, so prefork workers can share one log. */
+
+#define CAPTURE_MAGIC "HTTPCAP1"
+
+typedef struct capture_record {
+  uint64_t time;                // CLOCK_MONOTONIC ns at which it was parsed.
+  uint64_t conn_id;             // Same for every request on a connection.
+  uint64_t response_size;       // Bytes sent in response.
+  uint32_t request_size;
+  uint32_t latency_us;          // Parse to last byte of the response.
+} capture_record_t;
+
+/* Starts a new log at FILE, or adds to it if APPEND is set, as a server
+ * taking over from an upgraded one does. Must be called before forking. */
+int capture_open(const char *file, int append);
+/* Returns an id for the new connection on fd, or 0 if not capturing. Bytes
+ * sent on fd count towards its responses until capture_close. */
+uint64_t capture_connection(int fd);
+void capture_close(int fd);
+/* Adds DATA, read off fd after the request head and what came with it, to
+ * the body of the request being answered there. */
+void capture_body(int fd, const char *data, size_t size);
+/* Logs REQUEST on connection fd, parsed at START, once it has been
+ * answered. */
+void capture_request(uint64_t conn_id, int fd, struct http_request *request, uint64_t start);
+/* Writes out the buffered records of this process. */
+void capture_flush(void);
+
+#endif
@@ -0,0 +1,599 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <time.h>
+#include <unistd.h>
+#if !defined(__x86_64__)
+#include <ucontext.h>
+#endif
+
+#include "coro.h"
+#include "libhttp.h"
+#include "utlist.h"
+
+/* Most stacks each scheduler keeps for reuse. */
+#define CORO_POOL_MAX 256
+#define CORO_MAX_EVENTS 64
+
+typedef struct coro_sched coro_sched_t;
+
+struct coro {
+  void (*fn)(void *);
+  void *arg;
+  coro_sched_t *sched;
+  char *stack;                  // Lowest usable byte, above the guard page.
+#if defined(__x86_64__)
+  void *sp;                     // Saved while switched out.
+#else
+  ucontext_t context;
+#endif
+  int done;
+  int joinable;
+  struct coro *joiner;          // Coroutine in coro_join on this one.
+  void *saved;                  // From coro_save_hook.
+  int wait_fd;                  // Fd it waits on, or -1.
+  int wait_result;              // 1 if the fd got ready, 0 on a timeout.
+  uint64_t deadline;            // Monotonic ns, while in the sleepers heap.
+  int heap_index;               // -1 if not sleeping.
+  struct coro *next;            // In the ready list or the inbox.
+  struct coro *prev;
+};
+
+/* The coroutines waiting on one fd: one each way at most. */
+typedef struct coro_waiters {
+  coro_t *reader;
+  coro_t *writer;
+} coro_waiters_t;
+
+struct coro_sched {
+  pthread_t thread;
+  int epoll_fd;
+  int event_fd;                 // Written to wake the scheduler for the inbox.
+#if defined(__x86_64__)
+  void *sp;
+#else
+  ucontext_t context;
+#endif
+  coro_t *running;
+  coro_t *ready;
+  coro_t *starved;              // Waiting for a stack to be freed.
+  coro_t **sleepers;            // Min-heap by deadline.
+  int num_sleepers;
+  int max_sleepers;
+  coro_waiters_t *waiters;      // By fd.
+  int num_waiters;
+  char *free_stacks;            // Linked through their top word.
+  int num_free_stacks;
+  pthread_mutex_t lock;         // Guards the inbox.
+  coro_t *inbox;                // Woken or spawned by other threads.
+};
+
+void *(*coro_save_hook)(void);
+void (*coro_restore_hook)(void *saved);
+
+static coro_sched_t *coro_scheds;
+static int coro_num_scheds;
+static size_t coro_stack_size;
+static size_t coro_page_size;
+static unsigned int coro_next_sched;
+static __thread coro_sched_t *coro_current_sched;
+
+static long coro_live;
+static unsigned long coro_started;
+static long coro_stacks;
+static pthread_mutex_t coro_idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t coro_idle_cv = PTHREAD_COND_INITIALIZER;
+
+static uint64_t coro_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static void coro_entry(void);
+
+#if defined(__x86_64__)
+/* Saves the callee-saved registers and stack pointer to *SAVE_SP and
+ * switches to the stack at LOAD_SP, returning wherever it was saved. */
+void coro_switch(void **save_sp, void *load_sp);
+__asm__(
+    ".text\n"
+    ".globl coro_switch\n"
+    ".hidden coro_switch\n"
+    ".type coro_switch, @function\n"
+    "coro_switch:\n"
+    "  pushq %rbp\n"
+    "  pushq %rbx\n"
+    "  pushq %r12\n"
+    "  pushq %r13\n"
+    "  pushq %r14\n"
+    "  pushq %r15\n"
+    "  movq %rsp, (%rdi)\n"
+    "  movq %rsi, %rsp\n"
+    "  popq %r15\n"
+    "  popq %r14\n"
+    "  popq %r13\n"
+    "  popq %r12\n"
+    "  popq %rbx\n"
+    "  popq %rbp\n"
+    "  ret\n"
+    ".size coro_switch, .-coro_switch\n");
+
+/* Lays out CORO's stack as if coro_switch had saved it just before
+ * coro_entry, so the first switch to it returns there. */
+static void coro_context_init(coro_t *coro) {
+  void **top = (void **) (coro->stack + coro_stack_size);
+  *--top = NULL;                /* coro_entry's return address; it never returns. */
+  *--top = (void *) coro_entry;
+  for (int i = 0; i < 6; i++) *--top = NULL;
+  coro->sp = top;
+}
+
+static void coro_enter(coro_sched_t *sched, coro_t *coro) {
+  coro_switch(&sched->sp, coro->sp);
+}
+
+static void coro_leave(coro_t *coro) {
+  coro_switch(&coro->sp, coro->sched->sp);
+}
+#else
+static void coro_context_init(coro_t *coro) {
+  getcontext(&coro->context);
+  coro->context.uc_stack.ss_sp = coro->stack;
+  coro->context.uc_stack.ss_size = coro_stack_size;
+  coro->context.uc_link = NULL;
+  makecontext(&coro->context, coro_entry, 0);
+}
+
+static void coro_enter(coro_sched_t *sched, coro_t *coro) {
+  swapcontext(&sched->context, &coro->context);
+}
+
+static void coro_leave(coro_t *coro) {
+  swapcontext(&coro->context, &coro->sched->context);
+}
+#endif
+
+static char *coro_stack_get(coro_sched_t *sched) {
+  char *stack = sched->free_stacks;
+  if (stack) {
+    sched->free_stacks = *(char **) (stack + coro_stack_size - sizeof(char *));
+    sched->num_free_stacks--;
+    return stack;
+  }
+  char *base = mmap(NULL, coro_stack_size + coro_page_size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+  if (base == MAP_FAILED) return NULL;
+  mprotect(base, coro_page_size, PROT_NONE);
+  __sync_fetch_and_add(&coro_stacks, 1);
+  return base + coro_page_size;
+}
+
+static void coro_stack_put(coro_sched_t *sched, char *stack) {
+  if (sched->num_free_stacks == CORO_POOL_MAX) {
+    munmap(stack - coro_page_size, coro_stack_size + coro_page_size);
+    __sync_fetch_and_sub(&coro_stacks, 1);
+    return;
+  }
+  /* The top of the stack has been touched already, unlike its bottom. */
+  *(char **) (stack + coro_stack_size - sizeof(char *)) = sched->free_stacks;
+  sched->free_stacks = stack;
+  sched->num_free_stacks++;
+}
+
+static void coro_heap_swap(coro_sched_t *sched, int i, int j) {
+  coro_t *a = sched->sleepers[i];
+  sched->sleepers[i] = sched->sleepers[j];
+  sched->sleepers[j] = a;
+  sched->sleepers[i]->heap_index = i;
+  sched->sleepers[j]->heap_index = j;
+}
+
+static void coro_heap_fix(coro_sched_t *sched, int i) {
+  coro_t **heap = sched->sleepers;
+  while (i > 0 && heap[i]->deadline < heap[(i - 1) / 2]->deadline) {
+    coro_heap_swap(sched, i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+  while (1) {
+    int smallest = i;
+    for (int child = 2 * i + 1; child <= 2 * i + 2 && child < sched->num_sleepers; child++)
+      if (heap[child]->deadline < heap[smallest]->deadline) smallest = child;
+    if (smallest == i) return;
+    coro_heap_swap(sched, i, smallest);
+    i = smallest;
+  }
+}
+
+static int coro_heap_add(coro_sched_t *sched, coro_t *coro, uint64_t deadline) {
+  if (sched->num_sleepers == sched->max_sleepers) {
+    int max = sched->max_sleepers ? 2 * sched->max_sleepers : 64;
+    coro_t **sleepers = realloc(sched->sleepers, max * sizeof(coro_t *));
+    if (!sleepers) return -1;
+    sched->sleepers = sleepers;
+    sched->max_sleepers = max;
+  }
+  coro->deadline = deadline;
+  coro->heap_index = sched->num_sleepers;
+  sched->sleepers[sched->num_sleepers++] = coro;
+  coro_heap_fix(sched, coro->heap_index);
+  return 0;
+}
+
+static void coro_heap_remove(coro_sched_t *sched, coro_t *coro) {
+  int i = coro->heap_index;
+  coro->heap_index = -1;
+  if (--sched->num_sleepers == i) return;
+  sched->sleepers[i] = sched->sleepers[sched->num_sleepers];
+  sched->sleepers[i]->heap_index = i;
+  coro_heap_fix(sched, i);
+}
+
+/* (Re-)arms FD in the epoll set for the coroutines waiting on it. */
+static int coro_arm(coro_sched_t *sched, int fd) {
+  coro_waiters_t *waiters = &sched->waiters[fd];
+  struct epoll_event event = {
+    .events = EPOLLONESHOT | (waiters->reader ? EPOLLIN : 0) |
+        (waiters->writer ? EPOLLOUT : 0),
+    .data.fd = fd,
+  };
+  /* A closed fd leaves the set by itself, so a reused one may be new to it. */
+  if (epoll_ctl(sched->epoll_fd, EPOLL_CTL_MOD, fd, &event) == 0) return 0;
+  if (errno != ENOENT) return -1;
+  return epoll_ctl(sched->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+/* Stops CORO's wait on its fd and makes it ready with RESULT. */
+static void coro_ready(coro_sched_t *sched, coro_t *coro, int result) {
+  int fd = coro->wait_fd;
+  if (fd >= 0) {
+    coro_waiters_t *waiters = &sched->waiters[fd];
+    if (waiters->reader == coro) waiters->reader = NULL;
+    if (waiters->writer == coro) waiters->writer = NULL;
+    /* A timeout leaves the fd armed for the other side, if any. */
+    if (result == 0 && (waiters->reader || waiters->writer)) coro_arm(sched, fd);
+    coro->wait_fd = -1;
+  }
+  if (coro->heap_index >= 0) coro_heap_remove(sched, coro);
+  coro->wait_result = result;
+  DL_APPEND(sched->ready, coro);
+}
+
+static void coro_finish(coro_sched_t *sched, coro_t *coro) {
+  coro_stack_put(sched, coro->stack);
+  coro->stack = NULL;
+  if (sched->starved) {
+    coro_t *starved = sched->starved;
+    DL_DELETE(sched->starved, starved);
+    DL_APPEND(sched->ready, starved);
+  }
+  if (coro->joiner)
+    coro_ready(sched, coro->joiner, 1);
+  else if (!coro->joinable)
+    free(coro);
+  if (__sync_sub_and_fetch(&coro_live, 1) == 0) {
+    pthread_mutex_lock(&coro_idle_lock);
+    pthread_cond_broadcast(&coro_idle_cv);
+    pthread_mutex_unlock(&coro_idle_lock);
+  }
+}
+
+static void coro_run(coro_sched_t *sched, coro_t *coro) {
+  if (!coro->stack) {
+    coro->stack = coro_stack_get(sched);
+    if (!coro->stack) {
+      /* Try again once another coroutine gives its stack back. */
+      DL_APPEND(sched->starved, coro);
+      return;
+    }
+    coro_context_init(coro);
+  }
+  if (coro_restore_hook) coro_restore_hook(coro->saved);
+  sched->running = coro;
+  coro_enter(sched, coro);
+  sched->running = NULL;
+  if (coro->done) coro_finish(sched, coro);
+}
+
+/* Switches back to the scheduler until the coroutine is made ready. */
+static void coro_yield(coro_t *coro) {
+  if (coro_save_hook) coro->saved = coro_save_hook();
+  coro_leave(coro);
+}
+
+static void coro_entry(void) {
+  coro_t *coro = coro_current_sched->running;
+  coro->fn(coro->arg);
+  coro->done = 1;
+  coro_yield(coro);
+}
+
+/* Wakes the waiters of an fd epoll reported EVENTS for. */
+static void coro_dispatch(coro_sched_t *sched, int fd, uint32_t events) {
+  if (fd >= sched->num_waiters) return;
+  coro_waiters_t *waiters = &sched->waiters[fd];
+  coro_t *reader = waiters->reader, *writer = waiters->writer;
+  if (reader && (events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+    coro_ready(sched, reader, 1);
+  if (writer && (events & (EPOLLOUT | EPOLLHUP | EPOLLERR)))
+    coro_ready(sched, writer, 1);
+  if (waiters->reader || waiters->writer) coro_arm(sched, fd);
+}
+
+static void *coro_sched_work(void *arg) {
+  coro_sched_t *sched = arg;
+  coro_current_sched = sched;
+  struct epoll_event events[CORO_MAX_EVENTS];
+  while (1) {
+    pthread_mutex_lock(&sched->lock);
+    DL_CONCAT(sched->ready, sched->inbox);
+    sched->inbox = NULL;
+    pthread_mutex_unlock(&sched->lock);
+
+    /* Coroutines readied while these run wait for the next round, so the
+     * epoll set is never starved. */
+    coro_t *batch = sched->ready;
+    sched->ready = NULL;
+    while (batch) {
+      coro_t *coro = batch;
+      DL_DELETE(batch, coro);
+      coro_run(sched, coro);
+    }
+
+    int timeout = -1;
+    uint64_t now = coro_now();
+    if (sched->ready) {
+      timeout = 0;
+    } else if (sched->num_sleepers > 0) {
+      uint64_t deadline = sched->sleepers[0]->deadline;
+      timeout = deadline > now ? (deadline - now + 999999) / 1000000 : 0;
+    }
+    int n = epoll_wait(sched->epoll_fd, events, CORO_MAX_EVENTS, timeout);
+    for (int i = 0; i < n; i++) {
+      if (events[i].data.fd == sched->event_fd) {
+        uint64_t count;
+        if (read(sched->event_fd, &count, sizeof(count)) < 0) continue;
+      } else {
+        coro_dispatch(sched, events[i].data.fd, events[i].events);
+      }
+    }
+    now = coro_now();
+    while (sched->num_sleepers > 0 && sched->sleepers[0]->deadline <= now)
+      coro_ready(sched, sched->sleepers[0], 0);
+  }
+  return NULL;
+}
+
+int coro_init(int num_schedulers, size_t stack_size) {
+  if (num_schedulers <= 0) num_schedulers = sysconf(_SC_NPROCESSORS_ONLN);
+  if (num_schedulers <= 0) num_schedulers = 1;
+  coro_page_size = sysconf(_SC_PAGESIZE);
+  coro_stack_size = (stack_size + coro_page_size - 1) / coro_page_size * coro_page_size;
+  coro_scheds = calloc(num_schedulers, sizeof(coro_sched_t));
+  if (!coro_scheds) return -1;
+  for (int i = 0; i < num_schedulers; i++) {
+    coro_sched_t *sched = &coro_scheds[i];
+    pthread_mutex_init(&sched->lock, NULL);
+    sched->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    sched->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (sched->epoll_fd < 0 || sched->event_fd < 0) return -1;
+    struct epoll_event event = { .events = EPOLLIN, .data.fd = sched->event_fd };
+    if (epoll_ctl(sched->epoll_fd, EPOLL_CTL_ADD, sched->event_fd, &event) < 0) return -1;
+    if (pthread_create(&sched->thread, NULL, coro_sched_work, sched) != 0) return -1;
+    coro_num_scheds++;
+  }
+  printf("%i coroutine schedulers started\n", coro_num_scheds);
+  return 0;
+}
+
+static coro_t *coro_new(void (*fn)(void *), void *arg, coro_sched_t *sched) {
+  coro_t *coro = calloc(1, sizeof(coro_t));
+  if (!coro) {
+    perror("Failed to allocate coroutine");
+    exit(ENOMEM);
+  }
+  coro->fn = fn;
+  coro->arg = arg;
+  coro->sched = sched;
+  coro->wait_fd = -1;
+  coro->heap_index = -1;
+  __sync_fetch_and_add(&coro_live, 1);
+  __sync_fetch_and_add(&coro_started, 1);
+  return coro;
+}
+
+void coro_wake(coro_t *coro) {
+  coro_sched_t *sched = coro->sched;
+  if (sched == coro_current_sched) {
+    DL_APPEND(sched->ready, coro);
+    return;
+  }
+  pthread_mutex_lock(&sched->lock);
+  DL_APPEND(sched->inbox, coro);
+  pthread_mutex_unlock(&sched->lock);
+  uint64_t one = 1;
+  if (write(sched->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    perror("Failed to wake coroutine scheduler");
+}
+
+void coro_spawn(void (*fn)(void *), void *arg) {
+  coro_sched_t *sched = &coro_scheds[__sync_fetch_and_add(&coro_next_sched, 1) % coro_num_scheds];
+  coro_wake(coro_new(fn, arg, sched));
+}
+
+coro_t *coro_spawn_joinable(void (*fn)(void *), void *arg) {
+  coro_t *coro = coro_new(fn, arg, coro_current_sched);
+  coro->joinable = 1;
+  DL_APPEND(coro_current_sched->ready, coro);
+  return coro;
+}
+
+void coro_join(coro_t *coro) {
+  if (!coro->done) {
+    coro->joiner = coro_self();
+    coro_yield(coro->joiner);
+  }
+  free(coro);
+}
+
+coro_t *coro_self(void) {
+  return coro_current_sched ? coro_current_sched->running : NULL;
+}
+
+void coro_suspend(void) {
+  coro_yield(coro_self());
+}
+
+void coro_wait_idle(void) {
+  pthread_mutex_lock(&coro_idle_lock);
+  while (__sync_fetch_and_add(&coro_live, 0) > 0)
+    pthread_cond_wait(&coro_idle_cv, &coro_idle_lock);
+  pthread_mutex_unlock(&coro_idle_lock);
+}
+
+/* Waits in coroutine SELF for EVENTS on FD, for up to TIMEOUT_MS unless it
+ * is -1. Returns 1 once ready, 0 on a timeout and -1 on errors. */
+static int coro_wait(coro_t *self, int fd, short events, int timeout_ms) {
+  coro_sched_t *sched = self->sched;
+  if (fd >= sched->num_waiters) {
+    int num = fd + 1 > 2 * sched->num_waiters ? fd + 1 : 2 * sched->num_waiters;
+    coro_waiters_t *waiters = realloc(sched->waiters, num * sizeof(coro_waiters_t));
+    if (!waiters) return -1;
+    memset(waiters + sched->num_waiters, 0, (num - sched->num_waiters) * sizeof(coro_waiters_t));
+    sched->waiters = waiters;
+    sched->num_waiters = num;
+  }
+  coro_waiters_t *waiters = &sched->waiters[fd];
+  coro_t **slot = events & POLLIN ? &waiters->reader : &waiters->writer;
+  if (*slot) {
+    errno = EBUSY;
+    return -1;
+  }
+  *slot = self;
+  if (coro_arm(sched, fd) < 0) {
+    *slot = NULL;
+    /* Regular files can't be polled, and never block. */
+    return errno == EPERM ? 1 : -1;
+  }
+  self->wait_fd = fd;
+  if (timeout_ms >= 0) coro_heap_add(sched, self, coro_now() + timeout_ms * 1000000ull);
+  coro_yield(self);
+  return self->wait_result;
+}
+
+ssize_t coro_read(int fd, void *buffer, size_t size) {
+  coro_t *self = coro_self();
+  if (!self) return read(fd, buffer, size);
+  while (1) {
+    ssize_t n = recv(fd, buffer, size, MSG_DONTWAIT);
+    if (n < 0 && errno == ENOTSOCK) return read(fd, buffer, size);
+    if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) return n;
+    if (coro_wait(self, fd, POLLIN, -1) < 0) return -1;
+  }
+}
+
+ssize_t coro_write(int fd, const void *buffer, size_t size) {
+  coro_t *self = coro_self();
+  if (!self) return write(fd, buffer, size);
+  while (1) {
+    ssize_t n = send(fd, buffer, size, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n < 0 && errno == ENOTSOCK) return write(fd, buffer, size);
+    if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) return n;
+    if (coro_wait(self, fd, POLLOUT, -1) < 0) return -1;
+  }
+}
+
+ssize_t coro_writev(int fd, const struct iovec *iov, int iovcnt) {
+  coro_t *self = coro_self();
+  if (!self) return writev(fd, iov, iovcnt);
+  struct msghdr message = { .msg_iov = (struct iovec *) iov, .msg_iovlen = iovcnt };
+  while (1) {
+    ssize_t n = sendmsg(fd, &message, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n < 0 && errno == ENOTSOCK) return writev(fd, iov, iovcnt);
+    if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) return n;
+    if (coro_wait(self, fd, POLLOUT, -1) < 0) return -1;
+  }
+}
+
+int coro_accept(int fd, struct sockaddr *address, socklen_t *size) {
+  coro_t *self = coro_self();
+  if (!self) return accept(fd, address, size);
+  int flags = fcntl(fd, F_GETFL);
+  if (!(flags & O_NONBLOCK)) fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+  while (1) {
+    int client = accept(fd, address, size);
+    if (client >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) return client;
+    if (coro_wait(self, fd, POLLIN, -1) < 0) return -1;
+  }
+}
+
+int coro_connect(int fd, const struct sockaddr *address, socklen_t size, int timeout_ms) {
+  int flags = fcntl(fd, F_GETFL);
+  fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+  int result = connect(fd, address, size);
+  if (result < 0 && errno == EINPROGRESS) {
+    int error = 0;
+    socklen_t error_size = sizeof(error);
+    while ((result = coro_poll(fd, POLLOUT, timeout_ms)) < 0 && errno == EINTR);
+    if (result == 1 && getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_size) == 0 &&
+        error == 0)
+      result = 0;
+    else
+      result = -1;
+  }
+  fcntl(fd, F_SETFL, flags);
+  return result;
+}
+
+ssize_t coro_sendfile(int out_fd, int in_fd, off_t *offset, size_t count) {
+  coro_t *self = coro_self();
+  if (!self) return sendfile(out_fd, in_fd, offset, count);
+  /* Sendfile takes no flags, so the socket is nonblocking just for it. */
+  int flags = fcntl(out_fd, F_GETFL);
+  fcntl(out_fd, F_SETFL, flags | O_NONBLOCK);
+  ssize_t n;
+  while ((n = sendfile(out_fd, in_fd, offset, count)) < 0 &&
+      (errno == EAGAIN || errno == EWOULDBLOCK) && coro_wait(self, out_fd, POLLOUT, -1) >= 0);
+  int error = errno;
+  fcntl(out_fd, F_SETFL, flags);
+  errno = error;
+  return n;
+}
+
+int coro_poll(int fd, short events, int timeout_ms) {
+  coro_t *self = coro_self();
+  if (!self) {
+    struct pollfd pollfd = { .fd = fd, .events = events };
+    return poll(&pollfd, 1, timeout_ms);
+  }
+  return coro_wait(self, fd, events, timeout_ms);
+}
+
+void coro_sleep(long ms) {
+  coro_t *self = coro_self();
+  if (!self || coro_heap_add(self->sched, self, coro_now() + ms * 1000000ull) < 0) {
+    struct timespec delay = { .tv_sec = ms / 1000, .tv_nsec = ms % 1000 * 1000000 };
+    nanosleep(&delay, NULL);
+    return;
+  }
+  coro_yield(self);
+}
+
+void coro_format(struct http_buffer *buffer) {
+  http_buffer_printf(buffer, "coroutine_schedulers %d\n", coro_num_scheds);
+  http_buffer_printf(buffer, "coroutines_live %ld\n", __sync_fetch_and_add(&coro_live, 0));
+  http_buffer_printf(buffer, "coroutines_started %lu\n",
+      __sync_fetch_and_add(&coro_started, 0));
+  http_buffer_printf(buffer, "coroutine_stacks %ld\n", __sync_fetch_and_add(&coro_stacks, 0));
+  http_buffer_printf(buffer, "coroutine_stack_kb %zu\n", coro_stack_size / 1024);
+}
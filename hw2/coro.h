@@ -0,0 +1,71 @@
+#ifndef __CORO__
+#define __CORO__
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* CORO runs connections as coroutines: user-space threads, many to each
+ * kernel thread, so handlers keep their blocking style without costing a
+ * pthread per connection. There is a scheduler thread with an epoll set
+ * per core. A coroutine stays on the scheduler it started on; when it
+ * would block on a socket, it adds the socket to that epoll set and
+ * switches back to the scheduler, which runs whichever coroutines are
+ * ready.
+ *
+ * Stacks are mapped with a guard page and no reserved memory, so a stack
+ * only takes the pages it touches, and are pooled by each scheduler. A
+ * context switch saves just the callee-saved registers.
+ *
+ * The I/O calls below also work outside coroutines, as the plain blocking
+ * calls, so shared code can use them either way. In a coroutine, sockets
+ * are read and written with MSG_DONTWAIT, so the fds themselves stay
+ * blocking. Code that calls read or write directly, or waits on a pthread
+ * condition, still works but holds up its whole scheduler while it
+ * waits. */
+
+typedef struct coro coro_t;
+struct http_buffer;
+
+/* Starts NUM_SCHEDULERS schedulers, or one per core if 0, whose
+ * coroutines get STACK_SIZE bytes of stack. Returns -1 on failure. */
+int coro_init(int num_schedulers, size_t stack_size);
+/* Runs FN(ARG) in a new coroutine. May be called from any thread. */
+void coro_spawn(void (*fn)(void *), void *arg);
+/* Runs FN(ARG) in a new coroutine on the caller's scheduler, to be
+ * waited for and freed with coro_join. Only called from coroutines. */
+coro_t *coro_spawn_joinable(void (*fn)(void *), void *arg);
+void coro_join(coro_t *coro);
+/* Returns the calling coroutine, or NULL outside of one. */
+coro_t *coro_self(void);
+/* Switches away until another thread calls coro_wake for this coroutine. */
+void coro_suspend(void);
+void coro_wake(coro_t *coro);
+/* Waits until every coroutine has finished. */
+void coro_wait_idle(void);
+
+ssize_t coro_read(int fd, void *buffer, size_t size);
+ssize_t coro_write(int fd, const void *buffer, size_t size);
+ssize_t coro_writev(int fd, const struct iovec *iov, int iovcnt);
+/* Makes the listening socket FD nonblocking, since several schedulers may
+ * wait on it. The server itself accepts on its main thread, not in a
+ * coroutine, and sends files through its I/O buffers, so it uses neither
+ * this nor coro_sendfile. */
+int coro_accept(int fd, struct sockaddr *address, socklen_t *size);
+/* Connects FD, giving up after TIMEOUT_MS, or never if it is -1. */
+int coro_connect(int fd, const struct sockaddr *address, socklen_t size, int timeout_ms);
+ssize_t coro_sendfile(int out_fd, int in_fd, off_t *offset, size_t count);
+/* Waits up to TIMEOUT_MS, or forever if -1, for EVENTS (POLLIN, POLLOUT)
+ * on FD. Returns 1 once ready, 0 on a timeout and -1 on errors. */
+int coro_poll(int fd, short events, int timeout_ms);
+void coro_sleep(long ms);
+
+/* If set, called as each coroutine is switched out and in, to carry
+ * thread-local state along with it, e.g. the current trace. */
+extern void *(*coro_save_hook)(void);
+extern void (*coro_restore_hook)(void *saved);
+
+/* Appends coroutine and stack counters, one "name value" line each. */
+void coro_format(struct http_buffer *buffer);
+
+#endif
@@ -0,0 +1,158 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dircache.h"
+#include "utlist.h"
+
+#define DIRCACHE_BUCKETS 256
+
+static pthread_mutex_t dircache_lock = PTHREAD_MUTEX_INITIALIZER;
+static dircache_entry_t *dircache_buckets[DIRCACHE_BUCKETS];
+static dircache_entry_t *dircache_lru;
+static int dircache_count;
+static int dircache_max_entries;
+static size_t dircache_max_listing_size;
+static int dircache_sort;
+
+/* Initializes the cache. MAX_ENTRIES of 0 disables caching, so every
+ * request renders a fresh listing. */
+void dircache_init(int sorted, int max_entries, size_t max_listing_size) {
+  dircache_sort = sorted;
+  dircache_max_entries = max_entries;
+  dircache_max_listing_size = max_listing_size;
+}
+
+int dircache_sorted(void) {
+  return dircache_sort;
+}
+
+static unsigned int dircache_hash(const char *key) {
+  uint32_t hash = 2166136261u;
+  while (*key) {
+    hash ^= (unsigned char) *key++;
+    hash *= 16777619u;
+  }
+  return hash % DIRCACHE_BUCKETS;
+}
+
+/* Writes the key of REQUEST_PATH under FILES_DIR to KEY. Request paths
+ * never hold a newline, so no two pairs share a key. */
+static void dircache_key(char *key, size_t size, const char *files_dir, const char *request_path) {
+  snprintf(key, size, "%s\n%s", files_dir, request_path);
+}
+
+static void dircache_entry_free(dircache_entry_t *entry) {
+  http_buffer_free(&entry->listing);
+  free(entry->key);
+  free(entry);
+}
+
+/* Drops the cache's own reference to ENTRY. Must hold dircache_lock. */
+static void dircache_unlink(dircache_entry_t *entry) {
+  DL_DELETE(dircache_buckets[dircache_hash(entry->key)], entry);
+  DL_DELETE2(dircache_lru, entry, lru_prev, lru_next);
+  dircache_count--;
+  if (--entry->refcount == 0) dircache_entry_free(entry);
+}
+
+static dircache_entry_t *dircache_entry_new(const char *key, struct stat *s) {
+  dircache_entry_t *entry = calloc(1, sizeof(dircache_entry_t));
+  if (!entry) return NULL;
+  http_buffer_init(&entry->listing);
+  entry->key = strdup(key);
+  entry->inode = s->st_ino;
+  entry->mtime = s->st_mtim;
+  entry->refcount = 1;
+  if (!entry->key) {
+    free(entry);
+    return NULL;
+  }
+  return entry;
+}
+
+static int dircache_is_fresh(dircache_entry_t *entry, struct stat *s) {
+  return entry->inode == s->st_ino &&
+      entry->mtime.tv_sec == s->st_mtim.tv_sec &&
+      entry->mtime.tv_nsec == s->st_mtim.tv_nsec;
+}
+
+dircache_entry_t *dircache_get(const char *files_dir, char *request_path, struct stat *s) {
+  dircache_entry_t *entry;
+  char key[2 * MAX_PATH];
+  dircache_key(key, sizeof(key), files_dir, request_path);
+  unsigned int bucket = dircache_hash(key);
+
+  pthread_mutex_lock(&dircache_lock);
+  DL_FOREACH(dircache_buckets[bucket], entry) {
+    if (strcmp(entry->key, key) != 0) continue;
+    if (dircache_is_fresh(entry, s)) {
+      entry->refcount++;
+      DL_DELETE2(dircache_lru, entry, lru_prev, lru_next);
+      DL_APPEND2(dircache_lru, entry, lru_prev, lru_next);
+      pthread_mutex_unlock(&dircache_lock);
+      return entry;
+    }
+    break;
+  }
+  pthread_mutex_unlock(&dircache_lock);
+
+  /* Render outside the lock; a large directory can take a while. The key is
+   * the mtime seen before reading, so a change made while reading only
+   * makes the next request render again. */
+  entry = dircache_entry_new(key, s);
+  if (!entry) return NULL;
+  int result = http_get_list_files_max(files_dir, request_path, dircache_sort,
+      dircache_max_listing_size, &entry->listing);
+  if (result < 0) {
+    dircache_entry_free(entry);
+    return NULL;
+  }
+  /* Rendering stops at the limit, and the caller streams the listing
+   * instead; the entry stays on as a marker that it is oversized. */
+  if (result > 0) {
+    http_buffer_free(&entry->listing);
+    entry->oversized = 1;
+  }
+  if (dircache_max_entries == 0) return entry;
+
+  pthread_mutex_lock(&dircache_lock);
+  dircache_entry_t *old, *tmp;
+  DL_FOREACH_SAFE(dircache_buckets[bucket], old, tmp) {
+    if (strcmp(old->key, key) == 0) dircache_unlink(old);
+  }
+  while (dircache_count >= dircache_max_entries) dircache_unlink(dircache_lru);
+  entry->refcount++;
+  DL_APPEND(dircache_buckets[bucket], entry);
+  DL_APPEND2(dircache_lru, entry, lru_prev, lru_next);
+  dircache_count++;
+  pthread_mutex_unlock(&dircache_lock);
+  return entry;
+}
+
+void dircache_release(dircache_entry_t *entry) {
+  pthread_mutex_lock(&dircache_lock);
+  int refcount = --entry->refcount;
+  pthread_mutex_unlock(&dircache_lock);
+  if (refcount == 0) dircache_entry_free(entry);
+}
+
+void dircache_invalidate(const char *files_dir, const char *request_path) {
+  size_t length = strlen(request_path);
+  while (length > 1 && request_path[length - 1] == '/') length--;
+  /* Either spelling of the directory may be a key. */
+  char path[MAX_PATH], key[2 * MAX_PATH];
+  for (int slash = 0; slash < 2; slash++) {
+    snprintf(path, sizeof(path), "%.*s%s", (int) length, request_path,
+        slash && length > 1 ? "/" : "");
+    dircache_key(key, sizeof(key), files_dir, path);
+    unsigned int bucket = dircache_hash(key);
+    pthread_mutex_lock(&dircache_lock);
+    dircache_entry_t *entry, *tmp;
+    DL_FOREACH_SAFE(dircache_buckets[bucket], entry, tmp) {
+      if (strcmp(entry->key, key) == 0) dircache_unlink(entry);
+    }
+    pthread_mutex_unlock(&dircache_lock);
+  }
+}
@@ -0,0 +1,44 @@
+#ifndef __DIRCACHE__
+#define __DIRCACHE__
+
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "libhttp.h"
+
+/* DIRCACHE keeps rendered directory listings so repeated requests for the
+ * same directory don't readdir it again. Entries are keyed by the root
+ * served and the request path under it, since routes may serve several
+ * roots and a listing's links follow the request path. They are considered
+ * stale as soon as the directory's mtime changes.
+ * Listings larger than the configured limit are not kept, nor rendered past
+ * it; the cache only remembers that the directory is oversized so it can be
+ * streamed. */
+
+typedef struct dircache_entry {
+  char *key;                          // Root and request path, see dircache_key.
+  ino_t inode;
+  struct timespec mtime;
+  struct http_buffer listing;
+  int oversized;                      // Listing too large to keep; stream it.
+  int refcount;
+  struct dircache_entry *next;        // Hash bucket chain.
+  struct dircache_entry *prev;
+  struct dircache_entry *lru_next;    // Least recently used first.
+  struct dircache_entry *lru_prev;
+} dircache_entry_t;
+
+void dircache_init(int sorted, int max_entries, size_t max_listing_size);
+int dircache_sorted(void);
+/* Returns the listing of request_path under FILES_DIR, which has been
+ * stat'ed into S. The
+ * entry must be given back with dircache_release. Returns NULL if the
+ * directory cannot be read. An entry with oversized set has no listing. */
+dircache_entry_t *dircache_get(const char *files_dir, char *request_path, struct stat *s);
+void dircache_release(dircache_entry_t *entry);
+/* Drops the listing of request_path under FILES_DIR, with or without a
+ * trailing slash, for changes made within the directory's mtime
+ * granularity. */
+void dircache_invalidate(const char *files_dir, const char *request_path);
+
+#endif
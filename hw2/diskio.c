@@ -0,0 +1,98 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "diskio.h"
+#include "utlist.h"
+
+static pthread_mutex_t diskio_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t diskio_cv = PTHREAD_COND_INITIALIZER;
+static diskio_job_t *diskio_queue;
+static int diskio_queued;
+static int diskio_max_queued;
+static int diskio_running;
+/* Set once the kernel or filesystem turns down RWF_NOWAIT. */
+static int diskio_nowait_unsupported;
+
+static void *diskio_work(void *arg) {
+  pthread_mutex_lock(&diskio_lock);
+  while (1) {
+    while (diskio_queue == NULL)
+      pthread_cond_wait(&diskio_cv, &diskio_lock);
+    diskio_job_t *job = diskio_queue;
+    DL_DELETE(diskio_queue, job);
+    diskio_queued--;
+    pthread_mutex_unlock(&diskio_lock);
+
+    ssize_t n;
+    while ((n = pread(job->fd, job->buffer, job->size, job->offset)) < 0 && errno == EINTR);
+    job->done(job->arg, n, n < 0 ? errno : 0);
+    free(job);
+    pthread_mutex_lock(&diskio_lock);
+  }
+  return NULL;
+}
+
+void diskio_init(int num_threads, int max_queued) {
+  diskio_max_queued = max_queued;
+  for (int i = 0; i < num_threads; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, diskio_work, NULL) != 0) {
+      perror("Failed to start disk thread");
+      break;
+    }
+    pthread_detach(thread);
+    diskio_running++;
+  }
+  if (diskio_running > 0) printf("%i disk threads created\n", diskio_running);
+}
+
+ssize_t diskio_read_cached(int fd, void *buffer, size_t size, off_t offset) {
+  ssize_t n;
+  if (diskio_running > 0 && !diskio_nowait_unsupported) {
+    struct iovec iov = { .iov_base = buffer, .iov_len = size };
+    while ((n = preadv2(fd, &iov, 1, offset, RWF_NOWAIT)) < 0 && errno == EINTR);
+    if (n >= 0 || errno == EAGAIN) return n;
+    if (errno != EOPNOTSUPP && errno != ENOSYS && errno != EINVAL) return n;
+    diskio_nowait_unsupported = 1;
+    fprintf(stderr, "Non-blocking reads are not supported, reading inline\n");
+  }
+  while ((n = pread(fd, buffer, size, offset)) < 0 && errno == EINTR);
+  return n;
+}
+
+int diskio_submit(int fd, void *buffer, size_t size, off_t offset, diskio_done_t done,
+    void *arg) {
+  if (diskio_running == 0) return -1;
+  diskio_job_t *job = malloc(sizeof(diskio_job_t));
+  if (!job) return -1;
+  job->fd = fd;
+  job->buffer = buffer;
+  job->size = size;
+  job->offset = offset;
+  job->done = done;
+  job->arg = arg;
+
+  pthread_mutex_lock(&diskio_lock);
+  if (diskio_queued >= diskio_max_queued) {
+    pthread_mutex_unlock(&diskio_lock);
+    free(job);
+    return -1;
+  }
+  DL_APPEND(diskio_queue, job);
+  diskio_queued++;
+  pthread_cond_signal(&diskio_cv);
+  pthread_mutex_unlock(&diskio_lock);
+  return 0;
+}
+
+void diskio_advise_sequential(int fd) {
+  /* Doubles the kernel's readahead window, so one miss brings in the data
+   * the following reads will want. */
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+}
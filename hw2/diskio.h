@@ -0,0 +1,39 @@
+#ifndef __DISKIO__
+#define __DISKIO__
+
+#include <sys/types.h>
+
+/* DISKIO is a small pool of threads that do the file reads which would have
+ * to wait for the disk, so that a cold or slow disk only stalls the requests
+ * that need it. Worker threads first try to read from the page cache without
+ * blocking and only hand reads that miss over to the pool. The queue is
+ * bounded; when it is full the caller reads for itself. */
+
+/* Called on a disk thread with the result of the read and its errno. */
+typedef void (*diskio_done_t)(void *arg, ssize_t result, int error);
+
+typedef struct diskio_job {
+  int fd;
+  void *buffer;
+  size_t size;
+  off_t offset;
+  diskio_done_t done;
+  void *arg;
+  struct diskio_job *next;
+  struct diskio_job *prev;
+} diskio_job_t;
+
+/* Starts NUM_THREADS disk threads with room for MAX_QUEUED waiting reads.
+ * With no threads every read blocks in the caller. */
+void diskio_init(int num_threads, int max_queued);
+/* Reads like pread, but only from the page cache when the pool is running:
+ * fails with EAGAIN instead of waiting for the disk. */
+ssize_t diskio_read_cached(int fd, void *buffer, size_t size, off_t offset);
+/* Queues a blocking pread and calls DONE when it completes. Returns -1 if
+ * the pool is not running or its queue is full. */
+int diskio_submit(int fd, void *buffer, size_t size, off_t offset, diskio_done_t done,
+    void *arg);
+/* Hints that fd is about to be read from start to end. */
+void diskio_advise_sequential(int fd);
+
+#endif
@@ -0,0 +1,95 @@
+#include <string.h>
+
+#include "fcgi.h"
+
+static void append_header(struct http_buffer *buffer, int type, int id, size_t size,
+    int padding) {
+  char header[FCGI_HEADER_SIZE] = {
+    FCGI_VERSION_1, type, id >> 8, id, size >> 8, size, padding, 0,
+  };
+  http_buffer_append(buffer, header, sizeof(header));
+}
+
+void fcgi_append_record(struct http_buffer *buffer, int type, int id, const void *data,
+    size_t size) {
+  static const char zeros[8];
+  const char *p = data;
+  do {
+    size_t n = size > FCGI_MAX_CONTENT ? FCGI_MAX_CONTENT : size;
+    /* Content is padded to 8 bytes, as the spec recommends. */
+    int padding = (8 - n % 8) % 8;
+    append_header(buffer, type, id, n, padding);
+    if (n > 0) http_buffer_append(buffer, p, n);
+    http_buffer_append(buffer, zeros, padding);
+    p += n;
+    size -= n;
+  } while (size > 0);
+}
+
+void fcgi_append_begin(struct http_buffer *buffer, int id) {
+  char body[8] = { 0, FCGI_RESPONDER, FCGI_KEEP_CONN };
+  fcgi_append_record(buffer, FCGI_BEGIN_REQUEST, id, body, sizeof(body));
+}
+
+void fcgi_append_end(struct http_buffer *buffer, int id, int app_status) {
+  char body[8] = {
+    app_status >> 24, app_status >> 16, app_status >> 8, app_status, FCGI_REQUEST_COMPLETE,
+  };
+  fcgi_append_record(buffer, FCGI_END_REQUEST, id, body, sizeof(body));
+}
+
+/* Lengths below 128 take one byte, others four with the top bit set. */
+static void append_length(struct http_buffer *buffer, size_t length) {
+  if (length < 128) {
+    char byte = length;
+    http_buffer_append(buffer, &byte, 1);
+  } else {
+    char bytes[4] = { (length >> 24) | 0x80, length >> 16, length >> 8, length };
+    http_buffer_append(buffer, bytes, 4);
+  }
+}
+
+void fcgi_append_pair(struct http_buffer *buffer, const char *name, const char *value) {
+  size_t name_size = strlen(name), value_size = strlen(value);
+  append_length(buffer, name_size);
+  append_length(buffer, value_size);
+  http_buffer_append(buffer, name, name_size);
+  http_buffer_append(buffer, value, value_size);
+}
+
+ssize_t fcgi_parse_record(const uint8_t *data, size_t size, fcgi_record_t *record) {
+  if (size < FCGI_HEADER_SIZE) return 0;
+  if (data[0] != FCGI_VERSION_1) return -1;
+  size_t content_size = data[4] << 8 | data[5];
+  size_t total = FCGI_HEADER_SIZE + content_size + data[6];
+  if (size < total) return 0;
+  record->type = data[1];
+  record->id = data[2] << 8 | data[3];
+  record->content = data + FCGI_HEADER_SIZE;
+  record->size = content_size;
+  return total;
+}
+
+static int read_length(const uint8_t **data, const uint8_t *end, size_t *length) {
+  if (*data == end) return -1;
+  if (!(**data & 0x80)) {
+    *length = *(*data)++;
+    return 0;
+  }
+  if (end - *data < 4) return -1;
+  const uint8_t *p = *data;
+  *length = (size_t) (p[0] & 0x7f) << 24 | p[1] << 16 | p[2] << 8 | p[3];
+  *data += 4;
+  return 0;
+}
+
+int fcgi_next_pair(const uint8_t **data, const uint8_t *end, const char **name,
+    size_t *name_size, const char **value, size_t *value_size) {
+  if (read_length(data, end, name_size) < 0 || read_length(data, end, value_size) < 0 ||
+      *name_size + *value_size > (size_t) (end - *data))
+    return -1;
+  *name = (const char *) *data;
+  *value = *name + *name_size;
+  *data += *name_size + *value_size;
+  return 0;
+}
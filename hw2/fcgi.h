@@ -0,0 +1,59 @@
+#ifndef __FCGI__
+#define __FCGI__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "libhttp.h"
+
+/* FCGI encodes and decodes FastCGI records, the framing used between the
+ * server and its dynamic workers (see fcgipool.h and httpapp.c). A record
+ * carries up to 64 KB of one stream (params, stdin, stdout or stderr) of
+ * one request, so several requests can share a connection. */
+
+#define FCGI_VERSION_1 1
+#define FCGI_HEADER_SIZE 8
+#define FCGI_MAX_CONTENT 65535
+#define FCGI_LISTENSOCK_FILENO 0    // Workers accept on this fd.
+
+/* Record types. */
+#define FCGI_BEGIN_REQUEST 1
+#define FCGI_ABORT_REQUEST 2
+#define FCGI_END_REQUEST 3
+#define FCGI_PARAMS 4
+#define FCGI_STDIN 5
+#define FCGI_STDOUT 6
+#define FCGI_STDERR 7
+
+#define FCGI_RESPONDER 1            // The only role we use.
+#define FCGI_KEEP_CONN 1            // BEGIN_REQUEST flag.
+#define FCGI_REQUEST_COMPLETE 0     // END_REQUEST protocol status.
+
+typedef struct fcgi_record {
+  int type;
+  int id;                       // Request id, 1 and up.
+  const uint8_t *content;
+  size_t size;
+} fcgi_record_t;
+
+/* Appends DATA to BUFFER as records of TYPE for request ID, split as
+ * needed. A SIZE of 0 appends the empty record that ends a stream. */
+void fcgi_append_record(struct http_buffer *buffer, int type, int id, const void *data,
+    size_t size);
+/* Appends BEGIN_REQUEST for a responder that keeps the connection open. */
+void fcgi_append_begin(struct http_buffer *buffer, int id);
+/* Appends END_REQUEST with APP_STATUS. */
+void fcgi_append_end(struct http_buffer *buffer, int id, int app_status);
+/* Appends one name-value pair to a PARAMS stream being built in BUFFER. */
+void fcgi_append_pair(struct http_buffer *buffer, const char *name, const char *value);
+
+/* Parses the record at the start of DATA. Returns its size with padding,
+ * 0 if it isn't complete yet, or -1 if it is malformed. */
+ssize_t fcgi_parse_record(const uint8_t *data, size_t size, fcgi_record_t *record);
+/* Reads the pair at *DATA and moves past it. The name and value are not
+ * terminated. Returns -1 at END or if the pair is truncated. */
+int fcgi_next_pair(const uint8_t **data, const uint8_t *end, const char **name,
+    size_t *name_size, const char **value, size_t *value_size);
+
+#endif
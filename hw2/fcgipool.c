@@ -0,0 +1,381 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fcgi.h"
+#include "fcgipool.h"
+#include "stats.h"
+
+/* Response bytes held for a request before its worker's reader waits for
+ * the client to catch up. */
+#define FCGIPOOL_BUFFER_MAX (1 << 20)
+/* A worker that dies sooner than this after starting is restarted only
+ * after this long, so a broken command doesn't spin. */
+#define FCGIPOOL_RESTART_DELAY 1
+
+typedef enum fcgipool_slot_state {
+  FCGIPOOL_FREE,
+  FCGIPOOL_ACTIVE,
+  FCGIPOOL_ABANDONED,           // Ended early; waits for the worker's END.
+} fcgipool_slot_state_t;
+
+struct fcgipool_request {
+  struct fcgipool_worker *worker;
+  int id;                       // FastCGI request id, the slot index + 1.
+  fcgipool_slot_state_t state;
+  unsigned generation;          // Worker start it was sent to.
+  int begun;                    // BEGIN_REQUEST and params were sent.
+  int ended;                    // END_REQUEST was received.
+  int failed;                   // The worker died first.
+  struct http_buffer params;
+  struct http_buffer response;  // STDOUT not read yet.
+  size_t response_offset;
+  pthread_cond_t cv;
+};
+
+typedef struct fcgipool_worker {
+  int index;
+  pid_t pid;
+  int fd;                       // Connection to the worker, -1 while down.
+  unsigned generation;          // Bumped at every start.
+  pthread_mutex_t write_lock;   // Keeps records whole; also guards fd.
+  fcgipool_request_t *requests; // One slot per request id.
+  int outstanding;
+  unsigned long requests_served;
+  unsigned long restarts;
+  char socket_path[108];
+} fcgipool_worker_t;
+
+/* Guards the slots and counters of every worker. */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cv = PTHREAD_COND_INITIALIZER;
+static fcgipool_worker_t *pool_workers;
+static int pool_size;
+static int pool_max_requests;
+static char *pool_command;
+
+/* Starts the worker process, listening on its socket, and connects to it. */
+static int worker_start(fcgipool_worker_t *worker) {
+  struct sockaddr_un address = { .sun_family = AF_UNIX };
+  snprintf(address.sun_path, sizeof(address.sun_path), "%s", worker->socket_path);
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0) return -1;
+  unlink(worker->socket_path);
+  if (bind(listener, (struct sockaddr *) &address, sizeof(address)) < 0 ||
+      listen(listener, 16) < 0) {
+    perror("Failed to listen for dynamic worker");
+    close(listener);
+    return -1;
+  }
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    /* Only async-signal-safe calls until exec: other threads' locks may be
+     * held in this copy of the process. */
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    dup2(listener, FCGI_LISTENSOCK_FILENO);
+    long max_fd = sysconf(_SC_OPEN_MAX);
+    for (int fd = 3; fd < max_fd && fd < 65536; fd++) close(fd);
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+    signal(SIGPIPE, SIG_DFL);
+    execl("/bin/sh", "sh", "-c", pool_command, (char *) NULL);
+    _exit(127);
+  }
+  close(listener);
+  if (pid < 0) return -1;
+
+  /* The socket is listening already, so this doesn't wait for exec. */
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *) &address, sizeof(address)) < 0) {
+    if (fd >= 0) close(fd);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    unlink(worker->socket_path);
+    return -1;
+  }
+  /* Nothing else connects, so the name needn't outlive the process. */
+  unlink(worker->socket_path);
+  pthread_mutex_lock(&worker->write_lock);
+  pthread_mutex_lock(&pool_lock);
+  worker->pid = pid;
+  worker->fd = fd;
+  worker->generation++;
+  pthread_cond_broadcast(&pool_cv);
+  pthread_mutex_unlock(&pool_lock);
+  pthread_mutex_unlock(&worker->write_lock);
+  return 0;
+}
+
+/* Takes the worker down and fails whatever it had in flight. */
+static void worker_stop(fcgipool_worker_t *worker) {
+  pthread_mutex_lock(&worker->write_lock);
+  pthread_mutex_lock(&pool_lock);
+  int fd = worker->fd;
+  worker->fd = -1;
+  for (int i = 0; i < pool_max_requests; i++) {
+    fcgipool_request_t *request = &worker->requests[i];
+    if (request->state == FCGIPOOL_ABANDONED) {
+      request->state = FCGIPOOL_FREE;
+      worker->outstanding--;
+    } else if (request->state == FCGIPOOL_ACTIVE && request->begun && !request->ended) {
+      request->failed = 1;
+      pthread_cond_broadcast(&request->cv);
+    }
+  }
+  pthread_cond_broadcast(&pool_cv);
+  pthread_mutex_unlock(&pool_lock);
+  pthread_mutex_unlock(&worker->write_lock);
+  if (fd >= 0) close(fd);
+  if (worker->pid > 0) {
+    kill(worker->pid, SIGKILL);
+    waitpid(worker->pid, NULL, 0);
+    worker->pid = 0;
+  }
+}
+
+/* Routes one record from the worker to its request. Returns -1 if the
+ * worker broke the protocol. */
+static int worker_receive(fcgipool_worker_t *worker, fcgi_record_t *record) {
+  if (record->id < 1 || record->id > pool_max_requests) return 0;
+  fcgipool_request_t *request = &worker->requests[record->id - 1];
+  pthread_mutex_lock(&pool_lock);
+  if (record->type == FCGI_STDOUT && record->size > 0) {
+    /* Wait for a slow client rather than buffer without bound. This holds
+     * up the worker's other requests too, like TCP would. */
+    while (request->state == FCGIPOOL_ACTIVE &&
+        request->response.size - request->response_offset > FCGIPOOL_BUFFER_MAX)
+      pthread_cond_wait(&request->cv, &pool_lock);
+    if (request->state == FCGIPOOL_ACTIVE) {
+      http_buffer_append(&request->response, (char *) record->content, record->size);
+      pthread_cond_broadcast(&request->cv);
+    }
+  } else if (record->type == FCGI_STDERR && record->size > 0) {
+    fprintf(stderr, "app%d: %.*s", worker->index, (int) record->size, record->content);
+  } else if (record->type == FCGI_END_REQUEST) {
+    worker->requests_served++;
+    if (request->state == FCGIPOOL_ABANDONED) {
+      request->state = FCGIPOOL_FREE;
+      worker->outstanding--;
+      pthread_cond_broadcast(&pool_cv);
+    } else if (request->state == FCGIPOOL_ACTIVE) {
+      request->ended = 1;
+      pthread_cond_broadcast(&request->cv);
+    }
+  }
+  pthread_mutex_unlock(&pool_lock);
+  return 0;
+}
+
+/* Reads records from the worker until its connection ends. */
+static void worker_read(fcgipool_worker_t *worker, int fd) {
+  struct http_buffer input;
+  http_buffer_init(&input);
+  char buffer[FCGI_HEADER_SIZE + FCGI_MAX_CONTENT + 256];
+  while (1) {
+    ssize_t n = read(fd, buffer, sizeof(buffer));
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    http_buffer_append(&input, buffer, n);
+    size_t offset = 0;
+    fcgi_record_t record;
+    ssize_t size;
+    while ((size = fcgi_parse_record((uint8_t *) input.data + offset, input.size - offset,
+        &record)) > 0) {
+      worker_receive(worker, &record);
+      offset += size;
+    }
+    if (size < 0) {
+      fprintf(stderr, "app%d: malformed record\n", worker->index);
+      break;
+    }
+    memmove(input.data, input.data + offset, input.size - offset);
+    input.size -= offset;
+  }
+  http_buffer_free(&input);
+}
+
+static void *worker_supervise(void *arg) {
+  fcgipool_worker_t *worker = arg;
+  while (1) {
+    time_t started = time(NULL);
+    if (worker_start(worker) == 0) worker_read(worker, worker->fd);
+    worker_stop(worker);
+    worker->restarts++;
+    stats_add(STAT_DYNAMIC_RESTARTS, 1);
+    fprintf(stderr, "Restarting dynamic worker %d\n", worker->index);
+    if (time(NULL) - started < FCGIPOOL_RESTART_DELAY) sleep(FCGIPOOL_RESTART_DELAY);
+  }
+  return NULL;
+}
+
+int fcgipool_init(const char *command, int num_workers, int max_requests,
+    const char *socket_dir) {
+  /* exec, so that the worker is the shell's process and not its child. */
+  size_t size = strlen(command) + 6;
+  pool_command = malloc(size);
+  pool_workers = calloc(num_workers, sizeof(fcgipool_worker_t));
+  if (!pool_command || !pool_workers) return -1;
+  snprintf(pool_command, size, "exec %s", command);
+  pool_size = num_workers;
+  pool_max_requests = max_requests;
+
+  for (int i = 0; i < num_workers; i++) {
+    fcgipool_worker_t *worker = &pool_workers[i];
+    worker->index = i;
+    worker->fd = -1;
+    pthread_mutex_init(&worker->write_lock, NULL);
+    snprintf(worker->socket_path, sizeof(worker->socket_path), "%s/httpserver.%d.%d.sock",
+        socket_dir, getpid(), i);
+    worker->requests = calloc(max_requests, sizeof(fcgipool_request_t));
+    if (!worker->requests) return -1;
+    for (int j = 0; j < max_requests; j++) {
+      fcgipool_request_t *request = &worker->requests[j];
+      request->worker = worker;
+      request->id = j + 1;
+      http_buffer_init(&request->params);
+      http_buffer_init(&request->response);
+      pthread_cond_init(&request->cv, NULL);
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, worker_supervise, worker) != 0) return -1;
+    pthread_detach(thread);
+  }
+  return 0;
+}
+
+fcgipool_request_t *fcgipool_begin(int timeout) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += timeout;
+  fcgipool_request_t *request = NULL;
+  pthread_mutex_lock(&pool_lock);
+  while (!request) {
+    fcgipool_worker_t *best = NULL;
+    for (int i = 0; i < pool_size; i++) {
+      fcgipool_worker_t *worker = &pool_workers[i];
+      if (worker->fd >= 0 && worker->outstanding < pool_max_requests &&
+          (!best || worker->outstanding < best->outstanding))
+        best = worker;
+    }
+    if (best) {
+      for (int i = 0; !request; i++)
+        if (best->requests[i].state == FCGIPOOL_FREE) request = &best->requests[i];
+      break;
+    }
+    if (pthread_cond_timedwait(&pool_cv, &pool_lock, &deadline) == ETIMEDOUT) break;
+  }
+  if (request) {
+    request->state = FCGIPOOL_ACTIVE;
+    request->generation = request->worker->generation;
+    request->begun = request->ended = request->failed = 0;
+    request->params.size = 0;
+    request->response.size = request->response_offset = 0;
+    request->worker->outstanding++;
+  }
+  pthread_mutex_unlock(&pool_lock);
+  if (request) stats_add(STAT_DYNAMIC_REQUESTS, 1);
+  return request;
+}
+
+void fcgipool_param(fcgipool_request_t *request, const char *name, const char *value) {
+  fcgi_append_pair(&request->params, name, value);
+}
+
+/* Writes RECORDS to the worker the request was sent to, unless it has
+ * been restarted since, when the ids mean nothing to it. */
+static int send_records(fcgipool_request_t *request, struct http_buffer *records) {
+  fcgipool_worker_t *worker = request->worker;
+  pthread_mutex_lock(&worker->write_lock);
+  int result = -1;
+  if (worker->fd >= 0 && worker->generation == request->generation)
+    result = http_send_data(worker->fd, records->data, records->size);
+  pthread_mutex_unlock(&worker->write_lock);
+  return result;
+}
+
+int fcgipool_write(fcgipool_request_t *request, const char *data, size_t size) {
+  struct http_buffer records;
+  http_buffer_init(&records);
+  if (!request->begun) {
+    fcgi_append_begin(&records, request->id);
+    if (request->params.size > 0)
+      fcgi_append_record(&records, FCGI_PARAMS, request->id, request->params.data,
+          request->params.size);
+    fcgi_append_record(&records, FCGI_PARAMS, request->id, NULL, 0);
+    pthread_mutex_lock(&pool_lock);
+    request->begun = 1;
+    pthread_mutex_unlock(&pool_lock);
+  }
+  fcgi_append_record(&records, FCGI_STDIN, request->id, data, size);
+  int result = send_records(request, &records);
+  http_buffer_free(&records);
+  return result;
+}
+
+ssize_t fcgipool_read(fcgipool_request_t *request, char *buffer, size_t size) {
+  pthread_mutex_lock(&pool_lock);
+  while (request->response_offset == request->response.size && !request->ended &&
+      !request->failed)
+    pthread_cond_wait(&request->cv, &pool_lock);
+  ssize_t n = request->response.size - request->response_offset;
+  if (n > 0) {
+    if ((size_t) n > size) n = size;
+    memcpy(buffer, request->response.data + request->response_offset, n);
+    request->response_offset += n;
+    if (request->response_offset == request->response.size)
+      request->response.size = request->response_offset = 0;
+    /* The reader may be waiting for room. */
+    pthread_cond_broadcast(&request->cv);
+  } else {
+    n = request->failed ? -1 : 0;
+  }
+  pthread_mutex_unlock(&pool_lock);
+  return n;
+}
+
+void fcgipool_end(fcgipool_request_t *request) {
+  fcgipool_worker_t *worker = request->worker;
+  pthread_mutex_lock(&pool_lock);
+  int abort = request->begun && !request->ended && !request->failed;
+  if (abort) {
+    /* The id stays taken until the worker lets go of it. */
+    request->state = FCGIPOOL_ABANDONED;
+    pthread_cond_broadcast(&request->cv);
+  } else {
+    request->state = FCGIPOOL_FREE;
+    worker->outstanding--;
+    pthread_cond_broadcast(&pool_cv);
+  }
+  pthread_mutex_unlock(&pool_lock);
+  if (abort) {
+    struct http_buffer records;
+    http_buffer_init(&records);
+    fcgi_append_record(&records, FCGI_ABORT_REQUEST, request->id, NULL, 0);
+    send_records(request, &records);
+    http_buffer_free(&records);
+  }
+}
+
+void fcgipool_format(struct http_buffer *buffer) {
+  pthread_mutex_lock(&pool_lock);
+  for (int i = 0; i < pool_size; i++) {
+    fcgipool_worker_t *worker = &pool_workers[i];
+    http_buffer_printf(buffer, "app%d_pid %d\n", i, (int) worker->pid);
+    http_buffer_printf(buffer, "app%d_outstanding %d\n", i, worker->outstanding);
+    http_buffer_printf(buffer, "app%d_requests %lu\n", i, worker->requests_served);
+    http_buffer_printf(buffer, "app%d_restarts %lu\n", i, worker->restarts);
+  }
+  pthread_mutex_unlock(&pool_lock);
+}
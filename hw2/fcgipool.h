@@ -0,0 +1,44 @@
+#ifndef __FCGIPOOL__
+#define __FCGIPOOL__
+
+#include <sys/types.h>
+
+#include "libhttp.h"
+
+/* FCGIPOOL runs a pool of long-lived worker processes that answer dynamic
+ * requests over FastCGI (see fcgi.h). Each worker is exec'd with a
+ * listening Unix socket as its stdin, as FastCGI expects, and the pool
+ * keeps one connection to it on which up to max_requests requests are
+ * multiplexed. A new request goes to the worker with the fewest in flight.
+ *
+ * A supervisor thread per worker reads its responses and restarts it when
+ * it exits or breaks its connection; the requests it had in flight fail.
+ * Workers are started by the serving process, so in prefork mode each
+ * worker process has its own pool, and they die with it. */
+
+typedef struct fcgipool_request fcgipool_request_t;
+
+/* Starts NUM_WORKERS copies of COMMAND (run with /bin/sh -c), each
+ * listening on a socket under SOCKET_DIR. Returns -1 on failure. */
+int fcgipool_init(const char *command, int num_workers, int max_requests,
+    const char *socket_dir);
+
+/* Reserves a request on a worker, waiting up to TIMEOUT seconds for one
+ * to have room. Returns NULL if none did. */
+fcgipool_request_t *fcgipool_begin(int timeout);
+/* Adds a CGI parameter. All of them must be added before the first write. */
+void fcgipool_param(fcgipool_request_t *request, const char *name, const char *value);
+/* Sends request body bytes; a SIZE of 0 ends the body. Returns -1 if the
+ * worker is gone. */
+int fcgipool_write(fcgipool_request_t *request, const char *data, size_t size);
+/* Reads up to SIZE bytes of the CGI response, waiting for the worker.
+ * Returns the number read, 0 at the end of the response, or -1 if the
+ * worker failed. */
+ssize_t fcgipool_read(fcgipool_request_t *request, char *buffer, size_t size);
+/* Releases a request, aborting it at the worker if it isn't complete. */
+void fcgipool_end(fcgipool_request_t *request);
+
+/* Appends per-worker counters as "appN_name value" lines. */
+void fcgipool_format(struct http_buffer *buffer);
+
+#endif
@@ -0,0 +1,850 @@
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "h2.h"
+#include "hpack.h"
+#include "stats.h"
+#include "utlist.h"
+
+/* Frame types. */
+#define H2_DATA 0x0
+#define H2_HEADERS 0x1
+#define H2_PRIORITY 0x2
+#define H2_RST_STREAM 0x3
+#define H2_SETTINGS 0x4
+#define H2_PUSH_PROMISE 0x5
+#define H2_PING 0x6
+#define H2_GOAWAY 0x7
+#define H2_WINDOW_UPDATE 0x8
+#define H2_CONTINUATION 0x9
+
+/* Frame flags. */
+#define H2_FLAG_END_STREAM 0x1
+#define H2_FLAG_ACK 0x1
+#define H2_FLAG_END_HEADERS 0x4
+#define H2_FLAG_PADDED 0x8
+#define H2_FLAG_PRIORITY 0x20
+
+/* Error codes. */
+#define H2_NO_ERROR 0x0
+#define H2_PROTOCOL_ERROR 0x1
+#define H2_INTERNAL_ERROR 0x2
+#define H2_FLOW_CONTROL_ERROR 0x3
+#define H2_STREAM_CLOSED 0x5
+#define H2_FRAME_SIZE_ERROR 0x6
+#define H2_REFUSED_STREAM 0x7
+#define H2_COMPRESSION_ERROR 0x9
+#define H2_ENHANCE_YOUR_CALM 0xb
+
+/* Settings. */
+#define H2_SETTINGS_HEADER_TABLE_SIZE 0x1
+#define H2_SETTINGS_ENABLE_PUSH 0x2
+#define H2_SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define H2_SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define H2_SETTINGS_MAX_FRAME_SIZE 0x5
+
+#define H2_FRAME_HEADER_SIZE 9
+#define H2_FRAME_SIZE 16384             // Largest frame either side starts with.
+#define H2_WINDOW 65535                 // Initial window of either side.
+#define H2_MAX_WINDOW 0x7fffffff
+#define H2_HEADER_BLOCK_MAX (64 << 10)  // Largest header block we take.
+#define H2_RESPONSE_HEAD_MAX (64 << 10) // Largest HTTP/1 response head we frame.
+
+/*
+ * A stream. Request bytes go to the HTTP/1 side through fd, and its
+ * response comes back through fd until the HTTP/1 side closes it. Received
+ * DATA is only credited back to the client once fd took it, so a handler
+ * that doesn't read its request body stalls the client, not the server.
+ */
+typedef struct h2_stream {
+  uint32_t id;
+  int fd;                       // Our end of the socketpair.
+  pthread_t thread;             // Serves the other end.
+  int32_t window;               // What we may still send on it.
+  struct http_buffer input;     // Request bytes fd hasn't taken yet.
+  size_t input_offset;
+  size_t head_pending;          // Of which the head, which used no window.
+  int input_ended;              // The client sent END_STREAM.
+  int input_closed;             // fd was shut down for writing.
+  struct http_buffer output;    // Response bytes not framed yet.
+  size_t output_offset;
+  int headers_sent;
+  int output_ended;             // The HTTP/1 side closed fd.
+  int no_body;                  // A HEAD request, whose body is dropped.
+  struct h2_stream *next;
+  struct h2_stream *prev;
+} h2_stream_t;
+
+typedef struct h2_conn {
+  int fd;
+  hpack_table_t decoder;
+  hpack_table_t encoder;
+  int32_t window;               // What we may still send on the connection.
+  int32_t initial_window;       // The client's initial stream window.
+  uint32_t max_frame;           // Largest frame the client takes.
+  uint32_t last_stream_id;
+  int preface_received;
+  int goaway;                   // Take no new streams, end with the last one.
+  int closing;                  // Stop as soon as the frames are written.
+  h2_stream_t *streams;
+  int num_streams;
+  h2_stream_t *closed;          // Streams whose thread isn't joined yet.
+  int num_closed;
+  struct http_buffer input;     // Frames read from the client.
+  struct http_buffer output;    // Frames to be written to the client.
+  struct http_buffer header_block;
+  uint32_t header_stream;       // Stream of an unfinished header block, or 0.
+  int header_end_stream;
+  h2_stream_server_t serve_stream;
+  void *arg;
+} h2_conn_t;
+
+typedef struct h2_stream_start {
+  h2_stream_server_t serve_stream;
+  void *arg;
+  int fd;
+} h2_stream_start_t;
+
+static uint32_t read_u32(const uint8_t *p) {
+  return (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void write_u32(uint8_t *p, uint32_t value) {
+  p[0] = value >> 24;
+  p[1] = value >> 16;
+  p[2] = value >> 8;
+  p[3] = value;
+}
+
+/* Queues a frame; it is written at the end of the loop iteration. */
+static void send_frame(h2_conn_t *conn, int type, int flags, uint32_t stream_id,
+    const void *payload, size_t size) {
+  uint8_t header[H2_FRAME_HEADER_SIZE] = {
+    size >> 16, size >> 8, size, type, flags,
+  };
+  write_u32(header + 5, stream_id & H2_MAX_WINDOW);
+  http_buffer_append(&conn->output, (char *) header, sizeof(header));
+  if (size > 0) http_buffer_append(&conn->output, payload, size);
+}
+
+static void send_rst_stream(h2_conn_t *conn, uint32_t stream_id, uint32_t error) {
+  uint8_t payload[4];
+  write_u32(payload, error);
+  send_frame(conn, H2_RST_STREAM, 0, stream_id, payload, sizeof(payload));
+}
+
+/* Ends the connection, with an error if ERROR isn't H2_NO_ERROR. */
+static void send_goaway(h2_conn_t *conn, uint32_t error) {
+  uint8_t payload[8];
+  write_u32(payload, conn->last_stream_id);
+  write_u32(payload + 4, error);
+  send_frame(conn, H2_GOAWAY, 0, 0, payload, sizeof(payload));
+  conn->goaway = 1;
+  if (error != H2_NO_ERROR) conn->closing = 1;
+}
+
+static void send_window_update(h2_conn_t *conn, uint32_t stream_id, uint32_t increment) {
+  uint8_t payload[4];
+  write_u32(payload, increment);
+  send_frame(conn, H2_WINDOW_UPDATE, 0, stream_id, payload, sizeof(payload));
+}
+
+static void flush_output(h2_conn_t *conn) {
+  if (conn->output.size == 0) return;
+  if (http_send_data(conn->fd, conn->output.data, conn->output.size) < 0) conn->closing = 1;
+  conn->output.size = 0;
+}
+
+static h2_stream_t *find_stream(h2_conn_t *conn, uint32_t id) {
+  h2_stream_t *stream;
+  LL_FOREACH(conn->streams, stream)
+    if (stream->id == id) return stream;
+  return NULL;
+}
+
+static void *stream_thread(void *arg) {
+  h2_stream_start_t *start = arg;
+  start->serve_stream(start->fd, start->arg);
+  free(start);
+  return NULL;
+}
+
+/* Starts stream ID with the HTTP/1 REQUEST, which it takes over. */
+static void open_stream(h2_conn_t *conn, uint32_t id, struct http_buffer *request,
+    int end_stream, int no_body) {
+  int fds[2];
+  h2_stream_t *stream = calloc(1, sizeof(h2_stream_t));
+  h2_stream_start_t *start = malloc(sizeof(h2_stream_start_t));
+  if (!stream || !start || socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+    free(stream);
+    free(start);
+    http_buffer_free(request);
+    send_rst_stream(conn, id, H2_REFUSED_STREAM);
+    return;
+  }
+  fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+  stream->id = id;
+  stream->fd = fds[0];
+  stream->window = conn->initial_window;
+  stream->input = *request;
+  stream->head_pending = request->size;
+  stream->input_ended = end_stream;
+  stream->no_body = no_body;
+  http_buffer_init(&stream->output);
+  *start = (h2_stream_start_t) { conn->serve_stream, conn->arg, fds[1] };
+  if (pthread_create(&stream->thread, NULL, stream_thread, start) != 0) {
+    close(fds[0]);
+    close(fds[1]);
+    free(start);
+    http_buffer_free(&stream->input);
+    free(stream);
+    send_rst_stream(conn, id, H2_REFUSED_STREAM);
+    return;
+  }
+  LL_APPEND(conn->streams, stream);
+  conn->num_streams++;
+  stats_add(STAT_H2_STREAMS, 1);
+}
+
+/* Closing fd makes the HTTP/1 side fail its next read or write, if it is
+ * not done yet. Its thread is left to reap_streams, so a handler that is
+ * slow to notice doesn't hold up the other streams. */
+static void close_stream(h2_conn_t *conn, h2_stream_t *stream) {
+  close(stream->fd);
+  http_buffer_free(&stream->input);
+  http_buffer_free(&stream->output);
+  LL_DELETE(conn->streams, stream);
+  conn->num_streams--;
+  LL_APPEND(conn->closed, stream);
+  conn->num_closed++;
+}
+
+/* Joins the threads of closed streams that have finished, or all of them
+ * if WAIT is set. */
+static void reap_streams(h2_conn_t *conn, int wait) {
+  h2_stream_t *stream, *tmp;
+  LL_FOREACH_SAFE(conn->closed, stream, tmp) {
+    if (wait)
+      pthread_join(stream->thread, NULL);
+    else if (pthread_tryjoin_np(stream->thread, NULL) != 0)
+      continue;
+    LL_DELETE(conn->closed, stream);
+    conn->num_closed--;
+    free(stream);
+  }
+}
+
+static void reset_stream(h2_conn_t *conn, h2_stream_t *stream, uint32_t error) {
+  send_rst_stream(conn, stream->id, error);
+  close_stream(conn, stream);
+}
+
+/* Applies a SETTINGS payload from the client. Returns an error code. */
+static uint32_t apply_settings(h2_conn_t *conn, const uint8_t *payload, size_t size) {
+  if (size % 6 != 0) return H2_FRAME_SIZE_ERROR;
+  for (size_t i = 0; i < size; i += 6) {
+    int id = payload[i] << 8 | payload[i + 1];
+    uint32_t value = read_u32(payload + i + 2);
+    if (id == H2_SETTINGS_HEADER_TABLE_SIZE) {
+      hpack_set_max_size(&conn->encoder, value);
+    } else if (id == H2_SETTINGS_ENABLE_PUSH) {
+      if (value > 1) return H2_PROTOCOL_ERROR;
+    } else if (id == H2_SETTINGS_INITIAL_WINDOW_SIZE) {
+      if (value > H2_MAX_WINDOW) return H2_FLOW_CONTROL_ERROR;
+      /* Open streams move by the difference, possibly below zero. */
+      int64_t delta = (int64_t) value - conn->initial_window;
+      h2_stream_t *stream;
+      LL_FOREACH(conn->streams, stream) {
+        if (stream->window + delta > H2_MAX_WINDOW) return H2_FLOW_CONTROL_ERROR;
+        stream->window += delta;
+      }
+      conn->initial_window = value;
+    } else if (id == H2_SETTINGS_MAX_FRAME_SIZE) {
+      if (value < H2_FRAME_SIZE || value > 0xffffff) return H2_PROTOCOL_ERROR;
+      conn->max_frame = value;
+    }
+  }
+  return H2_NO_ERROR;
+}
+
+/* The HTTP/1 request a stream's header block turns into. */
+typedef struct h2_request {
+  char method[32];
+  char *path;
+  char *authority;
+  struct http_buffer headers;   // Regular fields as HTTP/1 header lines.
+  int has_host;
+  int malformed;
+} h2_request_t;
+
+/* Fields that only mean something to one HTTP/1 connection. */
+static int is_connection_field(const char *name) {
+  return strcmp(name, "connection") == 0 || strcmp(name, "keep-alive") == 0 ||
+      strcmp(name, "proxy-connection") == 0 || strcmp(name, "transfer-encoding") == 0 ||
+      strcmp(name, "upgrade") == 0 || strcmp(name, "te") == 0 ||
+      strcmp(name, "http2-settings") == 0;
+}
+
+/* Keeps a field from breaking out of its HTTP/1 line. */
+static int is_safe_field(const char *name, const char *value) {
+  return name[0] && !strpbrk(name, " \t\r\n:") && !strpbrk(value, "\r\n");
+}
+
+static int request_field(void *arg, const char *name, const char *value) {
+  h2_request_t *request = arg;
+  if (name[0] == ':') {
+    /* Pseudo-fields come first and never contain spaces. */
+    if (request->headers.size > 0 || strpbrk(value, " \t\r\n") || !value[0]) {
+      request->malformed = 1;
+    } else if (strcmp(name, ":method") == 0) {
+      if (snprintf(request->method, sizeof(request->method), "%s", value) >=
+          (int) sizeof(request->method))
+        request->malformed = 1;
+    } else if (strcmp(name, ":path") == 0) {
+      free(request->path);
+      request->path = strdup(value);
+    } else if (strcmp(name, ":authority") == 0) {
+      free(request->authority);
+      request->authority = strdup(value);
+    } else if (strcmp(name, ":scheme") != 0) {
+      request->malformed = 1;
+    }
+    return 0;
+  }
+  if (is_connection_field(name)) return 0;
+  if (!is_safe_field(name, value)) {
+    request->malformed = 1;
+    return 0;
+  }
+  if (strcmp(name, "host") == 0) request->has_host = 1;
+  http_buffer_printf(&request->headers, "%s: %s\r\n", name, value);
+  return 0;
+}
+
+/* Decodes the header block of stream ID and opens the stream. */
+static void end_header_block(h2_conn_t *conn, uint32_t id, int end_stream) {
+  h2_request_t request = { .path = NULL };
+  http_buffer_init(&request.headers);
+  int result = hpack_decode(&conn->decoder, (uint8_t *) conn->header_block.data,
+      conn->header_block.size, request_field, &request);
+  conn->header_block.size = 0;
+  conn->header_stream = 0;
+
+  h2_stream_t *stream = find_stream(conn, id);
+  if (result < 0) {
+    send_goaway(conn, H2_COMPRESSION_ERROR);
+  } else if (stream) {
+    /* Trailers, which HTTP/1.0 has no place for. */
+    if (end_stream) stream->input_ended = 1;
+  } else if (id <= conn->last_stream_id || id % 2 == 0) {
+    send_goaway(conn, H2_PROTOCOL_ERROR);
+  } else {
+    conn->last_stream_id = id;
+    if (conn->goaway || conn->num_streams + conn->num_closed >= H2_MAX_STREAMS) {
+      send_rst_stream(conn, id, H2_REFUSED_STREAM);
+    } else if (request.malformed || !request.method[0] || !request.path) {
+      send_rst_stream(conn, id, H2_PROTOCOL_ERROR);
+    } else {
+      struct http_buffer head;
+      http_buffer_init(&head);
+      http_buffer_printf(&head, "%s %s HTTP/1.0\r\n", request.method, request.path);
+      if (!request.has_host && request.authority)
+        http_buffer_printf(&head, "Host: %s\r\n", request.authority);
+      http_buffer_append(&head, request.headers.data, request.headers.size);
+      http_buffer_append(&head, "\r\n", 2);
+      open_stream(conn, id, &head, end_stream, strcmp(request.method, "HEAD") == 0);
+    }
+  }
+  free(request.path);
+  free(request.authority);
+  http_buffer_free(&request.headers);
+}
+
+/* Adds a HEADERS or CONTINUATION fragment to the open header block. */
+static void add_header_fragment(h2_conn_t *conn, uint32_t id, int flags,
+    const uint8_t *fragment, size_t size, int end_stream) {
+  if (conn->header_block.size + size > H2_HEADER_BLOCK_MAX) {
+    send_goaway(conn, H2_ENHANCE_YOUR_CALM);
+    return;
+  }
+  http_buffer_append(&conn->header_block, (char *) fragment, size);
+  if (flags & H2_FLAG_END_HEADERS) {
+    end_header_block(conn, id, end_stream);
+  } else {
+    conn->header_stream = id;
+    conn->header_end_stream = end_stream;
+  }
+}
+
+/* Strips the padding of a DATA or HEADERS payload. Returns -1 if it is
+ * longer than the payload. */
+static int strip_padding(int flags, const uint8_t **payload, size_t *size) {
+  if (!(flags & H2_FLAG_PADDED)) return 0;
+  if (*size < 1 || (*payload)[0] >= *size) return -1;
+  *size -= 1 + (*payload)[0];
+  (*payload)++;
+  return 0;
+}
+
+static void receive_data(h2_conn_t *conn, uint32_t id, int flags, const uint8_t *payload,
+    size_t size) {
+  h2_stream_t *stream = find_stream(conn, id);
+  if (id == 0 || (!stream && id > conn->last_stream_id)) {
+    send_goaway(conn, H2_PROTOCOL_ERROR);
+    return;
+  }
+  size_t frame_size = size;
+  if (strip_padding(flags, &payload, &size) < 0) {
+    send_goaway(conn, H2_PROTOCOL_ERROR);
+    return;
+  }
+  /* Padding, and data for streams that are gone, never reach fd, so they
+   * are credited back right away. */
+  if (!stream || stream->input_ended) {
+    if (frame_size > 0) send_window_update(conn, 0, frame_size);
+    if (!stream) send_rst_stream(conn, id, H2_STREAM_CLOSED);
+    else reset_stream(conn, stream, H2_STREAM_CLOSED);
+    return;
+  }
+  if (frame_size > size) {
+    send_window_update(conn, 0, frame_size - size);
+    send_window_update(conn, id, frame_size - size);
+  }
+  if (stream->input.size - stream->input_offset + size > H2_WINDOW) {
+    reset_stream(conn, stream, H2_FLOW_CONTROL_ERROR);
+    return;
+  }
+  http_buffer_append(&stream->input, (char *) payload, size);
+  if (flags & H2_FLAG_END_STREAM) stream->input_ended = 1;
+}
+
+static void receive_window_update(h2_conn_t *conn, uint32_t id, const uint8_t *payload,
+    size_t size) {
+  if (size != 4) {
+    send_goaway(conn, H2_FRAME_SIZE_ERROR);
+    return;
+  }
+  uint32_t increment = read_u32(payload) & H2_MAX_WINDOW;
+  if (id == 0) {
+    if (increment == 0 || (int64_t) conn->window + increment > H2_MAX_WINDOW)
+      send_goaway(conn, increment ? H2_FLOW_CONTROL_ERROR : H2_PROTOCOL_ERROR);
+    else
+      conn->window += increment;
+    return;
+  }
+  h2_stream_t *stream = find_stream(conn, id);
+  if (!stream) return;
+  if (increment == 0 || (int64_t) stream->window + increment > H2_MAX_WINDOW)
+    reset_stream(conn, stream, increment ? H2_FLOW_CONTROL_ERROR : H2_PROTOCOL_ERROR);
+  else
+    stream->window += increment;
+}
+
+static void receive_frame(h2_conn_t *conn, int type, int flags, uint32_t id,
+    const uint8_t *payload, size_t size) {
+  /* A header block may not be interrupted by anything. */
+  if (conn->header_stream && (type != H2_CONTINUATION || id != conn->header_stream)) {
+    send_goaway(conn, H2_PROTOCOL_ERROR);
+    return;
+  }
+  h2_stream_t *stream;
+  switch (type) {
+    case H2_DATA:
+      receive_data(conn, id, flags, payload, size);
+      break;
+    case H2_HEADERS:
+      if (id == 0 || strip_padding(flags, &payload, &size) < 0 ||
+          ((flags & H2_FLAG_PRIORITY) && size < 5)) {
+        send_goaway(conn, H2_PROTOCOL_ERROR);
+        break;
+      }
+      if (flags & H2_FLAG_PRIORITY) {
+        payload += 5;
+        size -= 5;
+      }
+      add_header_fragment(conn, id, flags, payload, size, flags & H2_FLAG_END_STREAM);
+      break;
+    case H2_CONTINUATION:
+      if (!conn->header_stream) {
+        send_goaway(conn, H2_PROTOCOL_ERROR);
+        break;
+      }
+      add_header_fragment(conn, id, flags, payload, size, conn->header_end_stream);
+      break;
+    case H2_RST_STREAM:
+      if (id == 0 || size != 4) {
+        send_goaway(conn, id ? H2_FRAME_SIZE_ERROR : H2_PROTOCOL_ERROR);
+      } else if ((stream = find_stream(conn, id)) != NULL) {
+        close_stream(conn, stream);
+      }
+      break;
+    case H2_SETTINGS:
+      if (id != 0) {
+        send_goaway(conn, H2_PROTOCOL_ERROR);
+      } else if (flags & H2_FLAG_ACK) {
+        if (size != 0) send_goaway(conn, H2_FRAME_SIZE_ERROR);
+      } else {
+        uint32_t error = apply_settings(conn, payload, size);
+        if (error != H2_NO_ERROR)
+          send_goaway(conn, error);
+        else
+          send_frame(conn, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+      }
+      break;
+    case H2_PING:
+      if (id != 0 || size != 8)
+        send_goaway(conn, id ? H2_PROTOCOL_ERROR : H2_FRAME_SIZE_ERROR);
+      else if (!(flags & H2_FLAG_ACK))
+        send_frame(conn, H2_PING, H2_FLAG_ACK, 0, payload, size);
+      break;
+    case H2_GOAWAY:
+      conn->goaway = 1;
+      break;
+    case H2_WINDOW_UPDATE:
+      receive_window_update(conn, id, payload, size);
+      break;
+    case H2_PUSH_PROMISE:
+      /* Clients can't push. */
+      send_goaway(conn, H2_PROTOCOL_ERROR);
+      break;
+    default:
+      /* PRIORITY is only advice, and unknown frames must be ignored. */
+      break;
+  }
+}
+
+/* Handles every complete frame read from the client so far. */
+static void receive_input(h2_conn_t *conn) {
+  uint8_t *data = (uint8_t *) conn->input.data;
+  size_t size = conn->input.size, offset = 0;
+  if (!conn->preface_received) {
+    if (size < H2_PREFACE_SIZE) return;
+    if (memcmp(data, H2_PREFACE, H2_PREFACE_SIZE) != 0) {
+      conn->closing = 1;
+      return;
+    }
+    conn->preface_received = 1;
+    offset = H2_PREFACE_SIZE;
+  }
+  while (!conn->closing && size - offset >= H2_FRAME_HEADER_SIZE) {
+    uint8_t *header = data + offset;
+    size_t length = header[0] << 16 | header[1] << 8 | header[2];
+    if (length > H2_FRAME_SIZE) {
+      send_goaway(conn, H2_FRAME_SIZE_ERROR);
+      break;
+    }
+    if (size - offset < H2_FRAME_HEADER_SIZE + length) break;
+    receive_frame(conn, header[3], header[4], read_u32(header + 5) & H2_MAX_WINDOW,
+        header + H2_FRAME_HEADER_SIZE, length);
+    offset += H2_FRAME_HEADER_SIZE + length;
+  }
+  memmove(conn->input.data, conn->input.data + offset, size - offset);
+  conn->input.size = size - offset;
+}
+
+/* Passes request bytes on to the HTTP/1 side as far as it takes them, and
+ * credits them back to the client. */
+static void write_stream_input(h2_conn_t *conn, h2_stream_t *stream) {
+  size_t written = 0;
+  while (stream->input_offset < stream->input.size) {
+    ssize_t n = write(stream->fd, stream->input.data + stream->input_offset,
+        stream->input.size - stream->input_offset);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && errno == EAGAIN) break;
+    if (n <= 0) {
+      /* Answered without reading the rest; drop it. */
+      n = stream->input.size - stream->input_offset;
+    }
+    stream->input_offset += n;
+    written += n;
+  }
+  if (stream->input_offset == stream->input.size) {
+    stream->input.size = 0;
+    stream->input_offset = 0;
+    if (stream->input_ended && !stream->input_closed) {
+      shutdown(stream->fd, SHUT_WR);
+      stream->input_closed = 1;
+    }
+  }
+  size_t head = written < stream->head_pending ? written : stream->head_pending;
+  stream->head_pending -= head;
+  written -= head;
+  if (written > 0) {
+    send_window_update(conn, 0, written);
+    if (!stream->input_ended) send_window_update(conn, stream->id, written);
+  }
+}
+
+/* Frames the head of an HTTP/1 response as a HEADERS block. */
+static int send_response_headers(h2_conn_t *conn, h2_stream_t *stream, char *head) {
+  int status;
+  if (sscanf(head, "HTTP/1.%*d %d", &status) != 1 || status < 200 || status > 999) return -1;
+  struct http_buffer block;
+  http_buffer_init(&block);
+  char value[16];
+  snprintf(value, sizeof(value), "%d", status);
+  hpack_encode(&conn->encoder, &block, ":status", value);
+
+  char *saveptr;
+  strtok_r(head, "\r\n", &saveptr);
+  for (char *line = strtok_r(NULL, "\r\n", &saveptr); line; line = strtok_r(NULL, "\r\n", &saveptr)) {
+    char *colon = strchr(line, ':');
+    if (!colon) continue;
+    *colon = '\0';
+    char *field_value = colon + 1;
+    while (*field_value == ' ' || *field_value == '\t') field_value++;
+    for (char *c = line; *c; c++) *c = tolower((unsigned char) *c);
+    if (is_connection_field(line)) continue;
+    hpack_encode(&conn->encoder, &block, line, field_value);
+  }
+
+  /* Split blocks larger than a frame over CONTINUATION frames. */
+  size_t offset = 0;
+  int type = H2_HEADERS;
+  do {
+    size_t size = block.size - offset;
+    if (size > conn->max_frame) size = conn->max_frame;
+    send_frame(conn, type, offset + size == block.size ? H2_FLAG_END_HEADERS : 0, stream->id,
+        block.data + offset, size);
+    type = H2_CONTINUATION;
+    offset += size;
+  } while (offset < block.size);
+  http_buffer_free(&block);
+  stream->headers_sent = 1;
+  return 0;
+}
+
+/* Reads the next part of the response from the HTTP/1 side. Returns -1 if
+ * it can't be framed. */
+static int read_stream_output(h2_conn_t *conn, h2_stream_t *stream) {
+  char buffer[H2_FRAME_SIZE];
+  ssize_t n;
+  while ((n = read(stream->fd, buffer, sizeof(buffer))) < 0 && errno == EINTR);
+  if (n < 0 && errno == EAGAIN) return 0;
+  if (n <= 0) {
+    stream->output_ended = 1;
+  } else {
+    if (stream->output_offset == stream->output.size) {
+      stream->output.size = 0;
+      stream->output_offset = 0;
+    }
+    http_buffer_append(&stream->output, buffer, n);
+  }
+  if (stream->headers_sent) return 0;
+
+  /* The HTTP/1 side always sends a head first. */
+  char *end = memmem(stream->output.data, stream->output.size, "\r\n\r\n", 4);
+  if (!end) return stream->output_ended || stream->output.size > H2_RESPONSE_HEAD_MAX ? -1 : 0;
+  *end = '\0';
+  if (send_response_headers(conn, stream, stream->output.data) < 0) return -1;
+  stream->output_offset = end + 4 - stream->output.data;
+  return 0;
+}
+
+/* Sends as much of the response as the flow-control windows allow. Returns
+ * 1 once the stream is complete. */
+static int send_stream_output(h2_conn_t *conn, h2_stream_t *stream) {
+  if (!stream->headers_sent) return 0;
+  if (stream->no_body) stream->output_offset = stream->output.size;
+  while (stream->output_offset < stream->output.size && stream->window > 0 &&
+      conn->window > 0) {
+    size_t size = stream->output.size - stream->output_offset;
+    if (size > (size_t) stream->window) size = stream->window;
+    if (size > (size_t) conn->window) size = conn->window;
+    if (size > conn->max_frame) size = conn->max_frame;
+    int last = stream->output_ended && stream->output_offset + size == stream->output.size;
+    send_frame(conn, H2_DATA, last ? H2_FLAG_END_STREAM : 0, stream->id,
+        stream->output.data + stream->output_offset, size);
+    stream->output_offset += size;
+    stream->window -= size;
+    conn->window -= size;
+    if (last) return 1;
+  }
+  if (stream->output_ended && stream->output_offset == stream->output.size) {
+    send_frame(conn, H2_DATA, H2_FLAG_END_STREAM, stream->id, NULL, 0);
+    return 1;
+  }
+  return 0;
+}
+
+static void send_settings(h2_conn_t *conn) {
+  uint8_t payload[6] = { 0, H2_SETTINGS_MAX_CONCURRENT_STREAMS };
+  write_u32(payload + 2, H2_MAX_STREAMS);
+  send_frame(conn, H2_SETTINGS, 0, 0, payload, sizeof(payload));
+}
+
+/* Decodes base64url without padding, as in HTTP2-Settings. */
+static ssize_t base64url_decode(const char *in, uint8_t *out, size_t max) {
+  static const char alphabet[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+  uint32_t bits = 0;
+  int count = 0;
+  size_t n = 0;
+  for (; *in && *in != '='; in++) {
+    const char *digit = strchr(alphabet, *in);
+    if (!digit) return -1;
+    bits = bits << 6 | (digit - alphabet);
+    count += 6;
+    if (count >= 8) {
+      count -= 8;
+      if (n == max) return -1;
+      out[n++] = bits >> count;
+    }
+  }
+  return n;
+}
+
+/* Switches the connection of UPGRADED over, which becomes stream 1. */
+static int start_upgraded(h2_conn_t *conn, struct http_request *upgraded) {
+  static char response[] =
+      "HTTP/1.1 101 Switching Protocols\r\n"
+      "Connection: Upgrade\r\n"
+      "Upgrade: h2c\r\n"
+      "\r\n";
+  uint8_t settings[256];
+  ssize_t size = base64url_decode(http_request_header(upgraded, "HTTP2-Settings"),
+      settings, sizeof(settings));
+  if (size < 0 || apply_settings(conn, settings, size) != H2_NO_ERROR) return -1;
+  if (http_send_data(conn->fd, response, sizeof(response) - 1) < 0) return -1;
+
+  struct http_buffer head;
+  http_buffer_init(&head);
+  http_buffer_printf(&head, "%s %s HTTP/1.0\r\n", upgraded->method, upgraded->path);
+  for (int i = 0; i < upgraded->num_headers; i++) {
+    char name[64];
+    snprintf(name, sizeof(name), "%s", upgraded->headers[i].key);
+    for (char *c = name; *c; c++) *c = tolower((unsigned char) *c);
+    if (is_connection_field(name)) continue;
+    http_buffer_printf(&head, "%s: %s\r\n", upgraded->headers[i].key,
+        upgraded->headers[i].value);
+  }
+  http_buffer_append(&head, "\r\n", 2);
+  /* Whatever followed the request is the start of the client's preface. */
+  if (upgraded->body_size > 0)
+    http_buffer_append(&conn->input, upgraded->body, upgraded->body_size);
+  conn->last_stream_id = 1;
+  send_settings(conn);
+  open_stream(conn, 1, &head, 1, strcmp(upgraded->method, "HEAD") == 0);
+  return 0;
+}
+
+int h2_preface_pending(int fd) {
+  char preface[H2_PREFACE_SIZE];
+  size_t size = 1;
+  /* Wait for as many bytes as it takes to tell, usually one. */
+  while (size <= H2_PREFACE_SIZE) {
+    ssize_t n = recv(fd, preface, size, MSG_PEEK | MSG_WAITALL);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < (ssize_t) size || memcmp(preface, H2_PREFACE, size) != 0) return 0;
+    size++;
+  }
+  return 1;
+}
+
+int h2_upgrade_requested(struct http_request *request) {
+  char *upgrade = http_request_header(request, "Upgrade");
+  char *connection = http_request_header(request, "Connection");
+  char *content_length = http_request_header(request, "Content-Length");
+  return request->version >= 11 && upgrade && http_has_token(upgrade, "h2c") &&
+      connection && http_has_token(connection, "Upgrade") &&
+      http_request_header(request, "HTTP2-Settings") &&
+      (!content_length || atoll(content_length) == 0);
+}
+
+void h2_serve(int fd, struct http_request *upgraded, h2_stream_server_t serve_stream,
+    void *arg, int idle_timeout, int write_timeout) {
+  h2_conn_t conn = {
+    .fd = fd, .window = H2_WINDOW, .initial_window = H2_WINDOW, .max_frame = H2_FRAME_SIZE,
+    .serve_stream = serve_stream, .arg = arg,
+  };
+  hpack_table_init(&conn.decoder, HPACK_TABLE_SIZE);
+  hpack_table_init(&conn.encoder, HPACK_TABLE_SIZE);
+  http_buffer_init(&conn.input);
+  http_buffer_init(&conn.output);
+  http_buffer_init(&conn.header_block);
+  stats_add(STAT_H2_CONNECTIONS, 1);
+  /* Clients that stop reading are dropped like on HTTP/1. */
+  struct timeval timeout = { .tv_sec = write_timeout };
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  if (upgraded) {
+    if (start_upgraded(&conn, upgraded) < 0) conn.closing = 1;
+  } else {
+    send_settings(&conn);
+  }
+
+  struct pollfd fds[H2_MAX_STREAMS + 1];
+  uint32_t ids[H2_MAX_STREAMS + 1];
+  while (!conn.closing) {
+    receive_input(&conn);
+    flush_output(&conn);
+    if (conn.closing || (conn.goaway && conn.num_streams == 0)) break;
+
+    /* Streams whose response waits on flow control aren't read, so they
+     * don't pile it up here. */
+    int nfds = 0;
+    fds[nfds++] = (struct pollfd) { .fd = fd, .events = POLLIN };
+    h2_stream_t *stream, *tmp;
+    LL_FOREACH(conn.streams, stream) {
+      short events = 0;
+      if (stream->input_offset < stream->input.size) events |= POLLOUT;
+      if (!stream->output_ended && (!stream->headers_sent ||
+          stream->output_offset == stream->output.size))
+        events |= POLLIN;
+      ids[nfds] = stream->id;
+      fds[nfds++] = (struct pollfd) { .fd = stream->fd, .events = events };
+    }
+    int wait = conn.num_streams == 0 && idle_timeout > 0 ? idle_timeout * 1000 : -1;
+    int ready = poll(fds, nfds, wait);
+    if (ready < 0 && errno == EINTR) continue;
+    if (ready < 0) break;
+    if (ready == 0) {
+      send_goaway(&conn, H2_NO_ERROR);
+      flush_output(&conn);
+      break;
+    }
+
+    for (int i = 1; i < nfds; i++) {
+      if (!fds[i].revents || !(stream = find_stream(&conn, ids[i]))) continue;
+      if (fds[i].revents & (POLLOUT | POLLERR)) write_stream_input(&conn, stream);
+      if ((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) &&
+          read_stream_output(&conn, stream) < 0)
+        reset_stream(&conn, stream, H2_INTERNAL_ERROR);
+    }
+    if (fds[0].revents) {
+      char buffer[H2_FRAME_SIZE];
+      ssize_t n;
+      while ((n = read(fd, buffer, sizeof(buffer))) < 0 && errno == EINTR);
+      if (n <= 0) break;
+      http_buffer_append(&conn.input, buffer, n);
+    }
+    receive_input(&conn);
+    /* One turn per stream, so that responses interleave. */
+    LL_FOREACH_SAFE(conn.streams, stream, tmp) {
+      if (stream->input_offset < stream->input.size) write_stream_input(&conn, stream);
+      if (send_stream_output(&conn, stream)) close_stream(&conn, stream);
+    }
+    reap_streams(&conn, 0);
+  }
+
+  flush_output(&conn);
+  while (conn.streams) close_stream(&conn, conn.streams);
+  reap_streams(&conn, 1);
+  hpack_table_free(&conn.decoder);
+  hpack_table_free(&conn.encoder);
+  http_buffer_free(&conn.input);
+  http_buffer_free(&conn.output);
+  http_buffer_free(&conn.header_block);
+}
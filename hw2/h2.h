@@ -0,0 +1,42 @@
+#ifndef __H2__
+#define __H2__
+
+#include "libhttp.h"
+
+/* H2 serves cleartext HTTP/2 (h2c, RFC 7540), either to clients that open
+ * with the connection preface (prior knowledge) or after an HTTP/1.1
+ * "Upgrade: h2c" request. Streams are multiplexed over the connection with
+ * per-stream and connection flow control in both directions, and their
+ * responses are sent interleaved, one DATA frame per ready stream in turn.
+ *
+ * Streams are answered by the HTTP/1 server itself: each request is
+ * rewritten as an HTTP/1.0 request into one end of a socketpair, the other
+ * end is served as a connection of its own on a new thread, and the close
+ * delimited response that comes back is framed for the client. Everything
+ * that serves HTTP/1 connections (files, packs, the proxy cache, stats)
+ * therefore serves HTTP/2 streams unchanged. */
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_SIZE 24
+#define H2_MAX_STREAMS 100          // Concurrent streams per connection.
+
+/* Serves a stream's HTTP/1 connection on FD, then closes it. */
+typedef void (*h2_stream_server_t)(int fd, void *arg);
+
+/* Returns 1 if the client on FD opens with the HTTP/2 connection preface.
+ * Only peeks, so an HTTP/1 request is left to be read as usual. */
+int h2_preface_pending(int fd);
+/* Returns 1 if REQUEST asks to upgrade its connection to h2c. Requests with
+ * a body are answered over HTTP/1.1 instead, which RFC 7540 allows. */
+int h2_upgrade_requested(struct http_request *request);
+
+/* Serves HTTP/2 on FD until the client goes away, idles for IDLE_TIMEOUT
+ * seconds without open streams, or stops reading for WRITE_TIMEOUT seconds
+ * (0 disables either). If UPGRADED is set, FD is switched over with a 101
+ * response and UPGRADED is answered as stream 1. Each stream's socketpair
+ * end is passed to SERVE_STREAM with ARG on a thread that is joined before
+ * returning. FD is left open. */
+void h2_serve(int fd, struct http_request *upgraded, h2_stream_server_t serve_stream,
+    void *arg, int idle_timeout, int write_timeout);
+
+#endif
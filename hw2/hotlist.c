@@ -0,0 +1,284 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "hotlist.h"
+
+#define HOTLIST_EMPTY 0
+#define HOTLIST_CLAIMED 1
+#define HOTLIST_READY 2
+/* Give up on a path after this many occupied slots. */
+#define HOTLIST_MAX_PROBES 32
+
+static hotlist_entry_t *hotlist_entries;
+static int hotlist_capacity;
+
+void hotlist_init(int capacity) {
+  hotlist_entry_t *entries = mmap(NULL, capacity * sizeof(hotlist_entry_t),
+      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (entries == MAP_FAILED) {
+    perror("Failed to map hot file table (not tracking hot files)");
+    return;
+  }
+  hotlist_entries = entries;
+  hotlist_capacity = capacity;
+}
+
+static uint32_t hotlist_hash(const char *path) {
+  uint32_t hash = 2166136261u;
+  while (*path) {
+    hash ^= (unsigned char) *path++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+void hotlist_record(const char *path, long long size, unsigned long hits) {
+  if (!hotlist_entries || strlen(path) >= HOTLIST_PATH_MAX) return;
+
+  uint32_t hash = hotlist_hash(path);
+  for (int probe = 0; probe < HOTLIST_MAX_PROBES; probe++) {
+    hotlist_entry_t *entry = &hotlist_entries[(hash + probe) % hotlist_capacity];
+    uint32_t state = __atomic_load_n(&entry->state, __ATOMIC_ACQUIRE);
+    if (state == HOTLIST_EMPTY &&
+        __sync_bool_compare_and_swap(&entry->state, HOTLIST_EMPTY, HOTLIST_CLAIMED)) {
+      strcpy(entry->path, path);
+      entry->hash = hash;
+      entry->size = size;
+      entry->hits = hits;
+      __atomic_store_n(&entry->state, HOTLIST_READY, __ATOMIC_RELEASE);
+      return;
+    }
+    /* A slot being claimed right now may be this path; counting it again
+     * elsewhere is harmless. */
+    if (state == HOTLIST_READY && entry->hash == hash && strcmp(entry->path, path) == 0) {
+      __sync_fetch_and_add(&entry->hits, hits);
+      entry->size = size;
+      return;
+    }
+  }
+}
+
+static int hotlist_compare_hits(const void *a, const void *b) {
+  unsigned long hits_a = (*(hotlist_entry_t * const *) a)->hits;
+  unsigned long hits_b = (*(hotlist_entry_t * const *) b)->hits;
+  return hits_a < hits_b ? 1 : hits_a > hits_b ? -1 : 0;
+}
+
+void hotlist_format(struct http_buffer *buffer, int n) {
+  if (!hotlist_entries) return;
+
+  hotlist_entry_t **ready = malloc(hotlist_capacity * sizeof(hotlist_entry_t *));
+  if (!ready) return;
+  int count = 0;
+  for (int i = 0; i < hotlist_capacity; i++) {
+    if (__atomic_load_n(&hotlist_entries[i].state, __ATOMIC_ACQUIRE) == HOTLIST_READY)
+      ready[count++] = &hotlist_entries[i];
+  }
+
+  qsort(ready, count, sizeof(hotlist_entry_t *), hotlist_compare_hits);
+  for (int i = 0; i < count && i < n; i++)
+    http_buffer_printf(buffer, "%lu %lld %s\n", ready[i]->hits, ready[i]->size, ready[i]->path);
+  free(ready);
+}
+
+int hotlist_save(const char *file, int n) {
+  struct http_buffer buffer;
+  http_buffer_init(&buffer);
+  http_buffer_printf(&buffer, "%s\n", HOTLIST_FILE_HEADER);
+  hotlist_format(&buffer, n);
+
+  /* Write a temporary file and rename it so readers never see half a list.
+   * Each saver gets its own, since during an upgrade the old and the new
+   * process both save the same list. */
+  char tmp[MAX_PATH];
+  if (snprintf(tmp, MAX_PATH, "%s.XXXXXX", file) >= MAX_PATH) {
+    http_buffer_free(&buffer);
+    return -1;
+  }
+  int fd = mkstemp(tmp);
+  int result = -1;
+  if (fd >= 0) {
+    result = fchmod(fd, 0644);
+    if (result == 0) result = http_send_data(fd, buffer.data, buffer.size);
+    if (close(fd) < 0) result = -1;
+    if (result == 0) result = rename(tmp, file);
+    if (result < 0) unlink(tmp);
+  }
+  http_buffer_free(&buffer);
+  return result;
+}
+
+char *hotlist_load(const char *file) {
+  FILE *f = fopen(file, "r");
+  if (!f) return NULL;
+
+  struct http_buffer buffer;
+  http_buffer_init(&buffer);
+  char chunk[MAX_FILE_SIZE];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+    http_buffer_append(&buffer, chunk, n);
+  fclose(f);
+  http_buffer_append(&buffer, "", 1);
+
+  size_t header = strlen(HOTLIST_FILE_HEADER);
+  if (strncmp(buffer.data, HOTLIST_FILE_HEADER, header) != 0 || buffer.data[header] != '\n') {
+    fprintf(stderr, "Ignoring %s: not a hot file list\n", file);
+    http_buffer_free(&buffer);
+    return NULL;
+  }
+  return buffer.data;
+}
+
+typedef struct hotlist_persister_args {
+  const char *file;
+  int n;
+  int interval;
+} hotlist_persister_args_t;
+
+static void *hotlist_persister_work(void *arg) {
+  hotlist_persister_args_t *args = arg;
+  while (1) {
+    sleep(args->interval);
+    if (hotlist_save(args->file, args->n) < 0)
+      perror("Failed to save hot file list");
+  }
+  return NULL;
+}
+
+void hotlist_start_persister(const char *file, int n, int interval) {
+  hotlist_persister_args_t *args = malloc(sizeof(hotlist_persister_args_t));
+  if (!args) return;
+  args->file = file;
+  args->n = n;
+  args->interval = interval;
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, hotlist_persister_work, args) != 0) {
+    free(args);
+    return;
+  }
+  pthread_detach(thread);
+}
+
+/* State shared by the preload threads. */
+typedef struct hotlist_preload {
+  const char *files_dir;
+  char *list;
+  char **paths;
+  long long *sizes;
+  int num_paths;
+  int next;                     // Next path to load, taken atomically.
+  long long budget;             // Bytes to load at most, 0 for no limit.
+  long long claimed;            // Bytes taken against the budget.
+  int files;
+  long long bytes;
+  int running;                  // Threads still loading; the last cleans up.
+} hotlist_preload_t;
+
+static void hotlist_preload_free(hotlist_preload_t *preload) {
+  printf("Preloaded %d hot files (%lld bytes)\n", preload->files, preload->bytes);
+  free(preload->paths);
+  free(preload->sizes);
+  free(preload->list);
+  free(preload);
+}
+
+static void *hotlist_preload_work(void *arg) {
+  hotlist_preload_t *preload = arg;
+  int i;
+  while ((i = __sync_fetch_and_add(&preload->next, 1)) < preload->num_paths) {
+    long long size = preload->sizes[i];
+    if (preload->budget > 0 &&
+        __sync_add_and_fetch(&preload->claimed, size) > preload->budget)
+      continue;
+
+    char fullpath[MAX_PATH];
+    if (snprintf(fullpath, MAX_PATH, "%s%s", preload->files_dir, preload->paths[i]) >= MAX_PATH)
+      continue;
+    int fd = open(fullpath, O_RDONLY);
+    if (fd < 0) continue;
+    /* Reads the file into the page cache, blocking this thread only. */
+    readahead(fd, 0, size);
+    close(fd);
+    __sync_fetch_and_add(&preload->files, 1);
+    __sync_fetch_and_add(&preload->bytes, size);
+  }
+  if (__sync_sub_and_fetch(&preload->running, 1) == 0) hotlist_preload_free(preload);
+  return NULL;
+}
+
+void hotlist_preload(const char *files_dir, char *list, int num_threads, long long budget,
+    int wait) {
+  hotlist_preload_t *preload = calloc(1, sizeof(hotlist_preload_t));
+  int capacity = 64;
+  if (preload) {
+    preload->paths = malloc(capacity * sizeof(char *));
+    preload->sizes = malloc(capacity * sizeof(long long));
+  }
+  if (!preload || !preload->paths || !preload->sizes) {
+    if (preload) {
+      free(preload->paths);
+      free(preload->sizes);
+    }
+    free(preload);
+    free(list);
+    return;
+  }
+  preload->files_dir = files_dir;
+  preload->list = list;
+  preload->budget = budget;
+
+  /* Parse the list and carry its counts over, so they survive another
+   * restart even if this process serves few requests. */
+  char *saveptr, *line = strtok_r(list, "\n", &saveptr);
+  for (; line != NULL; line = strtok_r(NULL, "\n", &saveptr)) {
+    unsigned long hits;
+    long long size;
+    int offset;
+    if (sscanf(line, "%lu %lld %n", &hits, &size, &offset) < 2 || line[offset] != '/')
+      continue;
+    if (preload->num_paths == capacity) {
+      capacity *= 2;
+      char **paths = realloc(preload->paths, capacity * sizeof(char *));
+      long long *sizes = realloc(preload->sizes, capacity * sizeof(long long));
+      if (paths) preload->paths = paths;
+      if (sizes) preload->sizes = sizes;
+      if (!paths || !sizes) break;
+    }
+    hotlist_record(line + offset, size, hits);
+    preload->paths[preload->num_paths] = line + offset;
+    preload->sizes[preload->num_paths] = size;
+    preload->num_paths++;
+  }
+
+  if (num_threads < 1) num_threads = 1;
+  pthread_t *threads = malloc(num_threads * sizeof(pthread_t));
+  if (!threads) {
+    hotlist_preload_free(preload);
+    return;
+  }
+  preload->running = num_threads;
+  int started = 0;
+  for (; started < num_threads; started++) {
+    if (pthread_create(&threads[started], NULL, hotlist_preload_work, preload) != 0) break;
+  }
+  /* Account for threads that could not be started. */
+  if (started < num_threads &&
+      __sync_sub_and_fetch(&preload->running, num_threads - started) == 0) {
+    hotlist_preload_free(preload);
+  }
+  for (int i = 0; i < started; i++) {
+    if (wait)
+      pthread_join(threads[i], NULL);
+    else
+      pthread_detach(threads[i]);
+  }
+  free(threads);
+}
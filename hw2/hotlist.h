@@ -0,0 +1,44 @@
+#ifndef __HOTLIST__
+#define __HOTLIST__
+
+#include <stdint.h>
+
+#include "libhttp.h"
+
+/* HOTLIST counts how often each file is served so a restarted server can
+ * warm its caches with the files that matter. The table lives in shared
+ * memory so prefork workers count into one place. It is lock free: a slot
+ * is claimed once with a compare-and-swap and never freed, so a full table
+ * keeps counting the paths it already has and ignores new ones. */
+
+#define HOTLIST_PATH_MAX 256
+#define HOTLIST_FILE_HEADER "# httpserver hot files v1"
+
+typedef struct hotlist_entry {
+  uint32_t state;               // HOTLIST_EMPTY, HOTLIST_CLAIMED or HOTLIST_READY.
+  uint32_t hash;
+  unsigned long hits;
+  long long size;
+  char path[HOTLIST_PATH_MAX];
+} hotlist_entry_t;
+
+/* Maps a table of CAPACITY paths. Must be called before forking. */
+void hotlist_init(int capacity);
+/* Counts HITS requests of the file at request path PATH, SIZE bytes long. */
+void hotlist_record(const char *path, long long size, unsigned long hits);
+/* Appends the N most requested paths to buffer as "hits size path" lines. */
+void hotlist_format(struct http_buffer *buffer, int n);
+/* Saves the N most requested paths to FILE, replacing it atomically. */
+int hotlist_save(const char *file, int n);
+/* Returns the list saved in FILE, to be freed by the caller, or NULL. */
+char *hotlist_load(const char *file);
+/* Saves the N most requested paths to FILE every INTERVAL seconds. */
+void hotlist_start_persister(const char *file, int n, int interval);
+/* Counts the entries of a list made by hotlist_format or hotlist_load and
+ * reads the files under files_dir into the page cache using NUM_THREADS
+ * threads, stopping after BUDGET bytes (0 for no limit). Returns at once
+ * unless WAIT is set. Takes ownership of LIST. */
+void hotlist_preload(const char *files_dir, char *list, int num_threads, long long budget,
+    int wait);
+
+#endif
@@ -0,0 +1,448 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hpack.h"
+
+/* The Huffman code of RFC 7541 Appendix B, by symbol; 256 is EOS. */
+static const uint32_t hpack_huffman_codes[257] = {
+  0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5,
+  0xfffffe6, 0xfffffe7, 0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9,
+  0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec, 0xfffffed, 0xfffffee,
+  0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+  0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9,
+  0xffffffa, 0xffffffb, 0x14, 0x3f8, 0x3f9, 0xffa,
+  0x1ff9, 0x15, 0xf8, 0x7fa, 0x3fa, 0x3fb,
+  0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+  0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b,
+  0x1c, 0x1d, 0x1e, 0x1f, 0x5c, 0xfb,
+  0x7ffc, 0x20, 0xffb, 0x3fc, 0x1ffa, 0x21,
+  0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+  0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+  0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e,
+  0x6f, 0x70, 0x71, 0x72, 0xfc, 0x73,
+  0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+  0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5,
+  0x25, 0x26, 0x27, 0x6, 0x74, 0x75,
+  0x28, 0x29, 0x2a, 0x7, 0x2b, 0x76,
+  0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+  0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd,
+  0x1ffd, 0xffffffc, 0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8,
+  0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9, 0x3fffd6, 0x7fffda,
+  0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+  0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1,
+  0x7fffe2, 0x7fffe3, 0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5,
+  0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef, 0x3fffda, 0x1fffdd,
+  0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+  0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf,
+  0x7fffeb, 0x7fffec, 0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2,
+  0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef, 0xfffea, 0x3fffe2,
+  0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+  0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2,
+  0x3fffe8, 0x1ffffec, 0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde,
+  0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed, 0x7fff2, 0x1fffe3,
+  0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+  0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3,
+  0x7ffffe4, 0x7ffffe5, 0xfffec, 0xfffff3, 0xfffed, 0x1fffe6,
+  0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3, 0x3fffea, 0x3fffeb,
+  0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+  0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8,
+  0x7ffffe9, 0x7ffffea, 0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed,
+  0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee, 0x3fffffff,
+};
+static const uint8_t hpack_huffman_lengths[257] = {
+  13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+  28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+  6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+  5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+  13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+  7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+  15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+  6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+  20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+  24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+  22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+  21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+  26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+  19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+  20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+  26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+  30,
+};
+
+/* The static table of RFC 7541 Appendix A, from index 1. */
+static const char *hpack_static_table[HPACK_STATIC_ENTRIES][2] = {
+  { ":authority", "" },
+  { ":method", "GET" },
+  { ":method", "POST" },
+  { ":path", "/" },
+  { ":path", "/index.html" },
+  { ":scheme", "http" },
+  { ":scheme", "https" },
+  { ":status", "200" },
+  { ":status", "204" },
+  { ":status", "206" },
+  { ":status", "304" },
+  { ":status", "400" },
+  { ":status", "404" },
+  { ":status", "500" },
+  { "accept-charset", "" },
+  { "accept-encoding", "gzip, deflate" },
+  { "accept-language", "" },
+  { "accept-ranges", "" },
+  { "accept", "" },
+  { "access-control-allow-origin", "" },
+  { "age", "" },
+  { "allow", "" },
+  { "authorization", "" },
+  { "cache-control", "" },
+  { "content-disposition", "" },
+  { "content-encoding", "" },
+  { "content-language", "" },
+  { "content-length", "" },
+  { "content-location", "" },
+  { "content-range", "" },
+  { "content-type", "" },
+  { "cookie", "" },
+  { "date", "" },
+  { "etag", "" },
+  { "expect", "" },
+  { "expires", "" },
+  { "from", "" },
+  { "host", "" },
+  { "if-match", "" },
+  { "if-modified-since", "" },
+  { "if-none-match", "" },
+  { "if-range", "" },
+  { "if-unmodified-since", "" },
+  { "last-modified", "" },
+  { "link", "" },
+  { "location", "" },
+  { "max-forwards", "" },
+  { "proxy-authenticate", "" },
+  { "proxy-authorization", "" },
+  { "range", "" },
+  { "referer", "" },
+  { "refresh", "" },
+  { "retry-after", "" },
+  { "server", "" },
+  { "set-cookie", "" },
+  { "strict-transport-security", "" },
+  { "transfer-encoding", "" },
+  { "user-agent", "" },
+  { "vary", "" },
+  { "via", "" },
+  { "www-authenticate", "" },
+};
+
+/* Symbols ordered by code length, then code. The code is canonical, so the
+ * codes of one length are consecutive and a code of LENGTH bits is symbol
+ * huffman_symbols[huffman_offset[LENGTH] + code - huffman_first[LENGTH]]. */
+static uint16_t huffman_symbols[257];
+static uint32_t huffman_first[31];
+static int huffman_count[31];
+static int huffman_offset[31];
+static pthread_once_t huffman_once = PTHREAD_ONCE_INIT;
+
+static void huffman_init(void) {
+  int n = 0;
+  for (int length = 1; length <= 30; length++) {
+    huffman_offset[length] = n;
+    for (int symbol = 0; symbol < 257; symbol++) {
+      if (hpack_huffman_lengths[symbol] != length) continue;
+      if (huffman_count[length]++ == 0) huffman_first[length] = hpack_huffman_codes[symbol];
+      huffman_symbols[n++] = symbol;
+    }
+  }
+}
+
+/* Decodes SIZE Huffman-coded bytes into OUT, which holds up to MAX bytes.
+ * Returns the decoded length, or -1. */
+static ssize_t huffman_decode(const uint8_t *data, size_t size, char *out, size_t max) {
+  pthread_once(&huffman_once, huffman_init);
+  size_t n = 0;
+  uint32_t code = 0;
+  int length = 0;
+  for (size_t i = 0; i < size; i++) {
+    for (int bit = 7; bit >= 0; bit--) {
+      code = (code << 1) | ((data[i] >> bit) & 1);
+      length++;
+      uint32_t index = code - huffman_first[length];
+      if (huffman_count[length] > 0 && code >= huffman_first[length] &&
+          index < (uint32_t) huffman_count[length]) {
+        int symbol = huffman_symbols[huffman_offset[length] + index];
+        if (symbol == 256 || n == max) return -1;
+        out[n++] = symbol;
+        code = 0;
+        length = 0;
+      } else if (length == 30) {
+        return -1;
+      }
+    }
+  }
+  /* What is left must be at most 7 bits of padding, all ones. */
+  if (length > 7 || code != (1u << length) - 1) return -1;
+  return n;
+}
+
+static size_t huffman_size(const char *s, size_t size) {
+  size_t bits = 0;
+  for (size_t i = 0; i < size; i++) bits += hpack_huffman_lengths[(uint8_t) s[i]];
+  return (bits + 7) / 8;
+}
+
+static void huffman_encode(struct http_buffer *out, const char *s, size_t size) {
+  uint64_t bits = 0;
+  int count = 0;
+  char bytes[64];
+  size_t n = 0;
+  for (size_t i = 0; i < size; i++) {
+    uint8_t symbol = s[i];
+    bits = (bits << hpack_huffman_lengths[symbol]) | hpack_huffman_codes[symbol];
+    count += hpack_huffman_lengths[symbol];
+    while (count >= 8) {
+      count -= 8;
+      bytes[n++] = bits >> count;
+      if (n == sizeof(bytes)) {
+        http_buffer_append(out, bytes, n);
+        n = 0;
+      }
+    }
+  }
+  /* Pad with the most significant bits of EOS, which are all ones. */
+  if (count > 0) bytes[n++] = (bits << (8 - count)) | (0xff >> count);
+  http_buffer_append(out, bytes, n);
+}
+
+void hpack_table_init(hpack_table_t *table, size_t max_size) {
+  memset(table, 0, sizeof(hpack_table_t));
+  table->max_size = max_size;
+}
+
+void hpack_table_free(hpack_table_t *table) {
+  for (int i = 0; i < table->count; i++)
+    free(table->entries[(table->first + i) % table->capacity].name);
+  free(table->entries);
+  table->entries = NULL;
+  table->count = 0;
+}
+
+static void table_evict(hpack_table_t *table) {
+  hpack_entry_t *oldest = &table->entries[(table->first + table->count - 1) % table->capacity];
+  table->size -= oldest->size;
+  free(oldest->name);
+  table->count--;
+}
+
+static void table_resize(hpack_table_t *table, size_t max_size) {
+  table->max_size = max_size;
+  while (table->size > max_size) table_evict(table);
+}
+
+static void table_add(hpack_table_t *table, const char *name, const char *value) {
+  size_t name_size = strlen(name), value_size = strlen(value);
+  size_t size = name_size + value_size + 32;
+  while (table->count > 0 && table->size + size > table->max_size) table_evict(table);
+  /* An entry larger than the whole table just empties it. */
+  if (size > table->max_size) return;
+  if (table->count == table->capacity) {
+    int capacity = table->capacity ? table->capacity * 2 : 16;
+    hpack_entry_t *entries = malloc(capacity * sizeof(hpack_entry_t));
+    if (!entries) return;
+    for (int i = 0; i < table->count; i++)
+      entries[i] = table->entries[(table->first + i) % table->capacity];
+    free(table->entries);
+    table->entries = entries;
+    table->capacity = capacity;
+    table->first = 0;
+  }
+  char *copy = malloc(name_size + value_size + 2);
+  if (!copy) return;
+  memcpy(copy, name, name_size + 1);
+  memcpy(copy + name_size + 1, value, value_size + 1);
+  table->first = (table->first + table->capacity - 1) % table->capacity;
+  table->entries[table->first] = (hpack_entry_t) {
+    .name = copy, .value = copy + name_size + 1, .size = size,
+  };
+  table->count++;
+  table->size += size;
+}
+
+/* Looks up INDEX in the static and then the dynamic table. */
+static int table_get(hpack_table_t *table, uint64_t index, const char **name,
+    const char **value) {
+  if (index == 0) return -1;
+  if (index <= HPACK_STATIC_ENTRIES) {
+    *name = hpack_static_table[index - 1][0];
+    *value = hpack_static_table[index - 1][1];
+    return 0;
+  }
+  index -= HPACK_STATIC_ENTRIES + 1;
+  if (index >= (uint64_t) table->count) return -1;
+  hpack_entry_t *entry = &table->entries[(table->first + index) % table->capacity];
+  *name = entry->name;
+  *value = entry->value;
+  return 0;
+}
+
+/* Reads an integer with a PREFIX-bit prefix from *DATA. */
+static int decode_integer(const uint8_t **data, const uint8_t *end, int prefix,
+    uint64_t *value) {
+  if (*data == end) return -1;
+  uint64_t mask = (1 << prefix) - 1;
+  *value = *(*data)++ & mask;
+  if (*value < mask) return 0;
+  for (int shift = 0; shift <= 28; shift += 7) {
+    if (*data == end) return -1;
+    uint8_t byte = *(*data)++;
+    *value += (uint64_t) (byte & 0x7f) << shift;
+    if (!(byte & 0x80)) return 0;
+  }
+  return -1;
+}
+
+/* Reads a string literal into OUT, which holds HPACK_STRING_MAX bytes. */
+static int decode_string(const uint8_t **data, const uint8_t *end, char *out) {
+  if (*data == end) return -1;
+  int huffman = **data & 0x80;
+  uint64_t size;
+  if (decode_integer(data, end, 7, &size) < 0 || size > (uint64_t) (end - *data)) return -1;
+  ssize_t n = size;
+  if (huffman) {
+    n = huffman_decode(*data, size, out, HPACK_STRING_MAX - 1);
+  } else if (size < HPACK_STRING_MAX) {
+    memcpy(out, *data, size);
+  } else {
+    n = -1;
+  }
+  if (n < 0) return -1;
+  out[n] = '\0';
+  *data += size;
+  return 0;
+}
+
+int hpack_decode(hpack_table_t *table, const uint8_t *data, size_t size, hpack_emit_t emit,
+    void *arg) {
+  const uint8_t *end = data + size;
+  char *name_buffer = malloc(2 * HPACK_STRING_MAX);
+  if (!name_buffer) return -1;
+  char *value_buffer = name_buffer + HPACK_STRING_MAX;
+  int result = 0;
+  while (data < end && result == 0) {
+    uint8_t first = *data;
+    uint64_t index;
+    const char *name, *value;
+    if (first & 0x80) {
+      /* Indexed field. */
+      result = decode_integer(&data, end, 7, &index) < 0 ||
+          table_get(table, index, &name, &value) < 0 ? -1 : emit(arg, name, value);
+    } else if ((first & 0xe0) == 0x20) {
+      /* Table size update, within what our settings allow. */
+      result = decode_integer(&data, end, 5, &index) < 0 || index > HPACK_TABLE_SIZE ? -1 : 0;
+      if (result == 0) table_resize(table, index);
+    } else {
+      /* Literal, with incremental indexing (01), or without (0000, 0001). */
+      int indexing = (first & 0xc0) == 0x40;
+      if (decode_integer(&data, end, indexing ? 6 : 4, &index) < 0) {
+        result = -1;
+      } else if (index > 0) {
+        if (table_get(table, index, &name, &value) < 0) {
+          result = -1;
+        } else {
+          /* The name may live in an entry the insertion below evicts. */
+          snprintf(name_buffer, HPACK_STRING_MAX, "%s", name);
+        }
+      } else if (decode_string(&data, end, name_buffer) < 0) {
+        result = -1;
+      }
+      if (result == 0 && decode_string(&data, end, value_buffer) < 0) result = -1;
+      if (result == 0) {
+        if (indexing) table_add(table, name_buffer, value_buffer);
+        result = emit(arg, name_buffer, value_buffer);
+      }
+    }
+  }
+  free(name_buffer);
+  return result;
+}
+
+void hpack_set_max_size(hpack_table_t *table, size_t max_size) {
+  if (max_size > HPACK_TABLE_SIZE) max_size = HPACK_TABLE_SIZE;
+  if (max_size == table->max_size) return;
+  table_resize(table, max_size);
+  table->size_update = 1;
+}
+
+static void encode_integer(struct http_buffer *out, uint8_t flags, int prefix, uint64_t value) {
+  char bytes[16];
+  size_t n = 0;
+  uint64_t mask = (1 << prefix) - 1;
+  if (value < mask) {
+    bytes[n++] = flags | value;
+  } else {
+    bytes[n++] = flags | mask;
+    for (value -= mask; value >= 0x80; value >>= 7) bytes[n++] = 0x80 | (value & 0x7f);
+    bytes[n++] = value;
+  }
+  http_buffer_append(out, bytes, n);
+}
+
+static void encode_string(struct http_buffer *out, const char *s) {
+  size_t size = strlen(s);
+  size_t huffman = huffman_size(s, size);
+  if (huffman < size) {
+    encode_integer(out, 0x80, 7, huffman);
+    huffman_encode(out, s, size);
+  } else {
+    encode_integer(out, 0, 7, size);
+    http_buffer_append(out, s, size);
+  }
+}
+
+/* Fields whose values change with every response, and would only push
+ * reusable ones out of the table. */
+static int is_unindexed_field(const char *name) {
+  static const char *unindexed[] = {
+    "content-length", "date", "etag", "last-modified", "age", "expires", "set-cookie",
+  };
+  for (size_t i = 0; i < sizeof(unindexed) / sizeof(unindexed[0]); i++)
+    if (strcmp(name, unindexed[i]) == 0) return 1;
+  return 0;
+}
+
+void hpack_encode(hpack_table_t *table, struct http_buffer *out, const char *name,
+    const char *value) {
+  if (table->size_update) {
+    encode_integer(out, 0x20, 5, table->max_size);
+    table->size_update = 0;
+  }
+  /* Find the field, or at least its name, in either table. */
+  uint64_t name_index = 0;
+  for (int i = 0; i < HPACK_STATIC_ENTRIES; i++) {
+    if (strcmp(hpack_static_table[i][0], name) != 0) continue;
+    if (strcmp(hpack_static_table[i][1], value) == 0) {
+      encode_integer(out, 0x80, 7, i + 1);
+      return;
+    }
+    if (!name_index) name_index = i + 1;
+  }
+  for (int i = 0; i < table->count; i++) {
+    hpack_entry_t *entry = &table->entries[(table->first + i) % table->capacity];
+    if (strcmp(entry->name, name) != 0) continue;
+    if (strcmp(entry->value, value) == 0) {
+      encode_integer(out, 0x80, 7, HPACK_STATIC_ENTRIES + 1 + i);
+      return;
+    }
+    if (!name_index) name_index = HPACK_STATIC_ENTRIES + 1 + i;
+  }
+
+  int indexing = !is_unindexed_field(name);
+  if (indexing)
+    encode_integer(out, 0x40, 6, name_index);
+  else
+    encode_integer(out, 0x00, 4, name_index);
+  if (!name_index) encode_string(out, name);
+  encode_string(out, value);
+  if (indexing) table_add(table, name, value);
+}
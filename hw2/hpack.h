@@ -0,0 +1,57 @@
+#ifndef __HPACK__
+#define __HPACK__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "libhttp.h"
+
+/* HPACK is the header compression of HTTP/2 (RFC 7541). Each direction of a
+ * connection keeps a dynamic table of recently sent fields, which both ends
+ * update in step, so a repeated field costs one index byte. Fields not in
+ * either table are sent as literals, Huffman-coded when that is shorter.
+ *
+ * A table belongs to one direction of one connection and is not
+ * thread-safe. */
+
+#define HPACK_STATIC_ENTRIES 61
+#define HPACK_TABLE_SIZE 4096       // Default and largest dynamic table size.
+#define HPACK_STRING_MAX 8192       // Longest name or value we decode.
+
+typedef struct hpack_entry {
+  char *name;                   // "name\0value\0" in one allocation.
+  char *value;
+  size_t size;                  // Length of both plus 32, as RFC 7541 counts.
+} hpack_entry_t;
+
+typedef struct hpack_table {
+  hpack_entry_t *entries;       // Ring buffer, newest at first.
+  int capacity;
+  int first;
+  int count;
+  size_t size;
+  size_t max_size;
+  int size_update;              // Encoder: max_size still to be signalled.
+} hpack_table_t;
+
+void hpack_table_init(hpack_table_t *table, size_t max_size);
+void hpack_table_free(hpack_table_t *table);
+
+/* Called for every field of a decoded header block. */
+typedef int (*hpack_emit_t)(void *arg, const char *name, const char *value);
+
+/* Decodes the header block in DATA, calling EMIT for each field in order.
+ * Returns 0, or -1 if the block is malformed (a compression error, after
+ * which the table can't be trusted) or EMIT returned -1. */
+int hpack_decode(hpack_table_t *table, const uint8_t *data, size_t size, hpack_emit_t emit,
+    void *arg);
+
+/* Makes the encoder use at most MAX_SIZE bytes of table, as the peer allows
+ * it. The change is signalled at the start of the next header block. */
+void hpack_set_max_size(hpack_table_t *table, size_t max_size);
+/* Appends one field to a header block being built in OUT. NAME must be
+ * lowercase. */
+void hpack_encode(hpack_table_t *table, struct http_buffer *out, const char *name,
+    const char *value);
+
+#endif
@@ -0,0 +1,223 @@
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "fcgi.h"
+#include "libhttp.h"
+
+/*
+ * A small FastCGI responder for trying out httpserver's dynamic routes:
+ *
+ *   ./httpserver --files www/ --port 8000 --dynamic-prefix /app/ \
+ *       --dynamic-command ./httpapp [--dynamic-workers 4]
+ *
+ * It accepts the server's connections on fd 0 and answers each request on
+ * a thread of its own, so requests multiplexed on one connection finish in
+ * any order. Under the route prefix it serves:
+ *
+ *   /echo          the request body
+ *   /sleep?ms=N    a reply after N milliseconds
+ *   /stream?n=N    N bytes without a Content-Length
+ *   /crash         nothing: the process exits, and the server restarts it
+ *   anything else  the CGI parameters it was given
+ */
+
+#define APP_MAX_REQUESTS 65536
+
+typedef struct app_conn {
+  int fd;
+  pthread_mutex_t write_lock;
+  int refcount;                  // The reader and every running request.
+} app_conn_t;
+
+typedef struct app_request {
+  app_conn_t *conn;
+  int id;
+  struct http_buffer params;
+  struct http_buffer body;
+  volatile int aborted;
+} app_request_t;
+
+static pthread_mutex_t conn_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void conn_release(app_conn_t *conn) {
+  pthread_mutex_lock(&conn_lock);
+  int last = --conn->refcount == 0;
+  pthread_mutex_unlock(&conn_lock);
+  if (!last) return;
+  close(conn->fd);
+  free(conn);
+}
+
+static void send_records(app_conn_t *conn, struct http_buffer *records) {
+  pthread_mutex_lock(&conn->write_lock);
+  http_send_data(conn->fd, records->data, records->size);
+  pthread_mutex_unlock(&conn->write_lock);
+  records->size = 0;
+}
+
+/* Returns the value of CGI parameter NAME, or "". */
+static const char *param(app_request_t *request, const char *name, char *value, size_t size) {
+  const uint8_t *data = (uint8_t *) request->params.data;
+  const uint8_t *end = data + request->params.size;
+  const char *key, *found;
+  size_t key_size, found_size;
+  while (fcgi_next_pair(&data, end, &key, &key_size, &found, &found_size) == 0) {
+    if (key_size == strlen(name) && memcmp(key, name, key_size) == 0) {
+      snprintf(value, size, "%.*s", (int) found_size, found);
+      return value;
+    }
+  }
+  return "";
+}
+
+static long query_number(app_request_t *request, const char *key) {
+  char query[256];
+  const char *value = strstr(param(request, "QUERY_STRING", query, sizeof(query)), key);
+  return value ? atol(value + strlen(key)) : 0;
+}
+
+static void *serve_request(void *arg) {
+  app_request_t *request = arg;
+  char path[1024];
+  param(request, "PATH_INFO", path, sizeof(path));
+  struct http_buffer out, records;
+  http_buffer_init(&out);
+  http_buffer_init(&records);
+
+  if (strcmp(path, "/crash") == 0) {
+    fprintf(stderr, "httpapp %d: crashing on request\n", getpid());
+    _exit(1);
+  } else if (strcmp(path, "/echo") == 0) {
+    http_buffer_printf(&out, "Content-Type: application/octet-stream\r\n"
+        "Content-Length: %zu\r\n\r\n", request->body.size);
+    http_buffer_append(&out, request->body.data, request->body.size);
+  } else if (strcmp(path, "/sleep") == 0) {
+    long ms = query_number(request, "ms=");
+    usleep(ms * 1000);
+    http_buffer_printf(&out, "Content-Type: text/plain\r\n\r\nslept %ld ms in %d\n", ms,
+        getpid());
+  } else if (strcmp(path, "/stream") == 0) {
+    /* Sent as it is produced, in records of 16 KB. */
+    long n = query_number(request, "n=");
+    http_buffer_printf(&out, "Content-Type: application/octet-stream\r\n\r\n");
+    fcgi_append_record(&records, FCGI_STDOUT, request->id, out.data, out.size);
+    send_records(request->conn, &records);
+    char chunk[16384];
+    memset(chunk, 'x', sizeof(chunk));
+    while (n > 0 && !request->aborted) {
+      size_t size = n < (long) sizeof(chunk) ? n : sizeof(chunk);
+      fcgi_append_record(&records, FCGI_STDOUT, request->id, chunk, size);
+      send_records(request->conn, &records);
+      n -= size;
+    }
+    out.size = 0;
+  } else if (strcmp(path, "/missing") == 0) {
+    http_buffer_printf(&out, "Status: 404 Not Found\r\nContent-Type: text/plain\r\n\r\n"
+        "no such thing\n");
+  } else {
+    http_buffer_printf(&out, "Content-Type: text/plain\r\n\r\npid %d\n", getpid());
+    const uint8_t *data = (uint8_t *) request->params.data;
+    const uint8_t *end = data + request->params.size;
+    const char *name, *value;
+    size_t name_size, value_size;
+    while (fcgi_next_pair(&data, end, &name, &name_size, &value, &value_size) == 0)
+      http_buffer_printf(&out, "%.*s=%.*s\n", (int) name_size, name, (int) value_size, value);
+  }
+
+  if (out.size > 0) fcgi_append_record(&records, FCGI_STDOUT, request->id, out.data, out.size);
+  fcgi_append_record(&records, FCGI_STDOUT, request->id, NULL, 0);
+  fcgi_append_end(&records, request->id, 0);
+  send_records(request->conn, &records);
+  http_buffer_free(&out);
+  http_buffer_free(&records);
+  http_buffer_free(&request->params);
+  http_buffer_free(&request->body);
+  conn_release(request->conn);
+  free(request);
+  return NULL;
+}
+
+/* Reads records off one server connection, starting each request once its
+ * body is complete. */
+static void *serve_connection(void *arg) {
+  app_conn_t *conn = arg;
+  app_request_t **requests = calloc(APP_MAX_REQUESTS, sizeof(app_request_t *));
+  struct http_buffer input;
+  http_buffer_init(&input);
+  char buffer[FCGI_HEADER_SIZE + FCGI_MAX_CONTENT + 256];
+  while (requests) {
+    ssize_t n = read(conn->fd, buffer, sizeof(buffer));
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    http_buffer_append(&input, buffer, n);
+    size_t offset = 0;
+    ssize_t size;
+    fcgi_record_t record;
+    while ((size = fcgi_parse_record((uint8_t *) input.data + offset, input.size - offset,
+        &record)) > 0) {
+      offset += size;
+      app_request_t *request = requests[record.id];
+      if (record.type == FCGI_BEGIN_REQUEST) {
+        request = requests[record.id] = calloc(1, sizeof(app_request_t));
+        request->conn = conn;
+        request->id = record.id;
+        http_buffer_init(&request->params);
+        http_buffer_init(&request->body);
+      } else if (!request) {
+        continue;
+      } else if (record.type == FCGI_PARAMS) {
+        http_buffer_append(&request->params, (char *) record.content, record.size);
+      } else if (record.type == FCGI_ABORT_REQUEST) {
+        request->aborted = 1;
+      } else if (record.type == FCGI_STDIN && record.size > 0) {
+        http_buffer_append(&request->body, (char *) record.content, record.size);
+      } else if (record.type == FCGI_STDIN) {
+        requests[record.id] = NULL;
+        pthread_mutex_lock(&conn_lock);
+        conn->refcount++;
+        pthread_mutex_unlock(&conn_lock);
+        pthread_t thread;
+        pthread_create(&thread, NULL, serve_request, request);
+        pthread_detach(thread);
+      }
+    }
+    if (size < 0) break;
+    memmove(input.data, input.data + offset, input.size - offset);
+    input.size -= offset;
+  }
+  http_buffer_free(&input);
+  free(requests);
+  conn_release(conn);
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1) {
+    fprintf(stderr, "Usage: %s, started by httpserver --dynamic-command with its "
+        "listening socket as stdin\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  signal(SIGPIPE, SIG_IGN);
+  while (1) {
+    int fd = accept(FCGI_LISTENSOCK_FILENO, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR) continue;
+      perror("accept");
+      return EXIT_FAILURE;
+    }
+    app_conn_t *conn = malloc(sizeof(app_conn_t));
+    conn->fd = fd;
+    conn->refcount = 1;
+    pthread_mutex_init(&conn->write_lock, NULL);
+    pthread_t thread;
+    pthread_create(&thread, NULL, serve_connection, conn);
+    pthread_detach(thread);
+  }
+}
@@ -0,0 +1,423 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "libhttp.h"
+
+/*
+ * Microbenchmarks for the libhttp primitives on the request path.
+ *
+ *   ./httpbench [--baseline bench_baseline.txt] [--threshold 30]
+ *
+ * Prints the time and allocations per op of each benchmark. Times are also
+ * given relative to a calibration loop that reads and scans the same
+ * requests without libhttp, which is what baselines hold: absolute times
+ * only compare runs on one machine, while the relative cost of libhttp
+ * carries over to others. With --baseline, fails if any benchmark's
+ * relative cost rose by more than --threshold percent or it allocates more
+ * per op. --save-baseline writes "name relative_cost allocs_per_op" lines.
+ * Even relative costs shift between kernels and filesystems, so baselines
+ * are recorded on the machine that checks against them (see the Makefile).
+ *
+ * Requests are read from memory and responses go to an in-memory sink
+ * rather than a socket, so those benchmarks time libhttp and not the
+ * kernel. Listings can't avoid the filesystem;
+ * their syscalls are noisier than the calibration loop, so they get
+ * BENCH_SYSCALL_NOISE percent on top of the threshold.
+ *
+ * Allocations are counted by linking with --wrap for malloc, calloc and
+ * realloc, so they cover libhttp's own calls but not those made inside libc.
+ */
+
+static unsigned long allocations;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+void *__wrap_malloc(size_t size) {
+  allocations++;
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+  allocations++;
+  return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *p, size_t size) {
+  allocations++;
+  return __real_realloc(p, size);
+}
+
+/* Requests as curl, a browser and an old client send them. */
+static const char *request_corpus[] = {
+  "GET /index.html HTTP/1.1\r\n"
+  "Host: localhost:8000\r\n"
+  "User-Agent: curl/8.5.0\r\n"
+  "Accept: */*\r\n"
+  "\r\n",
+
+  "GET /static/css/site.css?v=20180412 HTTP/1.1\r\n"
+  "Host: www.example.com\r\n"
+  "Connection: keep-alive\r\n"
+  "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) "
+  "Chrome/66.0.3359.139 Safari/537.36\r\n"
+  "Accept: text/css,*/*;q=0.1\r\n"
+  "Referer: http://www.example.com/\r\n"
+  "Accept-Encoding: gzip, deflate, br\r\n"
+  "Accept-Language: en-US,en;q=0.9\r\n"
+  "Cookie: session=4f2a9c1b7e; theme=dark; _ga=GA1.2.1234567890.1523456789\r\n"
+  "If-None-Match: \"5ad0f1a2-1c3e\"\r\n"
+  "If-Modified-Since: Fri, 13 Apr 2018 18:09:06 GMT\r\n"
+  "\r\n",
+
+  "HEAD /files/report.pdf HTTP/1.0\r\n"
+  "Connection: keep-alive\r\n"
+  "\r\n",
+
+  "GET /my_documents/ HTTP/1.1\r\n"
+  "Host: localhost\r\n"
+  "\r\n",
+};
+#define NUM_REQUESTS (sizeof(request_corpus) / sizeof(request_corpus[0]))
+
+static char *name_corpus[] = {
+  "index.html", "photo.jpeg", "logo.png", "site.css", "app.min.js", "paper.pdf",
+  "README", "archive.tar.gz", "page.htm", "image.jpg",
+};
+#define NUM_NAMES (sizeof(name_corpus) / sizeof(name_corpus[0]))
+
+static size_t request_sizes[NUM_REQUESTS];
+static int null_fd;
+static char listing_dir[] = "/tmp/httpbench.XXXXXX";
+static volatile size_t sink;
+
+/* The request the next read gets. */
+static const char *source;
+static size_t source_size;
+
+/* Stand in for the client socket, so that no benchmark but the listings
+ * spends its time in the kernel. */
+static ssize_t source_read(int fd, void *buffer, size_t size) {
+  if (size > source_size) size = source_size;
+  memcpy(buffer, source, size);
+  source += size;
+  source_size -= size;
+  return size;
+}
+
+static void source_set(long i) {
+  source = request_corpus[i % NUM_REQUESTS];
+  source_size = request_sizes[i % NUM_REQUESTS];
+}
+
+static ssize_t sink_write(int fd, const void *buffer, size_t size) {
+  sink += size;
+  return size;
+}
+
+static ssize_t sink_writev(int fd, const struct iovec *iov, int iovcnt) {
+  ssize_t size = 0;
+  for (int i = 0; i < iovcnt; i++) size += iov[i].iov_len;
+  sink += size;
+  return size;
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void bench_request_parse(long i) {
+  source_set(i);
+  struct http_request *request = http_request_parse(null_fd);
+  sink += request->num_headers;
+  http_request_free(request);
+}
+
+static void bench_request_parse_arena(long i) {
+  static char space[16384] __attribute__((aligned(ARENA_ALIGN)));
+  static arena_t arena;
+  if (i == 0) arena_init(&arena, space, sizeof(space));
+  source_set(i);
+  struct http_request *request = http_request_parse_arena(null_fd, &arena);
+  sink += request->num_headers;
+  arena_reset(&arena);
+}
+
+/* What parsing a request costs without libhttp: the copy out of the
+ * source and a pass over the bytes. */
+static void bench_calibration(long i) {
+  char buffer[1024];
+  source_set(i);
+  ssize_t n = source_read(null_fd, buffer, sizeof(buffer));
+  size_t hash = 5381;
+  for (ssize_t j = 0; j < n; j++) hash = hash * 33 + buffer[j];
+  sink += hash;
+}
+
+static void bench_mime_type(long i) {
+  sink += (size_t) http_get_mime_type(name_corpus[i % NUM_NAMES]);
+}
+
+static void bench_response_headers(long i) {
+  http_start_response(null_fd, 200);
+  http_send_header(null_fd, "Content-Type", "text/html");
+  http_send_header(null_fd, "Content-Length", "4537");
+  http_send_header(null_fd, "Connection", "keep-alive");
+  http_end_headers(null_fd);
+}
+
+static void bench_response_headers_single(long i) {
+  static const char headers[] =
+    "Content-Type: text/html\r\nContent-Length: 4537\r\nConnection: keep-alive\r\n";
+  http_send_response_headers(null_fd, 200, headers, sizeof(headers) - 1);
+}
+
+static void bench_list_files(long i) {
+  struct http_buffer buffer;
+  http_buffer_init(&buffer);
+  http_get_list_files(listing_dir, "/", 0, &buffer);
+  sink += buffer.size;
+  http_buffer_free(&buffer);
+}
+
+static void bench_list_files_sorted(long i) {
+  struct http_buffer buffer;
+  http_buffer_init(&buffer);
+  http_get_list_files(listing_dir, "/", 1, &buffer);
+  sink += buffer.size;
+  http_buffer_free(&buffer);
+}
+
+typedef struct bench {
+  const char *name;
+  void (*run)(long i);
+  int syscall_bound;            // Timed mostly in the kernel.
+} bench_t;
+
+/* Extra regression, in percent, allowed to syscall-bound benchmarks. */
+#define BENCH_SYSCALL_NOISE 30
+
+static bench_t benches[] = {
+  { "http_request_parse", bench_request_parse },
+  { "http_request_parse_arena", bench_request_parse_arena },
+  { "http_get_mime_type", bench_mime_type },
+  { "response_headers", bench_response_headers },
+  { "response_headers_single", bench_response_headers_single },
+  { "http_get_list_files", bench_list_files, 1 },
+  { "http_get_list_files_sorted", bench_list_files_sorted, 1 },
+};
+#define NUM_BENCHES (sizeof(benches) / sizeof(benches[0]))
+
+typedef struct result {
+  double ns_per_op;
+  double allocs_per_op;
+} result_t;
+
+/* Timed rounds per benchmark. Noise only ever makes a round slower, so the
+ * fastest of many short rounds is the most repeatable figure. */
+#define BENCH_ROUNDS 20
+
+/* Returns how many runs of BENCH take about ROUND_NS. */
+static long round_iterations(bench_t *bench, uint64_t round_ns) {
+  long iterations = 1;
+  while (1) {
+    uint64_t start = now_ns();
+    for (long i = 0; i < iterations; i++) bench->run(i);
+    uint64_t elapsed = now_ns() - start;
+    if (elapsed >= round_ns / 4 || iterations >= (1L << 30))
+      return elapsed > 0 ? iterations * round_ns / elapsed + 1 : iterations;
+    iterations *= 4;
+  }
+}
+
+/* Runs ITERATIONS of BENCH and keeps the fastest time per op in RESULT. */
+static void run_round(bench_t *bench, long iterations, result_t *result) {
+  unsigned long allocations_before = allocations;
+  uint64_t start = now_ns();
+  for (long i = 0; i < iterations; i++) bench->run(i);
+  double ns = (double) (now_ns() - start) / iterations;
+  if (result->ns_per_op < 0 || ns < result->ns_per_op) result->ns_per_op = ns;
+  result->allocs_per_op = (double) (allocations - allocations_before) / iterations;
+}
+
+/* Runs BENCH for about TARGET_NS in BENCH_ROUNDS rounds, each after a
+ * round of REFERENCE, whose fastest time per op goes to *REFERENCE_NS. Clock
+ * speed drifting during the run then moves both alike. */
+static result_t run_bench(bench_t *bench, bench_t *reference, uint64_t target_ns,
+    double *reference_ns) {
+  uint64_t round_ns = target_ns / BENCH_ROUNDS;
+  long iterations = round_iterations(bench, round_ns);
+  long reference_iterations = round_iterations(reference, round_ns / 2);
+
+  result_t result = { .ns_per_op = -1 }, reference_result = { .ns_per_op = -1 };
+  for (int round = 0; round < BENCH_ROUNDS; round++) {
+    run_round(reference, reference_iterations, &reference_result);
+    run_round(bench, iterations, &result);
+  }
+  *reference_ns = reference_result.ns_per_op;
+  return result;
+}
+
+static void setup(void) {
+  for (size_t i = 0; i < NUM_REQUESTS; i++) request_sizes[i] = strlen(request_corpus[i]);
+  null_fd = open("/dev/null", O_WRONLY);
+  http_read_hook = source_read;
+  http_write_hook = sink_write;
+  http_writev_hook = sink_writev;
+
+  /* A directory the size of a typical listing. */
+  if (!mkdtemp(listing_dir)) {
+    perror("Failed to create listing directory");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < 100; i++) {
+    char path[MAX_PATH];
+    snprintf(path, MAX_PATH, "%s/file-%03d-%s", listing_dir, (i * 37) % 100,
+        name_corpus[i % NUM_NAMES]);
+    int fd = open(path, O_WRONLY | O_CREAT, 0644);
+    if (fd >= 0) close(fd);
+  }
+}
+
+static void cleanup(void) {
+  char command[MAX_PATH];
+  snprintf(command, MAX_PATH, "rm -rf '%s'", listing_dir);
+  if (system(command) != 0) fprintf(stderr, "Failed to remove %s\n", listing_dir);
+}
+
+/* Looks up NAME in a saved baseline. */
+static int baseline_value(char *baseline, const char *name, result_t *result) {
+  size_t length = strlen(name);
+  for (char *line = baseline; line && *line; line = strchr(line, '\n')) {
+    if (*line == '\n') line++;
+    if (strncmp(line, name, length) == 0 && line[length] == ' ')
+      return sscanf(line + length, "%lf %lf", &result->ns_per_op, &result->allocs_per_op) == 2 ?
+          0 : -1;
+  }
+  return -1;
+}
+
+static char *read_text_file(const char *file) {
+  FILE *f = fopen(file, "r");
+  if (!f) {
+    perror(file);
+    exit(EXIT_FAILURE);
+  }
+  struct http_buffer buffer;
+  http_buffer_init(&buffer);
+  char chunk[MAX_FILE_SIZE];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+    http_buffer_append(&buffer, chunk, n);
+  fclose(f);
+  http_buffer_append(&buffer, "", 1);
+  return buffer.data;
+}
+
+char *USAGE =
+  "Usage: ./httpbench [--filter NAME] [--time-ms 500] [--save-baseline bench_baseline.txt]\n"
+  "                   [--baseline bench_baseline.txt] [--threshold 30]\n";
+
+void exit_with_usage() {
+  fprintf(stderr, "%s", USAGE);
+  exit(EXIT_SUCCESS);
+}
+
+int main(int argc, char **argv) {
+  char *filter = NULL, *save_baseline = NULL, *baseline_file = NULL;
+  double threshold = 30;
+  int time_ms = 500;
+  for (int i = 1; i < argc; i++) {
+    char *value = i + 1 < argc ? argv[i + 1] : NULL;
+    if (strcmp("--help", argv[i]) == 0) exit_with_usage();
+    if (!value) {
+      fprintf(stderr, "Expected argument after %s\n", argv[i]);
+      exit_with_usage();
+    }
+    if (strcmp("--filter", argv[i]) == 0) {
+      filter = value;
+    } else if (strcmp("--time-ms", argv[i]) == 0) {
+      time_ms = atoi(value);
+    } else if (strcmp("--save-baseline", argv[i]) == 0) {
+      save_baseline = value;
+    } else if (strcmp("--baseline", argv[i]) == 0) {
+      baseline_file = value;
+    } else if (strcmp("--threshold", argv[i]) == 0) {
+      threshold = atof(value);
+    } else {
+      fprintf(stderr, "Unrecognized option: %s\n", argv[i]);
+      exit_with_usage();
+    }
+    i++;
+  }
+  if (time_ms <= 0) exit_with_usage();
+  char *baseline = baseline_file ? read_text_file(baseline_file) : NULL;
+
+  setup();
+  /* http_request_parse logs every request to stdout. */
+  fflush(stdout);
+  int report_fd = dup(STDOUT_FILENO);
+  FILE *report = fdopen(report_fd, "w");
+  if (!report || !freopen("/dev/null", "w", stdout)) {
+    perror("Failed to redirect stdout");
+    exit(EXIT_FAILURE);
+  }
+
+  bench_t calibration = { "calibration", bench_calibration };
+  struct http_buffer results;
+  http_buffer_init(&results);
+  int failed = 0;
+  for (size_t i = 0; i < NUM_BENCHES; i++) {
+    bench_t *bench = &benches[i];
+    if (filter && !strstr(bench->name, filter)) continue;
+    double unit_ns;
+    result_t result = run_bench(bench, &calibration, time_ms * 1000000ull, &unit_ns);
+    double relative = result.ns_per_op / unit_ns;
+    http_buffer_printf(&results, "%s %.3f %.2f\n", bench->name, relative, result.allocs_per_op);
+    fprintf(report, "%-28s %10.1f ns/op %8.2fx %8.2f allocs/op", bench->name, result.ns_per_op,
+        relative, result.allocs_per_op);
+
+    /* Baselines hold relative costs in place of ns_per_op. */
+    result_t base;
+    if (baseline && baseline_value(baseline, bench->name, &base) == 0) {
+      double delta = (relative - base.ns_per_op) / base.ns_per_op * 100;
+      fprintf(report, "   %+6.1f%%", delta);
+      double allowed = threshold + (bench->syscall_bound ? BENCH_SYSCALL_NOISE : 0);
+      if (delta > allowed) {
+        fprintf(report, "  REGRESSED (threshold %.0f%%)", allowed);
+        failed = 1;
+      }
+      if (result.allocs_per_op > base.allocs_per_op + 0.005) {
+        fprintf(report, "  MORE ALLOCATIONS (was %.2f)", base.allocs_per_op);
+        failed = 1;
+      }
+    }
+    fprintf(report, "\n");
+    fflush(report);
+  }
+  cleanup();
+
+  if (save_baseline) {
+    FILE *f = fopen(save_baseline, "w");
+    if (!f || fwrite(results.data, 1, results.size, f) != results.size || fclose(f) != 0) {
+      perror(save_baseline);
+      exit(EXIT_FAILURE);
+    }
+  }
+  http_buffer_free(&results);
+  free(baseline);
+  fclose(report);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
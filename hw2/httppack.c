@@ -0,0 +1,279 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "libhttp.h"
+#include "mime.h"
+#include "pack.h"
+
+/*
+ * Writes every file under a directory into a pack for httpserver --pack.
+ *
+ *   ./httppack --files files/ --output site.pack
+ */
+
+/* Only keep a gzip variant that saves at least this share of the body. */
+#define PACK_GZIP_MIN_SAVING 10
+
+typedef struct pack_file {
+  char path[MAX_PATH];          // Request path, starting with '/'.
+  pack_entry_t entry;
+} pack_file_t;
+
+static pack_file_t *files;
+static int num_files, files_capacity;
+
+static void collect_files(const char *dir, const char *prefix) {
+  DIR *d = opendir(dir);
+  if (!d) {
+    perror(dir);
+    exit(EXIT_FAILURE);
+  }
+  struct dirent *e;
+  while ((e = readdir(d)) != NULL) {
+    if (e->d_name[0] == '.') continue;
+    char fullpath[MAX_PATH], path[MAX_PATH];
+    if (snprintf(fullpath, MAX_PATH, "%s/%s", dir, e->d_name) >= MAX_PATH ||
+        snprintf(path, MAX_PATH, "%s/%s", prefix, e->d_name) >= MAX_PATH) {
+      fprintf(stderr, "Skipping %s/%s: path too long\n", dir, e->d_name);
+      continue;
+    }
+    struct stat s;
+    if (stat(fullpath, &s) < 0) continue;
+    if (S_ISDIR(s.st_mode)) {
+      collect_files(fullpath, path);
+    } else if (S_ISREG(s.st_mode)) {
+      if (num_files == files_capacity) {
+        files_capacity = files_capacity ? files_capacity * 2 : 64;
+        files = realloc(files, files_capacity * sizeof(pack_file_t));
+        if (!files) {
+          perror("Failed to grow file list");
+          exit(EXIT_FAILURE);
+        }
+      }
+      memset(&files[num_files], 0, sizeof(pack_file_t));
+      strcpy(files[num_files].path, path);
+      num_files++;
+    }
+  }
+  closedir(d);
+}
+
+static char *read_file(const char *file, size_t *size) {
+  FILE *f = fopen(file, "rb");
+  if (!f) {
+    perror(file);
+    exit(EXIT_FAILURE);
+  }
+  struct http_buffer buffer;
+  http_buffer_init(&buffer);
+  char chunk[MAX_FILE_SIZE];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+    http_buffer_append(&buffer, chunk, n);
+  fclose(f);
+  *size = buffer.size;
+  return buffer.data;
+}
+
+static int is_compressible(const char *mime_type) {
+  return strncmp(mime_type, "text/", 5) == 0 || strcmp(mime_type, "application/javascript") == 0;
+}
+
+/* Returns a gzip copy of data, or NULL if it would not be worth serving. */
+static char *gzip_data(const char *data, size_t size, size_t *gzip_size) {
+  z_stream z;
+  memset(&z, 0, sizeof(z));
+  /* windowBits 15 + 16 writes a gzip header instead of a zlib one. */
+  if (deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+    return NULL;
+  size_t capacity = deflateBound(&z, size);
+  char *out = malloc(capacity);
+  if (!out) {
+    deflateEnd(&z);
+    return NULL;
+  }
+  z.next_in = (Bytef *) data;
+  z.avail_in = size;
+  z.next_out = (Bytef *) out;
+  z.avail_out = capacity;
+  int result = deflate(&z, Z_FINISH);
+  *gzip_size = z.total_out;
+  deflateEnd(&z);
+  if (result != Z_STREAM_END || *gzip_size * 100 > size * (100 - PACK_GZIP_MIN_SAVING)) {
+    free(out);
+    return NULL;
+  }
+  return out;
+}
+
+static void write_at(int fd, const void *data, size_t size, off_t offset) {
+  const char *p = data;
+  while (size > 0) {
+    ssize_t n = pwrite(fd, p, size, offset);
+    if (n <= 0) {
+      perror("Failed to write pack");
+      exit(EXIT_FAILURE);
+    }
+    p += n;
+    size -= n;
+    offset += n;
+  }
+}
+
+static uint64_t align(uint64_t offset) {
+  return (offset + PACK_ALIGN - 1) & ~(uint64_t) (PACK_ALIGN - 1);
+}
+
+/* Appends the response headers of one variant to the header region. */
+static void add_headers(struct http_buffer *headers, pack_variant_t *variant, pack_entry_t *entry,
+    char *mime_type, int gzip, int has_gzip) {
+  size_t start = headers->size;
+  char etag[PACK_ETAG_SIZE];
+  pack_etag(entry, gzip, etag, sizeof(etag));
+  http_buffer_printf(headers, "HTTP/1.1 200 OK\r\nContent-Type: %s\r\n"
+      "Content-Length: %llu\r\nETag: %s\r\n", mime_type,
+      (unsigned long long) variant->body_size, etag);
+  if (gzip) http_buffer_printf(headers, "Content-Encoding: gzip\r\n");
+  if (has_gzip) http_buffer_printf(headers, "Vary: Accept-Encoding\r\n");
+  variant->header_offset = start;
+  variant->header_size = headers->size - start;
+}
+
+char *USAGE =
+  "Usage: ./httppack --files files/ --output site.pack [--mime-types /etc/mime.types]\n";
+
+void exit_with_usage() {
+  fprintf(stderr, "%s", USAGE);
+  exit(EXIT_SUCCESS);
+}
+
+int main(int argc, char **argv) {
+  char *files_dir = NULL, *output = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp("--files", argv[i]) == 0) {
+      files_dir = argv[++i];
+    } else if (strcmp("--output", argv[i]) == 0 || strcmp("-o", argv[i]) == 0) {
+      output = argv[++i];
+    } else if (strcmp("--mime-types", argv[i]) == 0) {
+      char *mime_types_file = argv[++i];
+      if (!mime_types_file) exit_with_usage();
+      if (mime_load(mime_types_file) < 0) {
+        perror(mime_types_file);
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp("--help", argv[i]) == 0) {
+      exit_with_usage();
+    } else {
+      fprintf(stderr, "Unrecognized option: %s\n", argv[i]);
+      exit_with_usage();
+    }
+  }
+  if (!files_dir || !output) exit_with_usage();
+
+  size_t dir_size = strlen(files_dir);
+  while (dir_size > 1 && files_dir[dir_size - 1] == '/') files_dir[--dir_size] = '\0';
+  collect_files(files_dir, "");
+
+  int fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    perror(output);
+    exit(EXIT_FAILURE);
+  }
+
+  /* Bodies first, each on its own page so the mapping can be sent as is.
+   * Headers and paths are gathered and written after them. */
+  struct http_buffer headers, paths;
+  http_buffer_init(&headers);
+  http_buffer_init(&paths);
+  uint64_t offset = align(sizeof(pack_header_t));
+  unsigned long long total = 0, total_gzip = 0;
+  for (int i = 0; i < num_files; i++) {
+    pack_file_t *file = &files[i];
+    pack_entry_t *entry = &file->entry;
+    char fullpath[MAX_PATH];
+    snprintf(fullpath, MAX_PATH, "%s%s", files_dir, file->path);
+    size_t size;
+    char *data = read_file(fullpath, &size);
+    char *mime_type = http_get_mime_type(file->path);
+
+    entry->hash = pack_hash(file->path, strlen(file->path));
+    entry->etag = pack_hash(data, size);
+    entry->path_offset = paths.size;
+    entry->path_size = strlen(file->path);
+    http_buffer_append(&paths, file->path, entry->path_size);
+
+    entry->identity.body_offset = offset;
+    entry->identity.body_size = size;
+    write_at(fd, data, size, offset);
+    offset = align(offset + size);
+    total += size;
+
+    size_t gzip_size = 0;
+    char *gzip = is_compressible(mime_type) ? gzip_data(data, size, &gzip_size) : NULL;
+    if (gzip) {
+      entry->gzip.body_offset = offset;
+      entry->gzip.body_size = gzip_size;
+      write_at(fd, gzip, gzip_size, offset);
+      offset = align(offset + gzip_size);
+      total_gzip += gzip_size;
+      free(gzip);
+    }
+    free(data);
+
+    add_headers(&headers, &entry->identity, entry, mime_type, 0, gzip != NULL);
+    if (gzip) add_headers(&headers, &entry->gzip, entry, mime_type, 1, 1);
+  }
+
+  /* Header and path offsets so far are relative to their regions. */
+  uint64_t headers_offset = offset;
+  write_at(fd, headers.data, headers.size, headers_offset);
+  uint64_t paths_offset = headers_offset + headers.size;
+  write_at(fd, paths.data, paths.size, paths_offset);
+
+  uint32_t num_slots = 16;
+  while (num_slots < 2 * (uint32_t) num_files) num_slots *= 2;
+  pack_entry_t *index = calloc(num_slots, sizeof(pack_entry_t));
+  if (!index) {
+    perror("Failed to allocate index");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < num_files; i++) {
+    pack_entry_t *entry = &files[i].entry;
+    entry->path_offset += paths_offset;
+    entry->identity.header_offset += headers_offset;
+    if (entry->gzip.body_size > 0) entry->gzip.header_offset += headers_offset;
+    uint32_t slot = entry->hash & (num_slots - 1);
+    while (index[slot].hash != 0) slot = (slot + 1) & (num_slots - 1);
+    index[slot] = *entry;
+  }
+  uint64_t index_offset = (paths_offset + paths.size + 7) & ~(uint64_t) 7;
+  write_at(fd, index, num_slots * sizeof(pack_entry_t), index_offset);
+
+  /* The header goes last, so an interrupted run never looks like a pack. */
+  pack_header_t header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, PACK_MAGIC, 8);
+  header.version = PACK_VERSION;
+  header.num_entries = num_files;
+  header.num_slots = num_slots;
+  header.index_offset = index_offset;
+  write_at(fd, &header, sizeof(header), 0);
+  if (close(fd) < 0) {
+    perror(output);
+    exit(EXIT_FAILURE);
+  }
+
+  printf("Packed %d files (%llu bytes, %llu gzipped) into %s\n", num_files, total, total_gzip,
+      output);
+  free(index);
+  free(files);
+  http_buffer_free(&headers);
+  http_buffer_free(&paths);
+  return 0;
+}
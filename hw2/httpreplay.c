@@ -0,0 +1,507 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "libhttp.h"
+
+/*
+ * Replays a log written by httpserver --capture against a server, keeping
+ * each captured connection's requests on one connection and in order.
+ *
+ *   ./httpreplay --capture requests.cap --port 8000 [--speed 1]
+ *
+ * --speed 1 issues requests at their captured times, N at N times that
+ * pace and 0 as fast as possible. The report is a list of "name value"
+ * lines; --save-baseline keeps it, and --baseline compares against a kept
+ * one, failing if throughput drops or p99 latency rises by more than
+ * --max-regression percent.
+ */
+
+typedef struct replay_request {
+  capture_record_t record;
+  char *data;
+  uint64_t latency_ns;           // Time to the last byte, 0 if it failed.
+  uint64_t response_size;
+} replay_request_t;
+
+typedef struct replay_connection {
+  replay_request_t **requests;
+  int num_requests;
+} replay_connection_t;
+
+static replay_request_t *requests;
+static int num_requests;
+static replay_connection_t *connections;
+static int num_connections;
+static int next_connection;
+
+static struct sockaddr_in server_address;
+static double speed = 1;
+static uint64_t capture_start;   // Time of the first captured request.
+static uint64_t replay_start;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t t) {
+  struct timespec ts = { .tv_sec = t / 1000000000ull, .tv_nsec = t % 1000000000ull };
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+static void load_capture(const char *file) {
+  int fd = open(file, O_RDONLY);
+  struct stat s;
+  if (fd < 0 || fstat(fd, &s) < 0) {
+    perror(file);
+    exit(EXIT_FAILURE);
+  }
+  char *data = malloc(s.st_size + 1);
+  ssize_t n = 0, total = 0;
+  while (data && total < s.st_size && (n = read(fd, data + total, s.st_size - total)) > 0)
+    total += n;
+  close(fd);
+  if (!data || total < 8 || memcmp(data, CAPTURE_MAGIC, 8) != 0) {
+    fprintf(stderr, "%s: not a capture\n", file);
+    exit(EXIT_FAILURE);
+  }
+
+  int capacity = 1024;
+  requests = malloc(capacity * sizeof(replay_request_t));
+  char *p = data + 8, *end = data + total;
+  while (requests && end - p >= (ssize_t) sizeof(capture_record_t)) {
+    capture_record_t record;
+    memcpy(&record, p, sizeof(record));
+    if (end - p - sizeof(record) < record.request_size) break;
+    if (num_requests == capacity) {
+      capacity *= 2;
+      requests = realloc(requests, capacity * sizeof(replay_request_t));
+      if (!requests) break;
+    }
+    replay_request_t *request = &requests[num_requests++];
+    memset(request, 0, sizeof(replay_request_t));
+    request->record = record;
+    request->data = p + sizeof(record);
+    p += sizeof(record) + record.request_size;
+  }
+  if (!requests) {
+    perror("Failed to load capture");
+    exit(EXIT_FAILURE);
+  }
+  if (p != end) fprintf(stderr, "Ignoring a truncated record at the end of %s\n", file);
+}
+
+/* Orders requests by connection, then by time. */
+static int compare_requests(const void *a, const void *b) {
+  const capture_record_t *x = &((replay_request_t *) a)->record;
+  const capture_record_t *y = &((replay_request_t *) b)->record;
+  if (x->conn_id != y->conn_id) return x->conn_id < y->conn_id ? -1 : 1;
+  return x->time < y->time ? -1 : x->time > y->time ? 1 : 0;
+}
+
+static int compare_connections(const void *a, const void *b) {
+  uint64_t x = ((replay_connection_t *) a)->requests[0]->record.time;
+  uint64_t y = ((replay_connection_t *) b)->requests[0]->record.time;
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/* Groups the requests into connections, in the order they were opened. */
+static void build_connections(void) {
+  qsort(requests, num_requests, sizeof(replay_request_t), compare_requests);
+  connections = calloc(num_requests, sizeof(replay_connection_t));
+  replay_request_t **list = malloc(num_requests * sizeof(replay_request_t *));
+  if (num_requests > 0 && (!connections || !list)) {
+    perror("Failed to group connections");
+    exit(EXIT_FAILURE);
+  }
+  capture_start = num_requests > 0 ? requests[0].record.time : 0;
+  for (int i = 0; i < num_requests; i++) {
+    if (requests[i].record.time < capture_start) capture_start = requests[i].record.time;
+    if (i == 0 || requests[i].record.conn_id != requests[i - 1].record.conn_id)
+      connections[num_connections++].requests = &list[i];
+    connections[num_connections - 1].num_requests++;
+    list[i] = &requests[i];
+  }
+  qsort(connections, num_connections, sizeof(replay_connection_t), compare_connections);
+}
+
+static int connect_server(void) {
+  int fd = socket(PF_INET, SOCK_STREAM, 0);
+  if (fd < 0) return -1;
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  if (connect(fd, (struct sockaddr *) &server_address, sizeof(server_address)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* Bytes received on a connection but not consumed yet. */
+typedef struct replay_input {
+  int fd;
+  char data[16384];
+  size_t size;
+  int eof;
+} replay_input_t;
+
+static int input_fill(replay_input_t *input) {
+  if (input->size == sizeof(input->data)) return -1;
+  ssize_t n;
+  while ((n = read(input->fd, input->data + input->size, sizeof(input->data) - input->size)) < 0 &&
+      errno == EINTR);
+  if (n <= 0) {
+    input->eof = 1;
+    return -1;
+  }
+  input->size += n;
+  return 0;
+}
+
+static void input_consume(replay_input_t *input, size_t size) {
+  memmove(input->data, input->data + size, input->size - size);
+  input->size -= size;
+}
+
+/* Reads and discards SIZE bytes. */
+static int input_skip(replay_input_t *input, long long size) {
+  while (size > 0) {
+    if (input->size == 0 && input_fill(input) < 0) return -1;
+    size_t n = (unsigned long long) size > input->size ? input->size : size;
+    input_consume(input, n);
+    size -= n;
+  }
+  return 0;
+}
+
+/* Returns the length of the line at the start of input including its
+ * newline, reading more as needed, or -1. */
+static long input_line(replay_input_t *input, size_t from) {
+  while (1) {
+    char *newline = memchr(input->data + from, '\n', input->size - from);
+    if (newline) return newline - input->data + 1;
+    from = input->size;
+    if (input_fill(input) < 0) return -1;
+  }
+}
+
+/* Reads one response, returning its size in bytes or -1. Sets *close if
+ * the server will close the connection after it. */
+static long long read_response(replay_input_t *input, int head, int *close) {
+  size_t end = 0;
+  long line;
+  while ((line = input_line(input, end)) >= 0) {
+    size_t start = end;
+    end = line;
+    if (end - start <= 2 && (input->data[start] == '\r' || input->data[start] == '\n')) break;
+  }
+  if (line < 0) return -1;
+
+  /* Terminate the headers so they can be scanned as a string. */
+  char headers[sizeof(input->data) + 1];
+  memcpy(headers, input->data, end);
+  headers[end] = '\0';
+  input_consume(input, end);
+
+  int status = 0;
+  sscanf(headers, "HTTP/%*d.%*d %d", &status);
+  long long length = -1;
+  int chunked = 0;
+  *close = 0;
+  for (char *h = strchr(headers, '\n'); h && h[1]; h = strchr(h + 1, '\n')) {
+    char *name = h + 1;
+    if (strncasecmp(name, "Content-Length:", 15) == 0)
+      length = atoll(name + 15);
+    else if (strncasecmp(name, "Transfer-Encoding:", 18) == 0 && strstr(name, "chunked"))
+      chunked = 1;
+    else if (strncasecmp(name, "Connection:", 11) == 0 && strncasecmp(name + 12, "close", 5) == 0)
+      *close = 1;
+  }
+
+  long long size = end;
+  /* A 100 Continue to a captured Expect comes ahead of the response. */
+  if (status >= 100 && status < 200 && status != 101) {
+    long long rest = read_response(input, head, close);
+    return rest < 0 ? -1 : size + rest;
+  }
+  if (head || status == 204 || status == 304 || status < 200) return size;
+  if (chunked) {
+    while (1) {
+      if ((line = input_line(input, 0)) < 0) return -1;
+      long long chunk = strtoll(input->data, NULL, 16);
+      input_consume(input, line);
+      size += line;
+      /* The chunk, then its CRLF; the last chunk is followed by the
+       * trailer's empty line. */
+      if (input_skip(input, chunk) < 0 || (line = input_line(input, 0)) < 0) return -1;
+      input_consume(input, line);
+      size += chunk + line;
+      if (chunk == 0) return size;
+    }
+  }
+  if (length < 0) {
+    /* Delimited by the end of the connection. */
+    *close = 1;
+    long long total = input->size;
+    input->size = 0;
+    while (input_fill(input) == 0) {
+      total += input->size;
+      input->size = 0;
+    }
+    return size + total;
+  }
+  if (input_skip(input, length) < 0) return -1;
+  return size + length;
+}
+
+static void replay_connection(replay_connection_t *connection) {
+  replay_input_t *input = malloc(sizeof(replay_input_t));
+  if (!input) return;
+  input->fd = -1;
+  for (int i = 0; i < connection->num_requests; i++) {
+    replay_request_t *request = connection->requests[i];
+    if (speed > 0)
+      sleep_until(replay_start + (request->record.time - capture_start) / speed);
+    if (input->fd < 0) {
+      input->fd = connect_server();
+      input->size = 0;
+      input->eof = 0;
+      if (input->fd < 0) continue;
+    }
+
+    uint64_t start = now_ns();
+    int head = strncmp(request->data, "HEAD ", 5) == 0;
+    int close_after = 0;
+    long long size = -1;
+    if (http_send_data(input->fd, request->data, request->record.request_size) == 0)
+      size = read_response(input, head, &close_after);
+    if (size >= 0) {
+      request->latency_ns = now_ns() - start;
+      if (request->latency_ns == 0) request->latency_ns = 1;
+      request->response_size = size;
+    }
+    if (size < 0 || close_after) {
+      close(input->fd);
+      input->fd = -1;
+    }
+  }
+  if (input->fd >= 0) close(input->fd);
+  free(input);
+}
+
+static void *replay_work(void *arg) {
+  int i;
+  while ((i = __sync_fetch_and_add(&next_connection, 1)) < num_connections)
+    replay_connection(&connections[i]);
+  return NULL;
+}
+
+static int compare_latencies(const void *a, const void *b) {
+  uint64_t x = *(uint64_t *) a, y = *(uint64_t *) b;
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/* Fills buffer with the report for a replay that took ELAPSED ns. */
+static void format_report(struct http_buffer *buffer, uint64_t elapsed) {
+  uint64_t *latencies = malloc((num_requests + 1) * sizeof(uint64_t));
+  int ok = 0, mismatched = 0;
+  unsigned long long bytes = 0;
+  for (int i = 0; i < num_requests; i++) {
+    replay_request_t *request = &requests[i];
+    if (!request->latency_ns) continue;
+    latencies[ok++] = request->latency_ns;
+    bytes += request->response_size;
+    if (request->response_size != request->record.response_size) mismatched++;
+  }
+  qsort(latencies, ok, sizeof(uint64_t), compare_latencies);
+
+  double seconds = elapsed / 1e9;
+  http_buffer_printf(buffer, "connections %d\n", num_connections);
+  http_buffer_printf(buffer, "requests %d\n", num_requests);
+  http_buffer_printf(buffer, "errors %d\n", num_requests - ok);
+  http_buffer_printf(buffer, "size_mismatches %d\n", mismatched);
+  http_buffer_printf(buffer, "elapsed_s %.3f\n", seconds);
+  http_buffer_printf(buffer, "throughput_rps %.1f\n", seconds > 0 ? ok / seconds : 0);
+  http_buffer_printf(buffer, "throughput_mbps %.2f\n", seconds > 0 ? bytes / seconds / 1e6 : 0);
+  double percentiles[] = { 50, 90, 99, 100 };
+  char *names[] = { "p50", "p90", "p99", "max" };
+  for (int i = 0; i < 4; i++) {
+    uint64_t latency = 0;
+    if (ok > 0) {
+      int index = (int) (percentiles[i] / 100 * ok);
+      latency = latencies[index < ok ? index : ok - 1];
+    }
+    http_buffer_printf(buffer, "latency_%s_us %.1f\n", names[i], latency / 1000.0);
+  }
+  free(latencies);
+}
+
+/* Looks up the value of NAME in a report. */
+static int report_value(char *report, const char *name, double *value) {
+  size_t length = strlen(name);
+  for (char *line = report; line && *line; line = strchr(line, '\n'), line = line ? line + 1 : NULL) {
+    if (strncmp(line, name, length) == 0 && line[length] == ' ') {
+      *value = atof(line + length + 1);
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/* Prints how REPORT differs from BASELINE. Returns -1 if throughput or p99
+ * latency regressed by more than MAX_REGRESSION percent. */
+static int compare_baseline(char *report, char *baseline, double max_regression) {
+  printf("%-16s %12s %12s %9s\n", "metric", "baseline", "current", "delta");
+  char *names[] = { "throughput_rps", "throughput_mbps", "latency_p50_us", "latency_p90_us",
+      "latency_p99_us", "latency_max_us", "errors" };
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    double before, after;
+    if (report_value(baseline, names[i], &before) < 0 || report_value(report, names[i], &after) < 0)
+      continue;
+    double delta = before != 0 ? (after - before) / before * 100 : 0;
+    printf("%-16s %12.1f %12.1f %+8.1f%%\n", names[i], before, after, delta);
+  }
+
+  double before, after;
+  int result = 0;
+  if (report_value(baseline, "throughput_rps", &before) == 0 &&
+      report_value(report, "throughput_rps", &after) == 0 &&
+      after < before * (1 - max_regression / 100)) {
+    fprintf(stderr, "Throughput regressed by more than %.1f%%\n", max_regression);
+    result = -1;
+  }
+  if (report_value(baseline, "latency_p99_us", &before) == 0 &&
+      report_value(report, "latency_p99_us", &after) == 0 &&
+      after > before * (1 + max_regression / 100)) {
+    fprintf(stderr, "p99 latency regressed by more than %.1f%%\n", max_regression);
+    result = -1;
+  }
+  return result;
+}
+
+static char *read_text_file(const char *file) {
+  FILE *f = fopen(file, "r");
+  if (!f) {
+    perror(file);
+    exit(EXIT_FAILURE);
+  }
+  struct http_buffer buffer;
+  http_buffer_init(&buffer);
+  char chunk[MAX_FILE_SIZE];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+    http_buffer_append(&buffer, chunk, n);
+  fclose(f);
+  http_buffer_append(&buffer, "", 1);
+  return buffer.data;
+}
+
+char *USAGE =
+  "Usage: ./httpreplay --capture requests.cap --port 8000 [--host 127.0.0.1]\n"
+  "                    [--speed 1] [--concurrency 64]\n"
+  "                    [--save-baseline base.txt] [--baseline base.txt] [--max-regression 10]\n";
+
+void exit_with_usage() {
+  fprintf(stderr, "%s", USAGE);
+  exit(EXIT_SUCCESS);
+}
+
+int main(int argc, char **argv) {
+  char *capture_file = NULL, *host = "127.0.0.1", *save_baseline = NULL, *baseline = NULL;
+  int port = 0, concurrency = 64;
+  double max_regression = 10;
+  for (int i = 1; i < argc; i++) {
+    char *value = i + 1 < argc ? argv[i + 1] : NULL;
+    if (strcmp("--help", argv[i]) == 0) exit_with_usage();
+    if (!value) {
+      fprintf(stderr, "Expected argument after %s\n", argv[i]);
+      exit_with_usage();
+    }
+    if (strcmp("--capture", argv[i]) == 0) {
+      capture_file = value;
+    } else if (strcmp("--host", argv[i]) == 0) {
+      host = value;
+    } else if (strcmp("--port", argv[i]) == 0) {
+      port = atoi(value);
+    } else if (strcmp("--speed", argv[i]) == 0) {
+      speed = atof(value);
+    } else if (strcmp("--concurrency", argv[i]) == 0) {
+      concurrency = atoi(value);
+    } else if (strcmp("--save-baseline", argv[i]) == 0) {
+      save_baseline = value;
+    } else if (strcmp("--baseline", argv[i]) == 0) {
+      baseline = value;
+    } else if (strcmp("--max-regression", argv[i]) == 0) {
+      max_regression = atof(value);
+    } else {
+      fprintf(stderr, "Unrecognized option: %s\n", argv[i]);
+      exit_with_usage();
+    }
+    i++;
+  }
+  if (!capture_file || port <= 0 || concurrency < 1 || speed < 0) exit_with_usage();
+
+  struct hostent *entry = gethostbyname2(host, AF_INET);
+  if (!entry) {
+    fprintf(stderr, "Cannot find host: %s\n", host);
+    exit(ENXIO);
+  }
+  server_address.sin_family = AF_INET;
+  server_address.sin_port = htons(port);
+  memcpy(&server_address.sin_addr, entry->h_addr_list[0], sizeof(server_address.sin_addr));
+
+  load_capture(capture_file);
+  build_connections();
+  fprintf(stderr, "Replaying %d requests on %d connections\n", num_requests, num_connections);
+
+  pthread_t *threads = malloc(concurrency * sizeof(pthread_t));
+  if (!threads) {
+    perror("Failed to allocate threads");
+    exit(EXIT_FAILURE);
+  }
+  replay_start = now_ns();
+  int started = 0;
+  for (; started < concurrency && started < num_connections; started++) {
+    if (pthread_create(&threads[started], NULL, replay_work, NULL) != 0) break;
+  }
+  for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+  uint64_t elapsed = now_ns() - replay_start;
+  free(threads);
+
+  struct http_buffer report;
+  http_buffer_init(&report);
+  format_report(&report, elapsed);
+  http_buffer_append(&report, "", 1);
+  printf("%s", report.data);
+
+  if (save_baseline) {
+    FILE *f = fopen(save_baseline, "w");
+    if (!f || fputs(report.data, f) < 0 || fclose(f) != 0) {
+      perror(save_baseline);
+      exit(EXIT_FAILURE);
+    }
+  }
+  int result = 0;
+  if (baseline) {
+    char *saved = read_text_file(baseline);
+    result = compare_baseline(report.data, saved, max_regression);
+    free(saved);
+  }
+  http_buffer_free(&report);
+  return result < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -1,21 +1,49 @@
 #include <arpa/inet.h>
+#include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <time.h>
 
+#include "arena.h"
+#include "balancer.h"
+#include "bufpool.h"
+#include "cache.h"
+#include "capture.h"
+#include "coro.h"
+#include "dircache.h"
+#include "h2.h"
+#include "diskio.h"
+#include "fcgipool.h"
+#include "footprint.h"
+#include "hotlist.h"
 #include "libhttp.h"
+#include "mime.h"
+#include "pack.h"
+#include "ratelimit.h"
+#include "router.h"
+#include "stats.h"
+#include "trace.h"
+#include "tune.h"
+#include "upload.h"
+#include "tw.h"
+#include "upgrade.h"
 #include "wq.h"
 
 /*
@@ -25,24 +53,886 @@
  * command line arguments (already implemented for you).
  */
 wq_t work_queue;
+wq_policy_t queue_policy = WQ_FIFO;
+int queue_aging_ms = 100;
 int num_threads;
 int server_port;
 char *server_files_directory;
+char *server_pack_file;
+pack_t server_pack;
 char *server_proxy_hostname;
 int server_proxy_port;
 pthread_t* thread_arr;
 time_t start_time;
+int sort_listings;
+int dircache_size = -1;           // -1 until tuned or defaulted.
+size_t dircache_max_listing = 256 * 1024;
+char *stats_path;
+
+/* Request tracing: one in trace_sample connections, 0 to disable. */
+int trace_sample;
+int trace_buffer = 1024;
+char *trace_path;
+char *trace_file;
+
+/* Binary log of served requests for httpreplay, see capture.h. */
+char *capture_file;
+
+/* Routes by host and path prefix, see router.h. The stats, trace and
+ * dynamic paths are routes too; requests no route matches go to the
+ * handler of the --files, --pack or --proxy mode. */
+char *routes_file;
+router_t router;
+
+/* Requests under the dynamic prefix go to a pool of FastCGI workers running
+ * the dynamic command, see fcgipool.h. */
+char *dynamic_prefix;
+char *dynamic_command;
+int dynamic_workers = 4;
+int dynamic_requests = 16;
+char *dynamic_socket_dir = "/tmp";
+
+/* Whether clients may speak HTTP/2 without TLS, see h2.h. */
+int h2c;
+
+/* Whether connections run as coroutines instead of on the worker threads,
+ * see coro.h. 0 schedulers means one per core. */
+int coroutines;
+int coroutine_schedulers;
+int coroutine_stack_kb = 128;
+void (*coroutine_handler)(int);
+
+/* Whether PUT and POST store their bodies under the files directory, see
+ * upload.h. A rate of 0 leaves uploads uncapped. */
+int uploads;
+int upload_max_mb = 1024;
+int upload_rate_kb;
+
+/* Extra extension-to-type mappings in mime.types format. */
+char *mime_types_file;
+
+/* Disk threads that read cold files for the workers, 0 to read inline. */
+int disk_threads = 4;
+int disk_queue = 256;
+
+/* Caching proxy mode, see cache.h: memory for responses in MB, 0 to relay
+ * bytes blindly, and an optional directory for bodies pushed out of it. */
+int proxy_cache_mb;
+char *proxy_cache_dir;
+int proxy_cache_disk_mb = 1024;
+int proxy_cache_object_mb = 16;
+
+/* Backends of the proxy and how to spread requests over them, see
+ * balancer.h. A health interval of 0 disables active checks and a failure
+ * count of 0 disables ejection. */
+char *proxy_backends;
+int server_proxy_pool;
+char *server_proxy_host;         // host:port sent as the Host header.
+int proxy_pools;                 // Balancer pools of the proxy and proxy routes.
+balancer_policy_t proxy_balance = BALANCER_LEAST_OUTSTANDING;
+char *proxy_health_path = "/";
+int proxy_health_interval = 5;
+int proxy_max_failures = 3;
+int proxy_eject_seconds = 30;
+int proxy_connect_timeout = 3;
+
+/* Size classes and memory cap of the pool of I/O buffers used for file
+ * sends and proxy relays, see bufpool.h. */
+size_t io_buffer_sizes[BUFPOOL_MAX_CLASSES] = { 16 << 10, 64 << 10, 256 << 10 };
+int num_io_buffer_sizes = 3;
+int io_buffer_memory_mb = 64;
+/* Connections waiting on a disk thread, guarded by work_queue.lock. */
+int parked_connections;
+
+/* Connection timeouts in seconds, 0 to disable. */
+int header_timeout = 10;
+int write_timeout = 30;
+int idle_timeout = 5;
+int proxy_timeout = 60;
+tw_t timer_wheel;
+
+/* Per-client connection rate limit, 0 to disable. */
+double rate_limit;
+double rate_burst;
+int rate_limit_clients = -1;
+int rate_limit_refuse;
+
+/* Startup sizing, see tune.h. Settings left at -1 are tuned with
+ * --auto-tune and get their defaults otherwise. New connections are turned
+ * away at fd_high_water, and reserve_fd is given up to accept them when
+ * accept runs out of fds anyway. */
+int auto_tune;
+int thread_stack_kb = -1;          // 0 for the system default.
+pthread_attr_t thread_attr;        // Worker and proxy relay threads.
+int fd_high_water = INT32_MAX;
+int reserve_fd = -1;
+
+/* Prefork mode: number of worker processes, 0 to serve from this process. */
+int num_workers;
+pid_t *worker_pids;
+time_t *worker_started;
+int is_worker_process;
+
+/* Zero-downtime upgrade on SIGUSR2, see upgrade.h. */
+#define HOTLIST_CAPACITY 4096
+char **server_argv;
+int preload_hot = 1000;
+
+/* Hot file list persisted across restarts and preloaded at startup. */
+char *hot_file;
+int hot_file_interval = 60;
+int preload_threads = 2;
+long long preload_budget;
+int preload_before_accept;
+volatile sig_atomic_t upgrade_requested;
+volatile sig_atomic_t draining;
+sigset_t control_signals;
+
+/* Seconds between memory footprint log lines, 0 for none. */
+int memory_log_interval;
+
+/*
+ * A connection timer. When it fires, the connection is shut down, which
+ * makes whatever read or write its thread is blocked in return.
+ */
+typedef struct conn_timer {
+  tw_timer_t timer;
+  int fd;
+  int peer_fd;                 // Other side of a proxied connection, or -1.
+  stat_counter_t counter;      // Counter charged when the timer fires.
+  int fired;
+} conn_timer_t;
+
+void conn_timer_expired(tw_timer_t *timer) {
+  conn_timer_t *conn_timer = (conn_timer_t *) timer;
+  stats_add(conn_timer->counter, 1);
+  conn_timer->fired = 1;
+  shutdown(conn_timer->fd, SHUT_RDWR);
+  if (conn_timer->peer_fd >= 0) shutdown(conn_timer->peer_fd, SHUT_RDWR);
+}
+
+void conn_timer_init(conn_timer_t *conn_timer, int fd, int peer_fd) {
+  tw_timer_init(&conn_timer->timer, conn_timer_expired);
+  conn_timer->fd = fd;
+  conn_timer->peer_fd = peer_fd;
+  conn_timer->counter = STAT_TIMEOUT_HEADER;
+  conn_timer->fired = 0;
+}
+
+/* (Re-)arms CONN_TIMER to fire after TIMEOUT seconds, charging COUNTER. */
+void conn_timer_arm(conn_timer_t *conn_timer, stat_counter_t counter, int timeout) {
+  if (conn_timer->counter != counter) {
+    tw_cancel(&timer_wheel, &conn_timer->timer);
+    conn_timer->counter = counter;
+  }
+  if (timeout > 0)
+    tw_add(&timer_wheel, &conn_timer->timer, timeout * 1000);
+  else
+    tw_cancel(&timer_wheel, &conn_timer->timer);
+}
+
+/* Serves one parsed request on a connection, clearing request->keep_alive
+ * if the connection can't be reused afterwards. Returns 1 if the connection
+ * was parked, after which the caller must not touch it. */
+typedef struct conn conn_t;
+typedef int (*request_server_t)(conn_t *conn, struct http_request *request);
+
+/* Puts a connection back on the work queue when it fires. */
+typedef struct conn_wake {
+  tw_timer_t timer;
+  conn_t *conn;
+} conn_wake_t;
+
+/* A PUT or POST being stored, kept in the request's arena while its
+ * connection is parked to stay under the upload rate. */
+typedef struct upload_job {
+  upload_t upload;
+  long long length;              // -1 if chunked.
+  int file_fd;
+  char *fullpath;
+  char *directory;
+  char *temp;                    // Name of the file while it has a temporary one.
+  const char *root;              // Directory served, for its listings.
+  int existed;
+  int keep_alive;
+} upload_job_t;
+
+/* Inline arena space per connection: enough for the request, its 8 KB read
+ * buffer and the handler's paths, so typical requests never call malloc. */
+#define CONN_ARENA_SIZE 16384
+
+/*
+ * A client connection. While a disk thread reads the file it is sending,
+ * or its upload waits for the rate to allow more, the connection is parked:
+ * no worker holds it, and whichever worker picks it up from the work queue
+ * next resumes it.
+ */
+struct conn {
+  int fd;
+  conn_timer_t timer;
+  request_server_t serve_request;
+  struct http_request *request;  // Request being answered while parked.
+  int file_fd;                   // File being sent, or -1.
+  off_t offset;
+  off_t remaining;
+  ssize_t buffered;              // Bytes of the file in io_buffer, -1 if none.
+  int yielded;                   // Requeued for cheaper work, not parked on the disk.
+  uint64_t yielded_since;        // When the file first yielded, or 0.
+  coro_t *coro;                  // Coroutine waiting for its disk read.
+  upload_job_t *upload;          // Upload being received, or NULL.
+  conn_wake_t wake;              // Resumes the upload when its rate allows.
+  char *io_buffer;               // Pool buffer for the file, or buffer.
+  size_t io_size;
+  trace_request_t trace;
+  uint64_t capture_id;           // 0 unless requests are being captured.
+  uint64_t parsed_at;            // When the current request was parsed.
+  arena_t arena;                 // Memory of the current request.
+  struct http_carry carry;       // Pipelined bytes read past it.
+  char buffer[MAX_FILE_SIZE];
+  char arena_space[CONN_ARENA_SIZE] __attribute__((aligned(ARENA_ALIGN)));
+};
+void conn_read_done(void *arg, ssize_t result, int error);
+void conn_read_woken(void *arg, ssize_t result, int error);
+void conn_woken(tw_timer_t *timer);
+int receive_upload(conn_t *conn, struct http_request *request);
+void serve_h2(conn_t *conn, struct http_request *upgraded);
+void serve_dynamic_request(conn_t *conn, struct http_request *request, const char *prefix);
+int serve_route(conn_t *conn, struct http_request *request, route_t *route);
 
 /* Forward declearion */
 typedef struct fd_pair {
   int from;
   int to;
+  conn_timer_t *timer;
+  trace_request_t *trace;      // Stamped with the first byte to the client.
+  size_t relayed;              // Set when the thread ends.
+  int failed;                  // Whether it ended on an error.
 } fd_pair;
 void* proxy_child_thread_work(void* arg);
+void proxy_child_coroutine(void *arg);
+
+/*
+ * Sends a small html response whose length is known, keeping the connection
+ * open if the client asked for it. Only the headers go out for HEAD.
+ */
+void send_html_response(int fd, struct http_request *request, int status_code, char *body) {
+  char length[32];
+  snprintf(length, sizeof(length), "%zu", strlen(body));
+  http_start_response(fd, status_code);
+  http_send_header(fd, "Content-Type", "text/html");
+  http_send_header(fd, "Content-Length", length);
+  http_send_header(fd, "Connection", request->keep_alive ? "keep-alive" : "close");
+  http_end_headers(fd);
+  if (strcmp(request->method, "HEAD") != 0) http_send_string(fd, body);
+}
+
+/* Sends a directory listing, streaming it if it is too large to cache. */
+void serve_directory(int fd, struct http_request *request, struct stat *s, char *root) {
+  printf("Serving directory '%s':\n", request->path);
+  dircache_entry_t *entry = dircache_get(root, request->path, s);
+  if (entry == NULL) {
+    send_html_response(fd, request, 403, "<center><h1>403 Forbidden</h1><hr></center>");
+    return;
+  }
+
+  if (entry->oversized) {
+    struct http_stream stream;
+    http_stream_begin(&stream, fd, request, 200);
+    http_send_header(fd, "Content-Type", "text/html");
+    http_end_headers(fd);
+    http_stream_list_files(&stream, root, request->path, dircache_sorted());
+    http_stream_end(&stream);
+    if (stream.error) request->keep_alive = 0;
+  } else {
+    char length[32];
+    snprintf(length, sizeof(length), "%zu", entry->listing.size);
+    http_start_response(fd, 200);
+    http_send_header(fd, "Content-Type", "text/html");
+    http_send_header(fd, "Content-Length", length);
+    http_send_header(fd, "Connection", request->keep_alive ? "keep-alive" : "close");
+    http_end_headers(fd);
+    if (strcmp(request->method, "HEAD") != 0)
+      http_send_data(fd, entry->listing.data, entry->listing.size);
+  }
+  dircache_release(entry);
+}
+
+/* Parks CONN until a disk thread has read the next chunk of its file, or
+ * reads it right here if the disk threads are all busy. Returns 1 if the
+ * connection was parked. */
+int read_file_from_disk(conn_t *conn, struct http_request *request) {
+  /* Waiting on our own disk is not the client's fault. */
+  conn_timer_arm(&conn->timer, STAT_TIMEOUT_WRITE, 0);
+  trace_park(&conn->trace);
+  /* A coroutine waits for the read itself, as that only holds up its own
+   * connection. */
+  conn->coro = coro_self();
+  if (conn->coro) {
+    if (diskio_submit(conn->file_fd, conn->io_buffer, conn->io_size, conn->offset,
+          conn_read_woken, conn) == 0) {
+      stats_add(STAT_DISK_READS, 1);
+      coro_suspend();
+      trace_resume(&conn->trace);
+      return 0;
+    }
+  } else {
+    conn->request = request;
+    pthread_mutex_lock(&work_queue.lock);
+    parked_connections++;
+    pthread_mutex_unlock(&work_queue.lock);
+    if (diskio_submit(conn->file_fd, conn->io_buffer, conn->io_size, conn->offset,
+          conn_read_done, conn) == 0) {
+      stats_add(STAT_DISK_READS, 1);
+      return 1;
+    }
+    pthread_mutex_lock(&work_queue.lock);
+    parked_connections--;
+    pthread_mutex_unlock(&work_queue.lock);
+    conn->request = NULL;
+  }
+  ssize_t n;
+  while ((n = pread(conn->file_fd, conn->io_buffer, conn->io_size, conn->offset)) < 0 &&
+      errno == EINTR);
+  conn->buffered = n < 0 ? 0 : n;
+  return 0;
+}
+
+/* Under the SJF queue policy, puts CONN back on the work queue if cheaper
+ * work is waiting, so a large file doesn't hold a worker while small ones
+ * queue up. It keeps the time it first yielded at, so it ages like any
+ * other waiting item and is eventually served ahead of new small work.
+ * Returns 1 if it was requeued. */
+int yield_to_cheaper(conn_t *conn, struct http_request *request) {
+  wq_class_t class = wq_class_for_cost(conn->remaining);
+  /* The size is only a hint here; it is checked again under the lock. */
+  if (work_queue.policy != WQ_SJF || class == WQ_SMALL || work_queue.size == 0) return 0;
+  uint64_t since = conn->yielded_since ? conn->yielded_since : wq_now();
+  /* Stopped outside the queue lock, which timer callbacks take inside the
+   * wheel's; the next send arms it again if this doesn't yield. */
+  conn_timer_arm(&conn->timer, STAT_TIMEOUT_WRITE, 0);
+  pthread_mutex_lock(&work_queue.lock);
+  int yield = wq_has_cheaper(&work_queue, class, since);
+  if (yield) {
+    conn->request = request;
+    conn->yielded = 1;
+    conn->yielded_since = since;
+    wq_push_at(&work_queue, conn->fd, conn, class, since);
+    pthread_cond_signal(&work_queue.cv);
+  }
+  pthread_mutex_unlock(&work_queue.lock);
+  return yield;
+}
+
+/* Sends the rest of the file CONN is serving. Data in the page cache is
+ * sent straight away; the connection is parked whenever the next chunk has
+ * to come from the disk, and may yield to cheaper work after each chunk.
+ * Returns 1 if it was parked or yielded. */
+int send_file_body(conn_t *conn, struct http_request *request) {
+  while (conn->remaining > 0) {
+    if (conn->buffered < 0) {
+      ssize_t n = diskio_read_cached(conn->file_fd, conn->io_buffer, conn->io_size, conn->offset);
+      if (n < 0 && errno == EAGAIN) {
+        if (read_file_from_disk(conn, request)) return 1;
+      } else {
+        conn->buffered = n < 0 ? 0 : n;
+      }
+    }
+    ssize_t n = conn->buffered;
+    conn->buffered = -1;
+    if (n <= 0) break;
+    if (n > conn->remaining) n = conn->remaining;
+    /* The write timeout bounds each stall, not the whole transfer. */
+    conn_timer_arm(&conn->timer, STAT_TIMEOUT_WRITE, write_timeout);
+    if (http_send_data(conn->fd, conn->io_buffer, n) < 0) break;
+    conn->offset += n;
+    conn->remaining -= n;
+    /* Only after a chunk, so each turn on a worker gets something sent. */
+    if (conn->remaining > 0 && yield_to_cheaper(conn, request)) return 1;
+  }
+  /* The file shrank underneath us, so the promised length can't be met. */
+  if (conn->remaining > 0) request->keep_alive = 0;
+  close(conn->file_fd);
+  conn->file_fd = -1;
+  if (conn->io_buffer != conn->buffer) bufpool_put(conn->io_buffer, conn->io_size);
+  conn->io_buffer = NULL;
+  return 0;
+}
+
+/* Sends the regular file at fullpath, which has been stat'ed into S.
+ * Returns 1 if the connection was parked. */
+int serve_file(conn_t *conn, struct http_request *request, char *fullpath, struct stat *s) {
+  int fin = open(fullpath, O_RDONLY);
+  if (fin < 0) {
+    send_html_response(conn->fd, request, 403, "<center><h1>403 Forbidden</h1><hr></center>");
+    return 0;
+  }
+
+  printf("Serving file '%s':\n", request->path);
+  /* Built in one piece, so the headers leave in a single segment. */
+  const mime_type_t *mime = mime_lookup(fullpath);
+  char headers[MIME_HEADER_MAX + 96];
+  memcpy(headers, mime->header, mime->header_size);
+  int size = mime->header_size;
+  size += snprintf(headers + size, sizeof(headers) - size,
+      "Content-Length: %lld\r\nConnection: %s\r\n", (long long) s->st_size,
+      request->keep_alive ? "keep-alive" : "close");
+  http_send_response_headers(conn->fd, 200, headers, size);
+  if (strcmp(request->method, "HEAD") == 0) {
+    close(fin);
+    return 0;
+  }
+
+  diskio_advise_sequential(fin);
+  conn->file_fd = fin;
+  conn->offset = 0;
+  conn->remaining = s->st_size;
+  conn->yielded_since = 0;
+  conn->buffered = -1;
+  /* Small files fit the connection's own buffer. For larger ones, borrow a
+   * pool buffer if one is free, and otherwise send in small chunks rather
+   * than hold up the worker. */
+  conn->io_buffer = NULL;
+  if (s->st_size > MAX_FILE_SIZE)
+    conn->io_buffer = bufpool_get(s->st_size, &conn->io_size, 0);
+  if (!conn->io_buffer) {
+    conn->io_buffer = conn->buffer;
+    conn->io_size = MAX_FILE_SIZE;
+  }
+  return send_file_body(conn, request);
+}
+
+/* Appends the memory footprint of this process, as "memory_<field>_kb"
+ * lines each followed by its "_peak_kb" high-water mark. */
+void format_footprint(struct http_buffer *buffer) {
+  footprint_t footprint, peak;
+  if (footprint_sample(0, &footprint) < 0) return;
+  footprint_peak(&peak);
+  for (int i = 0; i < FOOTPRINT_NUM_FIELDS; i++) {
+    http_buffer_printf(buffer, "memory_%s_kb %zu\n", footprint_names[i], footprint.kb[i]);
+    if (i != FOOTPRINT_RSS_HWM)
+      http_buffer_printf(buffer, "memory_%s_peak_kb %zu\n", footprint_names[i], peak.kb[i]);
+  }
+  http_buffer_printf(buffer, "memory_threads %d\nmemory_threads_peak %d\n",
+      footprint.threads, peak.threads);
+  http_buffer_printf(buffer, "memory_stack_mappings %d\nmemory_stack_mappings_peak %d\n",
+      footprint.stacks, peak.stacks);
+  for (int i = 0; i < footprint.num_caches; i++)
+    http_buffer_printf(buffer, "memory_cache_%s_kb %zu\nmemory_cache_%s_peak_kb %zu\n",
+        footprint.cache_names[i], footprint.cache_kb[i],
+        footprint.cache_names[i], peak.cache_kb[i]);
+}
+
+/* Logs a line of this process's memory footprint every INTERVAL seconds. */
+void *memory_log_work(void *arg) {
+  int interval = (intptr_t) arg;
+  while (1) {
+    sleep(interval);
+    footprint_t footprint, peak;
+    if (footprint_sample(0, &footprint) < 0) continue;
+    footprint_peak(&peak);
+    struct http_buffer line;
+    http_buffer_init(&line);
+    http_buffer_printf(&line, "Memory of %d: rss %zu KB (peak %zu KB), heap %zu KB, "
+        "stacks %zu KB in %d for %d threads, files %zu KB, anon %zu KB", (int) getpid(),
+        footprint.kb[FOOTPRINT_RSS], footprint.kb[FOOTPRINT_RSS_HWM],
+        footprint.kb[FOOTPRINT_HEAP], footprint.kb[FOOTPRINT_STACKS], footprint.stacks,
+        footprint.threads, footprint.kb[FOOTPRINT_FILES], footprint.kb[FOOTPRINT_ANON]);
+    for (int i = 0; i < footprint.num_caches; i++)
+      http_buffer_printf(&line, ", %s %zu KB (peak %zu KB)", footprint.cache_names[i],
+          footprint.cache_kb[i], peak.cache_kb[i]);
+    printf("%.*s\n", (int) line.size, line.data);
+    http_buffer_free(&line);
+  }
+  return NULL;
+}
+
+/* Sends the server counters as plain text. */
+void serve_stats(int fd, struct http_request *request) {
+  struct http_buffer buffer;
+  http_buffer_init(&buffer);
+  stats_format(&buffer);
+  format_footprint(&buffer);
+  if (proxy_pools > 0) balancer_format(&buffer);
+  if (dynamic_command) fcgipool_format(&buffer);
+  if (coroutines) coro_format(&buffer);
+
+  struct http_stream stream;
+  http_stream_begin(&stream, fd, request, 200);
+  http_send_header(fd, "Content-Type", "text/plain");
+  http_end_headers(fd);
+  http_stream_write(&stream, buffer.data, buffer.size);
+  http_stream_end(&stream);
+  if (stream.error) request->keep_alive = 0;
+  http_buffer_free(&buffer);
+}
+
+/* Sends the traced requests of this process as Chrome trace JSON. */
+void serve_trace(int fd, struct http_request *request) {
+  struct http_buffer buffer;
+  http_buffer_init(&buffer);
+  trace_format(&buffer);
+
+  struct http_stream stream;
+  http_stream_begin(&stream, fd, request, 200);
+  http_send_header(fd, "Content-Type", "application/json");
+  http_end_headers(fd);
+  http_stream_write(&stream, buffer.data, buffer.size);
+  http_stream_end(&stream);
+  if (stream.error) request->keep_alive = 0;
+  http_buffer_free(&buffer);
+}
+
+conn_t *conn_new(int fd, request_server_t serve_request) {
+  conn_t *conn = malloc(sizeof(conn_t));
+  if (!conn) return NULL;
+  conn->fd = fd;
+  conn_timer_init(&conn->timer, fd, -1);
+  conn_timer_arm(&conn->timer, STAT_TIMEOUT_HEADER, header_timeout);
+  conn->serve_request = serve_request;
+  conn->request = NULL;
+  conn->file_fd = -1;
+  conn->buffered = -1;
+  conn->yielded = 0;
+  conn->coro = NULL;
+  conn->upload = NULL;
+  tw_timer_init(&conn->wake.timer, conn_woken);
+  conn->wake.conn = conn;
+  conn->io_buffer = NULL;
+  arena_init(&conn->arena, conn->arena_space, sizeof(conn->arena_space));
+  conn->carry.data = NULL;
+  conn->carry.size = 0;
+  trace_begin(&conn->trace, fd);
+  conn->capture_id = capture_connection(fd);
+  stats_add(STAT_CONNECTIONS, 1);
+  return conn;
+}
+
+void conn_close(conn_t *conn) {
+  tw_cancel(&timer_wheel, &conn->timer.timer);
+  capture_close(conn->fd);
+  close(conn->fd);
+  arena_free(&conn->arena);
+  http_carry_free(&conn->carry);
+  free(conn);
+}
+
+/* Largest unread request body dropped to keep a connection; larger ones,
+ * and those of unknown length, close it. */
+#define DISCARD_BODY_MAX (64 * 1024)
+
+/* Reads and drops what the handler left of REQUEST's body on the socket,
+ * so that none of it is taken for the next request. Returns -1 if the
+ * connection can't be reused. */
+int conn_discard_body(conn_t *conn, struct http_request *request) {
+  if (request->body_unread < 0 || request->body_unread > DISCARD_BODY_MAX) return -1;
+  conn_timer_arm(&conn->timer, STAT_TIMEOUT_HEADER, header_timeout);
+  while (request->body_unread > 0) {
+    ssize_t n = coro_read(conn->fd, conn->buffer, request->body_unread < MAX_FILE_SIZE ?
+        request->body_unread : MAX_FILE_SIZE);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    request->body_unread -= n;
+    capture_body(conn->fd, conn->buffer, n);
+  }
+  return 0;
+}
+
+/* Wraps up a request that has been answered. Returns 1 if the connection
+ * stays open for the next one. */
+int conn_finish_request(conn_t *conn, struct http_request *request) {
+  static int served = 0;
+  time_t t;
+  time(&t);
+  printf("Finish serving. Total served: %i. Time: %lf\n",
+      __sync_add_and_fetch(&served, 1), difftime(t, start_time));
+  if (request->keep_alive && request->body_unread != 0 && conn_discard_body(conn, request) < 0)
+    request->keep_alive = 0;
+  int keep_alive = request->keep_alive;
+  trace_end(&conn->trace);
+  capture_request(conn->capture_id, conn->fd, request, conn->parsed_at);
+  http_request_free(request);
+  arena_reset(&conn->arena);
+  /* Only idle time counts against the next request. */
+  if (keep_alive) conn_timer_arm(&conn->timer, STAT_TIMEOUT_IDLE, idle_timeout);
+  return keep_alive;
+}
+
+/*
+ * Reads HTTP requests from conn and answers each with the route it matches,
+ * or with its serve_request if it matches none. The connection is kept
+ * open for further requests while the client asks for keep-alive. Clients
+ * that are too slow to send a request or to read the response are
+ * disconnected. Returns early, leaving the connection open, if it is parked
+ * waiting for the disk; resume_connection carries on from there.
+ */
+void serve_connection(conn_t *conn) {
+  struct http_request *request;
+  trace_set_current(&conn->trace);
+  while ((request = http_request_parse_carry(conn->fd, &conn->arena, &conn->carry)) != NULL) {
+    if (h2c && h2_upgrade_requested(request)) {
+      serve_h2(conn, request);
+      return;
+    }
+    trace_parsed(&conn->trace, request);
+    if (conn->capture_id) conn->parsed_at = trace_now();
+    stats_add(STAT_REQUESTS, 1);
+    /* Let clients move to the new process during an upgrade. */
+    if (draining) request->keep_alive = 0;
+    conn_timer_arm(&conn->timer, STAT_TIMEOUT_WRITE, write_timeout);
+    route_t *route = router_match(&router, http_request_header(request, "Host"), request->path);
+    if (route ? serve_route(conn, request, route) : conn->serve_request(conn, request))
+      return;
+    if (!conn_finish_request(conn, request)) break;
+  }
+  conn_close(conn);
+}
+
+/* Called on a disk thread once the read for a parked connection is done.
+ * Queues the connection for the next free worker. */
+void conn_read_done(void *arg, ssize_t result, int error) {
+  conn_t *conn = arg;
+  conn->buffered = result < 0 ? 0 : result;
+  pthread_mutex_lock(&work_queue.lock);
+  parked_connections--;
+  wq_push_class(&work_queue, conn->fd, conn, wq_class_for_cost(conn->remaining));
+  pthread_cond_signal(&work_queue.cv);
+  pthread_mutex_unlock(&work_queue.lock);
+}
+
+/* Called on the timer wheel's thread once a parked upload may read more. */
+void conn_woken(tw_timer_t *timer) {
+  conn_t *conn = ((conn_wake_t *) timer)->conn;
+  pthread_mutex_lock(&work_queue.lock);
+  parked_connections--;
+  wq_push_class(&work_queue, conn->fd, conn, WQ_SMALL);
+  pthread_cond_signal(&work_queue.cv);
+  pthread_mutex_unlock(&work_queue.lock);
+}
+
+/* Called on a disk thread once the read a coroutine waits for is done. */
+void conn_read_woken(void *arg, ssize_t result, int error) {
+  conn_t *conn = arg;
+  conn->buffered = result < 0 ? 0 : result;
+  coro_wake(conn->coro);
+}
+
+/* Carries on with a connection whose disk read has completed, whose upload
+ * may go on, or which yielded to cheaper work. */
+void resume_connection(conn_t *conn) {
+  struct http_request *request = conn->request;
+  conn->request = NULL;
+  trace_set_current(&conn->trace);
+  if (conn->yielded)
+    conn->yielded = 0;
+  else
+    trace_resume(&conn->trace);
+  if (conn->upload) {
+    if (receive_upload(conn, request)) return;
+  } else if (send_file_body(conn, request)) {
+    return;
+  }
+  if (conn_finish_request(conn, request))
+    serve_connection(conn);
+  else
+    conn_close(conn);
+}
+
+/* Serves a new connection on fd with SERVE_REQUEST. */
+void handle_connection(int fd, request_server_t serve_request) {
+  conn_t *conn = conn_new(fd, serve_request);
+  if (!conn) {
+    close(fd);
+    return;
+  }
+  /* The header timeout is armed, so a client that sends nothing still
+   * can't hold the peek forever. */
+  if (h2c && h2_preface_pending(fd)) {
+    serve_h2(conn, NULL);
+    return;
+  }
+  serve_connection(conn);
+}
+
+/* Serves one HTTP/2 stream, whose end of a socketpair looks like a new
+ * connection to the HTTP/1 code. */
+void serve_h2_stream(int fd, void *arg) {
+  conn_t *conn = arg;
+  handle_connection(fd, conn->serve_request);
+  trace_set_current(NULL);
+}
+
+/* Serves conn over HTTP/2, answering UPGRADED first if it asked to switch.
+ * The HTTP/2 loop keeps its own timeouts, so the connection's timer is
+ * stopped for good. */
+void serve_h2(conn_t *conn, struct http_request *upgraded) {
+  tw_cancel(&timer_wheel, &conn->timer.timer);
+  h2_serve(conn->fd, upgraded, serve_h2_stream, conn, idle_timeout, write_timeout);
+  conn_close(conn);
+}
+
+/* Called while an upload waits on its client: a client that keeps sending
+ * keeps its connection. */
+void upload_progress(void *arg) {
+  conn_t *conn = arg;
+  conn_timer_arm(&conn->timer, STAT_TIMEOUT_HEADER, header_timeout);
+}
+
+/* Returns 1 if PATH has a ".." segment. */
+int has_parent_segment(const char *path) {
+  for (const char *dots = path; (dots = strstr(dots, "..")); dots += 2)
+    if ((dots == path || dots[-1] == '/') && (dots[2] == '\0' || dots[2] == '/')) return 1;
+  return 0;
+}
+
+/*
+ * Stores the body of a PUT or POST as the file at request->path under ROOT.
+ * The body goes to an unnamed file in the same directory, which is synced
+ * and only then named and renamed over the target, so readers see either
+ * the old file or the new one and never part of either.
+ */
+int serve_upload(conn_t *conn, struct http_request *request, const char *root) {
+  int fd = conn->fd;
+  char *content_length = http_request_header(request, "Content-Length");
+  char *transfer_encoding = http_request_header(request, "Transfer-Encoding");
+  int chunked = transfer_encoding && http_has_token(transfer_encoding, "chunked");
+  long long length = content_length ? atoll(content_length) : -1;
+  long long max_size = (long long) upload_max_mb << 20;
+  size_t path_length = strlen(request->path);
+
+  /* Refusals leave the body unread, so the connection can't be reused. */
+  int keep_alive = request->keep_alive;
+  request->keep_alive = 0;
+  if (!chunked && length < 0) {
+    send_html_response(fd, request, 411, "<center><h1>411 Length Required</h1><hr></center>");
+    return 0;
+  }
+  if (request->path[0] != '/' || request->path[path_length - 1] == '/' ||
+      has_parent_segment(request->path)) {
+    send_html_response(fd, request, 403, "<center><h1>403 Forbidden</h1><hr></center>");
+    return 0;
+  }
+  if (length > max_size) {
+    send_html_response(fd, request, 413,
+        "<center><h1>413 Payload Too Large</h1><hr></center>");
+    return 0;
+  }
+  /* The separator keeps "PUT x" from naming a sibling of the root, and
+   * gives the directory below a '/' to end at. */
+  char *fullpath = arena_alloc(&conn->arena, MAX_PATH);
+  snprintf(fullpath, MAX_PATH, "%s/%s", root, request->path + 1);
+  char *directory = arena_alloc(&conn->arena, MAX_PATH);
+  snprintf(directory, MAX_PATH, "%.*s", (int) (strrchr(fullpath, '/') - fullpath), fullpath);
+  struct stat s;
+  int existed = stat(fullpath, &s) == 0;
+  if ((existed && !S_ISREG(s.st_mode)) || stat(directory, &s) != 0 || !S_ISDIR(s.st_mode)) {
+    send_html_response(fd, request, 409, "<center><h1>409 Conflict</h1><hr></center>");
+    return 0;
+  }
+  upload_job_t *job = arena_alloc(&conn->arena, sizeof(upload_job_t));
+  job->temp = arena_alloc(&conn->arena, MAX_PATH);
+  int file_fd = upload_open_file(directory, job->temp, MAX_PATH);
+  if (file_fd < 0) {
+    perror("Failed to create upload");
+    send_html_response(fd, request, 500,
+        "<center><h1>500 Internal Server Error</h1><hr></center>");
+    return 0;
+  }
+
+  char *expect = http_request_header(request, "Expect");
+  if (request->version >= 11 && expect && strcasecmp(expect, "100-continue") == 0)
+    http_send_data(fd, "HTTP/1.1 100 Continue\r\n\r\n", 25);
+  job->length = chunked ? -1 : length;
+  job->file_fd = file_fd;
+  job->fullpath = fullpath;
+  job->directory = directory;
+  job->root = root;
+  job->existed = existed;
+  job->keep_alive = keep_alive;
+  upload_init(&job->upload, fd, request->body, request->body_size, file_fd, max_size,
+      upload_rate_kb * 1024L, upload_progress, conn);
+  if (conn->capture_id) upload_tap(&job->upload, capture_body);
+  conn->upload = job;
+  return receive_upload(conn, request);
+}
+
+/* Receives the rest of CONN's upload and stores it. Rather than wait on a
+ * worker thread for the upload rate, the connection is parked on the timer
+ * wheel until the rate allows more. Returns 1 if it was parked. */
+int receive_upload(conn_t *conn, struct http_request *request) {
+  upload_job_t *job = conn->upload;
+  int fd = conn->fd;
+  int park = num_threads > 0 && !coro_self();
+  int result = upload_receive(&job->upload, job->length, park);
+  if (result > 0) {
+    conn->request = request;
+    trace_park(&conn->trace);
+    pthread_mutex_lock(&work_queue.lock);
+    parked_connections++;
+    pthread_mutex_unlock(&work_queue.lock);
+    tw_add(&timer_wheel, &conn->wake.timer, job->upload.wait_ms);
+    return 1;
+  }
+  conn->upload = NULL;
+  upload_t *upload = &job->upload;
+  upload_free(upload);
+  if (result == 0) {
+    request->body_unread = 0;
+    /* What came after a chunked body with it is the next request. */
+    if (upload->buffered_size > 0) {
+      request->body_size -= upload->buffered_size;
+      conn->carry.data = malloc(upload->buffered_size);
+      if (!conn->carry.data) {
+        perror("Failed to keep pipelined request");
+        job->keep_alive = 0;
+      } else {
+        memcpy(conn->carry.data, upload->buffered, upload->buffered_size);
+        conn->carry.size = upload->buffered_size;
+      }
+    }
+  }
+  conn_timer_arm(&conn->timer, STAT_TIMEOUT_WRITE, write_timeout);
+  if (result == 0 && (fchmod(job->file_fd, 0644) < 0 || fsync(job->file_fd) < 0 ||
+      upload_commit_file(job->file_fd, job->directory, job->temp, MAX_PATH,
+          job->fullpath) < 0)) {
+    result = -1;
+    upload->error = UPLOAD_FILE_FAILED;
+  }
+  close(job->file_fd);
+
+  if (result < 0) {
+    if (job->temp[0]) unlink(job->temp);
+    if (upload->error == UPLOAD_FILE_FAILED) perror("Failed to store upload");
+    if (upload->error == UPLOAD_MALFORMED)
+      send_html_response(fd, request, 400, "<center><h1>400 Bad Request</h1><hr></center>");
+    else if (upload->error == UPLOAD_TOO_LARGE)
+      send_html_response(fd, request, 413,
+          "<center><h1>413 Payload Too Large</h1><hr></center>");
+    else if (upload->error == UPLOAD_FILE_FAILED)
+      send_html_response(fd, request, 500,
+          "<center><h1>500 Internal Server Error</h1><hr></center>");
+    return 0;
+  }
+  /* The rename itself is only durable once the directory is synced. */
+  int directory_fd = open(job->directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (directory_fd >= 0) {
+    fsync(directory_fd);
+    close(directory_fd);
+  }
+  char *parent = arena_alloc(&conn->arena, MAX_PATH);
+  size_t parent_length = strrchr(request->path, '/') - request->path;
+  snprintf(parent, MAX_PATH, "%.*s", (int) (parent_length ? parent_length : 1), request->path);
+  dircache_invalidate(job->root, parent);
+  stats_add(STAT_UPLOADS, 1);
+  stats_add(STAT_UPLOAD_BYTES, upload->received);
+
+  request->keep_alive = job->keep_alive;
+  send_html_response(fd, request, job->existed ? 200 : 201, job->existed ?
+      "<center><h1>Updated</h1><hr></center>" : "<center><h1>Created</h1><hr></center>");
+  return 0;
+}
 
 /*
- * Reads an HTTP request from stream (fd), and writes an HTTP response
- * containing:
+ * Writes an HTTP response to a request for a path under ROOT, containing:
  *
  *   1) If user requested an existing file, respond with the file
  *   2) If user requested a directory and index.html exists in the directory,
@@ -51,64 +941,83 @@ void* proxy_child_thread_work(void* arg);
  *      of files in the directory with links to each.
  *   4) Send a 404 Not Found response.
  */
-void handle_files_request(int fd) {
-
-  /*
-   * TODO: Your solution for Task 1 goes here! Feel free to delete/modify *
-   * any existing code.
-   */
-  static int served = 0;
-  struct http_request *request = http_request_parse(fd);
-  if (request == NULL) {
-    close(fd);
-    return;
-  }
+int serve_files(conn_t *conn, struct http_request *request, char *root) {
+  if (uploads && (strcmp(request->method, "PUT") == 0 || strcmp(request->method, "POST") == 0))
+    return serve_upload(conn, request, root);
   struct stat s;
-  char fullpath[MAX_PATH];
-  strcpy(fullpath, server_files_directory);
-  strcat(fullpath, request->path);
-  if (stat(fullpath, &s) != 0) {
+  char *fullpath = arena_alloc(&conn->arena, MAX_PATH);
+  snprintf(fullpath, MAX_PATH, "%s%s", root, request->path);
+  if (stat(fullpath, &s) != 0 || !(S_ISDIR(s.st_mode) || S_ISREG(s.st_mode))) {
     printf("file not found\n");
-    http_start_response(fd, 404);
-    http_send_header(fd, "Content-Type", "text/html");
-    http_end_headers(fd);
-    http_send_string(fd,
+    send_html_response(conn->fd, request, 404,
         "<center>"
         "<h1>FILE NOT FOUND!</h1>"
         "<hr>"
         "<p>Nothing's here yet.</p>"
         "</center>");
-    close(fd);
-    http_request_free(request);
-    return;
+  } else if (S_ISDIR(s.st_mode)) {
+    serve_directory(conn->fd, request, &s, root);
+  } else {
+    /* The hot list is preloaded from the files directory only. */
+    if (root == server_files_directory) hotlist_record(request->path, s.st_size, 1);
+    return serve_file(conn, request, fullpath, &s);
   }
+  return 0;
+}
 
-  if (S_ISDIR(s.st_mode)) {
-    printf("Serving directory '%s':\n", request->path);
-    http_start_response(fd, 200);
-    http_send_header(fd, "Content-Type", "text/html");
-    http_end_headers(fd);
+int serve_files_request(conn_t *conn, struct http_request *request) {
+  return serve_files(conn, request, server_files_directory);
+}
 
-    char content[MAX_FILE_SIZE];
-    size_t n = http_get_list_files(server_files_directory, request->path, content, MAX_FILE_SIZE);
-    http_send_data(fd, content, n);
-  } else if (S_ISREG(s.st_mode)) {
-    printf("Serving file '%s':\n", request->path);
-    http_start_response(fd, 200);
-    http_send_header(fd, "Content-Type", http_get_mime_type(fullpath));
-    http_end_headers(fd);
+void handle_files_request(int fd) {
+  handle_connection(fd, serve_files_request);
+}
 
-    char content[MAX_FILE_SIZE];
-    int fin = open(fullpath, O_RDONLY);
-    size_t n = read(fin, content, MAX_FILE_SIZE);
-    close(fin);
-    http_send_data(fd, content, n);
+/*
+ * Answers requests from the pack mapped by pack_open: one index lookup and
+ * one writev of the precomputed headers and the mapped body, without
+ * touching the filesystem.
+ */
+int serve_pack_request(conn_t *conn, struct http_request *request) {
+  int fd = conn->fd;
+  pack_entry_t *entry = pack_lookup_request(&server_pack, request->path);
+  if (entry == NULL) {
+    send_html_response(fd, request, 404,
+        "<center><h1>FILE NOT FOUND!</h1><hr></center>");
+    return 0;
   }
-  time_t t;
-  time(&t);
-  printf("Finish serving. Total served: %i. Time: %lf\n", ++served, difftime(t, start_time));
-  close(fd);
-  http_request_free(request);
+
+  char *accept_encoding = http_request_header(request, "Accept-Encoding");
+  int gzip = entry->gzip.body_size > 0 && accept_encoding && strstr(accept_encoding, "gzip");
+  pack_variant_t *variant = gzip ? &entry->gzip : &entry->identity;
+
+  char *if_none_match = http_request_header(request, "If-None-Match");
+  if (if_none_match && pack_etag_matches(entry, gzip, if_none_match)) {
+    char etag[PACK_ETAG_SIZE];
+    pack_etag(entry, gzip, etag, sizeof(etag));
+    http_start_response(fd, 304);
+    http_send_header(fd, "ETag", etag);
+    if (entry->gzip.body_size > 0) http_send_header(fd, "Vary", "Accept-Encoding");
+    http_send_header(fd, "Connection", request->keep_alive ? "keep-alive" : "close");
+    http_end_headers(fd);
+    return 0;
+  }
+
+  char *connection = request->keep_alive ?
+      "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+  struct iovec iov[3] = {
+    { .iov_base = server_pack.map + variant->header_offset, .iov_len = variant->header_size },
+    { .iov_base = connection, .iov_len = strlen(connection) },
+    { .iov_base = server_pack.map + variant->body_offset, .iov_len = variant->body_size },
+  };
+  int iovcnt = strcmp(request->method, "HEAD") == 0 ? 2 : 3;
+  trace_response_started(fd, 200);
+  if (http_send_iovec(fd, iov, iovcnt) < 0) request->keep_alive = 0;
+  return 0;
+}
+
+void handle_pack_request(int fd) {
+  handle_connection(fd, serve_pack_request);
 }
 
 
@@ -124,84 +1033,787 @@ void handle_files_request(int fd) {
  *   +--------+     +------------+     +--------------+
  */
 void handle_proxy_request(int client_socket_fd) {
+  trace_request_t trace;
+  trace_begin(&trace, client_socket_fd);
+  trace_set_current(&trace);
+
+  /* Backends were resolved at startup, see balancer.h. */
+  balancer_backend_t *backend;
+  int server_socket_fd = balancer_connect(server_proxy_pool, &backend);
+
+  if (server_socket_fd < 0) {
+    /* Dummy request parsing, just to be compliant. */
+    struct http_request *request = http_request_parse(client_socket_fd);
+    if (request) http_request_free(request);
+
+    http_start_response(client_socket_fd, 502);
+    http_send_header(client_socket_fd, "Content-Type", "text/html");
+    http_end_headers(client_socket_fd);
+    http_send_string(client_socket_fd, "<center><h1>502 Bad Gateway</h1><hr></center>");
+    trace_end(&trace);
+    close(client_socket_fd);
+    return;
+
+  }
+
+  trace_mark(&trace, TRACE_UPSTREAM);
+  /* Threading pooling is not implemented */
+  /* TODO: implement threading pooling */
+  /* Both directions share one idle timer, re-armed by any traffic. */
+  conn_timer_t timer;
+  conn_timer_init(&timer, client_socket_fd, server_socket_fd);
+  conn_timer_arm(&timer, STAT_TIMEOUT_PROXY, proxy_timeout);
+  fd_pair to_server = { .from = client_socket_fd, .to = server_socket_fd, .timer = &timer };
+  fd_pair to_client = { .from = server_socket_fd, .to = client_socket_fd, .timer = &timer,
+      .trace = &trace };
+  if (coro_self()) {
+    /* The client->server direction runs beside this coroutine. */
+    coro_t *to_server_coro = coro_spawn_joinable(proxy_child_coroutine, &to_server);
+    proxy_child_thread_work(&to_client);
+    coro_join(to_server_coro);
+  } else {
+    /* Create a child thread for client->server connection */
+    pthread_t thread_sc;
+    pthread_create(&thread_sc, &thread_attr, proxy_child_thread_work, &to_server);
+    /* Create a child thread for server->client connection */
+    pthread_t thread_cs;
+    pthread_create(&thread_cs, &thread_attr, proxy_child_thread_work, &to_client);
+    /* Wait for child thread to finish */
+    pthread_join(thread_cs, NULL);
+    pthread_join(thread_sc, NULL);
+  }
+  trace_end(&trace);
+  /* The timer must be stopped before the fds can be reused. */
+  tw_cancel(&timer_wheel, &timer.timer);
+  /* A backend that timed out or broke off without answering at all counts
+   * against it; anything it did send means it is up. */
+  balancer_done(backend, to_client.relayed > 0 || (!timer.fired && !to_client.failed));
+  close(client_socket_fd);
+  close(server_socket_fd);
+  printf("Finish handling proxy\n");
+}
+
+/* How long a relay coroutine sleeps before asking again for a buffer at
+ * the memory cap. */
+#define RELAY_BUFFER_RETRY_MS 10
+
+void* proxy_child_thread_work(void* arg) {
+  int thread = (unsigned int)(pthread_self() % 100);
+  printf("thread: %i\tstart proxy \n", thread);
+  int from_fd = ((fd_pair*)arg)->from;
+  int to_fd = ((fd_pair*)arg)->to;
+  conn_timer_t *timer = ((fd_pair*)arg)->timer;
+  trace_request_t *trace = ((fd_pair*)arg)->trace;
+
+  /* A pool buffer is only held while there is data to move, so idle
+   * directions pin no memory and a relay waiting at the cap never holds
+   * one that others wait for. */
+  ssize_t size;
+  size_t relayed = 0;
+  int failed = 0;
+
+  while (1) {
+    if (coro_poll(from_fd, POLLIN, -1) < 0) {
+      if (errno == EINTR) continue;
+      size = -1;
+      break;
+    }
+    size_t buffer_size;
+    /* A coroutine must not wait on one its scheduler's others hold, so
+     * it sleeps and tries again instead. */
+    char *buffer = bufpool_get(SIZE_MAX, &buffer_size, !coro_self());
+    if (!buffer && coro_self()) {
+      coro_sleep(RELAY_BUFFER_RETRY_MS);
+      continue;
+    }
+    if (!buffer) {
+      size = -1;
+      break;
+    }
+    size = coro_read(from_fd, buffer, buffer_size);
+    if (size > 0) {
+      printf("thread: %i\treads size: %li\n", thread, size);
+      conn_timer_arm(timer, STAT_TIMEOUT_PROXY, proxy_timeout);
+      if (trace && !trace->record.points[TRACE_FIRST_BYTE]) trace_mark(trace, TRACE_FIRST_BYTE);
+      failed = http_send_data(to_fd, buffer, size) < 0;
+      if (!failed) relayed += size;
+      if (!failed) printf("thread: %i\twrites size: %li\n", thread, size);
+    }
+    bufpool_put(buffer, buffer_size);
+    if (size < 0 && errno == EINTR) continue;
+    if (size <= 0 || failed) break;
+  }
+  /* Pass a clean end of stream on; on errors stop the other direction too.
+   * The fds themselves are closed by handle_proxy_request. */
+  if (size < 0 || failed) {
+    shutdown(from_fd, SHUT_RDWR);
+    shutdown(to_fd, SHUT_RDWR);
+  } else {
+    shutdown(to_fd, SHUT_WR);
+  }
+  ((fd_pair*)arg)->relayed = relayed;
+  ((fd_pair*)arg)->failed = size < 0 || failed;
+  printf("thread: %i\tend proxy \n", thread);
+  return NULL;
+}
+
+void proxy_child_coroutine(void *arg) {
+  proxy_child_thread_work(arg);
+}
+
+/* Headers that only concern one hop, and are never passed on. */
+int is_hop_by_hop_header(const char *key) {
+  static const char *hop_by_hop[] = {
+    "Connection", "Keep-Alive", "Proxy-Connection", "Proxy-Authenticate", "TE", "Trailer",
+    "Transfer-Encoding", "Upgrade",
+  };
+  for (size_t i = 0; i < sizeof(hop_by_hop) / sizeof(hop_by_hop[0]); i++)
+    if (strcasecmp(key, hop_by_hop[i]) == 0) return 1;
+  return 0;
+}
+
+/* Headers the cache sets itself on shared requests, so that every client
+ * gets the same full response. */
+int is_cache_controlled_header(const char *key) {
+  return strcasecmp(key, "Accept-Encoding") == 0 || strcasecmp(key, "If-None-Match") == 0 ||
+      strcasecmp(key, "If-Modified-Since") == 0 || strcasecmp(key, "Range") == 0 ||
+      strcasecmp(key, "If-Range") == 0;
+}
+
+/*
+ * Sends REQUEST to the upstream on fd as HTTP/1.0 with Connection: close,
+ * so the response body ends with the connection and is never chunked. A
+ * SHARED request asks for the response every client can be given, with the
+ * validators of STALE if there is one. Request bodies are relayed from the
+ * client. Returns -1 on failure.
+ */
+int proxy_send_request(int fd, conn_t *conn, struct http_request *request, const char *host,
+    int shared, int gzip, cache_entry_t *stale) {
+  struct http_buffer head;
+  http_buffer_init(&head);
+  http_buffer_printf(&head, "%s %s HTTP/1.0\r\nHost: %s\r\nConnection: close\r\n",
+      request->method, request->path, host);
+  for (int i = 0; i < request->num_headers; i++) {
+    char *key = request->headers[i].key;
+    if (is_hop_by_hop_header(key) || strcasecmp(key, "Host") == 0) continue;
+    if (shared && is_cache_controlled_header(key)) continue;
+    http_buffer_printf(&head, "%s: %s\r\n", key, request->headers[i].value);
+  }
+  if (shared && gzip) http_buffer_printf(&head, "Accept-Encoding: gzip\r\n");
+  if (stale && stale->etag) http_buffer_printf(&head, "If-None-Match: %s\r\n", stale->etag);
+  if (stale && stale->last_modified)
+    http_buffer_printf(&head, "If-Modified-Since: %s\r\n", stale->last_modified);
+  http_buffer_printf(&head, "\r\n");
+
+  char *content_length = http_request_header(request, "Content-Length");
+  long long remaining = content_length ? atoll(content_length) : 0;
+  size_t buffered = (long long) request->body_size < remaining ? request->body_size : remaining;
+  struct iovec iov[2] = {
+    { .iov_base = head.data, .iov_len = head.size },
+    { .iov_base = request->body, .iov_len = buffered },
+  };
+  int result = http_send_iovec(fd, iov, buffered > 0 ? 2 : 1);
+  http_buffer_free(&head);
+  remaining -= buffered;
+  while (result == 0 && remaining > 0) {
+    ssize_t n = coro_read(conn->fd, conn->buffer,
+        remaining < MAX_FILE_SIZE ? remaining : MAX_FILE_SIZE);
+    if (n <= 0) return -1;
+    request->body_unread -= n;
+    capture_body(conn->fd, conn->buffer, n);
+    result = http_send_data(fd, conn->buffer, n);
+    remaining -= n;
+  }
+  return result;
+}
+
+/* Adds the CGI/1.1 variables for REQUEST, whose path is under PREFIX: the
+ * prefix is the script, the rest of the path its PATH_INFO. */
+void dynamic_add_params(conn_t *conn, struct http_request *request, const char *prefix,
+    fcgipool_request_t *dynamic) {
+  char *buffer = arena_alloc(&conn->arena, MAX_PATH);
+  size_t prefix_size = strlen(prefix);
+  if (prefix_size > 0 && prefix[prefix_size - 1] == '/') prefix_size--;
+  snprintf(buffer, MAX_PATH, "%.*s", (int) prefix_size, prefix);
+  fcgipool_param(dynamic, "SCRIPT_NAME", buffer);
+  char *query = strchr(request->path, '?');
+  size_t path_size = query ? (size_t) (query - request->path) : strlen(request->path);
+  snprintf(buffer, MAX_PATH, "%.*s", (int) (path_size - prefix_size),
+      request->path + prefix_size);
+  fcgipool_param(dynamic, "PATH_INFO", buffer);
+  fcgipool_param(dynamic, "QUERY_STRING", query ? query + 1 : "");
+  fcgipool_param(dynamic, "REQUEST_METHOD", request->method);
+  fcgipool_param(dynamic, "REQUEST_URI", request->path);
+  fcgipool_param(dynamic, "SERVER_PROTOCOL", request->version >= 11 ? "HTTP/1.1" : "HTTP/1.0");
+  fcgipool_param(dynamic, "GATEWAY_INTERFACE", "CGI/1.1");
+  fcgipool_param(dynamic, "SERVER_SOFTWARE", "httpserver/1.0");
+  snprintf(buffer, MAX_PATH, "%d", server_port);
+  fcgipool_param(dynamic, "SERVER_PORT", buffer);
+
+  struct sockaddr_storage address;
+  socklen_t address_size = sizeof(address);
+  if (getpeername(conn->fd, (struct sockaddr *) &address, &address_size) == 0 &&
+      getnameinfo((struct sockaddr *) &address, address_size, buffer, MAX_PATH, NULL, 0,
+          NI_NUMERICHOST) == 0)
+    fcgipool_param(dynamic, "REMOTE_ADDR", buffer);
+
+  for (int i = 0; i < request->num_headers; i++) {
+    char *key = request->headers[i].key;
+    if (strcasecmp(key, "Content-Length") == 0) {
+      fcgipool_param(dynamic, "CONTENT_LENGTH", request->headers[i].value);
+      continue;
+    }
+    if (strcasecmp(key, "Content-Type") == 0) {
+      fcgipool_param(dynamic, "CONTENT_TYPE", request->headers[i].value);
+      continue;
+    }
+    /* HTTP_PROXY would be taken by the application for its own proxy. */
+    if (strcasecmp(key, "Proxy") == 0) continue;
+    /* Header "X-Foo" becomes HTTP_X_FOO. */
+    size_t size = snprintf(buffer, MAX_PATH, "HTTP_%s", key);
+    for (size_t j = 5; j < size && j < MAX_PATH; j++)
+      buffer[j] = buffer[j] == '-' ? '_' : toupper((unsigned char) buffer[j]);
+    fcgipool_param(dynamic, buffer, request->headers[i].value);
+  }
+}
+
+/* Sends the request body to the worker: what was read with the head, then
+ * the rest of its Content-Length. Returns -1 if the client or the worker
+ * went away. */
+int dynamic_send_body(conn_t *conn, struct http_request *request,
+    fcgipool_request_t *dynamic) {
+  char *content_length = http_request_header(request, "Content-Length");
+  long long remaining = content_length ? atoll(content_length) : 0;
+  size_t buffered = (long long) request->body_size < remaining ? request->body_size : remaining;
+  if (buffered > 0 && fcgipool_write(dynamic, request->body, buffered) < 0) return -1;
+  remaining -= buffered;
+  while (remaining > 0) {
+    ssize_t n = coro_read(conn->fd, conn->buffer,
+        remaining < MAX_FILE_SIZE ? remaining : MAX_FILE_SIZE);
+    if (n < 0 && errno == EINTR) continue;
+    if (n > 0) {
+      request->body_unread -= n;
+      capture_body(conn->fd, conn->buffer, n);
+    }
+    if (n <= 0 || fcgipool_write(dynamic, conn->buffer, n) < 0) return -1;
+    remaining -= n;
+  }
+  return fcgipool_write(dynamic, NULL, 0);
+}
+
+/* Reads the CGI response head from the worker and turns it into HTTP
+ * headers: Status sets the status, Location alone makes a redirect, and
+ * hop-by-hop headers are dropped. Body bytes read along with it are left
+ * in RAW from *BODY on. Returns -1 if the worker failed or sent garbage. */
+int dynamic_read_head(fcgipool_request_t *dynamic, struct http_buffer *raw, size_t *body,
+    int *status, long long *content_length, struct http_buffer *headers) {
+  char *end = NULL;
+  size_t separator = 0;
+  while (!end) {
+    if (raw->size >= 65536) return -1;
+    char data[4096];
+    ssize_t n = fcgipool_read(dynamic, data, sizeof(data));
+    if (n <= 0) return -1;
+    http_buffer_append(raw, data, n);
+    http_buffer_append(raw, "", 1);
+    raw->size--;
+    char *crlf = strstr(raw->data, "\r\n\r\n"), *lf = strstr(raw->data, "\n\n");
+    if (crlf && (!lf || crlf < lf)) {
+      end = crlf;
+      separator = 4;
+    } else if (lf) {
+      end = lf;
+      separator = 2;
+    }
+  }
+  *body = end - raw->data + separator;
+  *end = '\0';
+
+  *status = 0;
+  *content_length = -1;
+  int location = 0;
+  char *saveptr;
+  for (char *line = strtok_r(raw->data, "\n", &saveptr); line;
+      line = strtok_r(NULL, "\n", &saveptr)) {
+    size_t size = strlen(line);
+    if (size > 0 && line[size - 1] == '\r') line[size - 1] = '\0';
+    char *colon = strchr(line, ':');
+    if (!colon) return -1;
+    *colon = '\0';
+    char *value = colon + 1;
+    while (*value == ' ' || *value == '\t') value++;
+    if (strcasecmp(line, "Status") == 0) {
+      *status = atoi(value);
+      continue;
+    }
+    if (strcasecmp(line, "Content-Length") == 0) *content_length = atoll(value);
+    else if (strcasecmp(line, "Location") == 0) location = 1;
+    if (is_hop_by_hop_header(line) || strcasecmp(line, "Content-Length") == 0) continue;
+    http_buffer_printf(headers, "%s: %s\r\n", line, value);
+  }
+  if (*status == 0) *status = location ? 302 : 200;
+  return *status < 100 || *status > 999 ? -1 : 0;
+}
+
+/*
+ * Answers a request under the dynamic route PREFIX from the worker pool
+ * (see fcgipool.h). Responses with a Content-Length keep the connection open;
+ * others are streamed, chunked to HTTP/1.1 clients.
+ */
+void serve_dynamic_request(conn_t *conn, struct http_request *request, const char *prefix) {
+  int fd = conn->fd;
+  if (http_request_header(request, "Transfer-Encoding")) {
+    request->keep_alive = 0;
+    send_html_response(fd, request, 411, "<center><h1>411 Length Required</h1><hr></center>");
+    return;
+  }
+  fcgipool_request_t *dynamic = fcgipool_begin(proxy_timeout);
+  if (!dynamic) {
+    send_html_response(fd, request, 503,
+        "<center><h1>503 Service Unavailable</h1><hr></center>");
+    return;
+  }
+  dynamic_add_params(conn, request, prefix, dynamic);
+
+  struct http_buffer raw, headers;
+  http_buffer_init(&raw);
+  http_buffer_init(&headers);
+  size_t body;
+  int status;
+  long long content_length;
+  if (dynamic_send_body(conn, request, dynamic) < 0 ||
+      dynamic_read_head(dynamic, &raw, &body, &status, &content_length, &headers) < 0) {
+    /* The request body may be half read, so the connection can't be reused. */
+    request->keep_alive = 0;
+    send_html_response(fd, request, 502, "<center><h1>502 Bad Gateway</h1><hr></center>");
+    goto done;
+  }
+
+  int head = strcmp(request->method, "HEAD") == 0;
+  char *data = raw.data + body;
+  ssize_t n = raw.size - body;
+  if (content_length >= 0) {
+    http_buffer_printf(&headers, "Content-Length: %lld\r\nConnection: %s\r\n", content_length,
+        request->keep_alive ? "keep-alive" : "close");
+    if (http_send_response_headers(fd, status, headers.data, headers.size) < 0) {
+      request->keep_alive = 0;
+      goto done;
+    }
+    long long remaining = head ? 0 : content_length;
+    while (remaining > 0) {
+      if (n == 0) {
+        data = conn->buffer;
+        n = fcgipool_read(dynamic, conn->buffer, MAX_FILE_SIZE);
+        /* Short of the length it promised: only closing can tell the client. */
+        if (n <= 0) break;
+      }
+      if (n > remaining) n = remaining;
+      if (http_send_data(fd, data, n) < 0) break;
+      remaining -= n;
+      n = 0;
+    }
+    if (remaining > 0) request->keep_alive = 0;
+  } else {
+    struct http_stream stream;
+    http_stream_begin(&stream, fd, request, status);
+    http_send_data(fd, headers.data, headers.size);
+    http_end_headers(fd);
+    if (!head) {
+      while (n > 0 && !stream.error) {
+        http_stream_write(&stream, data, n);
+        data = conn->buffer;
+        n = fcgipool_read(dynamic, conn->buffer, MAX_FILE_SIZE);
+      }
+      /* A cut-off response must not look complete. */
+      if (n < 0) stream.error = 1;
+      else http_stream_end(&stream);
+    }
+    if (stream.error) request->keep_alive = 0;
+  }
+
+done:
+  fcgipool_end(dynamic);
+  http_buffer_free(&raw);
+  http_buffer_free(&headers);
+}
+
+/* The head of an upstream response, with its end-to-end headers. */
+typedef struct upstream_response {
+  int status;
+  long long content_length;    // -1 if the body ends with the connection.
+  struct http_buffer headers;
+  char *body;                  // Body bytes read along with the head.
+  size_t body_size;
+  char buffer[8193];
+} upstream_response_t;
+
+/* Reads the response head from the upstream on fd. Returns -1 if it is
+ * cut short or malformed. */
+int proxy_read_response(int fd, upstream_response_t *response) {
+  size_t size = 0;
+  char *end = NULL;
+  while (!end && size < sizeof(response->buffer) - 1) {
+    ssize_t n = coro_read(fd, response->buffer + size, sizeof(response->buffer) - 1 - size);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    size += n;
+    response->buffer[size] = '\0';
+    end = strstr(response->buffer, "\r\n\r\n");
+  }
+  if (!end || sscanf(response->buffer, "HTTP/1.%*d %d", &response->status) != 1) return -1;
+  response->body = end + 4;
+  response->body_size = response->buffer + size - response->body;
+  response->content_length = -1;
+
+  http_buffer_init(&response->headers);
+  char *line = strstr(response->buffer, "\r\n") + 2;
+  while (line < end) {
+    char *line_end = strstr(line, "\r\n");
+    *line_end = '\0';
+    char *colon = strchr(line, ':');
+    if (colon) {
+      *colon = '\0';
+      char *value = colon + 1;
+      while (*value == ' ' || *value == '\t') value++;
+      if (strcasecmp(line, "Content-Length") == 0) {
+        response->content_length = atoll(value);
+      } else if (strcasecmp(line, "Transfer-Encoding") == 0) {
+        /* Not expected in answer to HTTP/1.0, and not supported. */
+        http_buffer_free(&response->headers);
+        return -1;
+      } else if (!is_hop_by_hop_header(line)) {
+        http_buffer_printf(&response->headers, "%s: %s\r\n", line, value);
+      }
+    }
+    line = line_end + 2;
+  }
+  return 0;
+}
+
+/* A response to a client that is being relayed or served from the cache. */
+typedef struct proxy_reply {
+  int fd;
+  int head_only;
+  int streaming;               // Whether the body length isn't known.
+  int failed;
+  struct http_stream stream;
+} proxy_reply_t;
+
+/* Sends the status and headers of ENTRY, marked with CACHE_STATUS. */
+void proxy_reply_begin(proxy_reply_t *reply, int fd, struct http_request *request,
+    cache_entry_t *entry, const char *cache_status) {
+  reply->fd = fd;
+  reply->head_only = strcmp(request->method, "HEAD") == 0;
+  reply->failed = 0;
+  int no_body = entry->status == 304 || entry->status == 204 || entry->status < 200;
+  reply->streaming = entry->content_length < 0 && !no_body && !reply->head_only;
+
+  struct http_buffer headers;
+  http_buffer_init(&headers);
+  http_buffer_append(&headers, entry->headers, entry->headers_size);
+  if (cache_status) {
+    time_t age = time(NULL) - entry->response_time;
+    http_buffer_printf(&headers, "Age: %lld\r\nX-Cache: %s\r\n",
+        (long long) (age > 0 ? age : 0), cache_status);
+  }
+  if (reply->streaming) {
+    http_stream_begin(&reply->stream, fd, request, entry->status);
+    if (http_send_data(fd, headers.data, headers.size) < 0) reply->failed = 1;
+    http_end_headers(fd);
+  } else {
+    if (!no_body && entry->content_length >= 0)
+      http_buffer_printf(&headers, "Content-Length: %lld\r\n", entry->content_length);
+    http_buffer_printf(&headers, "Connection: %s\r\n", request->keep_alive ? "keep-alive" : "close");
+    if (http_send_response_headers(fd, entry->status, headers.data, headers.size) < 0)
+      reply->failed = 1;
+  }
+  http_buffer_free(&headers);
+}
+
+void proxy_reply_data(proxy_reply_t *reply, char *data, size_t size) {
+  if (reply->failed || reply->head_only) return;
+  if (reply->streaming) {
+    http_stream_write(&reply->stream, data, size);
+    reply->failed = reply->stream.error;
+  } else if (http_send_data(reply->fd, data, size) < 0) {
+    reply->failed = 1;
+  }
+}
+
+/* Ends the reply. A body cut short (not OK) can only be signalled by
+ * closing the connection. */
+void proxy_reply_end(proxy_reply_t *reply, struct http_request *request, int ok) {
+  if (reply->streaming && ok && !reply->failed) {
+    http_stream_end(&reply->stream);
+    reply->failed = reply->stream.error;
+  }
+  if (!ok || reply->failed) request->keep_alive = 0;
+}
+
+/* Answers REQUEST from ENTRY, waiting for its leader as needed. */
+void proxy_reply_from_cache(conn_t *conn, struct http_request *request, cache_entry_t *entry,
+    const char *cache_status) {
+  /* Waiting on the upstream is not the client's fault. */
+  conn_timer_arm(&conn->timer, STAT_TIMEOUT_PROXY, proxy_timeout);
+  if (cache_wait_head(entry) < 0) {
+    send_html_response(conn->fd, request, 502, "<center><h1>502 Bad Gateway</h1><hr></center>");
+    return;
+  }
+  /* The client may already have what we have. */
+  char *if_none_match = http_request_header(request, "If-None-Match");
+  if (if_none_match && entry->state == CACHE_COMPLETE && entry->etag &&
+      strstr(if_none_match, entry->etag)) {
+    char headers[512];
+    int size = snprintf(headers, sizeof(headers), "ETag: %s\r\nConnection: %s\r\n",
+        entry->etag, request->keep_alive ? "keep-alive" : "close");
+    if (size >= (int) sizeof(headers)) size = sizeof(headers) - 1;
+    http_send_response_headers(conn->fd, 304, headers, size);
+    return;
+  }
 
-  /*
-  * The code below does a DNS lookup of server_proxy_hostname and 
-  * opens a connection to it. Please do not modify.
-  */
+  proxy_reply_t reply;
+  proxy_reply_begin(&reply, conn->fd, request, entry, cache_status);
+  size_t buffer_size;
+  char *buffer = bufpool_get(entry->content_length > 0 ? entry->content_length : SIZE_MAX,
+      &buffer_size, 0);
+  if (!buffer) {
+    buffer = conn->buffer;
+    buffer_size = MAX_FILE_SIZE;
+  }
+  size_t offset = 0;
+  ssize_t n = 0;
+  while (!reply.head_only && !reply.failed &&
+      (n = cache_read(entry, offset, buffer, buffer_size)) > 0) {
+    conn_timer_arm(&conn->timer, STAT_TIMEOUT_WRITE, write_timeout);
+    proxy_reply_data(&reply, buffer, n);
+    offset += n;
+  }
+  if (buffer != conn->buffer) bufpool_put(buffer, buffer_size);
+  proxy_reply_end(&reply, request, n == 0);
+}
 
-  struct sockaddr_in target_address;
-  memset(&target_address, 0, sizeof(target_address));
-  target_address.sin_family = AF_INET;
-  target_address.sin_port = htons(server_proxy_port);
+/* Fetches REQUEST from a backend of POOL, which expects HOST, into the
+ * leader entry ENTRY, relaying it to the client as it arrives. */
+void proxy_fetch(conn_t *conn, struct http_request *request, int pool, const char *host,
+    cache_entry_t *entry, cache_entry_t *stale, int shared, int gzip) {
+  conn_timer_arm(&conn->timer, STAT_TIMEOUT_PROXY, proxy_timeout);
+  balancer_backend_t *backend;
+  int upstream = balancer_connect(pool, &backend);
+  trace_mark(&conn->trace, TRACE_UPSTREAM);
+  if (upstream < 0) {
+    cache_finish(entry, 0);
+    send_html_response(conn->fd, request, 502, "<center><h1>502 Bad Gateway</h1><hr></center>");
+    return;
+  }
+  conn_timer_t timer;
+  conn_timer_init(&timer, upstream, -1);
+  conn_timer_arm(&timer, STAT_TIMEOUT_PROXY, proxy_timeout);
 
-  struct hostent *target_dns_entry = gethostbyname2(server_proxy_hostname, AF_INET);
+  upstream_response_t *response = malloc(sizeof(upstream_response_t));
+  if (!response || proxy_send_request(upstream, conn, request, host, shared, gzip, stale) < 0 ||
+      proxy_read_response(upstream, response) < 0) {
+    /* Only a backend that never answered is to blame. */
+    balancer_done(backend, 0);
+    cache_finish(entry, 0);
+    send_html_response(conn->fd, request, 502, "<center><h1>502 Bad Gateway</h1><hr></center>");
+    free(response);
+    tw_cancel(&timer_wheel, &timer.timer);
+    close(upstream);
+    return;
+  }
+  /* Only the upstream failing to send the body counts against it, not the
+   * client going away. */
+  int backend_ok = 1;
+  if (stale && response->status == 304) {
+    cache_revalidated(entry, stale, response->headers.data, response->headers.size);
+    cache_finish(entry, 1);
+    http_buffer_free(&response->headers);
+    proxy_reply_from_cache(conn, request, entry, "REVALIDATED");
+  } else {
+    /* A HEAD response keeps the length of the body it doesn't have. */
+    int head = strcmp(request->method, "HEAD") == 0;
+    int no_body = head || response->status == 304 || response->status == 204 ||
+        response->status < 200;
+    if (no_body && !head) response->content_length = 0;
+    cache_begin(entry, response->status, response->headers.data, response->headers.size,
+        response->content_length);
+    http_buffer_free(&response->headers);
 
-  int server_socket_fd = socket(PF_INET, SOCK_STREAM, 0);
-  if (server_socket_fd == -1) {
-    fprintf(stderr, "Failed to create a new socket: error %d: %s\n", errno, strerror(errno));
-    exit(errno);
+    proxy_reply_t reply;
+    proxy_reply_begin(&reply, conn->fd, request, entry, shared ? "MISS" : NULL);
+    size_t buffer_size;
+    char *buffer = bufpool_get(SIZE_MAX, &buffer_size, 0);
+    if (!buffer) {
+      buffer = conn->buffer;
+      buffer_size = MAX_FILE_SIZE;
+    }
+    long long remaining = no_body ? 0 : response->content_length;
+    char *data = response->body;
+    ssize_t n = response->body_size;
+    int ok = 1;
+    while (!no_body && (remaining != 0 || n > 0)) {
+      if (remaining >= 0 && n > remaining) n = remaining;
+      if (n > 0) {
+        int buffering = cache_append(entry, data, n);
+        conn_timer_arm(&conn->timer, STAT_TIMEOUT_WRITE, write_timeout);
+        proxy_reply_data(&reply, data, n);
+        /* Keep going after the client is gone only if others need it. */
+        if (reply.failed && !buffering) {
+          ok = 0;
+          break;
+        }
+        if (remaining > 0) remaining -= n;
+      }
+      if (remaining == 0) break;
+      conn_timer_arm(&timer, STAT_TIMEOUT_PROXY, proxy_timeout);
+      while ((n = coro_read(upstream, buffer, buffer_size)) < 0 && errno == EINTR);
+      data = buffer;
+      if (n <= 0) {
+        /* Without a length, the end of the connection ends the body. */
+        ok = n == 0 && remaining < 0;
+        backend_ok = ok;
+        break;
+      }
+    }
+    if (buffer != conn->buffer) bufpool_put(buffer, buffer_size);
+    cache_finish(entry, ok);
+    proxy_reply_end(&reply, request, ok);
   }
+  free(response);
+  tw_cancel(&timer_wheel, &timer.timer);
+  close(upstream);
+  balancer_done(backend, backend_ok);
+}
 
-  if (target_dns_entry == NULL) {
-    fprintf(stderr, "Cannot find host: %s\n", server_proxy_hostname);
-    exit(ENXIO);
+/*
+ * Answers requests through the caching proxy, see cache.h. GET requests are
+ * shared: they are answered from the cache when it has a fresh response,
+ * wait on a fetch of the same URL already under way once it turns out to
+ * be storable, or become the fetch.
+ * Accept-Encoding is narrowed down to gzip or nothing and made part of the
+ * key, so responses that vary by encoding can be stored. Requests with
+ * credentials, Authorization or a Cookie, are never shared. HEAD requests are
+ * answered from the cache if it can; they and all other requests go to the
+ * upstream unshared. Without a cache, every request goes upstream unshared.
+ * Requests go to the backends of POOL, with HOST as their Host header.
+ * Chunked request bodies are refused, as they are only relayed by length.
+ */
+void serve_proxy(conn_t *conn, struct http_request *request, int pool, const char *host) {
+  if (http_request_header(request, "Transfer-Encoding")) {
+    request->keep_alive = 0;
+    send_html_response(conn->fd, request, 411,
+        "<center><h1>411 Length Required</h1><hr></center>");
+    return;
   }
+  int get = strcmp(request->method, "GET") == 0;
+  int head = strcmp(request->method, "HEAD") == 0;
+  char *cache_control = http_request_header(request, "Cache-Control");
+  char *pragma = http_request_header(request, "Pragma");
+  int cacheable = proxy_cache_mb > 0 && (get || head) &&
+      !http_request_header(request, "Authorization") &&
+      !http_request_header(request, "Cookie") &&
+      !(cache_control && strstr(cache_control, "no-store"));
+  int revalidate = (cache_control && (strstr(cache_control, "no-cache") ||
+      strstr(cache_control, "max-age=0"))) || (pragma && strstr(pragma, "no-cache"));
 
-  char *dns_address = target_dns_entry->h_addr_list[0];
+  char *accept_encoding = http_request_header(request, "Accept-Encoding");
+  int gzip = accept_encoding && strstr(accept_encoding, "gzip");
+  /* Pools have separate keys, since their paths mean different things. */
+  char *key = arena_alloc(&conn->arena, strlen(request->path) + 24);
+  sprintf(key, "%d\n%s%s", pool, request->path, gzip ? "\ngzip" : "");
 
-  memcpy(&target_address.sin_addr, dns_address, sizeof(target_address.sin_addr));
-  int connection_status = connect(server_socket_fd, (struct sockaddr*) &target_address,
-      sizeof(target_address));
+  cache_entry_t *entry = NULL, *stale = NULL;
+  int leader = 0;
+  if (cacheable) entry = cache_get(key, revalidate, head, &stale, &leader);
+  if (entry && !leader) {
+    proxy_reply_from_cache(conn, request, entry, "HIT");
+  } else if (entry) {
+    proxy_fetch(conn, request, pool, host, entry, stale, 1, gzip);
+  } else if ((entry = cache_get_private()) != NULL) {
+    proxy_fetch(conn, request, pool, host, entry, NULL, 0, gzip);
+  } else {
+    request->keep_alive = 0;
+  }
+  if (stale) cache_release(stale);
+  if (entry) cache_release(entry);
+}
 
-  if (connection_status < 0) {
-    /* Dummy request parsing, just to be compliant. */
-    http_request_parse(client_socket_fd);
+int serve_cache_proxy_request(conn_t *conn, struct http_request *request) {
+  serve_proxy(conn, request, server_proxy_pool, server_proxy_host);
+  return 0;
+}
 
-    http_start_response(client_socket_fd, 502);
-    http_send_header(client_socket_fd, "Content-Type", "text/html");
-    http_end_headers(client_socket_fd);
-    http_send_string(client_socket_fd, "<center><h1>502 Bad Gateway</h1><hr></center>");
-    return;
+void handle_cache_proxy_request(int fd) {
+  handle_connection(fd, serve_cache_proxy_request);
+}
 
+/* Serves REQUEST with the handler ROUTE names. Proxy and dynamic routes
+ * refuse chunked request bodies with 411 and close; other handlers leave
+ * them to conn_finish_request, which closes rather than parse them as the
+ * next request. Returns 1 if the connection was parked. */
+int serve_route(conn_t *conn, struct http_request *request, route_t *route) {
+  switch (route->type) {
+    case ROUTE_FILES:
+      return serve_files(conn, request, route->target);
+    case ROUTE_PROXY: {
+      /* The first backend names the Host sent upstream, as with --proxy. */
+      char *host = arena_alloc(&conn->arena, strlen(route->target) + 1);
+      sprintf(host, "%.*s", (int) strcspn(route->target, ","), route->target);
+      serve_proxy(conn, request, route->pool, host);
+      break;
+    }
+    case ROUTE_DYNAMIC:
+      serve_dynamic_request(conn, request, route->path);
+      break;
+    case ROUTE_STATS:
+      serve_stats(conn->fd, request);
+      break;
+    case ROUTE_TRACE:
+      serve_trace(conn->fd, request);
+      break;
   }
+  return 0;
+}
 
-  /* 
-  * TODO: Your solution for task 3 belongs here! 
-  */
+/* Answers requests that match no route when there is no --files, --pack or
+ * --proxy to fall back on. */
+int serve_unrouted_request(conn_t *conn, struct http_request *request) {
+  send_html_response(conn->fd, request, 404,
+      "<center><h1>FILE NOT FOUND!</h1><hr></center>");
+  return 0;
+}
 
-  /* Threading pooling is not implemented */
-  /* TODO: implement threading pooling */
-  /* Create a child thread for client->server connection */
-  pthread_t thread_sc;
-  pthread_create(&thread_sc, NULL, proxy_child_thread_work, &(fd_pair){ .from = client_socket_fd, .to = server_socket_fd });
-  /* Create a child thread for server->client connection */
-  pthread_t thread_cs;
-  pthread_create(&thread_cs, NULL, proxy_child_thread_work, &(fd_pair){ .from = server_socket_fd, .to = client_socket_fd });
-  /* Wait for child thread to finish */
-  pthread_join(thread_cs, NULL);
-  pthread_join(thread_sc, NULL);
-  printf("Finish handling proxy\n");
+void handle_routed_request(int fd) {
+  handle_connection(fd, serve_unrouted_request);
 }
 
-void* proxy_child_thread_work(void* arg) {
-  int thread = (unsigned int)(pthread_self() % 100);
-  printf("thread: %i\tstart proxy \n", thread);
-  int from_fd = ((fd_pair*)arg)->from;
-  int to_fd = ((fd_pair*)arg)->to;
+/* Serves the connection on fd ARG, as a coroutine. */
+void serve_coroutine(void *arg) {
+  coroutine_handler((int) (intptr_t) arg);
+  trace_set_current(NULL);
+}
 
-  ssize_t size = MAX_FILE_SIZE;
-  char buffer[size];
+void *coroutine_save_trace(void) {
+  return trace_get_current();
+}
+
+void coroutine_restore_trace(void *saved) {
+  trace_set_current(saved);
+}
 
-  while ((size = read(from_fd, buffer, MAX_FILE_SIZE)) > 0) {
-    printf("thread: %i\treads size: %li\n", thread, size);
-    size = write(to_fd, buffer, size);
-    printf("thread: %i\twrites size: %li\n", thread, size);
+/* Starts the coroutine schedulers that stand in for the thread pool, and
+ * routes libhttp's socket I/O through them. */
+void init_coroutines(void (*request_handler)(int)) {
+  coroutine_handler = request_handler;
+  coro_save_hook = coroutine_save_trace;
+  coro_restore_hook = coroutine_restore_trace;
+  http_read_hook = coro_read;
+  http_write_hook = coro_write;
+  http_writev_hook = coro_writev;
+  if (coro_init(coroutine_schedulers, coroutine_stack_kb * 1024) < 0) {
+    perror("Failed to start coroutine schedulers");
+    exit(errno);
   }
-  close(from_fd);
-  close(to_fd);
-  printf("thread: %i\tend proxy \n", thread);
-  return NULL;
 }
 
 void* worker_work(void* arg) {
@@ -209,14 +1821,20 @@ void* worker_work(void* arg) {
   pthread_mutex_lock(&work_queue.lock);
   while(1) {
     printf("queue size:%i\tthread id: %i\n", work_queue.size, (unsigned int)(pthread_self() % 100));
-    if (work_queue.shutdown) {
+    /* Parked connections come back through the queue. */
+    if (work_queue.shutdown && work_queue.size == 0 && parked_connections == 0) {
       pthread_mutex_unlock(&work_queue.lock);
       break;
     } else if (work_queue.size > 0) {
-      int fd = wq_pop(&work_queue);
+      conn_t *conn;
+      int fd = wq_pop(&work_queue, (void **) &conn);
       pthread_mutex_unlock(&work_queue.lock);
-      request_handler(fd);
-      close(fd);
+      if (conn)
+        resume_connection(conn);
+      else
+        request_handler(fd);
+      trace_set_current(NULL);
+      pthread_mutex_lock(&work_queue.lock);
     } else {
       pthread_cond_wait(&work_queue.cv, &work_queue.lock);
     }
@@ -230,22 +1848,330 @@ void init_thread_pool(int num_threads, void (*request_handler)(int)) {
    */
   pthread_t* ptr = thread_arr = malloc(sizeof(pthread_t) * num_threads);
   for (int i = 0; i < num_threads; ++i) {
-    pthread_create(ptr++, NULL, worker_work, request_handler);
+    pthread_create(ptr++, &thread_attr, worker_work, request_handler);
   }
   printf("%i threads created\n", num_threads);
 }
 
+/* Lets the workers finish every queued connection, then stops them. */
+void drain_thread_pool() {
+  draining = 1;
+  if (coroutines) {
+    coro_wait_idle();
+    return;
+  }
+  if (num_threads == 0) return;
+  pthread_mutex_lock(&work_queue.lock);
+  work_queue.shutdown = 1;
+  pthread_cond_broadcast(&work_queue.cv);
+  pthread_mutex_unlock(&work_queue.lock);
+  for (int i = 0; i < num_threads; ++i) {
+    pthread_join(thread_arr[i], NULL);
+  }
+  free(thread_arr);
+}
+
+/* Hands the listening socket and hot file list to a new exec of this
+ * server. Returns 0 if the new process took over. */
+int start_upgrade(int socket_number) {
+  printf("Upgrade requested\n");
+  struct http_buffer hot;
+  http_buffer_init(&hot);
+  hotlist_format(&hot, preload_hot);
+  int result = upgrade_handoff(server_argv, socket_number, &hot);
+  http_buffer_free(&hot);
+  return result;
+}
+
 /*
- * Opens a TCP stream socket on all interfaces with port number PORTNO. Saves
- * the fd number of the server socket in *socket_number. For each accepted
- * connection, calls request_handler with the accepted fd number.
+ * Turns away a client that is over its rate limit, straight from the accept
+ * loop so no worker ever sees the connection.
  */
-void serve_forever(int *socket_number, void (*request_handler)(int)) {
+void reject_rate_limited(int fd) {
+  stats_add(STAT_RATE_LIMITED, 1);
+  if (rate_limit_refuse) {
+    /* Abort with a reset instead of a graceful close. */
+    struct linger linger = { .l_onoff = 1, .l_linger = 0 };
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+  } else {
+    static char response[] =
+        "HTTP/1.1 429 Too Many Requests\r\n"
+        "Content-Length: 0\r\n"
+        "Retry-After: 1\r\n"
+        "Connection: close\r\n"
+        "\r\n";
+    /* Never block the accept loop on a client that isn't reading. */
+    send(fd, response, sizeof(response) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+  }
+  close(fd);
+}
+
+/* Turns away a connection with a 503 while fds are running out, so that
+ * load is shed before accept starts failing. */
+void shed_connection(int fd) {
+  static char response[] =
+      "HTTP/1.1 503 Service Unavailable\r\n"
+      "Content-Length: 0\r\n"
+      "Retry-After: 1\r\n"
+      "Connection: close\r\n"
+      "\r\n";
+  stats_add(STAT_SHED, 1);
+  send(fd, response, sizeof(response) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+  close(fd);
+}
+
+/* Accept picks the fd before it blocks, so an fd at the high-water mark
+ * may only say how busy the server was before the connection came in.
+ * Moves FD to the lowest free fd and returns it, or sheds the connection
+ * and returns -1 if that is still above the mark. */
+int lower_fd(int fd) {
+  int lower = fcntl(fd, F_DUPFD, 0);
+  if (lower >= 0 && lower < fd_high_water) {
+    close(fd);
+    return lower;
+  }
+  if (lower >= 0) close(lower);
+  shed_connection(fd);
+  return -1;
+}
+
+/* Called when accept fails for lack of fds, which it does without waiting
+ * for a connection. Waits for one, then gives up the reserved fd just long
+ * enough to accept it, so the backlog keeps draining instead of accept
+ * failing over and over. Returns the fd if the reserve could be taken back
+ * and -1 otherwise, having shed the connection. */
+int accept_with_reserve_fd(int socket_number, struct sockaddr *address, socklen_t *length) {
+  if (reserve_fd < 0) {
+    /* Someone took the reserve's place; wait for fds to be closed. */
+    struct timespec delay = { .tv_nsec = 10 * 1000 * 1000 };
+    nanosleep(&delay, NULL);
+    reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return -1;
+  }
+  struct pollfd pending = { .fd = socket_number, .events = POLLIN };
+  if (poll(&pending, 1, 10) <= 0) return -1;
+  close(reserve_fd);
+  int fd = accept(socket_number, address, length);
+  reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  if (fd >= 0 && reserve_fd < 0) {
+    shed_connection(fd);
+    reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return -1;
+  }
+  return fd;
+}
 
-  struct sockaddr_in server_address, client_address;
+/*
+ * Accepts connections on socket_number forever. For each accepted
+ * connection, calls request_handler with the accepted fd number, which the
+ * handler closes once it is done with the connection.
+ */
+void serve_connections(int socket_number, void (*request_handler)(int)) {
+  struct sockaddr_in client_address;
   size_t client_address_length = sizeof(client_address);
   int client_socket_number;
 
+  tw_init(&timer_wheel, 100);
+
+  /* Each prefork worker runs its own pool, so its requests never wait on
+   * another process. */
+  if (dynamic_command &&
+      fcgipool_init(dynamic_command, dynamic_workers, dynamic_requests, dynamic_socket_dir) < 0) {
+    perror("Failed to start dynamic workers");
+    exit(errno);
+  }
+
+  if (coroutines) {
+    init_coroutines(request_handler);
+  } else {
+    wq_set_policy(&work_queue, queue_policy, queue_aging_ms);
+    init_thread_pool(num_threads, request_handler);
+  }
+  /* Each process logs its own footprint; a prefork master holds little. */
+  if (memory_log_interval > 0) {
+    pthread_t memory_log_thread;
+    if (pthread_create(&memory_log_thread, &thread_attr, memory_log_work,
+        (void *) (intptr_t) memory_log_interval) == 0)
+      pthread_detach(memory_log_thread);
+  }
+  /* Parked connections need workers, or coroutines, to come back to. */
+  if (num_threads > 0 || coroutines) diskio_init(disk_threads, disk_queue);
+
+  /* Only this thread handles control signals, so they interrupt accept.
+   * Prefork workers leave upgrades to the master. */
+  sigset_t handled = control_signals;
+  if (is_worker_process) sigdelset(&handled, SIGUSR2);
+  pthread_sigmask(SIG_UNBLOCK, &handled, NULL);
+  upgrade_complete();
+  reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+  while (1) {
+    if (upgrade_requested) {
+      upgrade_requested = 0;
+      if (start_upgrade(socket_number) == 0) break;
+    }
+    client_socket_number = accept(socket_number,
+        (struct sockaddr *) &client_address,
+        (socklen_t *) &client_address_length);
+    if (client_socket_number < 0) {
+      if (errno == EMFILE || errno == ENFILE)
+        client_socket_number = accept_with_reserve_fd(socket_number,
+            (struct sockaddr *) &client_address,
+            (socklen_t *) &client_address_length);
+      else if (errno != EINTR)
+        perror("Error accepting socket");
+      if (client_socket_number < 0) continue;
+    }
+    if (client_socket_number >= fd_high_water &&
+        (client_socket_number = lower_fd(client_socket_number)) < 0)
+      continue;
+
+    printf("Accepted connection from %s on port %d\n",
+        inet_ntoa(client_address.sin_addr),
+        client_address.sin_port);
+
+    trace_accepted(client_socket_number);
+
+    /* Responses are written whole, headers then body, so don't let Nagle
+     * hold the body back waiting for the client to ack the headers. */
+    int nodelay = 1;
+    setsockopt(client_socket_number, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    if (rate_limit > 0 && ratelimit_allow(client_address.sin_addr.s_addr) < 0) {
+      reject_rate_limited(client_socket_number);
+      continue;
+    }
+
+    if (coroutines) {
+      trace_enqueued(client_socket_number);
+      coro_spawn(serve_coroutine, (void *) (intptr_t) client_socket_number);
+    } else if (num_threads == 0) {
+      request_handler(client_socket_number);
+      trace_set_current(NULL);
+    } else {
+      trace_enqueued(client_socket_number);
+      pthread_mutex_lock(&work_queue.lock);
+      wq_push(&work_queue, client_socket_number);
+      pthread_cond_signal(&work_queue.cv);
+      pthread_mutex_unlock(&work_queue.lock);
+    }
+
+  }
+
+  /* The socket now belongs to the new process; don't shut it down. */
+  close(socket_number);
+  drain_thread_pool();
+  capture_flush();
+  printf("Drained, exiting\n");
+  exit(EXIT_SUCCESS);
+}
+
+/* Starts a worker process in SLOT serving connections on socket_number. */
+pid_t spawn_worker(int slot, int socket_number, void (*request_handler)(int)) {
+  /* Don't let the child inherit and repeat buffered output. */
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("Failed to fork worker");
+    return -1;
+  } else if (pid == 0) {
+    pthread_sigmask(SIG_BLOCK, &control_signals, NULL);
+    free(worker_pids);
+    worker_pids = NULL;
+    is_worker_process = 1;
+    stats_set_slot(slot + 1);
+    serve_connections(socket_number, request_handler);
+    exit(EXIT_SUCCESS);
+  }
+  worker_started[slot] = time(NULL);
+  printf("Started worker %d as pid %d\n", slot, pid);
+  return pid;
+}
+
+/* Asks every worker to drain and waits for them. Only waits for workers, as
+ * a new master started by an upgrade is a child too. */
+void stop_workers() {
+  for (int i = 0; i < num_workers; i++) {
+    if (worker_pids[i] > 0) kill(worker_pids[i], SIGTERM);
+  }
+  for (int i = 0; i < num_workers; i++) {
+    if (worker_pids[i] <= 0) continue;
+    while (waitpid(worker_pids[i], NULL, 0) < 0 && errno == EINTR);
+  }
+}
+
+/*
+ * Prefork master: runs num_workers processes that each accept on the
+ * shared listening socket with their own thread pool, and replaces any
+ * that die. Stats are kept in shared memory, so any worker can report the
+ * totals of all of them.
+ */
+void run_master(int socket_number, void (*request_handler)(int)) {
+  worker_pids = calloc(num_workers, sizeof(pid_t));
+  worker_started = calloc(num_workers, sizeof(time_t));
+  /* Report readiness before forking so workers don't inherit the upgrade
+   * channel; the old process keeps accepting until they are up. */
+  upgrade_complete();
+  for (int i = 0; i < num_workers; i++)
+    worker_pids[i] = spawn_worker(i, socket_number, request_handler);
+  pthread_sigmask(SIG_UNBLOCK, &control_signals, NULL);
+
+  while (1) {
+    if (upgrade_requested) {
+      upgrade_requested = 0;
+      if (start_upgrade(socket_number) == 0) {
+        /* Workers drain on SIGTERM; the new master has its own. */
+        close(socket_number);
+        stop_workers();
+        printf("Drained, exiting\n");
+        exit(EXIT_SUCCESS);
+      }
+    }
+    int status;
+    pid_t pid = wait(&status);
+    if (pid < 0) {
+      if (errno == EINTR) continue;
+      perror("Failed to wait for workers");
+      sleep(1);
+    }
+
+    for (int i = 0; i < num_workers; i++) {
+      if (pid > 0 && worker_pids[i] == pid) {
+        if (WIFSIGNALED(status))
+          printf("Worker %d (pid %d) killed by signal %d\n", i, pid, WTERMSIG(status));
+        else
+          printf("Worker %d (pid %d) exited with status %d\n", i, pid, WEXITSTATUS(status));
+        stats_add(STAT_WORKER_RESTARTS, 1);
+        /* Don't spin if a worker dies right after starting. */
+        if (time(NULL) - worker_started[i] < 1) sleep(1);
+        worker_pids[i] = spawn_worker(i, socket_number, request_handler);
+      } else if (worker_pids[i] < 0) {
+        /* Retry slots whose fork failed earlier. */
+        worker_pids[i] = spawn_worker(i, socket_number, request_handler);
+      }
+    }
+  }
+}
+
+/*
+ * Opens a TCP stream socket on all interfaces with port number PORTNO. Saves
+ * the fd number of the server socket in *socket_number, then serves it
+ * either from this process or from num_workers forked processes.
+ */
+void serve_forever(int *socket_number, void (*request_handler)(int)) {
+  struct sockaddr_in server_address;
+
+  struct http_buffer hot;
+  *socket_number = upgrade_receive(&hot);
+  if (*socket_number >= 0) {
+    if (server_files_directory && preload_hot > 0)
+      hotlist_preload(server_files_directory, hot.data, preload_threads, preload_budget,
+          preload_before_accept);
+    else
+      http_buffer_free(&hot);
+    goto serve;
+  }
+
   *socket_number = socket(PF_INET, SOCK_STREAM, 0);
   if (*socket_number == -1) {
     perror("Failed to create a new socket");
@@ -277,40 +2203,22 @@ void serve_forever(int *socket_number, void (*request_handler)(int)) {
 
   printf("Listening on port %d...\n", server_port);
 
-  init_thread_pool(num_threads, request_handler);
-
-  while (1) {
-    client_socket_number = accept(*socket_number,
-        (struct sockaddr *) &client_address,
-        (socklen_t *) &client_address_length);
-    if (client_socket_number < 0) {
-      perror("Error accepting socket");
-      continue;
-    }
-
-    printf("Accepted connection from %s on port %d\n",
-        inet_ntoa(client_address.sin_addr),
-        client_address.sin_port);
-
-    if (num_threads == 0) {
-      request_handler(client_socket_number);
-      close(client_socket_number);
-    } else {
-      pthread_mutex_lock(&work_queue.lock);
-      wq_push(&work_queue, client_socket_number);
-      pthread_cond_signal(&work_queue.cv);
-      pthread_mutex_unlock(&work_queue.lock);
-    }
-
-    
-
-    printf("Accepted connection from %s on port %d\n",
-        inet_ntoa(client_address.sin_addr),
-        client_address.sin_port);
+  /* Warm the page cache with what was hot before the last restart. */
+  char *list;
+  if (hot_file && server_files_directory && (list = hotlist_load(hot_file)) != NULL) {
+    printf("Preloading hot files from %s\n", hot_file);
+    hotlist_preload(server_files_directory, list, preload_threads, preload_budget,
+        preload_before_accept);
   }
 
-  shutdown(*socket_number, SHUT_RDWR);
-  close(*socket_number);
+serve:
+  if (hot_file) hotlist_start_persister(hot_file, preload_hot, hot_file_interval);
+  if (proxy_pools > 0 && proxy_health_interval > 0)
+    balancer_start_health_checks(proxy_health_path, proxy_health_interval);
+  if (num_workers > 0)
+    run_master(*socket_number, request_handler);
+  else
+    serve_connections(*socket_number, request_handler);
 }
 
 int server_fd;
@@ -318,31 +2226,169 @@ void signal_callback_handler(int signum) {
   printf("Caught signal %d: %s\n", signum, strsignal(signum));
   printf("Closing socket %d\n", server_fd);
   if (close(server_fd) < 0) perror("Failed to close server_fd (ignoring)\n");
-  /* Exit worker threads */
-  if (num_threads > 0)  {
-    pthread_mutex_lock(&work_queue.lock);
-    work_queue.shutdown = 1;
-    pthread_cond_broadcast(&work_queue.cv);
-    pthread_mutex_unlock(&work_queue.lock);
-    for (int i = 0; i < num_threads; ++i) {
-      pthread_join(thread_arr[i], NULL);
-    }
-    free(thread_arr); 
+  if (worker_pids != NULL) {
+    /* Prefork master: let every worker drain, then report the totals. */
+    stop_workers();
+  } else {
+    drain_thread_pool();
+  }
+  capture_flush();
+  /* Each process only has its own threads' traces. */
+  if (trace_sample > 0 && trace_file) {
+    char file[MAX_PATH];
+    if (is_worker_process)
+      snprintf(file, MAX_PATH, "%s.%d", trace_file, getpid());
+    else
+      snprintf(file, MAX_PATH, "%s", trace_file);
+    if (trace_save(file) < 0) perror("Failed to save trace");
+  }
+  /* The master reports for all of its workers. */
+  if (!is_worker_process) {
+    if (hot_file && hotlist_save(hot_file, preload_hot) < 0)
+      perror("Failed to save hot file list");
+    struct http_buffer buffer;
+    http_buffer_init(&buffer);
+    stats_format(&buffer);
+    if (proxy_pools > 0) balancer_format(&buffer);
+    printf("%.*s", (int) buffer.size, buffer.data);
+    http_buffer_free(&buffer);
   }
   exit(0);
 }
 
+void upgrade_signal_handler(int signum) {
+  upgrade_requested = 1;
+}
+
 char *USAGE =
   "Usage: ./httpserver --files www_directory/ --port 8000 [--num-threads 5]\n"
-  "       ./httpserver --proxy inst.eecs.berkeley.edu:80 --port 8000 [--num-threads 5]\n";
+  "                    [--sort-listings] [--dircache-size 64] [--stats-path /stats]\n"
+  "                    [--disk-threads 4] [--disk-queue 256]  Read cold files off the\n"
+  "                    workers, 0 disk threads to read inline.\n"
+  "       [--uploads] [--upload-max-mb 1024] [--upload-rate-kb 0]  Store PUT and POST\n"
+  "           bodies as files, at most this large and, per upload, this fast.\n"
+  "       [--h2c]  Also speak cleartext HTTP/2, by prior knowledge or Upgrade: h2c.\n"
+  "       [--dynamic-prefix /app/ --dynamic-command ./httpapp]  Answer requests under the\n"
+  "           prefix from a pool of FastCGI workers running the command.\n"
+  "           [--dynamic-workers 4] [--dynamic-requests 16]  Per-worker concurrent requests.\n"
+  "           [--dynamic-socket-dir /tmp]\n"
+  "       [--coroutines] [--coroutine-schedulers 0] [--coroutine-stack-kb 128]  Run each\n"
+  "           connection as a coroutine on a scheduler per core (or this many) rather\n"
+  "           than on a worker thread; not with --h2c, --dynamic-command, a proxy cache\n"
+  "           or --queue-policy sjf.\n"
+  "       [--queue-policy fifo|sjf] [--queue-aging-ms 100]  Serve the work queue in order,\n"
+  "           or small files first, with waiting work gaining a size class per interval.\n"
+  "       [--io-buffer-sizes 16,64,256] [--io-buffer-memory-mb 64]  Size classes (KB) and\n"
+  "           memory cap of the I/O buffers for file sends and proxy relays.\n"
+  "       ./httpserver --pack site.pack --port 8000 [--num-threads 5]\n"
+  "       ./httpserver --routes routes.conf --port 8000  See router.h for the format; also\n"
+  "           with --files, --pack or --proxy for requests no route matches.\n"
+  "       ./httpserver --proxy inst.eecs.berkeley.edu:80 --port 8000 [--num-threads 5]\n"
+  "                    [--proxy-cache-mb 64] [--proxy-cache-dir DIR] [--proxy-cache-disk-mb 1024]\n"
+  "                    [--proxy-cache-object-mb 16]  Cache upstream responses.\n"
+  "           --proxy host1:80,host2:80 balances over several backends:\n"
+  "                    [--proxy-balance least|p2c] [--proxy-connect-timeout 3]\n"
+  "                    [--proxy-health-path /] [--proxy-health-interval 5]\n"
+  "                    [--proxy-max-failures 3] [--proxy-eject-seconds 30]\n"
+  "Timeouts in seconds, 0 disables:\n"
+  "       [--header-timeout 10] [--write-timeout 30] [--idle-timeout 5] [--proxy-timeout 60]\n"
+  "       [--workers 4]  Serve from this many prefork worker processes.\n"
+  "       [--preload-hot 1000]  Hot files handed over and preloaded on upgrade (SIGUSR2).\n"
+  "       [--hot-file hot.txt] [--hot-file-interval 60]  Persist the hot files and\n"
+  "           preload them at startup.\n"
+  "       [--preload-threads 2] [--preload-budget-mb 0] [--preload-before-accept]\n"
+  "Request tracing, dumped as Chrome trace JSON at the trace path:\n"
+  "       [--trace-sample 100] [--trace-buffer 1024] [--trace-path /trace]\n"
+  "       [--trace-file trace.json]  Also saved here on shutdown.\n"
+  "       [--capture requests.cap]  Log requests for httpreplay.\n"
+  "       [--mime-types /etc/mime.types]  Content types beyond the built-in ones.\n"
+  "Per-client connection rate limit:\n"
+  "       [--rate-limit 20] [--rate-burst 40] [--rate-limit-clients 65536] [--rate-limit-refuse]\n"
+  "Sizing; the fd limit is always raised to the hard limit:\n"
+  "       [--auto-tune]  Size the threads, their stacks, the listing cache and the\n"
+  "           rate limiter from the fds, cores and memory, unless given.\n"
+  "       [--thread-stack-kb 0]  Worker thread stacks, 0 for the system default.\n"
+  "       [--memory-log 0]  Log where memory goes every this many seconds; it is\n"
+  "           also reported, with high-water marks, at the stats path.\n";
 
 void exit_with_usage() {
   fprintf(stderr, "%s", USAGE);
   exit(EXIT_SUCCESS);
 }
 
+/* Parses the argument of OPTION as a non-negative integer. */
+int parse_nonnegative_option(char *option, char *value) {
+  if (!value || value[0] < '0' || value[0] > '9') {
+    fprintf(stderr, "Expected non-negative integer after %s\n", option);
+    exit_with_usage();
+  }
+  return atoi(value);
+}
+
+/* Raises the fd limit, fills in the settings --auto-tune was left to
+ * choose and logs what the server ended up with. */
+void tune_server() {
+  tune_t tune;
+  tune_probe(&tune);
+  int processes = num_workers > 0 ? num_workers : 1;
+  if (auto_tune) {
+    if (num_threads == 0 && !coroutines) num_threads = tune_threads(&tune, processes);
+    if (thread_stack_kb < 0 && num_threads > 0)
+      thread_stack_kb = tune_thread_stack(&tune, num_threads) >> 10;
+    if (dircache_size < 0) dircache_size = tune_dircache_entries(&tune, dircache_max_listing);
+    if (rate_limit_clients < 0) rate_limit_clients = tune_clients(&tune);
+  }
+  if (dircache_size < 0) dircache_size = 64;
+  if (rate_limit_clients < 0) rate_limit_clients = 65536;
+  fd_high_water = tune_fd_high_water(&tune);
+
+  pthread_attr_init(&thread_attr);
+  if (thread_stack_kb > 0 &&
+      pthread_attr_setstacksize(&thread_attr, (size_t) thread_stack_kb << 10) != 0) {
+    fprintf(stderr, "Thread stacks of %d KB are too small\n", thread_stack_kb);
+    exit(EINVAL);
+  }
+
+  printf("Limits: %ld fds (raised from %ld), %ld cores, %zu MB memory, ",
+      tune.fds, tune.fds_before, tune.cores, tune.memory >> 20);
+  if (tune.threads_limit > 0)
+    printf("%ld threads, ", tune.threads_limit);
+  else
+    printf("unlimited threads, ");
+  printf("%zu KB stacks\n", tune.stack_limit >> 10);
+  printf("Configuration: %d processes of %d threads, ", processes, num_threads);
+  if (thread_stack_kb > 0)
+    printf("%d KB thread stacks, ", thread_stack_kb);
+  else
+    printf("default thread stacks, ");
+  printf("%d cached listings, %d rate-limited clients, shedding at fd %d\n",
+      dircache_size, rate_limit_clients, fd_high_water);
+}
+
 int main(int argc, char **argv) {
   signal(SIGINT, signal_callback_handler);
+  signal(SIGTERM, signal_callback_handler);
+  /* No SA_RESTART, so the signal interrupts accept or wait. */
+  struct sigaction upgrade_action;
+  memset(&upgrade_action, 0, sizeof(upgrade_action));
+  upgrade_action.sa_handler = upgrade_signal_handler;
+  sigaction(SIGUSR2, &upgrade_action, NULL);
+  /* Threads inherit this mask; only the accepting thread unblocks them. */
+  sigemptyset(&control_signals);
+  sigaddset(&control_signals, SIGINT);
+  sigaddset(&control_signals, SIGTERM);
+  sigaddset(&control_signals, SIGUSR2);
+  pthread_sigmask(SIG_BLOCK, &control_signals, NULL);
+  /* Options are parsed from a copy, so an upgrade execs the command line
+   * this process was started with, whatever parsing does to the strings. */
+  server_argv = argv;
+  argv = malloc((argc + 1) * sizeof(char *));
+  if (!argv) exit(ENOMEM);
+  for (int i = 0; i < argc; i++)
+    if (!(argv[i] = strdup(server_argv[i]))) exit(ENOMEM);
+  argv[argc] = NULL;
+  /* Writes to a client that went away must fail, not kill the server. */
+  signal(SIGPIPE, SIG_IGN);
 
   /* Default settings */
   server_port = 8000;
@@ -360,6 +2406,13 @@ int main(int argc, char **argv) {
         fprintf(stderr, "Expected argument after --files\n");
         exit_with_usage();
       }
+    } else if (strcmp("--pack", argv[i]) == 0) {
+      request_handler = handle_pack_request;
+      server_pack_file = argv[++i];
+      if (!server_pack_file) {
+        fprintf(stderr, "Expected argument after --pack\n");
+        exit_with_usage();
+      }
     } else if (strcmp("--proxy", argv[i]) == 0) {
       request_handler = handle_proxy_request;
 
@@ -369,6 +2422,10 @@ int main(int argc, char **argv) {
         exit_with_usage();
       }
 
+      /* A comma-separated list balances over several backends; the first
+       * one names the Host sent upstream. */
+      proxy_backends = proxy_target;
+      proxy_target = strndup(proxy_target, strcspn(proxy_target, ","));
       char *colon_pointer = strchr(proxy_target, ':');
       if (colon_pointer != NULL) {
         *colon_pointer = '\0';
@@ -378,6 +2435,110 @@ int main(int argc, char **argv) {
         server_proxy_hostname = proxy_target;
         server_proxy_port = 80;
       }
+    } else if (strcmp("--routes", argv[i]) == 0) {
+      routes_file = argv[++i];
+      if (!routes_file) {
+        fprintf(stderr, "Expected argument after --routes\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--uploads", argv[i]) == 0) {
+      uploads = 1;
+    } else if (strcmp("--upload-max-mb", argv[i]) == 0) {
+      upload_max_mb = parse_nonnegative_option(argv[i], argv[i + 1]);
+      i++;
+    } else if (strcmp("--upload-rate-kb", argv[i]) == 0) {
+      upload_rate_kb = parse_nonnegative_option(argv[i], argv[i + 1]);
+      i++;
+    } else if (strcmp("--coroutines", argv[i]) == 0) {
+      coroutines = 1;
+    } else if (strcmp("--coroutine-schedulers", argv[i]) == 0) {
+      coroutine_schedulers = parse_nonnegative_option(argv[i], argv[i + 1]);
+      i++;
+    } else if (strcmp("--coroutine-stack-kb", argv[i]) == 0) {
+      coroutine_stack_kb = parse_nonnegative_option(argv[i], argv[i + 1]);
+      i++;
+    } else if (strcmp("--queue-policy", argv[i]) == 0) {
+      char *policy = argv[++i];
+      if (policy && strcmp(policy, "fifo") == 0) {
+        queue_policy = WQ_FIFO;
+      } else if (policy && strcmp(policy, "sjf") == 0) {
+        queue_policy = WQ_SJF;
+      } else {
+        fprintf(stderr, "Expected fifo or sjf after --queue-policy\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--queue-aging-ms", argv[i]) == 0) {
+      queue_aging_ms = parse_nonnegative_option(argv[i], argv[i + 1]);
+      i++;
+    } else if (strcmp("--h2c", argv[i]) == 0) {
+      h2c = 1;
+    } else if (strcmp("--dynamic-prefix", argv[i]) == 0) {
+      dynamic_prefix = argv[++i];
+      if (!dynamic_prefix || dynamic_prefix[0] != '/') {
+        fprintf(stderr, "Expected a path after --dynamic-prefix\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--dynamic-command", argv[i]) == 0) {
+      dynamic_command = argv[++i];
+      if (!dynamic_command) {
+        fprintf(stderr, "Expected argument after --dynamic-command\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--dynamic-workers", argv[i]) == 0) {
+      dynamic_workers = parse_nonnegative_option(argv[i], argv[i + 1]);
+      i++;
+    } else if (strcmp("--dynamic-requests", argv[i]) == 0) {
+      dynamic_requests = parse_nonnegative_option(argv[i], argv[i + 1]);
+      i++;
+    } else if (strcmp("--dynamic-socket-dir", argv[i]) == 0) {
+      dynamic_socket_dir = argv[++i];
+      if (!dynamic_socket_dir) {
+        fprintf(stderr, "Expected argument after --dynamic-socket-dir\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--proxy-balance", argv[i]) == 0) {
+      char *policy = argv[++i];
+      if (policy && strcmp(policy, "least") == 0) {
+        proxy_balance = BALANCER_LEAST_OUTSTANDING;
+      } else if (policy && strcmp(policy, "p2c") == 0) {
+        proxy_balance = BALANCER_TWO_CHOICES;
+      } else {
+        fprintf(stderr, "Expected least or p2c after --proxy-balance\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--proxy-health-path", argv[i]) == 0) {
+      proxy_health_path = argv[++i];
+      if (!proxy_health_path) {
+        fprintf(stderr, "Expected argument after --proxy-health-path\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--proxy-health-interval", argv[i]) == 0) {
+      proxy_health_interval = parse_nonnegative_option(argv[i], argv[i + 1]);
+      i++;
+    } else if (strcmp("--proxy-max-failures", argv[i]) == 0) {
+      proxy_max_failures = parse_nonnegative_option(argv[i], argv[i + 1]);
+      i++;
+    } else if (strcmp("--proxy-eject-seconds", argv[i]) == 0) {
+      proxy_eject_seconds = parse_nonnegative_option(argv[i], argv[i + 1]);
+      i++;
+    } else if (strcmp("--proxy-connect-timeout", argv[i]) == 0) {
+      proxy_connect_timeout = parse_nonnegative_option(argv[i], argv[i + 1]);
+      i++;
+    } else if (strcmp("--proxy-cache-mb", argv[i]) == 0) {
+      proxy_cache_mb = parse_nonnegative_option(argv[i], argv[i + 1]);
+      i++;
+    } else if (strcmp("--proxy-cache-dir", argv[i]) == 0) {
+      proxy_cache_dir = argv[++i];
+      if (!proxy_cache_dir) {
+        fprintf(stderr, "Expected argument after --proxy-cache-dir\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--proxy-cache-disk-mb", argv[i]) == 0) {
+      proxy_cache_disk_mb = parse_nonnegative_option(argv[i], argv[i + 1]);
+      i++;
+    } else if (strcmp("--proxy-cache-object-mb", argv[i]) == 0) {
+      proxy_cache_object_mb = parse_nonnegative_option(argv[i], argv[i + 1]);
+      i++;
     } else if (strcmp("--port", argv[i]) == 0) {
       char *server_port_string = argv[++i];
       if (!server_port_string) {
@@ -391,6 +2552,138 @@ int main(int argc, char **argv) {
         fprintf(stderr, "Expected positive integer after --num-threads\n");
         exit_with_usage();
       }
+    } else if (strcmp("--memory-log", argv[i]) == 0) {
+      memory_log_interval = parse_nonnegative_option(argv[i], argv[i + 1]);
+      i++;
+    } else if (strcmp("--auto-tune", argv[i]) == 0) {
+      auto_tune = 1;
+    } else if (strcmp("--thread-stack-kb", argv[i]) == 0) {
+      thread_stack_kb = parse_nonnegative_option(argv[i], argv[i + 1]);
+      i++;
+    } else if (strcmp("--disk-threads", argv[i]) == 0) {
+      disk_threads = parse_nonnegative_option(argv[i], argv[i + 1]);
+      i++;
+    } else if (strcmp("--io-buffer-sizes", argv[i]) == 0) {
+      if (!argv[i + 1] ||
+          (num_io_buffer_sizes = bufpool_parse_sizes(argv[i + 1], io_buffer_sizes)) < 0) {
+        fprintf(stderr, "Expected ascending sizes in KB after --io-buffer-sizes\n");
+        exit_with_usage();
+      }
+      i++;
+    } else if (strcmp("--io-buffer-memory-mb", argv[i]) == 0) {
+      io_buffer_memory_mb = parse_nonnegative_option(argv[i], argv[i + 1]);
+      i++;
+    } else if (strcmp("--disk-queue", argv[i]) == 0) {
+      disk_queue = parse_nonnegative_option(argv[i], argv[i + 1]);
+      i++;
+    } else if (strcmp("--sort-listings", argv[i]) == 0) {
+      sort_listings = 1;
+    } else if (strcmp("--dircache-size", argv[i]) == 0) {
+      char *dircache_size_str = argv[++i];
+      if (!dircache_size_str || (dircache_size = atoi(dircache_size_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --dircache-size\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--stats-path", argv[i]) == 0) {
+      stats_path = argv[++i];
+      if (!stats_path) {
+        fprintf(stderr, "Expected argument after --stats-path\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--trace-sample", argv[i]) == 0) {
+      trace_sample = parse_nonnegative_option(argv[i], argv[i + 1]);
+      i++;
+    } else if (strcmp("--trace-buffer", argv[i]) == 0) {
+      trace_buffer = parse_nonnegative_option(argv[i], argv[i + 1]);
+      i++;
+    } else if (strcmp("--trace-path", argv[i]) == 0) {
+      trace_path = argv[++i];
+      if (!trace_path) {
+        fprintf(stderr, "Expected argument after --trace-path\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--trace-file", argv[i]) == 0) {
+      trace_file = argv[++i];
+      if (!trace_file) {
+        fprintf(stderr, "Expected argument after --trace-file\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--capture", argv[i]) == 0) {
+      capture_file = argv[++i];
+      if (!capture_file) {
+        fprintf(stderr, "Expected argument after --capture\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--mime-types", argv[i]) == 0) {
+      mime_types_file = argv[++i];
+      if (!mime_types_file) {
+        fprintf(stderr, "Expected argument after --mime-types\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--header-timeout", argv[i]) == 0) {
+      header_timeout = parse_nonnegative_option(argv[i], argv[i + 1]);
+      i++;
+    } else if (strcmp("--write-timeout", argv[i]) == 0) {
+      write_timeout = parse_nonnegative_option(argv[i], argv[i + 1]);
+      i++;
+    } else if (strcmp("--idle-timeout", argv[i]) == 0) {
+      idle_timeout = parse_nonnegative_option(argv[i], argv[i + 1]);
+      i++;
+    } else if (strcmp("--proxy-timeout", argv[i]) == 0) {
+      proxy_timeout = parse_nonnegative_option(argv[i], argv[i + 1]);
+      i++;
+    } else if (strcmp("--workers", argv[i]) == 0) {
+      char *num_workers_str = argv[++i];
+      if (!num_workers_str || (num_workers = atoi(num_workers_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --workers\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--preload-hot", argv[i]) == 0) {
+      preload_hot = parse_nonnegative_option(argv[i], argv[i + 1]);
+      i++;
+    } else if (strcmp("--hot-file", argv[i]) == 0) {
+      hot_file = argv[++i];
+      if (!hot_file) {
+        fprintf(stderr, "Expected argument after --hot-file\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--hot-file-interval", argv[i]) == 0) {
+      char *interval_str = argv[++i];
+      if (!interval_str || (hot_file_interval = atoi(interval_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --hot-file-interval\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--preload-threads", argv[i]) == 0) {
+      char *threads_str = argv[++i];
+      if (!threads_str || (preload_threads = atoi(threads_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --preload-threads\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--preload-budget-mb", argv[i]) == 0) {
+      preload_budget = (long long) parse_nonnegative_option(argv[i], argv[i + 1]) << 20;
+      i++;
+    } else if (strcmp("--preload-before-accept", argv[i]) == 0) {
+      preload_before_accept = 1;
+    } else if (strcmp("--rate-limit", argv[i]) == 0) {
+      char *rate_limit_str = argv[++i];
+      if (!rate_limit_str || (rate_limit = atof(rate_limit_str)) <= 0) {
+        fprintf(stderr, "Expected positive number after --rate-limit\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--rate-burst", argv[i]) == 0) {
+      char *rate_burst_str = argv[++i];
+      if (!rate_burst_str || (rate_burst = atof(rate_burst_str)) < 1) {
+        fprintf(stderr, "Expected number of at least 1 after --rate-burst\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--rate-limit-clients", argv[i]) == 0) {
+      char *clients_str = argv[++i];
+      if (!clients_str || (rate_limit_clients = atoi(clients_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --rate-limit-clients\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--rate-limit-refuse", argv[i]) == 0) {
+      rate_limit_refuse = 1;
     } else if (strcmp("--help", argv[i]) == 0) {
       exit_with_usage();
     } else {
@@ -399,12 +2692,100 @@ int main(int argc, char **argv) {
     }
   }
 
-  if (server_files_directory == NULL && server_proxy_hostname == NULL) {
-    fprintf(stderr, "Please specify either \"--files [DIRECTORY]\" or \n"
-                    "                      \"--proxy [HOSTNAME:PORT]\"\n");
+  if (server_files_directory == NULL && server_proxy_hostname == NULL &&
+      server_pack_file == NULL && routes_file == NULL) {
+    fprintf(stderr, "Please specify either \"--files [DIRECTORY]\", \n"
+                    "                      \"--pack [FILE]\", \n"
+                    "                      \"--proxy [HOSTNAME:PORT]\" or \n"
+                    "                      \"--routes [FILE]\"\n");
+    exit_with_usage();
+  }
+  if (!request_handler) request_handler = handle_routed_request;
+
+  router_init(&router);
+  if (stats_path) router_add(&router, NULL, stats_path, 1, ROUTE_STATS, NULL);
+  if (trace_path) router_add(&router, NULL, trace_path, 1, ROUTE_TRACE, NULL);
+  if (dynamic_prefix) router_add(&router, NULL, dynamic_prefix, 0, ROUTE_DYNAMIC, NULL);
+  if (routes_file && router_load(&router, routes_file) < 0) exit(EXIT_FAILURE);
+  int dynamic_routes = 0, proxy_routes = 0;
+  for (int j = 0; j < router.num_routes; j++) {
+    dynamic_routes |= router.routes[j].type == ROUTE_DYNAMIC;
+    proxy_routes |= router.routes[j].type == ROUTE_PROXY;
+  }
+  if (!dynamic_routes != !dynamic_command || dynamic_workers < 1 || dynamic_requests < 1) {
+    fprintf(stderr, "Dynamic routes and --dynamic-command go together, with at least one "
+        "worker and request\n");
     exit_with_usage();
   }
+  /* These wait on threads and conditions no coroutine can yield from. The
+   * work queue, and so its policy, isn't used by coroutines at all. */
+  if (coroutines && (h2c || dynamic_command || proxy_cache_mb > 0 || queue_policy == WQ_SJF ||
+      coroutine_stack_kb < 32)) {
+    fprintf(stderr, "--coroutines doesn't go with --h2c, --dynamic-command, "
+        "--proxy-cache-mb or --queue-policy sjf, and needs stacks of at least 32 KB\n");
+    exit_with_usage();
+  }
+  if (router_compile(&router) < 0) {
+    perror("Failed to compile routes");
+    exit(EXIT_FAILURE);
+  }
+
+  if (server_pack_file && pack_open(&server_pack, server_pack_file) < 0) {
+    fprintf(stderr, "Cannot load pack %s\n", server_pack_file);
+    exit(EXIT_FAILURE);
+  }
+
+  /* The proxy and each proxy route balance over a pool of their own. */
+  if ((proxy_backends || proxy_routes) && balancer_init(proxy_balance, proxy_max_failures,
+      proxy_eject_seconds, proxy_connect_timeout) < 0)
+    exit(ENXIO);
+  if (proxy_backends) {
+    if ((server_proxy_pool = balancer_add_pool(proxy_backends)) < 0) exit(ENXIO);
+    proxy_pools++;
+    server_proxy_host = malloc(strlen(server_proxy_hostname) + 16);
+    sprintf(server_proxy_host, "%s:%d", server_proxy_hostname, server_proxy_port);
+  }
+  for (int j = 0; j < router.num_routes; j++) {
+    route_t *route = &router.routes[j];
+    if (route->type != ROUTE_PROXY) continue;
+    if ((route->pool = balancer_add_pool(route->target)) < 0) exit(ENXIO);
+    proxy_pools++;
+  }
+
+  if (proxy_pools > 0 && proxy_cache_mb > 0)
+    cache_init((size_t) proxy_cache_mb << 20, proxy_cache_dir,
+        (size_t) proxy_cache_disk_mb << 20, (size_t) proxy_cache_object_mb << 20);
+  /* Routes need each request parsed, which relaying bytes blindly doesn't. */
+  if (request_handler == handle_proxy_request && (proxy_cache_mb > 0 || router.num_routes > 0))
+    request_handler = handle_cache_proxy_request;
+
+  if (mime_types_file && mime_load(mime_types_file) < 0) {
+    perror(mime_types_file);
+    exit(EXIT_FAILURE);
+  }
 
+  tune_server();
+  /* Relays always take their buffer from the pool. */
+  if (((size_t) io_buffer_memory_mb << 20) < io_buffer_sizes[0]) {
+    fprintf(stderr, "--io-buffer-memory-mb must hold at least one %zu KB buffer\n",
+        io_buffer_sizes[0] >> 10);
+    exit_with_usage();
+  }
+  bufpool_init(io_buffer_sizes, num_io_buffer_sizes, (size_t) io_buffer_memory_mb << 20);
+  footprint_track("io_buffers", bufpool_memory);
+  if (proxy_pools > 0 && proxy_cache_mb > 0) footprint_track("proxy_cache", cache_memory);
+  stats_init(num_workers + 1);
+  if (trace_sample > 0) trace_init(trace_sample, trace_buffer);
+  if (capture_file && capture_open(capture_file, getenv(UPGRADE_ENV) != NULL) < 0) {
+    perror("Failed to open capture file");
+    exit(EXIT_FAILURE);
+  }
+  hotlist_init(HOTLIST_CAPACITY);
+  dircache_init(sort_listings, dircache_size, dircache_max_listing);
+  if (rate_limit > 0) {
+    if (rate_burst < 1) rate_burst = rate_limit < 1 ? 1 : rate_limit;
+    ratelimit_init(rate_limit, rate_burst, rate_limit_clients);
+  }
   serve_forever(&server_fd, request_handler);
 
   return EXIT_SUCCESS;
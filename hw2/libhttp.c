@@ -1,11 +1,17 @@
 #include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <sys/uio.h>
 
+#include "arena.h"
 #include "libhttp.h"
+#include "mime.h"
 
 #define LIBHTTP_REQUEST_MAX_SIZE 8192
 
@@ -14,16 +20,157 @@ void http_fatal_error(char *message) {
   exit(ENOBUFS);
 }
 
+/* Finds the blank line ending the headers in the SIZE bytes of
+ * READ_BUFFER, rescanning from SCAN_FROM, and stores where it ends. */
+static int http_find_headers_end(char *read_buffer, int scan_from, char **headers_end) {
+  char *end = strstr(read_buffer + scan_from, "\r\n\r\n");
+  if (end) {
+    *headers_end = end + 4;
+    return 1;
+  }
+  end = strstr(read_buffer + scan_from, "\n\n");
+  if (end) {
+    *headers_end = end + 2;
+    return 1;
+  }
+  return 0;
+}
+
+/* Reads from fd until the blank line ending the request headers has been
+ * received, after the BYTES_READ bytes already in READ_BUFFER. Returns the
+ * number of bytes in it, or -1 if the connection closed or failed first. */
+static int http_read_headers(int fd, char *read_buffer, int bytes_read, char **headers_end) {
+  read_buffer[bytes_read] = '\0';
+  if (bytes_read > 0 && http_find_headers_end(read_buffer, 0, headers_end))
+    return bytes_read;
+  while (bytes_read < LIBHTTP_REQUEST_MAX_SIZE) {
+    ssize_t n = (http_read_hook ? http_read_hook : read)(fd, read_buffer + bytes_read,
+        LIBHTTP_REQUEST_MAX_SIZE - bytes_read);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    /* Rescan a few old bytes in case the terminator straddles two reads. */
+    int scan_from = bytes_read > 3 ? bytes_read - 3 : 0;
+    bytes_read += n;
+    read_buffer[bytes_read] = '\0'; /* Always null-terminate. */
+    if (http_find_headers_end(read_buffer, scan_from, headers_end)) return bytes_read;
+  }
+  return -1;
+}
+
+void http_carry_free(struct http_carry *carry) {
+  free(carry->data);
+  carry->data = NULL;
+  carry->size = 0;
+}
+
+/* Cuts the request's body down to its Content-Length and moves the bytes
+ * after it to CARRY, if there is one. Bodies of unknown length, and the
+ * stream after a protocol switch, keep everything that was read. */
+static void http_split_body(struct http_request *request, struct http_carry *carry) {
+  request->body_unread = 0;
+  if (http_request_header(request, "Transfer-Encoding")) {
+    request->body_unread = -1;
+    return;
+  }
+  if (http_request_header(request, "Upgrade")) return;
+  char *content_length = http_request_header(request, "Content-Length");
+  long long length = content_length ? atoll(content_length) : 0;
+  size_t body_size = request->body_size;
+  if (length <= 0)
+    body_size = 0;
+  else if ((long long) body_size > length)
+    body_size = length;
+  else
+    request->body_unread = length - body_size;
+  if (carry && body_size < request->body_size) {
+    carry->size = request->body_size - body_size;
+    carry->data = malloc(carry->size);
+    if (!carry->data) http_fatal_error("Malloc failed");
+    memcpy(carry->data, request->body + body_size, carry->size);
+  }
+  request->body_size = body_size;
+}
+
+/* Splits the header lines between start and end in place. */
+static void http_parse_headers(struct http_request *request, char *start, char *end) {
+  while (start < end && request->num_headers < HTTP_MAX_HEADERS) {
+    char *line_end = memchr(start, '\n', end - start);
+    if (!line_end) break;
+    char *next = line_end + 1;
+    if (line_end > start && line_end[-1] == '\r') line_end--;
+    *line_end = '\0';
+
+    char *colon = strchr(start, ':');
+    if (colon && colon > start) {
+      *colon = '\0';
+      char *value = colon + 1;
+      while (*value == ' ' || *value == '\t') value++;
+      request->headers[request->num_headers].key = start;
+      request->headers[request->num_headers].value = value;
+      request->num_headers++;
+    }
+    start = next;
+  }
+}
+
+int http_has_token(const char *value, const char *token) {
+  size_t length = strlen(token);
+  while (value && *value) {
+    while (*value == ' ' || *value == ',') value++;
+    if (strncasecmp(value, token, length) == 0 &&
+        (value[length] == '\0' || value[length] == ',' || value[length] == ' '))
+      return 1;
+    value = strchr(value, ',');
+  }
+  return 0;
+}
+
+/* Allocates from ARENA if there is one, from the heap otherwise. */
+static void *http_alloc(struct arena *arena, size_t size) {
+  if (arena) return arena_alloc(arena, size);
+  void *p = malloc(size);
+  if (!p) http_fatal_error("Malloc failed");
+  return p;
+}
+
+int http_keep_head;
+
 struct http_request *http_request_parse(int fd) {
-  struct http_request *request = calloc(1, sizeof(struct http_request));
-  if (!request) http_fatal_error("Malloc failed");
+  return http_request_parse_arena(fd, NULL);
+}
+
+struct http_request *http_request_parse_arena(int fd, struct arena *arena) {
+  return http_request_parse_carry(fd, arena, NULL);
+}
+
+struct http_request *http_request_parse_carry(int fd, struct arena *arena,
+    struct http_carry *carry) {
+  struct http_request *request = http_alloc(arena, sizeof(struct http_request));
+  memset(request, 0, sizeof(struct http_request));
+  request->arena = arena;
 
-  char *read_buffer = malloc(LIBHTTP_REQUEST_MAX_SIZE + 1);
-  if (!read_buffer) http_fatal_error("Malloc failed");
+  char *read_buffer = http_alloc(arena, LIBHTTP_REQUEST_MAX_SIZE + 1);
+  request->read_buffer = read_buffer;
 
-  int bytes_read = read(fd, read_buffer, LIBHTTP_REQUEST_MAX_SIZE);
-  read_buffer[bytes_read] = '\0'; /* Always null-terminate. */
+  /* Carried bytes never exceed a request buffer, since they came from one. */
+  int carried = 0;
+  if (carry && carry->size > 0) {
+    carried = carry->size;
+    memcpy(read_buffer, carry->data, carried);
+    http_carry_free(carry);
+  }
+  char *headers_end = NULL;
+  int bytes_read = http_read_headers(fd, read_buffer, carried, &headers_end);
+  if (bytes_read < 0) {
+    http_request_free(request);
+    return NULL;
+  }
   printf("\n--------------------\nRequest start %i:\n%sRequest end\n", fd, read_buffer);
+  if (http_keep_head) {
+    request->head_size = headers_end - read_buffer;
+    request->head = http_alloc(arena, request->head_size);
+    memcpy(request->head, read_buffer, request->head_size);
+  }
 
   char *read_start, *read_end;
   size_t read_size;
@@ -34,7 +181,7 @@ struct http_request *http_request_parse(int fd) {
     while (*read_end >= 'A' && *read_end <= 'Z') read_end++;
     read_size = read_end - read_start;
     if (read_size == 0) break;
-    request->method = malloc(read_size + 1);
+    request->method = http_alloc(arena, read_size + 1);
     memcpy(request->method, read_start, read_size);
     request->method[read_size] = '\0';
 
@@ -48,45 +195,83 @@ struct http_request *http_request_parse(int fd) {
     while (*read_end != '\0' && *read_end != ' ' && *read_end != '\n') read_end++;
     read_size = read_end - read_start;
     if (read_size == 0) break;
-    request->path = malloc(read_size + 1);
+    request->path = http_alloc(arena, read_size + 1);
     memcpy(request->path, read_start, read_size);
     request->path[read_size] = '\0';
 
     /* Read in HTTP version and rest of request line: ".*" */
     read_start = read_end;
+    request->version = 10;
+    if (strncmp(read_start, " HTTP/1.", 8) == 0 && read_start[8] >= '1' && read_start[8] <= '9')
+      request->version = 11;
     while (*read_end != '\0' && *read_end != '\n') read_end++;
     if (*read_end != '\n') break;
     read_end++;
 
-    free(read_buffer);
+    /* Read in the headers, which are left in read_buffer. */
+    http_parse_headers(request, read_end, headers_end);
+    request->body = headers_end;
+    request->body_size = bytes_read - (headers_end - read_buffer);
+    http_split_body(request, carry);
+
+    char *connection = http_request_header(request, "Connection");
+    if (request->version >= 11)
+      request->keep_alive = !http_has_token(connection, "close");
+    else
+      request->keep_alive = http_has_token(connection, "keep-alive");
+
     return request;
   } while (0);
 
   /* An error occurred. */
   http_request_free(request);
-  free(read_buffer);
   return NULL;
 
 }
 
+char *http_request_header(struct http_request *request, const char *key) {
+  for (int i = 0; i < request->num_headers; i++) {
+    if (strcasecmp(request->headers[i].key, key) == 0)
+      return request->headers[i].value;
+  }
+  return NULL;
+}
+
 void http_request_free(struct http_request* request) {
+  /* Arena requests go with the arena's next reset. */
+  if (request->arena) return;
   if (request->method) free(request->method);
   if (request->path) free(request->path);
+  if (request->read_buffer) free(request->read_buffer);
+  free(request->head);
   free(request);
 }
 
+/* Codes without a phrase of their own get the generic one of their class. */
 char* http_get_response_message(int status_code) {
   switch (status_code) {
     case 100:
       return "Continue";
+    case 101:
+      return "Switching Protocols";
     case 200:
       return "OK";
+    case 201:
+      return "Created";
+    case 204:
+      return "No Content";
+    case 206:
+      return "Partial Content";
     case 301:
       return "Moved Permanently";
     case 302:
       return "Found";
     case 304:
       return "Not Modified";
+    case 307:
+      return "Temporary Redirect";
+    case 308:
+      return "Permanent Redirect";
     case 400:
       return "Bad Request";
     case 401:
@@ -97,90 +282,345 @@ char* http_get_response_message(int status_code) {
       return "Not Found";
     case 405:
       return "Method Not Allowed";
-    default:
+    case 409:
+      return "Conflict";
+    case 410:
+      return "Gone";
+    case 411:
+      return "Length Required";
+    case 413:
+      return "Content Too Large";
+    case 416:
+      return "Range Not Satisfiable";
+    case 429:
+      return "Too Many Requests";
+    case 500:
       return "Internal Server Error";
+    case 502:
+      return "Bad Gateway";
+    case 503:
+      return "Service Unavailable";
+    case 504:
+      return "Gateway Timeout";
+  }
+  switch (status_code / 100) {
+    case 1:
+      return "Informational";
+    case 2:
+      return "Success";
+    case 3:
+      return "Redirection";
+    case 4:
+      return "Client Error";
+    default:
+      return "Server Error";
   }
 }
 
+void (*http_response_hook)(int fd, int status_code);
+void (*http_sent_hook)(int fd, size_t size);
+ssize_t (*http_read_hook)(int fd, void *buffer, size_t size);
+ssize_t (*http_write_hook)(int fd, const void *buffer, size_t size);
+ssize_t (*http_writev_hook)(int fd, const struct iovec *iov, int iovcnt);
+
+static void http_count_sent(int fd, ssize_t size) {
+  if (http_sent_hook && size > 0) http_sent_hook(fd, size);
+}
+
+/* The head being built by http_start_response and http_send_header on this
+ * thread. Nothing can yield before http_end_headers sends it, and it is
+ * taken off the thread while it is sent, so a coroutine that yields in the
+ * write can't have it overwritten by another starting a response. */
+static __thread struct http_buffer http_head;
+
 void http_start_response(int fd, int status_code) {
-  dprintf(fd, "HTTP/1.0 %d %s\r\n", status_code,
+  if (http_response_hook) http_response_hook(fd, status_code);
+  http_head.size = 0;
+  http_buffer_printf(&http_head, "HTTP/1.1 %d %s\r\n", status_code,
       http_get_response_message(status_code));
 }
 
+int http_send_response_headers(int fd, int status_code, const char *headers, size_t size) {
+  if (http_response_hook) http_response_hook(fd, status_code);
+  char status[64];
+  struct iovec iov[3] = {
+    { .iov_base = status, .iov_len = snprintf(status, sizeof(status), "HTTP/1.1 %d %s\r\n",
+        status_code, http_get_response_message(status_code)) },
+    { .iov_base = (char *) headers, .iov_len = size },
+    { .iov_base = "\r\n", .iov_len = 2 },
+  };
+  return http_send_iovec(fd, iov, 3);
+}
+
 void http_send_header(int fd, char *key, char *value) {
-  dprintf(fd, "%s: %s\r\n", key, value);
+  http_buffer_printf(&http_head, "%s: %s\r\n", key, value);
 }
 
 void http_end_headers(int fd) {
-  dprintf(fd, "\r\n");
+  struct http_buffer head = http_head;
+  http_buffer_init(&http_head);
+  http_buffer_append(&head, "\r\n", 2);
+  http_send_data(fd, head.data, head.size);
+  /* Kept for the next response, unless one made its own meanwhile. */
+  if (http_head.data) {
+    http_buffer_free(&head);
+  } else {
+    http_head = head;
+    http_head.size = 0;
+  }
 }
 
 void http_send_string(int fd, char *data) {
   http_send_data(fd, data, strlen(data));
 }
 
-void http_send_data(int fd, char *data, size_t size) {
+int http_send_data(int fd, char *data, size_t size) {
   ssize_t bytes_sent;
   while (size > 0) {
-    bytes_sent = write(fd, data, size);
+    bytes_sent = (http_write_hook ? http_write_hook : write)(fd, data, size);
+    if (bytes_sent < 0 && errno == EINTR)
+      continue;
     if (bytes_sent < 0)
-      return;
+      return -1;
+    http_count_sent(fd, bytes_sent);
     size -= bytes_sent;
     data += bytes_sent;
   }
+  return 0;
+}
+
+int http_send_iovec(int fd, struct iovec *iov, int iovcnt) {
+  while (iovcnt > 0) {
+    ssize_t bytes_sent = (http_writev_hook ? http_writev_hook : writev)(fd, iov, iovcnt);
+    if (bytes_sent < 0 && errno == EINTR) continue;
+    if (bytes_sent < 0) return -1;
+    http_count_sent(fd, bytes_sent);
+    while (iovcnt > 0 && (size_t) bytes_sent >= iov->iov_len) {
+      bytes_sent -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *) iov->iov_base + bytes_sent;
+      iov->iov_len -= bytes_sent;
+    }
+  }
+  return 0;
+}
+
+void http_stream_begin(struct http_stream *stream, int fd, struct http_request *request,
+    int status_code) {
+  stream->fd = fd;
+  stream->size = 0;
+  stream->error = 0;
+  stream->chunked = request->version >= 11;
+  stream->head_only = strcmp(request->method, "HEAD") == 0;
+  if (!stream->chunked && !stream->head_only) request->keep_alive = 0;
+
+  http_start_response(fd, status_code);
+  if (stream->chunked) http_send_header(fd, "Transfer-Encoding", "chunked");
+  http_send_header(fd, "Connection", request->keep_alive ? "keep-alive" : "close");
+}
+
+/* Sends the buffered bytes followed by DATA as a single chunk. */
+static void http_stream_send(struct http_stream *stream, char *data, size_t size) {
+  size_t total = stream->size + size;
+  if (total == 0 || stream->error || stream->head_only) {
+    stream->size = 0;
+    return;
+  }
+
+  char prefix[32];
+  struct iovec iov[4];
+  int iovcnt = 0;
+  if (stream->chunked) {
+    iov[iovcnt].iov_base = prefix;
+    iov[iovcnt++].iov_len = snprintf(prefix, sizeof(prefix), "%zx\r\n", total);
+  }
+  if (stream->size > 0) {
+    iov[iovcnt].iov_base = stream->buffer;
+    iov[iovcnt++].iov_len = stream->size;
+  }
+  if (size > 0) {
+    iov[iovcnt].iov_base = data;
+    iov[iovcnt++].iov_len = size;
+  }
+  if (stream->chunked) {
+    iov[iovcnt].iov_base = "\r\n";
+    iov[iovcnt++].iov_len = 2;
+  }
+  if (http_send_iovec(stream->fd, iov, iovcnt) < 0) stream->error = 1;
+  stream->size = 0;
+}
+
+void http_stream_write(struct http_stream *stream, char *data, size_t size) {
+  if (stream->size + size <= HTTP_STREAM_BUFFER_SIZE) {
+    memcpy(stream->buffer + stream->size, data, size);
+    stream->size += size;
+    return;
+  }
+  http_stream_send(stream, data, size);
+}
+
+void http_stream_end(struct http_stream *stream) {
+  http_stream_send(stream, NULL, 0);
+  if (stream->chunked && !stream->error && !stream->head_only) {
+    struct iovec iov = { .iov_base = "0\r\n\r\n", .iov_len = 5 };
+    if (http_send_iovec(stream->fd, &iov, 1) < 0) stream->error = 1;
+  }
 }
 
 char *http_get_mime_type(char *file_name) {
-  char *file_extension = strrchr(file_name, '.');
-  if (file_extension == NULL) {
-    return "text/plain";
-  }
-
-  if (strcmp(file_extension, ".html") == 0 || strcmp(file_extension, ".htm") == 0) {
-    return "text/html";
-  } else if (strcmp(file_extension, ".jpg") == 0 || strcmp(file_extension, ".jpeg") == 0) {
-    return "image/jpeg";
-  } else if (strcmp(file_extension, ".png") == 0) {
-    return "image/png";
-  } else if (strcmp(file_extension, ".css") == 0) {
-    return "text/css";
-  } else if (strcmp(file_extension, ".js") == 0) {
-    return "application/javascript";
-  } else if (strcmp(file_extension, ".pdf") == 0) {
-    return "application/pdf";
+  return mime_lookup(file_name)->type;
+}
+
+void http_buffer_init(struct http_buffer *buffer) {
+  buffer->data = NULL;
+  buffer->size = 0;
+  buffer->capacity = 0;
+}
+
+/* Makes room for at least size more bytes, doubling the capacity so appends
+ * stay amortized O(1). */
+static void http_buffer_reserve(struct http_buffer *buffer, size_t size) {
+  if (buffer->size + size <= buffer->capacity) return;
+  size_t capacity = buffer->capacity ? buffer->capacity : MAX_FILE_SIZE;
+  while (capacity < buffer->size + size) capacity *= 2;
+  char *data = realloc(buffer->data, capacity);
+  if (!data) http_fatal_error("Malloc failed");
+  buffer->data = data;
+  buffer->capacity = capacity;
+}
+
+void http_buffer_append(struct http_buffer *buffer, const char *data, size_t size) {
+  http_buffer_reserve(buffer, size);
+  memcpy(buffer->data + buffer->size, data, size);
+  buffer->size += size;
+}
+
+void http_buffer_printf(struct http_buffer *buffer, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf(NULL, 0, format, args);
+  va_end(args);
+  if (n < 0) return;
+
+  /* Reserve one extra byte for the terminator vsnprintf always writes. */
+  http_buffer_reserve(buffer, n + 1);
+  va_start(args, format);
+  vsnprintf(buffer->data + buffer->size, n + 1, format, args);
+  va_end(args);
+  buffer->size += n;
+}
+
+void http_buffer_free(struct http_buffer *buffer) {
+  free(buffer->data);
+  http_buffer_init(buffer);
+}
+
+static void http_list_file_entry(struct http_buffer *buffer, char *request_path,
+    const char *name) {
+  if (strcmp(name, ".") == 0) {
+    http_buffer_printf(buffer, "<a href=\"/\">%s</a><br />\n", name);
+  } else if (strcmp(name, "..") == 0) {
+    http_buffer_printf(buffer, "<a href=\"../\">%s</a><br />\n", name);
   } else {
-    return "text/plain";
+    size_t length = strlen(request_path);
+    char *slash = (length > 0 && request_path[length - 1] == '/') ? "" : "/";
+    http_buffer_printf(buffer, "<a href=\"%s%s%s\">%s</a><br />\n",
+        request_path, slash, name, name);
   }
 }
 
-size_t http_get_list_files(const char* http_files_dir, char* request_path, char* buff, size_t size) {
-  int n, total = 0;
+static int http_compare_names(const void *a, const void *b) {
+  return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/* Renders the listing one entry at a time into LINE, handing each rendered
+ * entry to EMIT. Stops and returns 1 if EMIT returns nonzero. */
+static int http_list_files(const char* http_files_dir, char* request_path, int sorted,
+    int (*emit)(void *sink, struct http_buffer *line), void *sink) {
   char fullpath[MAX_PATH];
-  strcpy(fullpath, http_files_dir);
-  strcat(fullpath, request_path);
-  char href[MAX_PATH];
-  DIR *d;
+  if (snprintf(fullpath, MAX_PATH, "%s%s", http_files_dir, request_path) >= MAX_PATH)
+    return -1;
+
+  DIR *d = opendir(fullpath);
+  if (!d) return -1;
+
+  struct http_buffer line;
+  http_buffer_init(&line);
   struct dirent *dir;
-  d = opendir(fullpath);
-  if (d) {
-    while ((dir = readdir(d)) != NULL) {
-      strcpy(href, request_path);
-      if (href[strlen(href) - 1] != '/') {
-        strcat(href, "/");
-      }
-      strcat(href, dir->d_name);
-      if (strcmp(dir->d_name, ".") == 0) {
-        n = snprintf(buff, size, "<a href=\"/\">%s</a><br />\n", dir->d_name);
-      } else if (strcmp(dir->d_name, "..") == 0) {
-        n = snprintf(buff, size, "<a href=\"../\">%s</a><br />\n", dir->d_name);
-      } else {
-        n = snprintf(buff, size, "<a href=\"%s\">%s</a><br />\n", href, dir->d_name);
-      }
-      size -= n;
-      buff += n;
-      total += n;
+  int stopped = 0;
+  if (!sorted) {
+    while (!stopped && (dir = readdir(d)) != NULL) {
+      line.size = 0;
+      http_list_file_entry(&line, request_path, dir->d_name);
+      stopped = emit(sink, &line);
     }
     closedir(d);
+    http_buffer_free(&line);
+    return stopped;
+  }
+
+  /* Collect the names first so they can be sorted before rendering. */
+  size_t count = 0, capacity = 64;
+  char **names = malloc(capacity * sizeof(char *));
+  if (!names) http_fatal_error("Malloc failed");
+  while ((dir = readdir(d)) != NULL) {
+    if (count == capacity) {
+      capacity *= 2;
+      names = realloc(names, capacity * sizeof(char *));
+      if (!names) http_fatal_error("Malloc failed");
+    }
+    names[count] = strdup(dir->d_name);
+    if (!names[count]) http_fatal_error("Malloc failed");
+    count++;
+  }
+  closedir(d);
+
+  qsort(names, count, sizeof(char *), http_compare_names);
+  for (size_t i = 0; i < count; i++) {
+    if (!stopped) {
+      line.size = 0;
+      http_list_file_entry(&line, request_path, names[i]);
+      stopped = emit(sink, &line);
+    }
+    free(names[i]);
   }
-  return total;
+  free(names);
+  http_buffer_free(&line);
+  return stopped;
+}
+
+/* A listing rendered into a buffer, up to max_size bytes. */
+struct http_list_buffer {
+  struct http_buffer *buffer;
+  size_t max_size;
+};
+
+static int http_list_to_buffer(void *sink, struct http_buffer *line) {
+  struct http_list_buffer *list = sink;
+  http_buffer_append(list->buffer, line->data, line->size);
+  return list->buffer->size > list->max_size;
+}
+
+static int http_list_to_stream(void *sink, struct http_buffer *line) {
+  http_stream_write(sink, line->data, line->size);
+  return 0;
+}
+
+int http_get_list_files(const char* http_files_dir, char* request_path, int sorted,
+    struct http_buffer *buffer) {
+  return http_get_list_files_max(http_files_dir, request_path, sorted, SIZE_MAX, buffer);
+}
+
+int http_get_list_files_max(const char* http_files_dir, char* request_path, int sorted,
+    size_t max_size, struct http_buffer *buffer) {
+  struct http_list_buffer list = { buffer, max_size };
+  return http_list_files(http_files_dir, request_path, sorted, http_list_to_buffer, &list);
+}
+
+int http_stream_list_files(struct http_stream *stream, const char* http_files_dir,
+    char* request_path, int sorted) {
+  return http_list_files(http_files_dir, request_path, sorted, http_list_to_stream, stream);
 }
@@ -15,41 +15,163 @@
  *     http_send_string(fd, "<html><body><a href='/'>Home</a></body></html>");
  *
  *     close(fd);
+ *
+ * Bodies whose length is not known up front can be streamed instead. On
+ * HTTP/1.1 they are sent with chunked encoding, so the connection can be
+ * kept alive; HTTP/1.0 clients get a close-delimited body.
+ *
+ *     struct http_stream stream;
+ *     http_stream_begin(&stream, fd, request, 200);
+ *     http_send_header(fd, "Content-Type", "text/html");
+ *     http_end_headers(fd);
+ *     http_stream_write(&stream, data, size);
+ *     http_stream_end(&stream);
  */
 
 #ifndef LIBHTTP_H
 #define LIBHTTP_H
 
+#include <stddef.h>
+#include <sys/types.h>
+
 #define MAX_PATH 1024
 #define MAX_FILE_SIZE 4096
+#define HTTP_MAX_HEADERS 32
+#define HTTP_STREAM_BUFFER_SIZE 8192
 
 
 /*
  * Functions for parsing an HTTP request.
  */
+struct http_header {
+  char *key;
+  char *value;
+};
+
 struct http_request {
   char *method;
   char *path;
+  int version;                  // 10 for HTTP/1.0, 11 for HTTP/1.1.
+  int keep_alive;               // Whether the client wants the connection reused.
+  struct http_header headers[HTTP_MAX_HEADERS];
+  int num_headers;
+  char *body;                   // Body bytes read along with the headers,
+                                // no more than its Content-Length.
+  size_t body_size;
+  long long body_unread;        // Body bytes still on the socket, -1 if
+                                // unknown. Whoever reads them counts them off.
+  char *read_buffer;
+  char *head;                   // The head as received, if http_keep_head.
+  size_t head_size;
+  struct arena *arena;          // Owner of the request's memory, or NULL.
+};
+
+/* Bytes read from a connection past the end of a request and its body:
+ * the start of the next request, pipelined behind it. */
+struct http_carry {
+  char *data;
+  size_t size;
 };
 
 struct http_request *http_request_parse(int fd);
+/* Same as http_request_parse, but takes all of the request's memory from
+ * ARENA (see arena.h), so that resetting the arena releases it. */
+struct arena;
+struct http_request *http_request_parse_arena(int fd, struct arena *arena);
+/* Same again, but parses the bytes in CARRY before reading more, and leaves
+ * whatever follows this request's body there for the next call. Bytes past
+ * a request that switches protocols are left in its body instead. */
+struct http_request *http_request_parse_carry(int fd, struct arena *arena,
+    struct http_carry *carry);
+void http_carry_free(struct http_carry *carry);
+/* Returns the value of header KEY (case-insensitive), or NULL. */
+char *http_request_header(struct http_request *request, const char *key);
+/* Returns 1 if the comma-separated header VALUE lists TOKEN (case-insensitive). */
+int http_has_token(const char *value, const char *token);
 void http_request_free(struct http_request* request);
+/* If set, parsed requests keep a verbatim copy of their head, which the
+ * parser otherwise splits in place. */
+extern int http_keep_head;
 
 /*
  * Functions for sending an HTTP response.
  */
+/* Starts a response head, which http_send_header adds to and
+ * http_end_headers sends in a single write. */
 void http_start_response(int fd, int status_code);
+/* If set, called by http_start_response before anything is written, e.g.
+ * to timestamp the response. */
+extern void (*http_response_hook)(int fd, int status_code);
+/* If set, called with the number of bytes each write to a client sent. */
+extern void (*http_sent_hook)(int fd, size_t size);
+struct iovec;
+/* If set, used instead of read, write and writev on client sockets, e.g. to
+ * wait for them without blocking the thread. */
+extern ssize_t (*http_read_hook)(int fd, void *buffer, size_t size);
+extern ssize_t (*http_write_hook)(int fd, const void *buffer, size_t size);
+extern ssize_t (*http_writev_hook)(int fd, const struct iovec *iov, int iovcnt);
+/* Sends the status line, HEADERS (whole "Key: value\r\n" lines) and the
+ * blank line ending them in a single write. Returns -1 on failure. */
+int http_send_response_headers(int fd, int status_code, const char *headers, size_t size);
 void http_send_header(int fd, char *key, char *value);
 void http_end_headers(int fd);
 void http_send_string(int fd, char *data);
-void http_send_data(int fd, char *data, size_t size);
+/* Returns -1 if the data could not be sent in full. */
+int http_send_data(int fd, char *data, size_t size);
+/* Sends all of IOV with as few writes as possible. Modifies IOV. Returns -1
+ * if it could not be sent in full. */
+int http_send_iovec(int fd, struct iovec *iov, int iovcnt);
+
+/*
+ * Functions for streaming a response body of unknown length. Writes smaller
+ * than the stream buffer are coalesced into one chunk.
+ */
+struct http_stream {
+  int fd;
+  int chunked;
+  int head_only;               // Answers a HEAD request, so nothing is sent.
+  int error;
+  size_t size;
+  char buffer[HTTP_STREAM_BUFFER_SIZE];
+};
+
+/* Sends the status line and framing headers. Clears request->keep_alive if
+ * the body has to be close-delimited. The body is dropped for HEAD. */
+void http_stream_begin(struct http_stream *stream, int fd, struct http_request *request,
+    int status_code);
+void http_stream_write(struct http_stream *stream, char *data, size_t size);
+void http_stream_end(struct http_stream *stream);
+
+/*
+ * Growable buffer for generated response bodies.
+ */
+struct http_buffer {
+  char *data;
+  size_t size;
+  size_t capacity;
+};
+
+void http_buffer_init(struct http_buffer *buffer);
+void http_buffer_append(struct http_buffer *buffer, const char *data, size_t size);
+void http_buffer_printf(struct http_buffer *buffer, const char *format, ...)
+  __attribute__((format(printf, 2, 3)));
+void http_buffer_free(struct http_buffer *buffer);
 
 /*
  * Helper functions
  */
-/* Gets the Content-Type based on a file name. */
+/* Gets the Content-Type based on a file name. See mime.h. */
 char *http_get_mime_type(char *file_name);
-/* Gets list of files from path in html */
-size_t http_get_list_files(const char* http_files_dir, char* request_path, char* buff, size_t size);
+/* Appends the list of files in path to buffer as html, sorted by name if
+ * sorted is set. Returns -1 if the directory cannot be opened. */
+int http_get_list_files(const char* http_files_dir, char* request_path, int sorted,
+    struct http_buffer *buffer);
+/* Same as http_get_list_files, but gives up and returns 1 as soon as the
+ * listing grows past MAX_SIZE bytes, leaving BUFFER with part of it. */
+int http_get_list_files_max(const char* http_files_dir, char* request_path, int sorted,
+    size_t max_size, struct http_buffer *buffer);
+/* Same as http_get_list_files, but streams the listing as it is read. */
+int http_stream_list_files(struct http_stream *stream, const char* http_files_dir,
+    char* request_path, int sorted);
 
 #endif
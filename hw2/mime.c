@@ -0,0 +1,265 @@
+#include <ctype.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mime.h"
+
+/* Give up on a table size after this many displacements for one bucket. */
+#define MIME_MAX_DISPLACEMENT 65536
+
+static const char *mime_builtin[][2] = {
+  { "html", "text/html" }, { "htm", "text/html" }, { "css", "text/css" },
+  { "txt", "text/plain" }, { "csv", "text/csv" }, { "xml", "application/xml" },
+  { "js", "application/javascript" }, { "mjs", "application/javascript" },
+  { "json", "application/json" }, { "map", "application/json" },
+  { "wasm", "application/wasm" }, { "pdf", "application/pdf" },
+  { "zip", "application/zip" }, { "gz", "application/gzip" }, { "tar", "application/x-tar" },
+  { "jpg", "image/jpeg" }, { "jpeg", "image/jpeg" }, { "png", "image/png" },
+  { "gif", "image/gif" }, { "svg", "image/svg+xml" }, { "ico", "image/x-icon" },
+  { "webp", "image/webp" }, { "avif", "image/avif" },
+  { "woff", "font/woff" }, { "woff2", "font/woff2" }, { "ttf", "font/ttf" }, { "otf", "font/otf" },
+  { "mp3", "audio/mpeg" }, { "mp4", "video/mp4" }, { "webm", "video/webm" },
+};
+
+/* Every extension given so far, later ones taking precedence. */
+typedef struct mime_pair {
+  mime_type_t type;
+  int order;
+} mime_pair_t;
+
+static mime_pair_t *mime_pairs;
+static int mime_num_pairs, mime_pairs_capacity;
+
+/* The perfect hash: a key's bucket picks a displacement, and the key's hash
+ * displaced by it picks a slot no other key maps to. */
+static mime_type_t *mime_slots;
+static uint32_t *mime_displacements;
+static uint32_t mime_slot_mask, mime_bucket_mask;
+
+static mime_type_t mime_default = {
+  .extension = "",
+  .type = "text/plain",
+  .header = "Content-Type: text/plain\r\n",
+  .header_size = sizeof("Content-Type: text/plain\r\n") - 1,
+};
+
+static pthread_once_t mime_once = PTHREAD_ONCE_INIT;
+
+/* FNV-1a, over extensions that are already lowercase. */
+#define MIME_HASH_SEED 14695981039346656037ull
+#define MIME_HASH_PRIME 1099511628211ull
+
+static uint64_t mime_hash(const char *extension) {
+  uint64_t hash = MIME_HASH_SEED;
+  while (*extension) hash = (hash ^ (unsigned char) *extension++) * MIME_HASH_PRIME;
+  return hash;
+}
+
+static uint64_t mime_mix(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ull;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebull;
+  return x ^ (x >> 31);
+}
+
+static uint32_t mime_bucket(uint64_t hash, uint32_t bucket_mask) {
+  return (hash >> 32) & bucket_mask;
+}
+
+static uint32_t mime_slot(uint64_t hash, uint32_t displacement, uint32_t slot_mask) {
+  return mime_mix(hash + (displacement + 1) * 0x9e3779b97f4a7c15ull) & slot_mask;
+}
+
+static int mime_add(const char *extension, const char *type) {
+  size_t length = strlen(extension);
+  if (length == 0 || length >= MIME_EXTENSION_MAX) return -1;
+  if (mime_num_pairs == mime_pairs_capacity) {
+    int capacity = mime_pairs_capacity ? mime_pairs_capacity * 2 : 64;
+    mime_pair_t *pairs = realloc(mime_pairs, capacity * sizeof(mime_pair_t));
+    if (!pairs) return -1;
+    mime_pairs = pairs;
+    mime_pairs_capacity = capacity;
+  }
+  mime_pair_t *pair = &mime_pairs[mime_num_pairs];
+  for (size_t i = 0; i <= length; i++) pair->type.extension[i] = tolower((unsigned char) extension[i]);
+  size_t header_size = strlen("Content-Type: \r\n") + strlen(type);
+  if (header_size > MIME_HEADER_MAX) return -1;
+  pair->type.type = strdup(type);
+  pair->type.header = malloc(header_size + 1);
+  if (!pair->type.type || !pair->type.header) {
+    free(pair->type.type);
+    free(pair->type.header);
+    return -1;
+  }
+  snprintf(pair->type.header, header_size + 1, "Content-Type: %s\r\n", type);
+  pair->type.header_size = header_size;
+  pair->order = mime_num_pairs++;
+  return 0;
+}
+
+static int mime_compare_pairs(const void *a, const void *b) {
+  const mime_pair_t *x = a, *y = b;
+  int result = strcmp(x->type.extension, y->type.extension);
+  return result ? result : x->order - y->order;
+}
+
+/* Finds displacements that place every key in a slot of its own. The table
+ * in use is only replaced once they are all found. */
+static int mime_place(mime_type_t **keys, int n, uint32_t num_slots, uint32_t num_buckets) {
+  uint32_t slot_mask = num_slots - 1, bucket_mask = num_buckets - 1;
+  mime_type_t *slots = calloc(num_slots, sizeof(mime_type_t));
+  uint32_t *displacements = calloc(num_buckets, sizeof(uint32_t));
+  uint32_t *starts = calloc(num_buckets + 1, sizeof(uint32_t));
+  uint32_t *order = malloc(num_buckets * sizeof(uint32_t));
+  int *members = malloc((n + 1) * sizeof(int));
+  uint64_t *hashes = malloc((n + 1) * sizeof(uint64_t));
+  uint32_t *placed = malloc((n + 1) * sizeof(uint32_t));
+  int ok = slots && displacements && starts && order && members && hashes && placed;
+
+  /* Group the keys by bucket: bucket b owns members[starts[b]..starts[b + 1]). */
+  for (int i = 0; ok && i < n; i++) {
+    hashes[i] = mime_hash(keys[i]->extension);
+    starts[mime_bucket(hashes[i], bucket_mask) + 1]++;
+  }
+  for (uint32_t b = 0; ok && b < num_buckets; b++) starts[b + 1] += starts[b];
+  /* order[] serves as the fill cursor until the buckets are sorted. */
+  if (ok) memcpy(order, starts, num_buckets * sizeof(uint32_t));
+  for (int i = 0; ok && i < n; i++) members[order[mime_bucket(hashes[i], bucket_mask)]++] = i;
+
+  /* Place the fullest buckets first, while there is the most room. */
+  for (uint32_t i = 0; ok && i < num_buckets; i++) order[i] = i;
+  for (uint32_t i = 1; ok && i < num_buckets; i++) {
+    uint32_t bucket = order[i], j = i;
+    uint32_t size = starts[bucket + 1] - starts[bucket];
+    for (; j > 0 && starts[order[j - 1] + 1] - starts[order[j - 1]] < size; j--)
+      order[j] = order[j - 1];
+    order[j] = bucket;
+  }
+
+  for (uint32_t b = 0; ok && b < num_buckets; b++) {
+    uint32_t bucket = order[b];
+    int count = starts[bucket + 1] - starts[bucket];
+    if (count == 0) break;
+    int *bucket_members = &members[starts[bucket]];
+    int found = 0;
+    for (uint32_t d = 0; d < MIME_MAX_DISPLACEMENT && !found; d++) {
+      int i;
+      for (i = 0; i < count; i++) {
+        uint32_t slot = mime_slot(hashes[bucket_members[i]], d, slot_mask);
+        if (slots[slot].extension[0]) break;
+        /* Claim the slot now, so keys of the same bucket cannot share it. */
+        slots[slot] = *keys[bucket_members[i]];
+        placed[i] = slot;
+      }
+      found = i == count;
+      if (found) {
+        displacements[bucket] = d;
+      } else {
+        while (i-- > 0) memset(&slots[placed[i]], 0, sizeof(mime_type_t));
+      }
+    }
+    if (!found) ok = 0;
+  }
+
+  free(starts);
+  free(order);
+  free(members);
+  free(hashes);
+  free(placed);
+  if (!ok) {
+    free(slots);
+    free(displacements);
+    return -1;
+  }
+  free(mime_slots);
+  free(mime_displacements);
+  mime_slots = slots;
+  mime_displacements = displacements;
+  mime_slot_mask = slot_mask;
+  mime_bucket_mask = bucket_mask;
+  return 0;
+}
+
+static int mime_build(void) {
+  qsort(mime_pairs, mime_num_pairs, sizeof(mime_pair_t), mime_compare_pairs);
+  mime_type_t **keys = malloc((mime_num_pairs + 1) * sizeof(mime_type_t *));
+  if (!keys) return -1;
+  int n = 0;
+  for (int i = 0; i < mime_num_pairs; i++) {
+    /* Of several entries for one extension, the last given wins. */
+    if (i + 1 < mime_num_pairs &&
+        strcmp(mime_pairs[i].type.extension, mime_pairs[i + 1].type.extension) == 0)
+      continue;
+    keys[n++] = &mime_pairs[i].type;
+  }
+
+  uint32_t num_slots = 1, num_buckets = 1;
+  while (num_slots < (uint32_t) n + n / 4) num_slots *= 2;
+  while (num_buckets < (uint32_t) n / 2) num_buckets *= 2;
+  int result;
+  while ((result = mime_place(keys, n, num_slots, num_buckets)) < 0 && num_slots < (1u << 24))
+    num_slots *= 2;
+  free(keys);
+  return result;
+}
+
+static void mime_init(void) {
+  for (size_t i = 0; i < sizeof(mime_builtin) / sizeof(mime_builtin[0]); i++)
+    mime_add(mime_builtin[i][0], mime_builtin[i][1]);
+  if (mime_build() < 0) fprintf(stderr, "Failed to build the MIME table\n");
+}
+
+int mime_load(const char *file) {
+  pthread_once(&mime_once, mime_init);
+  FILE *f = fopen(file, "r");
+  if (!f) return -1;
+  char *line = NULL;
+  size_t capacity = 0;
+  int count = 0;
+  while (getline(&line, &capacity, f) >= 0) {
+    char *comment = strchr(line, '#');
+    if (comment) *comment = '\0';
+    char *saveptr;
+    char *type = strtok_r(line, " \t\r\n", &saveptr);
+    if (!type) continue;
+    char *extension;
+    while ((extension = strtok_r(NULL, " \t\r\n", &saveptr)) != NULL) {
+      if (mime_add(extension, type) == 0) count++;
+    }
+  }
+  free(line);
+  fclose(f);
+  if (mime_build() < 0) {
+    fprintf(stderr, "Failed to build the MIME table from %s\n", file);
+    return -1;
+  }
+  return count;
+}
+
+const mime_type_t *mime_lookup(const char *file_name) {
+  pthread_once(&mime_once, mime_init);
+  const char *dot = strrchr(file_name, '.');
+  if (!dot || !mime_slots) return &mime_default;
+
+  /* Lowercase and hash the extension in one pass. */
+  char extension[MIME_EXTENSION_MAX];
+  uint64_t hash = MIME_HASH_SEED;
+  size_t i = 0;
+  for (dot++; dot[i]; i++) {
+    if (i == MIME_EXTENSION_MAX - 1) return &mime_default;
+    char c = dot[i] >= 'A' && dot[i] <= 'Z' ? dot[i] + 'a' - 'A' : dot[i];
+    extension[i] = c;
+    hash = (hash ^ (unsigned char) c) * MIME_HASH_PRIME;
+  }
+  extension[i] = '\0';
+  /* Empty slots have an empty extension too. */
+  if (i == 0) return &mime_default;
+
+  uint32_t bucket = mime_bucket(hash, mime_bucket_mask);
+  mime_type_t *type = &mime_slots[mime_slot(hash, mime_displacements[bucket], mime_slot_mask)];
+  return strcmp(type->extension, extension) == 0 ? type : &mime_default;
+}
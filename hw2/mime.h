@@ -0,0 +1,32 @@
+#ifndef __MIME__
+#define __MIME__
+
+#include <stddef.h>
+
+/* MIME maps file extensions to content types through a perfect hash table,
+ * so a lookup costs one hash of the extension and one comparison. Each
+ * type also carries its ready-made "Content-Type: ...\r\n" header line for
+ * response builders to copy as is. The table starts with a built-in set of
+ * common web types and can be extended from a mime.types file. It is
+ * rebuilt on load and must not be changed while lookups may be running. */
+
+#define MIME_EXTENSION_MAX 16
+/* Longest header line kept; types that would not fit are skipped. */
+#define MIME_HEADER_MAX 128
+
+typedef struct mime_type {
+  char extension[MIME_EXTENSION_MAX];  // Lowercase, without the dot.
+  char *type;
+  char *header;                        // "Content-Type: <type>\r\n"
+  size_t header_size;
+} mime_type_t;
+
+/* Adds the types in a mime.types file ("type ext ext ..." lines) to the
+ * table, replacing built-in ones with the same extension. Returns the
+ * number of extensions read, or -1 if FILE cannot be read. */
+int mime_load(const char *file);
+/* Returns the type of FILE_NAME by its extension, ignoring case. Files
+ * without a known extension are text/plain. */
+const mime_type_t *mime_lookup(const char *file_name);
+
+#endif
@@ -0,0 +1,121 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "libhttp.h"
+#include "pack.h"
+
+uint64_t pack_hash(const char *path, size_t size) {
+  uint64_t hash = 14695981039346656037ull;
+  for (size_t i = 0; i < size; i++) {
+    hash ^= (unsigned char) path[i];
+    hash *= 1099511628211ull;
+  }
+  return hash ? hash : 1;
+}
+
+/* Whether [offset, offset + size) lies inside the mapping. */
+static int pack_in_bounds(pack_t *pack, uint64_t offset, uint64_t size) {
+  return offset <= pack->size && size <= pack->size - offset;
+}
+
+static int pack_variant_valid(pack_t *pack, pack_variant_t *variant) {
+  return pack_in_bounds(pack, variant->header_offset, variant->header_size) &&
+      pack_in_bounds(pack, variant->body_offset, variant->body_size);
+}
+
+int pack_open(pack_t *pack, const char *file) {
+  int fd = open(file, O_RDONLY);
+  if (fd < 0) {
+    perror("Failed to open pack");
+    return -1;
+  }
+  struct stat s;
+  if (fstat(fd, &s) < 0 || s.st_size < (off_t) sizeof(pack_header_t)) {
+    fprintf(stderr, "%s: not a pack\n", file);
+    close(fd);
+    return -1;
+  }
+  pack->size = s.st_size;
+  pack->map = mmap(NULL, pack->size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (pack->map == MAP_FAILED) {
+    perror("Failed to map pack");
+    return -1;
+  }
+
+  /* Check everything the request path will trust once, up front. */
+  pack->header = (pack_header_t *) pack->map;
+  pack_header_t *header = pack->header;
+  uint32_t slots = header->num_slots;
+  if (memcmp(header->magic, PACK_MAGIC, 8) != 0 || header->version != PACK_VERSION ||
+      slots == 0 || (slots & (slots - 1)) != 0 ||
+      !pack_in_bounds(pack, header->index_offset, (uint64_t) slots * sizeof(pack_entry_t))) {
+    fprintf(stderr, "%s: bad pack header\n", file);
+    munmap(pack->map, pack->size);
+    return -1;
+  }
+  pack->index = (pack_entry_t *) (pack->map + header->index_offset);
+  uint32_t used = 0;
+  for (uint32_t i = 0; i < slots; i++) {
+    pack_entry_t *entry = &pack->index[i];
+    if (entry->hash == 0) continue;
+    used++;
+    if (!pack_in_bounds(pack, entry->path_offset, entry->path_size) ||
+        !pack_variant_valid(pack, &entry->identity) ||
+        (entry->gzip.body_size > 0 && !pack_variant_valid(pack, &entry->gzip))) {
+      fprintf(stderr, "%s: corrupt index entry %u\n", file, i);
+      munmap(pack->map, pack->size);
+      return -1;
+    }
+  }
+  /* Lookups stop at the first empty slot, so a full index would never
+   * answer a miss. */
+  if (used == slots) {
+    fprintf(stderr, "%s: index has no free slot\n", file);
+    munmap(pack->map, pack->size);
+    return -1;
+  }
+
+  /* Bodies are read on every request; ask for them early. */
+  madvise(pack->map, pack->size, MADV_WILLNEED);
+  printf("Loaded pack %s: %u files, %zu bytes\n", file, header->num_entries, pack->size);
+  return 0;
+}
+
+pack_entry_t *pack_lookup(pack_t *pack, const char *path, size_t size) {
+  uint64_t hash = pack_hash(path, size);
+  uint32_t mask = pack->header->num_slots - 1;
+  for (uint32_t i = hash & mask;; i = (i + 1) & mask) {
+    pack_entry_t *entry = &pack->index[i];
+    if (entry->hash == 0) return NULL;
+    if (entry->hash == hash && entry->path_size == size &&
+        memcmp(pack->map + entry->path_offset, path, size) == 0)
+      return entry;
+  }
+}
+
+pack_entry_t *pack_lookup_request(pack_t *pack, const char *path) {
+  size_t size = strlen(path);
+  pack_entry_t *entry = pack_lookup(pack, path, size);
+  if (entry || size + sizeof("/index.html") > MAX_PATH) return entry;
+
+  char index[MAX_PATH];
+  int n = snprintf(index, MAX_PATH, "%s%sindex.html", path,
+      size > 0 && path[size - 1] == '/' ? "" : "/");
+  return pack_lookup(pack, index, n);
+}
+
+int pack_etag(pack_entry_t *entry, int gzip, char *etag, size_t size) {
+  return snprintf(etag, size, "\"%016llx%s\"", (unsigned long long) entry->etag,
+      gzip ? "-gz" : "");
+}
+
+int pack_etag_matches(pack_entry_t *entry, int gzip, const char *if_none_match) {
+  char etag[PACK_ETAG_SIZE];
+  pack_etag(entry, gzip, etag, sizeof(etag));
+  return strcmp(if_none_match, "*") == 0 || strstr(if_none_match, etag) != NULL;
+}
@@ -0,0 +1,71 @@
+#ifndef __PACK__
+#define __PACK__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* PACK is a single-file image of a static site, written by httppack and
+ * served straight from an mmap. The file starts with a pack_header_t. The
+ * index is an open-addressing hash table of pack_entry_t keyed by request
+ * path. Each entry points at its path, its precomputed response headers
+ * (everything but the Connection header and the blank line) and its body.
+ * Bodies are page-aligned, and text assets may also carry a gzip variant.
+ * All offsets are from the start of the file. */
+
+#define PACK_MAGIC "HTTPPACK"
+#define PACK_VERSION 1
+#define PACK_ALIGN 4096
+
+typedef struct pack_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t num_entries;
+  uint32_t num_slots;           // Size of the index, a power of two.
+  uint32_t reserved;
+  uint64_t index_offset;
+} pack_header_t;
+
+typedef struct pack_variant {
+  uint64_t header_offset;
+  uint64_t body_offset;
+  uint64_t body_size;
+  uint32_t header_size;
+  uint32_t reserved;
+} pack_variant_t;
+
+typedef struct pack_entry {
+  uint64_t hash;                // 0 marks an empty slot.
+  uint64_t path_offset;
+  uint32_t path_size;
+  uint32_t reserved;
+  uint64_t etag;
+  pack_variant_t identity;
+  pack_variant_t gzip;          // body_size is 0 without a gzip variant.
+} pack_entry_t;
+
+/* Room for a quoted ETag with its variant suffix. */
+#define PACK_ETAG_SIZE 32
+
+typedef struct pack {
+  char *map;
+  size_t size;
+  pack_header_t *header;
+  pack_entry_t *index;
+} pack_t;
+
+/* Hash of a request path as used by the index. Never 0. */
+uint64_t pack_hash(const char *path, size_t size);
+/* Maps and validates the pack at FILE. Returns -1 on error. */
+int pack_open(pack_t *pack, const char *file);
+pack_entry_t *pack_lookup(pack_t *pack, const char *path, size_t size);
+/* Looks up a request path, falling back to the index.html of a directory. */
+pack_entry_t *pack_lookup_request(pack_t *pack, const char *path);
+/*
+ * Writes the quoted ETag of one variant of ENTRY. The gzip variant carries a
+ * "-gz" suffix so caches never confuse it with the identity body.
+ */
+int pack_etag(pack_entry_t *entry, int gzip, char *etag, size_t size);
+/* Whether an If-None-Match header value matches the variant's ETag. */
+int pack_etag_matches(pack_entry_t *entry, int gzip, const char *if_none_match);
+
+#endif
@@ -0,0 +1,125 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "ratelimit.h"
+#include "utlist.h"
+
+static ratelimit_shard_t *ratelimit_shards;
+static double ratelimit_rate;
+static double ratelimit_burst;
+static int ratelimit_shard_capacity;
+
+/* Forgets every client of SHARD. */
+static void ratelimit_shard_clear(ratelimit_shard_t *shard) {
+  shard->count = 0;
+  shard->lru = NULL;
+  for (int j = 0; j < RATELIMIT_BUCKETS_PER_SHARD; j++) shard->buckets[j] = NULL;
+}
+
+void ratelimit_init(double rate, double burst, int max_clients) {
+  ratelimit_rate = rate;
+  ratelimit_burst = burst;
+  ratelimit_shard_capacity = max_clients / RATELIMIT_SHARDS;
+  if (ratelimit_shard_capacity < 1) ratelimit_shard_capacity = 1;
+
+  /* Mapped at the same address in every worker, so the lists can keep
+   * plain pointers. */
+  size_t shards_size = RATELIMIT_SHARDS * sizeof(ratelimit_shard_t);
+  size_t size = shards_size +
+      (size_t) RATELIMIT_SHARDS * ratelimit_shard_capacity * sizeof(ratelimit_client_t);
+  void *table = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  int shared = table != MAP_FAILED;
+  if (!shared) {
+    perror("Failed to map shared rate limits (limiting per process)");
+    if (!(table = calloc(1, size))) {
+      perror("Failed to allocate rate limits");
+      exit(EXIT_FAILURE);
+    }
+  }
+  ratelimit_shards = table;
+  ratelimit_client_t *clients = (ratelimit_client_t *) ((char *) table + shards_size);
+
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  if (shared) {
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+  }
+  for (int i = 0; i < RATELIMIT_SHARDS; i++) {
+    pthread_mutex_init(&ratelimit_shards[i].lock, &attr);
+    ratelimit_shards[i].clients = clients + (size_t) i * ratelimit_shard_capacity;
+    ratelimit_shard_clear(&ratelimit_shards[i]);
+  }
+  pthread_mutexattr_destroy(&attr);
+}
+
+/* A worker that died holding the lock may have left the shard's lists half
+ * updated, so its clients are forgotten and start again with full buckets. */
+static void ratelimit_lock(ratelimit_shard_t *shard) {
+  if (pthread_mutex_lock(&shard->lock) == EOWNERDEAD) {
+    ratelimit_shard_clear(shard);
+    pthread_mutex_consistent(&shard->lock);
+  }
+}
+
+static uint64_t ratelimit_clock_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Spreads the address bits so neighbouring addresses land in different
+ * shards and buckets. */
+static uint32_t ratelimit_hash(uint32_t addr) {
+  addr ^= addr >> 16;
+  addr *= 0x7feb352d;
+  addr ^= addr >> 15;
+  addr *= 0x846ca68b;
+  addr ^= addr >> 16;
+  return addr;
+}
+
+int ratelimit_allow(uint32_t addr) {
+  uint32_t hash = ratelimit_hash(addr);
+  ratelimit_shard_t *shard = &ratelimit_shards[hash % RATELIMIT_SHARDS];
+  ratelimit_client_t **bucket =
+      &shard->buckets[(hash / RATELIMIT_SHARDS) % RATELIMIT_BUCKETS_PER_SHARD];
+  uint64_t now = ratelimit_clock_ns();
+
+  ratelimit_lock(shard);
+  ratelimit_client_t *client;
+  DL_FOREACH(*bucket, client) {
+    if (client->addr == addr) break;
+  }
+
+  if (client) {
+    DL_DELETE2(shard->lru, client, lru_prev, lru_next);
+    client->tokens += (now - client->last_ns) / 1e9 * ratelimit_rate;
+    if (client->tokens > ratelimit_burst) client->tokens = ratelimit_burst;
+  } else {
+    if (shard->count >= ratelimit_shard_capacity) {
+      /* Reuse the least recently seen client; a forgotten client simply
+       * starts again with a full bucket. */
+      client = shard->lru;
+      DL_DELETE2(shard->lru, client, lru_prev, lru_next);
+      uint32_t old_hash = ratelimit_hash(client->addr);
+      DL_DELETE(shard->buckets[(old_hash / RATELIMIT_SHARDS) % RATELIMIT_BUCKETS_PER_SHARD],
+          client);
+    } else {
+      client = &shard->clients[shard->count++];
+    }
+    client->addr = addr;
+    client->tokens = ratelimit_burst;
+    DL_APPEND(*bucket, client);
+  }
+  client->last_ns = now;
+  DL_APPEND2(shard->lru, client, lru_prev, lru_next);
+
+  int allowed = client->tokens >= 1.0;
+  if (allowed) client->tokens -= 1.0;
+  pthread_mutex_unlock(&shard->lock);
+  return allowed ? 0 : -1;
+}
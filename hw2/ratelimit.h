@@ -0,0 +1,42 @@
+#ifndef __RATELIMIT__
+#define __RATELIMIT__
+
+#include <pthread.h>
+#include <stdint.h>
+
+/* RATELIMIT keeps a token bucket per client address. The table is split
+ * into shards with their own lock so concurrent lookups rarely contend, and
+ * each shard evicts its least recently seen client once it is full. It lives
+ * in shared memory with process-shared locks, so prefork workers all take
+ * from the same buckets and a client's rate holds across them. */
+
+#define RATELIMIT_SHARDS 64
+#define RATELIMIT_BUCKETS_PER_SHARD 256
+
+typedef struct ratelimit_client {
+  uint32_t addr;
+  double tokens;
+  uint64_t last_ns;                    // Time tokens was last refilled.
+  struct ratelimit_client *next;       // Hash bucket chain.
+  struct ratelimit_client *prev;
+  struct ratelimit_client *lru_next;   // Least recently seen first.
+  struct ratelimit_client *lru_prev;
+} ratelimit_client_t;
+
+typedef struct ratelimit_shard {
+  pthread_mutex_t lock;
+  int count;                           // Slots of clients in use.
+  ratelimit_client_t *clients;         // This shard's slots.
+  ratelimit_client_t *buckets[RATELIMIT_BUCKETS_PER_SHARD];
+  ratelimit_client_t *lru;
+} ratelimit_shard_t;
+
+/* Allows RATE connections per second per client, with bursts of up to
+ * BURST, tracking at most MAX_CLIENTS addresses. Must be called before
+ * forking. */
+void ratelimit_init(double rate, double burst, int max_clients);
+/* Takes a token for the client at ADDR (network byte order). Returns 0 if
+ * the connection is allowed and -1 if the client is over its limit. */
+int ratelimit_allow(uint32_t addr);
+
+#endif
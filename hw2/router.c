@@ -0,0 +1,224 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "router.h"
+
+/* A route's trie key: its host, if any, followed by its path. */
+typedef struct router_key {
+  char *key;
+  int route;
+} router_key_t;
+
+static const char *route_type_names[] = {
+  [ROUTE_FILES] = "files",
+  [ROUTE_PROXY] = "proxy",
+  [ROUTE_DYNAMIC] = "dynamic",
+  [ROUTE_STATS] = "stats",
+  [ROUTE_TRACE] = "trace",
+};
+
+void router_init(router_t *router) {
+  memset(router, 0, sizeof(router_t));
+}
+
+static char *lowercase(const char *s) {
+  char *copy = strdup(s);
+  for (char *c = copy; *c; c++) *c = tolower((unsigned char) *c);
+  return copy;
+}
+
+int router_add(router_t *router, const char *host, const char *path, int exact,
+    route_type_t type, const char *target) {
+  for (int i = 0; i < router->num_routes; i++) {
+    route_t *route = &router->routes[i];
+    if (route->exact == exact && strcmp(route->path, path) == 0 &&
+        (route->host && host ? strcasecmp(route->host, host) == 0 : route->host == host))
+      return -1;
+  }
+  route_t *routes = realloc(router->routes, (router->num_routes + 1) * sizeof(route_t));
+  if (!routes) return -1;
+  router->routes = routes;
+  route_t *route = &routes[router->num_routes++];
+  route->type = type;
+  route->host = host ? lowercase(host) : NULL;
+  route->path = strdup(path);
+  route->exact = exact;
+  route->target = target ? strdup(target) : NULL;
+  route->pool = -1;
+  if (host) router->host_routes = 1;
+  return 0;
+}
+
+int router_load(router_t *router, const char *file) {
+  FILE *f = fopen(file, "r");
+  if (!f) {
+    perror(file);
+    return -1;
+  }
+  char line[1024];
+  int number = 0, errors = 0;
+  while (fgets(line, sizeof(line), f)) {
+    number++;
+    char *comment = strchr(line, '#');
+    if (comment) *comment = '\0';
+    char *words[5], *saveptr;
+    int num_words = 0;
+    for (char *word = strtok_r(line, " \t\r\n", &saveptr); word && num_words < 5;
+        word = strtok_r(NULL, " \t\r\n", &saveptr))
+      words[num_words++] = word;
+    if (num_words == 0) continue;
+
+    /* Paths start with "/" or "=/"; anything before one is a host. */
+    char **word = words, **end = words + num_words;
+    char *host = (*word)[0] != '/' && (*word)[0] != '=' ? *word++ : NULL;
+    char *path = word < end ? *word++ : NULL;
+    char *type_name = word < end ? *word++ : NULL;
+    char *target = word < end ? *word++ : NULL;
+    int exact = path && path[0] == '=';
+    if (exact) path++;
+    int type = -1;
+    for (int i = 0; type_name && i < (int) (sizeof(route_type_names) / sizeof(char *)); i++)
+      if (strcmp(type_name, route_type_names[i]) == 0) type = i;
+    const char *error = NULL;
+    if (!path || path[0] != '/')
+      error = "expected [HOST] PATH TYPE [TARGET], with PATH starting with / or =/";
+    else if (type < 0)
+      error = "expected a type of files, proxy, dynamic, stats or trace";
+    else if (!target != !(type == ROUTE_FILES || type == ROUTE_PROXY))
+      error = target ? "this type takes no target" : "this type needs a target";
+    else if (word < end)
+      error = "unexpected words at the end";
+    else if (router_add(router, host, path, exact, type, target) < 0)
+      error = "routed already";
+    if (error) {
+      fprintf(stderr, "%s:%d: %s\n", file, number, error);
+      errors++;
+    }
+  }
+  fclose(f);
+  return errors ? -1 : 0;
+}
+
+static int router_key_compare(const void *a, const void *b) {
+  return strcmp(((router_key_t *) a)->key, ((router_key_t *) b)->key);
+}
+
+/* Builds the subtrie for KEYS[LO, HI), which share their first DEPTH bytes
+ * and are sorted, and returns its node. Each node's edges are allocated
+ * together, so they sit side by side in byte order. Returns -1 if out of
+ * memory. */
+static int64_t router_build(router_t *router, router_key_t *keys, int lo, int hi,
+    size_t depth, uint32_t *num_nodes, uint32_t *num_edges) {
+  router_node_t *nodes = realloc(router->nodes, (*num_nodes + 1) * sizeof(router_node_t));
+  if (!nodes) return -1;
+  router->nodes = nodes;
+  uint32_t node = (*num_nodes)++;
+  nodes[node].prefix_route = nodes[node].exact_route = -1;
+
+  /* Keys ending here sort before the ones going on. */
+  for (; lo < hi && keys[lo].key[depth] == '\0'; lo++) {
+    route_t *route = &router->routes[keys[lo].route];
+    if (route->exact)
+      nodes[node].exact_route = keys[lo].route;
+    else
+      nodes[node].prefix_route = keys[lo].route;
+  }
+  uint32_t count = 0;
+  for (int i = lo; i < hi; i++)
+    if (i == lo || keys[i].key[depth] != keys[i - 1].key[depth]) count++;
+  uint32_t first = *num_edges;
+  if (count > 0) {
+    router_edge_t *edges = realloc(router->edges, (first + count) * sizeof(router_edge_t));
+    if (!edges) return -1;
+    router->edges = edges;
+    *num_edges += count;
+  }
+  nodes[node].first_edge = first;
+  nodes[node].num_edges = count;
+
+  uint32_t edge = first;
+  for (int i = lo; i < hi; ) {
+    int j = i;
+    unsigned char byte = keys[i].key[depth];
+    while (j < hi && (unsigned char) keys[j].key[depth] == byte) j++;
+    int64_t child = router_build(router, keys, i, j, depth + 1, num_nodes, num_edges);
+    if (child < 0) return -1;
+    router->edges[edge].byte = byte;
+    router->edges[edge].node = child;
+    edge++;
+    i = j;
+  }
+  return node;
+}
+
+int router_compile(router_t *router) {
+  router_key_t *keys = calloc(router->num_routes + 1, sizeof(router_key_t));
+  if (!keys) return -1;
+  int result = 0;
+  for (int i = 0; i < router->num_routes && result == 0; i++) {
+    route_t *route = &router->routes[i];
+    const char *host = route->host ? route->host : "";
+    keys[i].key = malloc(strlen(host) + strlen(route->path) + 1);
+    keys[i].route = i;
+    if (keys[i].key)
+      sprintf(keys[i].key, "%s%s", host, route->path);
+    else
+      result = -1;
+  }
+  if (result == 0) {
+    qsort(keys, router->num_routes, sizeof(router_key_t), router_key_compare);
+    uint32_t num_nodes = 0, num_edges = 0;
+    if (router_build(router, keys, 0, router->num_routes, 0, &num_nodes, &num_edges) < 0)
+      result = -1;
+  }
+  for (int i = 0; i < router->num_routes; i++) free(keys[i].key);
+  free(keys);
+  return result;
+}
+
+/* Follows the edge for BYTE out of NODE. Returns -1 if there is none. */
+static int64_t router_next(router_t *router, uint32_t node, unsigned char byte) {
+  router_edge_t *edges = router->edges + router->nodes[node].first_edge;
+  int lo = 0, hi = router->nodes[node].num_edges;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (edges[mid].byte == byte) return edges[mid].node;
+    if (edges[mid].byte < byte)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return -1;
+}
+
+/* Matches the SIZE bytes of PATH from NODE. Returns the route or -1. */
+static int router_match_path(router_t *router, int64_t node, const char *path, size_t size) {
+  int best = -1;
+  for (size_t i = 0; i < size && node >= 0; i++) {
+    node = router_next(router, node, path[i]);
+    if (node >= 0 && router->nodes[node].prefix_route >= 0)
+      best = router->nodes[node].prefix_route;
+  }
+  if (node >= 0 && router->nodes[node].exact_route >= 0) return router->nodes[node].exact_route;
+  return best;
+}
+
+route_t *router_match(router_t *router, const char *host, const char *path) {
+  if (!router->nodes) return NULL;
+  size_t size = strcspn(path, "?");
+  int route = -1;
+  if (host && router->host_routes) {
+    /* The port is not part of the name, but an IPv6 address has colons. */
+    const char *end = host[0] == '[' ? strchr(host, ']') : strchr(host, ':');
+    if (!end) end = host + strlen(host);
+    else if (host[0] == '[') end++;
+    int64_t node = 0;
+    for (const char *c = host; c < end && node >= 0; c++)
+      node = router_next(router, node, tolower((unsigned char) *c));
+    if (node >= 0) route = router_match_path(router, node, path, size);
+  }
+  if (route < 0) route = router_match_path(router, 0, path, size);
+  return route >= 0 ? &router->routes[route] : NULL;
+}
@@ -0,0 +1,75 @@
+#ifndef __ROUTER__
+#define __ROUTER__
+
+#include <stdint.h>
+
+/* ROUTER maps requests to what serves them by Host header and path
+ * prefix, so one process can serve files, proxy to upstreams and run its
+ * internal handlers side by side. Routes are read from a file like:
+ *
+ *   # [HOST] PATH        TYPE     [TARGET]
+ *   /                    files    /var/www
+ *   /api/                proxy    127.0.0.1:9000,127.0.0.1:9001
+ *   /app/                dynamic
+ *   =/stats              stats
+ *   static.example.com / files    /srv/static
+ *
+ * A PATH is a prefix, or the whole path if it starts with "=". The longest
+ * matching prefix wins, and a whole-path match beats any prefix. Routes of
+ * the request's host are tried before routes for any host.
+ *
+ * The routes are compiled into a byte trie keyed by host and path, with
+ * each node's edges sorted in one flat array, so matching walks the path
+ * once, a binary search over a few bytes per step. */
+
+typedef enum route_type {
+  ROUTE_FILES,                  // Files under TARGET, at their request path.
+  ROUTE_PROXY,                  // The backends listed in TARGET, see balancer.h.
+  ROUTE_DYNAMIC,                // The FastCGI worker pool, see fcgipool.h.
+  ROUTE_STATS,
+  ROUTE_TRACE,
+} route_type_t;
+
+typedef struct route {
+  route_type_t type;
+  char *host;                   // Lowercase host it is limited to, or NULL.
+  char *path;
+  int exact;                    // Whether PATH must be the whole path.
+  char *target;                 // NULL for internal handlers.
+  int pool;                     // Balancer pool of a proxy route.
+} route_t;
+
+typedef struct router_node {
+  int32_t prefix_route;         // Route ending here as a prefix, or -1.
+  int32_t exact_route;          // Route ending here as a whole path, or -1.
+  uint32_t first_edge;
+  uint32_t num_edges;
+} router_node_t;
+
+typedef struct router_edge {
+  unsigned char byte;
+  uint32_t node;
+} router_edge_t;
+
+typedef struct router {
+  route_t *routes;
+  int num_routes;
+  int host_routes;              // Whether any route names a host.
+  router_node_t *nodes;         // Root first. NULL until compiled.
+  router_edge_t *edges;
+} router_t;
+
+void router_init(router_t *router);
+/* Adds a route, before the router is compiled. Returns -1 if the same
+ * host and path are routed already. */
+int router_add(router_t *router, const char *host, const char *path, int exact,
+    route_type_t type, const char *target);
+/* Adds the routes in FILE, reporting mistakes by line. Returns -1 on any. */
+int router_load(router_t *router, const char *file);
+/* Builds the trie. Returns -1 if out of memory. */
+int router_compile(router_t *router);
+/* Returns the route for a request for PATH, whose query string is ignored,
+ * with Host header HOST (may be NULL), or NULL if none matches. */
+route_t *router_match(router_t *router, const char *host, const char *path);
+
+#endif
@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <sys/mman.h>
+
+#include "stats.h"
+
+static const char *stats_names[STAT_NUM_COUNTERS] = {
+  [STAT_CONNECTIONS] = "connections",
+  [STAT_REQUESTS] = "requests",
+  [STAT_TIMEOUT_HEADER] = "timeout_header",
+  [STAT_TIMEOUT_WRITE] = "timeout_write",
+  [STAT_TIMEOUT_IDLE] = "timeout_idle",
+  [STAT_TIMEOUT_PROXY] = "timeout_proxy",
+  [STAT_RATE_LIMITED] = "rate_limited",
+  [STAT_SHED] = "shed",
+  [STAT_WORKER_RESTARTS] = "worker_restarts",
+  [STAT_DISK_READS] = "disk_reads",
+  [STAT_BUFFER_WAITS] = "buffer_waits",
+  [STAT_CACHE_HITS] = "cache_hits",
+  [STAT_CACHE_MISSES] = "cache_misses",
+  [STAT_CACHE_COALESCED] = "cache_coalesced",
+  [STAT_CACHE_REVALIDATED] = "cache_revalidated",
+  [STAT_H2_CONNECTIONS] = "h2_connections",
+  [STAT_H2_STREAMS] = "h2_streams",
+  [STAT_DYNAMIC_REQUESTS] = "dynamic_requests",
+  [STAT_DYNAMIC_RESTARTS] = "dynamic_restarts",
+  [STAT_UPLOADS] = "uploads",
+  [STAT_UPLOAD_BYTES] = "upload_bytes",
+  [STAT_QUEUE_SMALL_JOBS] = "queue_small_jobs",
+  [STAT_QUEUE_SMALL_WAIT_US] = "queue_small_wait_us",
+  [STAT_QUEUE_SMALL_SLOW] = "queue_small_slow",
+  [STAT_QUEUE_MEDIUM_JOBS] = "queue_medium_jobs",
+  [STAT_QUEUE_MEDIUM_WAIT_US] = "queue_medium_wait_us",
+  [STAT_QUEUE_MEDIUM_SLOW] = "queue_medium_slow",
+  [STAT_QUEUE_LARGE_JOBS] = "queue_large_jobs",
+  [STAT_QUEUE_LARGE_WAIT_US] = "queue_large_wait_us",
+  [STAT_QUEUE_LARGE_SLOW] = "queue_large_slow",
+  [STAT_QUEUE_AGED] = "queue_aged",
+};
+
+typedef unsigned long stats_row_t[STAT_NUM_COUNTERS];
+
+/* Used until stats_init maps the shared rows. */
+static stats_row_t stats_local_row;
+static stats_row_t *stats_rows = &stats_local_row;
+static int stats_num_slots = 1;
+static int stats_slot;
+
+void stats_init(int num_slots) {
+  stats_row_t *rows = mmap(NULL, num_slots * sizeof(stats_row_t), PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (rows == MAP_FAILED) {
+    perror("Failed to map shared stats (counting per process)");
+    return;
+  }
+  stats_rows = rows;
+  stats_num_slots = num_slots;
+  stats_slot = 0;
+}
+
+void stats_set_slot(int slot) {
+  if (slot < stats_num_slots) stats_slot = slot;
+}
+
+void stats_add(stat_counter_t counter, unsigned long value) {
+  __sync_fetch_and_add(&stats_rows[stats_slot][counter], value);
+}
+
+unsigned long stats_get(stat_counter_t counter) {
+  unsigned long total = 0;
+  for (int i = 0; i < stats_num_slots; i++)
+    total += __sync_fetch_and_add(&stats_rows[i][counter], 0);
+  return total;
+}
+
+void stats_format(struct http_buffer *buffer) {
+  for (int i = 0; i < STAT_NUM_COUNTERS; i++)
+    http_buffer_printf(buffer, "%s %lu\n", stats_names[i], stats_get(i));
+  if (stats_num_slots > 1) {
+    for (int slot = 1; slot < stats_num_slots; slot++)
+      http_buffer_printf(buffer, "worker%d_requests %lu\n", slot - 1,
+          __sync_fetch_and_add(&stats_rows[slot][STAT_REQUESTS], 0));
+  }
+}
@@ -0,0 +1,56 @@
+#ifndef __STATS__
+#define __STATS__
+
+#include "libhttp.h"
+
+/* STATS holds the server's counters. They are updated with atomic adds so
+ * any thread can bump them without taking a lock. The counters live in
+ * shared memory with one row per process, so prefork workers each count into
+ * their own row and any of them can report the sum. */
+
+typedef enum stat_counter {
+  STAT_CONNECTIONS,
+  STAT_REQUESTS,
+  STAT_TIMEOUT_HEADER,      // Killed while sending the first request.
+  STAT_TIMEOUT_WRITE,       // Killed while not reading the response.
+  STAT_TIMEOUT_IDLE,        // Closed idle between keep-alive requests.
+  STAT_TIMEOUT_PROXY,       // Proxied connection with no traffic either way.
+  STAT_RATE_LIMITED,        // Turned away in the accept loop.
+  STAT_SHED,                // Turned away with a 503 as fds ran out.
+  STAT_WORKER_RESTARTS,     // Prefork workers that died and were replaced.
+  STAT_DISK_READS,          // File reads that missed the page cache.
+  STAT_BUFFER_WAITS,        // Waits for an I/O buffer at the memory cap.
+  STAT_CACHE_HITS,          // Proxy requests answered from the cache.
+  STAT_CACHE_MISSES,        // Proxy requests that fetched from upstream.
+  STAT_CACHE_COALESCED,     // Misses that waited on another one's fetch.
+  STAT_CACHE_REVALIDATED,   // Stale entries upstream confirmed with a 304.
+  STAT_H2_CONNECTIONS,      // Connections served over HTTP/2.
+  STAT_H2_STREAMS,          // Requests on them, also counted as connections.
+  STAT_DYNAMIC_REQUESTS,    // Requests forwarded to the dynamic worker pool.
+  STAT_DYNAMIC_RESTARTS,    // Dynamic workers that exited and were restarted.
+  STAT_UPLOADS,             // Files stored from PUT and POST bodies.
+  STAT_UPLOAD_BYTES,
+  STAT_QUEUE_SMALL_JOBS,    // Work queue items served, by cost class.
+  STAT_QUEUE_SMALL_WAIT_US, // Total time they waited in the queue.
+  STAT_QUEUE_SMALL_SLOW,    // Ones that waited over 10 ms.
+  STAT_QUEUE_MEDIUM_JOBS,
+  STAT_QUEUE_MEDIUM_WAIT_US,
+  STAT_QUEUE_MEDIUM_SLOW,
+  STAT_QUEUE_LARGE_JOBS,
+  STAT_QUEUE_LARGE_WAIT_US,
+  STAT_QUEUE_LARGE_SLOW,
+  STAT_QUEUE_AGED,          // Items served ahead of a cheaper class by aging.
+  STAT_NUM_COUNTERS
+} stat_counter_t;
+
+/* Maps counters for NUM_SLOTS processes. Must be called before forking. */
+void stats_init(int num_slots);
+/* Selects the row this process counts into, 0 being the master's. */
+void stats_set_slot(int slot);
+void stats_add(stat_counter_t counter, unsigned long value);
+/* Returns the sum of COUNTER over all processes. */
+unsigned long stats_get(stat_counter_t counter);
+/* Appends every counter as a "name value" line to buffer. */
+void stats_format(struct http_buffer *buffer);
+
+#endif
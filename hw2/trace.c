@@ -0,0 +1,253 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "utlist.h"
+
+/* Where a queued connection stands before a worker picks it up. */
+typedef struct trace_pending {
+  int sampled;
+  uint64_t accept;
+  uint64_t enqueue;
+} trace_pending_t;
+
+/* The requests finished by one thread. Only that thread writes to it; the
+ * lock keeps a dump from reading a record halfway through an update. */
+typedef struct trace_ring {
+  pthread_mutex_t lock;
+  pid_t tid;
+  unsigned long count;                 // Records written so far.
+  trace_record_t *records;
+  struct trace_ring *next;
+  struct trace_ring *prev;
+} trace_ring_t;
+
+static int trace_sample_every;
+static int trace_ring_size;
+static unsigned long trace_accepts;
+/* Indexed by fd, so no lookup is needed between accept and dequeue. */
+static trace_pending_t *trace_pending;
+static int trace_max_fd;
+
+static pthread_mutex_t trace_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_ring_t *trace_rings;
+static __thread trace_ring_t *trace_thread_ring;
+static __thread trace_request_t *trace_current;
+
+void trace_init(int sample_every, int ring_size) {
+  struct rlimit limit;
+  int max_fd = 65536;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < (rlim_t) max_fd)
+    max_fd = limit.rlim_cur;
+  trace_pending = calloc(max_fd, sizeof(trace_pending_t));
+  if (!trace_pending) {
+    perror("Failed to allocate trace table (not tracing)");
+    return;
+  }
+  trace_max_fd = max_fd;
+  trace_ring_size = ring_size;
+  trace_sample_every = sample_every;
+  http_response_hook = trace_response_started;
+}
+
+uint64_t trace_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void trace_accepted(int fd) {
+  if (trace_sample_every <= 0 || fd >= trace_max_fd) return;
+  trace_pending_t *pending = &trace_pending[fd];
+  pending->sampled = __sync_fetch_and_add(&trace_accepts, 1) % trace_sample_every == 0;
+  if (pending->sampled) pending->accept = trace_now();
+}
+
+void trace_enqueued(int fd) {
+  if (trace_sample_every <= 0 || fd >= trace_max_fd || !trace_pending[fd].sampled) return;
+  trace_pending[fd].enqueue = trace_now();
+}
+
+void trace_begin(trace_request_t *trace, int fd) {
+  memset(trace, 0, sizeof(trace_request_t));
+  if (trace_sample_every <= 0 || fd >= trace_max_fd || !trace_pending[fd].sampled) return;
+  /* The queue's lock orders these reads after the accept loop's writes. */
+  trace_pending_t *pending = &trace_pending[fd];
+  trace->sampled = 1;
+  trace->record.points[TRACE_ACCEPT] = pending->accept;
+  trace->record.points[TRACE_ENQUEUE] = pending->enqueue;
+  trace->record.points[TRACE_DEQUEUE] = trace->record.points[TRACE_START] = trace_now();
+  pending->sampled = 0;
+  pending->enqueue = 0;
+}
+
+void trace_mark(trace_request_t *trace, trace_point_t point) {
+  if (trace->sampled) trace->record.points[point] = trace_now();
+}
+
+void trace_parsed(trace_request_t *trace, struct http_request *request) {
+  if (!trace->sampled) return;
+  trace->record.points[TRACE_PARSE] = trace_now();
+  snprintf(trace->record.method, sizeof(trace->record.method), "%s", request->method);
+  snprintf(trace->record.path, sizeof(trace->record.path), "%s", request->path);
+}
+
+void trace_set_current(trace_request_t *trace) {
+  trace_current = trace;
+}
+
+trace_request_t *trace_get_current(void) {
+  return trace_current;
+}
+
+void trace_response_started(int fd, int status_code) {
+  trace_request_t *trace = trace_current;
+  if (!trace || !trace->sampled || trace->record.points[TRACE_FIRST_BYTE]) return;
+  trace->record.points[TRACE_FIRST_BYTE] = trace_now();
+  trace->record.status = status_code;
+}
+
+void trace_park(trace_request_t *trace) {
+  if (!trace->sampled) return;
+  trace->parked = trace_now();
+  if (!trace->record.disk_start) trace->record.disk_start = trace->parked;
+}
+
+void trace_resume(trace_request_t *trace) {
+  if (!trace->sampled) return;
+  uint64_t now = trace_now();
+  trace->record.disk_end = now;
+  trace->record.disk_wait += now - trace->parked;
+  trace->record.disk_reads++;
+}
+
+static trace_ring_t *trace_get_ring(void) {
+  if (trace_thread_ring) return trace_thread_ring;
+  trace_ring_t *ring = calloc(1, sizeof(trace_ring_t));
+  if (!ring) return NULL;
+  ring->records = calloc(trace_ring_size, sizeof(trace_record_t));
+  if (!ring->records) {
+    free(ring);
+    return NULL;
+  }
+  pthread_mutex_init(&ring->lock, NULL);
+  ring->tid = syscall(SYS_gettid);
+  pthread_mutex_lock(&trace_rings_lock);
+  DL_APPEND(trace_rings, ring);
+  pthread_mutex_unlock(&trace_rings_lock);
+  return trace_thread_ring = ring;
+}
+
+void trace_end(trace_request_t *trace) {
+  if (!trace->sampled) return;
+  uint64_t now = trace_now();
+  trace->record.points[TRACE_LAST_BYTE] = now;
+  trace_ring_t *ring = trace_get_ring();
+  if (ring && trace_ring_size > 0) {
+    pthread_mutex_lock(&ring->lock);
+    ring->records[ring->count++ % trace_ring_size] = trace->record;
+    pthread_mutex_unlock(&ring->lock);
+  }
+
+  /* The next request on this connection starts being read right away. */
+  memset(&trace->record, 0, sizeof(trace_record_t));
+  trace->record.points[TRACE_START] = now;
+}
+
+static void trace_json_string(struct http_buffer *buffer, const char *s) {
+  http_buffer_append(buffer, "\"", 1);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\')
+      http_buffer_printf(buffer, "\\%c", *s);
+    else if ((unsigned char) *s < 0x20)
+      http_buffer_printf(buffer, "\\u%04x", *s);
+    else
+      http_buffer_append(buffer, s, 1);
+  }
+  http_buffer_append(buffer, "\"", 1);
+}
+
+/* Emits a complete ("X") event from START to END, if both were reached. */
+static void trace_span(struct http_buffer *buffer, int *first, pid_t pid, pid_t tid,
+    const char *name, uint64_t start, uint64_t end, trace_record_t *record) {
+  if (!start || !end || end < start) return;
+  http_buffer_printf(buffer, "%s\n{\"name\":", *first ? "" : ",");
+  trace_json_string(buffer, name);
+  http_buffer_printf(buffer, ",\"cat\":\"request\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+      "\"pid\":%d,\"tid\":%d", start / 1000.0, (end - start) / 1000.0, pid, tid);
+  if (record) {
+    http_buffer_printf(buffer, ",\"args\":{\"status\":%d,\"disk_reads\":%d,"
+        "\"disk_wait_us\":%.3f}", record->status, record->disk_reads,
+        record->disk_wait / 1000.0);
+  }
+  http_buffer_append(buffer, "}", 1);
+  *first = 0;
+}
+
+static void trace_format_record(struct http_buffer *buffer, int *first, pid_t pid, pid_t tid,
+    trace_record_t *record) {
+  uint64_t *points = record->points;
+  uint64_t begin = 0;
+  for (int i = 0; i < TRACE_NUM_POINTS && !begin; i++) begin = points[i];
+
+  char name[sizeof(record->method) + TRACE_PATH_MAX + 1];
+  if (record->method[0])
+    snprintf(name, sizeof(name), "%s %s", record->method, record->path);
+  else
+    snprintf(name, sizeof(name), "connection");
+  trace_span(buffer, first, pid, tid, name, begin, points[TRACE_LAST_BYTE], record);
+  trace_span(buffer, first, pid, tid, "accept", points[TRACE_ACCEPT],
+      points[TRACE_ENQUEUE] ? points[TRACE_ENQUEUE] : points[TRACE_DEQUEUE], NULL);
+  trace_span(buffer, first, pid, tid, "queued", points[TRACE_ENQUEUE], points[TRACE_DEQUEUE],
+      NULL);
+  trace_span(buffer, first, pid, tid, "read request", points[TRACE_START], points[TRACE_PARSE],
+      NULL);
+  trace_span(buffer, first, pid, tid, "connect upstream", points[TRACE_START],
+      points[TRACE_UPSTREAM], NULL);
+  trace_span(buffer, first, pid, tid, "handle",
+      points[TRACE_PARSE] ? points[TRACE_PARSE] : points[TRACE_UPSTREAM],
+      points[TRACE_FIRST_BYTE], NULL);
+  trace_span(buffer, first, pid, tid, "send", points[TRACE_FIRST_BYTE], points[TRACE_LAST_BYTE],
+      NULL);
+  trace_span(buffer, first, pid, tid, "disk", record->disk_start, record->disk_end, NULL);
+}
+
+void trace_format(struct http_buffer *buffer) {
+  pid_t pid = getpid();
+  int first = 1;
+  http_buffer_printf(buffer, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+  pthread_mutex_lock(&trace_rings_lock);
+  trace_ring_t *ring;
+  DL_FOREACH(trace_rings, ring) {
+    pthread_mutex_lock(&ring->lock);
+    unsigned long count = ring->count < (unsigned long) trace_ring_size ?
+        ring->count : (unsigned long) trace_ring_size;
+    for (unsigned long i = ring->count - count; i < ring->count; i++)
+      trace_format_record(buffer, &first, pid, ring->tid, &ring->records[i % trace_ring_size]);
+    pthread_mutex_unlock(&ring->lock);
+  }
+  pthread_mutex_unlock(&trace_rings_lock);
+  http_buffer_printf(buffer, "\n]}\n");
+}
+
+int trace_save(const char *file) {
+  struct http_buffer buffer;
+  http_buffer_init(&buffer);
+  trace_format(&buffer);
+  int fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  int result = -1;
+  if (fd >= 0) {
+    result = http_send_data(fd, buffer.data, buffer.size);
+    if (close(fd) < 0) result = -1;
+  }
+  http_buffer_free(&buffer);
+  return result;
+}
@@ -0,0 +1,75 @@
+#ifndef __TRACE__
+#define __TRACE__
+
+#include <stdint.h>
+
+#include "libhttp.h"
+
+/* TRACE timestamps the life of sampled requests, from accept to the last
+ * byte of the response, so slow requests can be broken down into time spent
+ * queued, reading the request, handling it, waiting for the disk and
+ * sending. Finished requests go into a ring buffer of the thread that
+ * finished them, and trace_format dumps every ring as Chrome trace JSON
+ * that chrome://tracing and Perfetto can open. All times come from
+ * CLOCK_MONOTONIC, in nanoseconds. */
+
+#define TRACE_PATH_MAX 64
+
+typedef enum trace_point {
+  TRACE_ACCEPT,         // Returned from accept.
+  TRACE_ENQUEUE,        // Pushed on the work queue.
+  TRACE_DEQUEUE,        // Taken off the work queue by a worker.
+  TRACE_START,          // Began reading the request.
+  TRACE_PARSE,          // Request headers parsed.
+  TRACE_UPSTREAM,       // Connected to the proxy target.
+  TRACE_FIRST_BYTE,     // Response started.
+  TRACE_LAST_BYTE,      // Response done.
+  TRACE_NUM_POINTS
+} trace_point_t;
+
+typedef struct trace_record {
+  uint64_t points[TRACE_NUM_POINTS];   // 0 where a point was not reached.
+  uint64_t disk_start;                 // First wait for a disk thread.
+  uint64_t disk_end;                   // End of the last one.
+  uint64_t disk_wait;                  // Total time spent waiting.
+  int disk_reads;
+  int status;
+  char method[8];
+  char path[TRACE_PATH_MAX];
+} trace_record_t;
+
+/* The trace of the request a connection is serving. */
+typedef struct trace_request {
+  int sampled;
+  uint64_t parked;                     // When it started waiting for the disk.
+  trace_record_t record;
+} trace_request_t;
+
+/* Traces one in SAMPLE_EVERY connections, keeping the last RING_SIZE
+ * requests per thread. Tracing is off until this is called. */
+void trace_init(int sample_every, int ring_size);
+uint64_t trace_now(void);
+/* Called from the accept loop as connection fd is accepted and queued. */
+void trace_accepted(int fd);
+void trace_enqueued(int fd);
+/* Starts tracing connection fd as a worker takes it off the queue. */
+void trace_begin(trace_request_t *trace, int fd);
+void trace_mark(trace_request_t *trace, trace_point_t point);
+void trace_parsed(trace_request_t *trace, struct http_request *request);
+/* Makes TRACE the request whose response this thread is writing, NULL for
+ * none. */
+void trace_set_current(trace_request_t *trace);
+trace_request_t *trace_get_current(void);
+/* Notes the first byte of the current request's response. */
+void trace_response_started(int fd, int status_code);
+void trace_park(trace_request_t *trace);
+void trace_resume(trace_request_t *trace);
+/* Records the finished request and starts timing the next one on the same
+ * connection. */
+void trace_end(trace_request_t *trace);
+/* Appends all recorded requests to buffer as Chrome trace JSON. */
+void trace_format(struct http_buffer *buffer);
+/* Writes trace_format's output to FILE. Returns -1 on error. */
+int trace_save(const char *file);
+
+#endif
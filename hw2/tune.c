@@ -0,0 +1,77 @@
+#include <stdio.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "tune.h"
+
+#define TUNE_DEFAULT_STACK (8 * 1024 * 1024)
+#define TUNE_MIN_STACK (256 * 1024)
+
+void tune_probe(tune_t *tune) {
+  struct rlimit limit;
+  tune->fds = tune->fds_before = sysconf(_SC_OPEN_MAX);
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+    tune->fds = tune->fds_before = limit.rlim_cur;
+    if (limit.rlim_cur < limit.rlim_max) {
+      limit.rlim_cur = limit.rlim_max;
+      if (setrlimit(RLIMIT_NOFILE, &limit) == 0)
+        tune->fds = limit.rlim_cur;
+      else
+        perror("Failed to raise the fd limit");
+    }
+  }
+  tune->threads_limit = -1;
+  if (getrlimit(RLIMIT_NPROC, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+    tune->threads_limit = limit.rlim_cur;
+  tune->stack_limit = TUNE_DEFAULT_STACK;
+  if (getrlimit(RLIMIT_STACK, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+    tune->stack_limit = limit.rlim_cur;
+  tune->cores = sysconf(_SC_NPROCESSORS_ONLN);
+  if (tune->cores < 1) tune->cores = 1;
+  long pages = sysconf(_SC_PHYS_PAGES);
+  tune->memory = pages > 0 ? (size_t) pages * sysconf(_SC_PAGESIZE) : 1ul << 30;
+}
+
+int tune_threads(const tune_t *tune, int processes) {
+  /* Workers mostly wait on clients, so a few per core keep them all busy. */
+  long threads = tune->cores * 8;
+  /* Each connection being served may hold a file or upstream fd too. */
+  long by_fds = (tune_fd_high_water(tune) - 16) / 4;
+  if (threads > by_fds) threads = by_fds;
+  /* RLIMIT_NPROC counts the user's threads, so leave most of it alone. */
+  if (tune->threads_limit > 0 && threads > tune->threads_limit / 4 / processes)
+    threads = tune->threads_limit / 4 / processes;
+  if (threads > 512) threads = 512;
+  return threads < 2 ? 2 : threads;
+}
+
+size_t tune_thread_stack(const tune_t *tune, int threads) {
+  /* An eighth of memory for the stacks, were they all used up. */
+  size_t stack = tune->memory / 8 / (threads > 0 ? threads : 1);
+  if (stack > tune->stack_limit) stack = tune->stack_limit;
+  if (stack < TUNE_MIN_STACK) stack = TUNE_MIN_STACK;
+  return stack & ~(size_t) 0xffff;
+}
+
+int tune_dircache_entries(const tune_t *tune, size_t max_listing) {
+  /* A sixty-fourth of memory, if every listing were as large as allowed. */
+  size_t entries = tune->memory / 64 / (max_listing > 0 ? max_listing : 1);
+  if (entries < 64) entries = 64;
+  if (entries > 4096) entries = 4096;
+  return entries;
+}
+
+int tune_clients(const tune_t *tune) {
+  /* Every connection may come from another client. */
+  long clients = 2 * tune->fds;
+  if (clients < 65536) clients = 65536;
+  if (clients > 1 << 22) clients = 1 << 22;
+  return clients;
+}
+
+int tune_fd_high_water(const tune_t *tune) {
+  long headroom = tune->fds / 8 > 16 ? tune->fds / 8 : 16;
+  long high_water = tune->fds - headroom;
+  if (high_water > 1 << 30) high_water = 1 << 30;
+  return high_water > 16 ? high_water : 16;
+}
@@ -0,0 +1,38 @@
+#ifndef __TUNE__
+#define __TUNE__
+
+#include <stddef.h>
+
+/* TUNE sizes the server to the machine it starts on. The soft limit on
+ * open files is raised to the hard limit, and the settings --auto-tune
+ * leaves to it are derived from the fds, cores and memory available.
+ *
+ * Fds run out first under load, so connections are turned away with a 503
+ * once the fd table is nearly full. Fds are handed out lowest first, so an
+ * accepted fd at or above the high-water mark means every fd below it is
+ * taken. The rest of the table is left for the files and upstreams of the
+ * connections already being served. */
+
+typedef struct tune {
+  long fds;                     // Soft RLIMIT_NOFILE, after raising it.
+  long fds_before;              // Soft RLIMIT_NOFILE the server started with.
+  long threads_limit;           // RLIMIT_NPROC, -1 if unlimited.
+  size_t stack_limit;           // RLIMIT_STACK, 8 MB if unlimited.
+  long cores;
+  size_t memory;                // Physical memory in bytes.
+} tune_t;
+
+/* Raises the fd limit and reads the rest into TUNE. */
+void tune_probe(tune_t *tune);
+/* Worker threads for each of PROCESSES serving processes. */
+int tune_threads(const tune_t *tune, int processes);
+/* Stack size for each of THREADS threads in bytes. */
+size_t tune_thread_stack(const tune_t *tune, int threads);
+/* Directory listings to cache, at most MAX_LISTING bytes each. */
+int tune_dircache_entries(const tune_t *tune, size_t max_listing);
+/* Clients the rate limiter keeps track of. */
+int tune_clients(const tune_t *tune);
+/* Lowest fd number an accepted connection is turned away at. */
+int tune_fd_high_water(const tune_t *tune);
+
+#endif
@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "tw.h"
+#include "utlist.h"
+
+#define TW_MASK (TW_SLOTS - 1)
+
+static uint64_t tw_clock_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Puts TIMER into the level whose range covers its remaining ticks. Must
+ * hold tw->lock. */
+static void tw_place(tw_t *tw, tw_timer_t *timer) {
+  uint64_t expires = timer->expires;
+  if (expires < tw->now) expires = tw->now;
+  uint64_t delta = expires - tw->now;
+
+  int level = 0;
+  while (level < TW_LEVELS - 1 && delta >= (uint64_t) 1 << (TW_SLOT_BITS * (level + 1)))
+    level++;
+  /* Anything beyond the outermost level waits there and is re-placed. */
+  uint64_t span = (uint64_t) 1 << (TW_SLOT_BITS * TW_LEVELS);
+  if (delta >= span) expires = tw->now + span - 1;
+
+  int slot = (expires >> (TW_SLOT_BITS * level)) & TW_MASK;
+  timer->slot = &tw->slots[level][slot];
+  DL_APPEND(*timer->slot, timer);
+}
+
+/* Re-places every timer of one outer slot into the finer levels. */
+static void tw_cascade(tw_t *tw, int level, int slot) {
+  tw_timer_t *timer, *tmp, *list = tw->slots[level][slot];
+  tw->slots[level][slot] = NULL;
+  DL_FOREACH_SAFE(list, timer, tmp) {
+    DL_DELETE(list, timer);
+    tw_place(tw, timer);
+  }
+}
+
+/* Processes tick tw->now. Must hold tw->lock. */
+static void tw_tick(tw_t *tw) {
+  int slot = tw->now & TW_MASK;
+  for (int level = 1; slot == 0 && level < TW_LEVELS; level++) {
+    slot = (tw->now >> (TW_SLOT_BITS * level)) & TW_MASK;
+    tw_cascade(tw, level, slot);
+  }
+
+  tw_timer_t *timer, *tmp, **expired = &tw->slots[0][tw->now & TW_MASK];
+  DL_FOREACH_SAFE(*expired, timer, tmp) {
+    DL_DELETE(*expired, timer);
+    timer->pending = 0;
+    timer->callback(timer);
+  }
+  tw->now++;
+}
+
+static void *tw_run(void *arg) {
+  tw_t *tw = arg;
+  struct timespec interval = {
+    .tv_sec = tw->tick_ms / 1000,
+    .tv_nsec = (tw->tick_ms % 1000) * 1000000L,
+  };
+  while (1) {
+    nanosleep(&interval, NULL);
+    uint64_t target = (tw_clock_ms() - tw->start_ms) / tw->tick_ms;
+    pthread_mutex_lock(&tw->lock);
+    while (tw->now <= target) tw_tick(tw);
+    pthread_mutex_unlock(&tw->lock);
+  }
+  return NULL;
+}
+
+void tw_init(tw_t *tw, int tick_ms) {
+  pthread_mutex_init(&tw->lock, NULL);
+  tw->now = 0;
+  tw->tick_ms = tick_ms;
+  tw->start_ms = tw_clock_ms();
+  for (int level = 0; level < TW_LEVELS; level++)
+    for (int slot = 0; slot < TW_SLOTS; slot++)
+      tw->slots[level][slot] = NULL;
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, tw_run, tw) != 0) {
+    perror("Failed to start timer thread");
+    exit(1);
+  }
+  pthread_detach(thread);
+}
+
+void tw_timer_init(tw_timer_t *timer, void (*callback)(tw_timer_t *timer)) {
+  timer->callback = callback;
+  timer->pending = 0;
+  timer->slot = NULL;
+  timer->next = timer->prev = NULL;
+}
+
+void tw_add(tw_t *tw, tw_timer_t *timer, int timeout_ms) {
+  pthread_mutex_lock(&tw->lock);
+  if (timer->pending) DL_DELETE(*timer->slot, timer);
+  /* Round up so a timer never fires early. */
+  uint64_t elapsed = tw_clock_ms() - tw->start_ms;
+  timer->expires = (elapsed + timeout_ms + tw->tick_ms - 1) / tw->tick_ms;
+  timer->pending = 1;
+  tw_place(tw, timer);
+  pthread_mutex_unlock(&tw->lock);
+}
+
+void tw_cancel(tw_t *tw, tw_timer_t *timer) {
+  pthread_mutex_lock(&tw->lock);
+  if (timer->pending) {
+    DL_DELETE(*timer->slot, timer);
+    timer->pending = 0;
+  }
+  pthread_mutex_unlock(&tw->lock);
+}
@@ -0,0 +1,44 @@
+#ifndef __TW__
+#define __TW__
+
+#include <pthread.h>
+#include <stdint.h>
+
+/* TW is a hierarchical timer wheel used to time out connections. Adding,
+ * re-arming and cancelling a timer are all O(1), so every connection can
+ * carry its own timer. A background thread advances the wheel and runs the
+ * callbacks of expired timers.
+ *
+ * Callbacks run with the wheel locked, which guarantees that a timer has
+ * either fired or will never fire once tw_cancel returns. They must be short
+ * and must not call back into the wheel. */
+
+#define TW_LEVELS 4
+#define TW_SLOT_BITS 6
+#define TW_SLOTS (1 << TW_SLOT_BITS)
+
+typedef struct tw_timer {
+  uint64_t expires;                  // Tick at which the timer fires.
+  void (*callback)(struct tw_timer *timer);
+  int pending;
+  struct tw_timer **slot;            // List the timer is queued on.
+  struct tw_timer *next;
+  struct tw_timer *prev;
+} tw_timer_t;
+
+typedef struct tw {
+  pthread_mutex_t lock;
+  uint64_t now;                      // Next tick to be processed.
+  uint64_t start_ms;
+  int tick_ms;
+  tw_timer_t *slots[TW_LEVELS][TW_SLOTS];
+} tw_t;
+
+/* Initializes TW and starts the thread that advances it every TICK_MS. */
+void tw_init(tw_t *tw, int tick_ms);
+void tw_timer_init(tw_timer_t *timer, void (*callback)(tw_timer_t *timer));
+/* Arms TIMER to fire TIMEOUT_MS from now, re-arming it if already pending. */
+void tw_add(tw_t *tw, tw_timer_t *timer, int timeout_ms);
+void tw_cancel(tw_t *tw, tw_timer_t *timer);
+
+#endif
@@ -0,0 +1,189 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "upgrade.h"
+
+/* How long the old process waits for the new one to start accepting. */
+#define UPGRADE_TIMEOUT_MS 30000
+/* The new process gets its end of the socket pair as this fd. */
+#define UPGRADE_CHANNEL_FD 3
+
+static int upgrade_channel = -1;
+
+static int upgrade_write_all(int fd, char *data, size_t size) {
+  while (size > 0) {
+    ssize_t n = write(fd, data, size);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    data += n;
+    size -= n;
+  }
+  return 0;
+}
+
+/* Sends the listening socket along with the length of the hot list. */
+static int upgrade_send_fd(int channel, int listen_fd, uint32_t list_size) {
+  char control[CMSG_SPACE(sizeof(int))];
+  memset(control, 0, sizeof(control));
+  struct iovec iov = { .iov_base = &list_size, .iov_len = sizeof(list_size) };
+  struct msghdr message = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control,
+    .msg_controllen = sizeof(control),
+  };
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &listen_fd, sizeof(int));
+  return sendmsg(channel, &message, 0) == sizeof(list_size) ? 0 : -1;
+}
+
+/* Returns a copy of this process's environment that tells the new process
+ * where its channel is. Built before forking, since a child of a threaded
+ * process may only make async-signal-safe calls, which malloc is not. */
+static char **upgrade_environment(void) {
+  extern char **environ;
+  static char channel_variable[sizeof(UPGRADE_ENV) + 16];
+  snprintf(channel_variable, sizeof(channel_variable), "%s=%d", UPGRADE_ENV, UPGRADE_CHANNEL_FD);
+  size_t count = 0;
+  while (environ[count]) count++;
+  char **envp = malloc((count + 2) * sizeof(char *));
+  if (!envp) return NULL;
+  size_t n = 0;
+  for (size_t i = 0; i < count; i++)
+    if (strncmp(environ[i], UPGRADE_ENV "=", sizeof(UPGRADE_ENV)) != 0) envp[n++] = environ[i];
+  envp[n++] = channel_variable;
+  envp[n] = NULL;
+  return envp;
+}
+
+int upgrade_handoff(char **argv, int listen_fd, struct http_buffer *hotlist) {
+  char **envp = upgrade_environment();
+  if (!envp) {
+    perror("Upgrade: failed to copy the environment");
+    return -1;
+  }
+  int channel[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, channel) < 0) {
+    perror("Upgrade: failed to create socket pair");
+    free(envp);
+    return -1;
+  }
+
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("Upgrade: failed to fork");
+    close(channel[0]);
+    close(channel[1]);
+    free(envp);
+    return -1;
+  } else if (pid == 0) {
+    /* Nothing but the channel may leak into the new binary, least of all
+     * client connections it would never close. */
+    if (dup2(channel[1], UPGRADE_CHANNEL_FD) < 0) _exit(1);
+    close_range(UPGRADE_CHANNEL_FD + 1, ~0U, 0);
+    signal(SIGPIPE, SIG_DFL);
+    execvpe(argv[0], argv, envp);
+    static char message[] = "Upgrade: failed to exec\n";
+    write(STDERR_FILENO, message, sizeof(message) - 1);
+    _exit(1);
+  }
+  close(channel[1]);
+  free(envp);
+  printf("Upgrade: started pid %d\n", pid);
+
+  int ok = upgrade_send_fd(channel[0], listen_fd, hotlist->size) == 0 &&
+      upgrade_write_all(channel[0], hotlist->data, hotlist->size) == 0;
+
+  /* Wait for the new process to report that it is accepting. */
+  char ready = 0;
+  if (ok) {
+    struct pollfd pfd = { .fd = channel[0], .events = POLLIN };
+    int n;
+    while ((n = poll(&pfd, 1, UPGRADE_TIMEOUT_MS)) < 0 && errno == EINTR);
+    ok = n == 1 && read(channel[0], &ready, 1) == 1 && ready == 'R';
+  }
+  close(channel[0]);
+
+  if (!ok) {
+    fprintf(stderr, "Upgrade: pid %d did not take over, keep serving\n", pid);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return -1;
+  }
+  printf("Upgrade: pid %d took over, draining\n", pid);
+  return 0;
+}
+
+static int upgrade_read_all(int fd, char *data, size_t size) {
+  while (size > 0) {
+    ssize_t n = read(fd, data, size);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    data += n;
+    size -= n;
+  }
+  return 0;
+}
+
+int upgrade_receive(struct http_buffer *hotlist) {
+  char *value = getenv(UPGRADE_ENV);
+  if (!value) return -1;
+  upgrade_channel = atoi(value);
+  unsetenv(UPGRADE_ENV);
+
+  uint32_t list_size;
+  char control[CMSG_SPACE(sizeof(int))];
+  struct iovec iov = { .iov_base = &list_size, .iov_len = sizeof(list_size) };
+  struct msghdr message = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control,
+    .msg_controllen = sizeof(control),
+  };
+  if (recvmsg(upgrade_channel, &message, 0) != sizeof(list_size)) {
+    perror("Upgrade: failed to receive listening socket");
+    exit(1);
+  }
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+  if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+    fprintf(stderr, "Upgrade: no listening socket received\n");
+    exit(1);
+  }
+  int listen_fd;
+  memcpy(&listen_fd, CMSG_DATA(cmsg), sizeof(int));
+
+  http_buffer_init(hotlist);
+  char *list = malloc(list_size + 1);
+  if (!list || upgrade_read_all(upgrade_channel, list, list_size) < 0) {
+    fprintf(stderr, "Upgrade: failed to receive hot file list\n");
+    exit(1);
+  }
+  list[list_size] = '\0';
+  hotlist->data = list;
+  hotlist->size = list_size;
+  hotlist->capacity = list_size + 1;
+  printf("Upgrade: inherited listening socket %d\n", listen_fd);
+  return listen_fd;
+}
+
+void upgrade_complete(void) {
+  if (upgrade_channel < 0) return;
+  char ready = 'R';
+  if (upgrade_write_all(upgrade_channel, &ready, 1) < 0)
+    perror("Upgrade: failed to notify the old process");
+  close(upgrade_channel);
+  upgrade_channel = -1;
+}
@@ -0,0 +1,29 @@
+#ifndef __UPGRADE__
+#define __UPGRADE__
+
+#include "libhttp.h"
+
+/* UPGRADE replaces a running server with a freshly exec'd binary without
+ * closing the listening socket. The old process starts the new one with one
+ * end of a Unix socket pair and sends it the listening socket (SCM_RIGHTS)
+ * and its hot file list. Once the new process reports that it is accepting,
+ * the old one stops accepting, drains and exits. Both accept on the same
+ * socket in between, so no connection is refused. */
+
+#define UPGRADE_ENV "HTTPSERVER_UPGRADE_FD"
+
+/* Old side: execs ARGV and hands it LISTEN_FD and HOTLIST. Returns 0 once
+ * the new process is accepting, or -1 if the upgrade failed and this
+ * process must keep serving. */
+int upgrade_handoff(char **argv, int listen_fd, struct http_buffer *hotlist);
+
+/* New side: if this process was started by upgrade_handoff, receives the
+ * listening socket and stores the hot file list in HOTLIST (NUL-terminated).
+ * Returns the listening socket, or -1 for a normal start. */
+int upgrade_receive(struct http_buffer *hotlist);
+
+/* New side: tells the old process that this one is accepting. Does nothing
+ * on a normal start. */
+void upgrade_complete(void);
+
+#endif
@@ -0,0 +1,269 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "coro.h"
+#include "upload.h"
+
+/* Most bytes moved by one splice. */
+#define UPLOAD_CHUNK (64 * 1024)
+/* Bytes copied at a time when splicing isn't possible. Kept off the stack,
+ * which a coroutine's may be too small for. */
+#define UPLOAD_COPY_SIZE 16384
+/* Longest chunk-size or trailer line accepted. */
+#define UPLOAD_LINE_MAX 1024
+
+void upload_init(upload_t *upload, int sock, const char *buffered, size_t buffered_size,
+    int file_fd, long long max_size, long rate, upload_progress_t progress, void *arg) {
+  upload->sock = sock;
+  upload->file_fd = file_fd;
+  upload->buffered = buffered;
+  upload->buffered_size = buffered_size;
+  if (pipe2(upload->pipe, O_CLOEXEC) < 0) upload->pipe[0] = upload->pipe[1] = -1;
+  upload->copy_buffer = NULL;
+  upload->received = 0;
+  upload->max_size = max_size;
+  upload->rate = rate;
+  clock_gettime(CLOCK_MONOTONIC, &upload->started);
+  upload->left = -1;
+  upload->wait_ms = 0;
+  upload->park = 0;
+  upload->progress = progress;
+  upload->progress_arg = arg;
+  upload->tap = NULL;
+  upload->error = UPLOAD_OK;
+}
+
+static void upload_close_pipe(upload_t *upload) {
+  if (upload->pipe[0] < 0) return;
+  close(upload->pipe[0]);
+  close(upload->pipe[1]);
+  upload->pipe[0] = upload->pipe[1] = -1;
+}
+
+void upload_free(upload_t *upload) {
+  upload_close_pipe(upload);
+  free(upload->copy_buffer);
+  upload->copy_buffer = NULL;
+}
+
+void upload_tap(upload_t *upload, upload_tap_t tap) {
+  upload->tap = tap;
+  upload_close_pipe(upload);
+}
+
+int upload_open_file(const char *directory, char *temp, size_t temp_size) {
+  temp[0] = '\0';
+  int fd = open(directory, O_TMPFILE | O_WRONLY | O_CLOEXEC, 0644);
+  if (fd >= 0 || (errno != EOPNOTSUPP && errno != EISDIR)) return fd;
+  snprintf(temp, temp_size, "%s/.upload.XXXXXX", directory);
+  return mkostemp(temp, O_CLOEXEC);
+}
+
+/* Linkat can't replace a file, so an unnamed file is linked under a new
+ * temporary name and renamed over PATH from there. */
+int upload_commit_file(int file_fd, const char *directory, char *temp, size_t temp_size,
+    const char *path) {
+  static unsigned counter;
+  if (!temp[0]) {
+    char proc_path[64];
+    snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", file_fd);
+    while (1) {
+      snprintf(temp, temp_size, "%s/.upload.%d.%u", directory, (int) getpid(),
+          __sync_fetch_and_add(&counter, 1));
+      if (linkat(AT_FDCWD, proc_path, AT_FDCWD, temp, AT_SYMLINK_FOLLOW) == 0) break;
+      if (errno != EEXIST) {
+        temp[0] = '\0';
+        return -1;
+      }
+    }
+  }
+  return rename(temp, path);
+}
+
+static int upload_fail(upload_t *upload, upload_error_t error) {
+  upload->error = error;
+  return -1;
+}
+
+static void upload_waiting(upload_t *upload) {
+  if (upload->progress) upload->progress(upload->progress_arg);
+}
+
+/* Waits until the rate allows reading more of the body, then returns how
+ * much, at most WANTED. Pieces are small at low rates, so that the client
+ * is never left unread for long. A parking upload doesn't wait, but gets 0
+ * with wait_ms set. */
+static size_t upload_allowance(upload_t *upload, size_t wanted) {
+  if (upload->rate <= 0) return wanted;
+  size_t piece = upload->rate / 8 > 512 ? upload->rate / 8 : 512;
+  if (wanted > piece) wanted = piece;
+  while (1) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - upload->started.tv_sec) +
+        (now.tv_nsec - upload->started.tv_nsec) / 1e9;
+    double allowed = elapsed * upload->rate - upload->received;
+    if (allowed >= wanted) return wanted;
+    upload->wait_ms = (long) ((wanted - allowed) * 1000 / upload->rate) + 1;
+    if (upload->park) return 0;
+    coro_sleep(upload->wait_ms);
+  }
+}
+
+static int write_all(int fd, const char *data, size_t size) {
+  while (size > 0) {
+    ssize_t n = write(fd, data, size);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) return -1;
+    data += n;
+    size -= n;
+  }
+  return 0;
+}
+
+/* Copies up to SIZE bytes from the socket through user space, for sockets
+ * that can't be spliced. */
+static ssize_t upload_read_write(upload_t *upload, size_t size) {
+  if (!upload->copy_buffer && !(upload->copy_buffer = malloc(UPLOAD_COPY_SIZE)))
+    return upload_fail(upload, UPLOAD_FILE_FAILED);
+  ssize_t n;
+  size_t wanted = size < UPLOAD_COPY_SIZE ? size : UPLOAD_COPY_SIZE;
+  while ((n = coro_read(upload->sock, upload->copy_buffer, wanted)) < 0 && errno == EINTR)
+    ;
+  if (n <= 0) return upload_fail(upload, UPLOAD_CLIENT_FAILED);
+  if (upload->tap) upload->tap(upload->sock, upload->copy_buffer, n);
+  if (write_all(upload->file_fd, upload->copy_buffer, n) < 0)
+    return upload_fail(upload, UPLOAD_FILE_FAILED);
+  return n;
+}
+
+/* Moves up to SIZE bytes from the socket into the file through the pipe. */
+static ssize_t upload_splice(upload_t *upload, size_t size) {
+  ssize_t n;
+  /* Splice can't be told not to wait, so a coroutine waits beforehand. */
+  if (coro_self() && coro_poll(upload->sock, POLLIN, -1) < 0)
+    return upload_fail(upload, UPLOAD_CLIENT_FAILED);
+  while ((n = splice(upload->sock, NULL, upload->pipe[1], NULL, size, SPLICE_F_MOVE)) < 0 &&
+      errno == EINTR)
+    ;
+  if (n < 0 && errno == EINVAL) {
+    upload_close_pipe(upload);
+    return upload_read_write(upload, size);
+  }
+  if (n <= 0) return upload_fail(upload, UPLOAD_CLIENT_FAILED);
+  for (ssize_t left = n; left > 0; ) {
+    ssize_t m = splice(upload->pipe[0], NULL, upload->file_fd, NULL, left, SPLICE_F_MOVE);
+    if (m < 0 && errno == EINTR) continue;
+    if (m <= 0) return upload_fail(upload, UPLOAD_FILE_FAILED);
+    left -= m;
+  }
+  return n;
+}
+
+/* Starts copying SIZE bytes of body data. */
+static int upload_start(upload_t *upload, long long size) {
+  if (size > upload->max_size - upload->received) return upload_fail(upload, UPLOAD_TOO_LARGE);
+  upload->left = size;
+  return 0;
+}
+
+/* Moves the data left into the file. Returns 1 if a parking upload has to
+ * wait for the rate first. */
+static int upload_copy(upload_t *upload) {
+  while (upload->left > 0) {
+    if (upload->buffered_size > 0) {
+      size_t n = (long long) upload->buffered_size < upload->left ?
+          upload->buffered_size : upload->left;
+      if (write_all(upload->file_fd, upload->buffered, n) < 0)
+        return upload_fail(upload, UPLOAD_FILE_FAILED);
+      upload->buffered += n;
+      upload->buffered_size -= n;
+      upload->received += n;
+      upload->left -= n;
+      continue;
+    }
+    size_t wanted = upload_allowance(upload,
+        upload->left < UPLOAD_CHUNK ? upload->left : UPLOAD_CHUNK);
+    if (wanted == 0) return 1;
+    upload_waiting(upload);
+    ssize_t n = upload->pipe[0] >= 0 ? upload_splice(upload, wanted) :
+        upload_read_write(upload, wanted);
+    if (n < 0) return -1;
+    upload->received += n;
+    upload->left -= n;
+  }
+  return 0;
+}
+
+/* Returns the next byte of the body stream, or -1 at its end. */
+static int upload_getc(upload_t *upload) {
+  if (upload->buffered_size > 0) {
+    upload->buffered_size--;
+    return (unsigned char) *upload->buffered++;
+  }
+  char c;
+  ssize_t n;
+  while ((n = coro_read(upload->sock, &c, 1)) < 0 && errno == EINTR)
+    ;
+  if (n != 1) return -1;
+  if (upload->tap) upload->tap(upload->sock, &c, 1);
+  return (unsigned char) c;
+}
+
+/* Reads a line of chunk framing without its line ending. The socket is
+ * read a byte at a time so that none of the data after it is consumed. */
+static int upload_read_line(upload_t *upload, char *line, size_t size) {
+  size_t length = 0;
+  int c;
+  upload_waiting(upload);
+  while ((c = upload_getc(upload)) >= 0) {
+    if (c == '\n') {
+      if (length > 0 && line[length - 1] == '\r') length--;
+      line[length] = '\0';
+      return 0;
+    }
+    if (length + 1 >= size) return upload_fail(upload, UPLOAD_MALFORMED);
+    line[length++] = c;
+  }
+  return upload_fail(upload, UPLOAD_CLIENT_FAILED);
+}
+
+int upload_receive(upload_t *upload, long long content_length, int park) {
+  upload->park = park;
+  if (content_length >= 0) {
+    if (upload->left < 0 && upload_start(upload, content_length) < 0) return -1;
+    return upload_copy(upload);
+  }
+
+  /* Waits for the rate only come up while copying a chunk, so that is
+   * where a parked upload picks up again. */
+  char line[UPLOAD_LINE_MAX];
+  while (1) {
+    if (upload->left >= 0) {
+      int result = upload_copy(upload);
+      if (result != 0) return result;
+      upload->left = -1;
+      if (upload_read_line(upload, line, sizeof(line)) < 0) return -1;
+      if (line[0]) return upload_fail(upload, UPLOAD_MALFORMED);
+    }
+    if (upload_read_line(upload, line, sizeof(line)) < 0) return -1;
+    char *end;
+    errno = 0;
+    long long size = strtoll(line, &end, 16);
+    if (end == line || errno || size < 0 || (*end && *end != ';' && *end != ' '))
+      return upload_fail(upload, UPLOAD_MALFORMED);
+    if (size == 0) break;
+    if (upload_start(upload, size) < 0) return -1;
+  }
+  /* Trailers carry nothing a file needs. */
+  do {
+    if (upload_read_line(upload, line, sizeof(line)) < 0) return -1;
+  } while (line[0]);
+  return 0;
+}
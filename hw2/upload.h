@@ -0,0 +1,76 @@
+#ifndef __UPLOAD__
+#define __UPLOAD__
+
+#include <time.h>
+
+/* UPLOAD receives a request body into a file without holding it in memory.
+ * The body bytes read along with the request head are written out first,
+ * and the rest is spliced from the socket through a pipe straight into the
+ * file, so it never passes through user space. Bodies may be delimited by
+ * Content-Length or sent chunked; chunk framing is read off the socket and
+ * only the data is spliced.
+ *
+ * An upload may be capped to a rate: it then only takes from the socket
+ * what the rate allows so far, which makes TCP slow the client down. While
+ * it waits for the rate to allow more, it either sleeps or returns to be
+ * carried on later, so that the wait needn't hold a thread. */
+
+typedef enum upload_error {
+  UPLOAD_OK,
+  UPLOAD_CLIENT_FAILED,         // The client went away or timed out.
+  UPLOAD_MALFORMED,             // Bad chunk framing.
+  UPLOAD_TOO_LARGE,
+  UPLOAD_FILE_FAILED,           // Writing the file failed, see errno.
+} upload_error_t;
+
+/* Called before each wait on the client, e.g. to re-arm its timeout. */
+typedef void (*upload_progress_t)(void *arg);
+/* Given each piece of the body read off socket SOCK. */
+typedef void (*upload_tap_t)(int sock, const char *data, size_t size);
+
+typedef struct upload {
+  int sock;
+  int file_fd;
+  const char *buffered;         // Body bytes read with the head, not yet used.
+  size_t buffered_size;
+  int pipe[2];                  // -1 when splicing isn't possible.
+  char *copy_buffer;            // For copying when it isn't, or NULL.
+  long long received;           // Body bytes written to the file.
+  long long max_size;
+  long rate;                    // Bytes per second, 0 for no cap.
+  struct timespec started;
+  long long left;               // Data left in the body or chunk, -1 between chunks.
+  long wait_ms;                 // How long until the rate allows more.
+  int park;                     // Return instead of sleeping for the rate.
+  upload_progress_t progress;
+  void *progress_arg;
+  upload_tap_t tap;             // NULL unless the body is being recorded.
+  upload_error_t error;
+} upload_t;
+
+/* Prepares to read a body from SOCK into FILE_FD. BUFFERED holds the body
+ * bytes that came with the head. Bodies over MAX_SIZE are refused. */
+void upload_init(upload_t *upload, int sock, const char *buffered, size_t buffered_size,
+    int file_fd, long long max_size, long rate, upload_progress_t progress, void *arg);
+/* Receives the body, CONTENT_LENGTH bytes or chunked if it is -1. Returns
+ * -1 with upload->error set on failure. On success, upload->buffered holds
+ * what followed the body in the bytes that came with the head. If PARK is set and the rate allows
+ * no more for now, returns 1 with upload->wait_ms set instead of sleeping:
+ * call it again with the same CONTENT_LENGTH after that long to go on. */
+int upload_receive(upload_t *upload, long long content_length, int park);
+/* Hands TAP everything read off the socket, framing included. The body
+ * is then copied rather than spliced, as TAP has to see it. */
+void upload_tap(upload_t *upload, upload_tap_t tap);
+void upload_free(upload_t *upload);
+
+/* Opens a file in DIRECTORY for a body. It has no name, so a partial upload
+ * is never served and none is left behind if the server dies. Where that
+ * isn't supported, it gets a hidden temporary name, stored in TEMP, which
+ * is otherwise set to "". */
+int upload_open_file(const char *directory, char *temp, size_t temp_size);
+/* Puts the complete file FILE_FD from upload_open_file at PATH, replacing
+ * any file there. TEMP names the file if this fails after naming it. */
+int upload_commit_file(int file_fd, const char *directory, char *temp, size_t temp_size,
+    const char *path);
+
+#endif
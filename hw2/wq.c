@@ -1,7 +1,28 @@
 #include <stdlib.h>
+#include <time.h>
+#include "stats.h"
 #include "wq.h"
 #include "utlist.h"
 
+/* Queue waits over this count as slow in the stats. */
+#define WQ_SLOW_NS (10 * 1000000ll)
+
+static const stat_counter_t wq_jobs_counters[WQ_NUM_CLASSES] = {
+  STAT_QUEUE_SMALL_JOBS, STAT_QUEUE_MEDIUM_JOBS, STAT_QUEUE_LARGE_JOBS,
+};
+static const stat_counter_t wq_wait_counters[WQ_NUM_CLASSES] = {
+  STAT_QUEUE_SMALL_WAIT_US, STAT_QUEUE_MEDIUM_WAIT_US, STAT_QUEUE_LARGE_WAIT_US,
+};
+static const stat_counter_t wq_slow_counters[WQ_NUM_CLASSES] = {
+  STAT_QUEUE_SMALL_SLOW, STAT_QUEUE_MEDIUM_SLOW, STAT_QUEUE_LARGE_SLOW,
+};
+
+uint64_t wq_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
 /* Initializes a work queue WQ. */
 void wq_init(wq_t *wq) {
 
@@ -10,32 +31,133 @@ void wq_init(wq_t *wq) {
   pthread_cond_init(&(wq->cv), NULL);
 
   wq->size = 0;
-  wq->head = NULL;
+  for (int i = 0; i < WQ_NUM_CLASSES; i++) wq->heads[i] = NULL;
+  wq->free_items = NULL;
+  wq->policy = WQ_FIFO;
+  wq->aging_ms = 0;
   wq->shutdown = 0;
 }
 
+void wq_set_policy(wq_t *wq, wq_policy_t policy, int aging_ms) {
+  wq->policy = policy;
+  wq->aging_ms = aging_ms;
+}
+
+wq_class_t wq_class_for_cost(size_t bytes) {
+  if (bytes <= WQ_SMALL_COST) return WQ_SMALL;
+  if (bytes <= WQ_MEDIUM_COST) return WQ_MEDIUM;
+  return WQ_LARGE;
+}
+
+/* Returns when an item of CLASS pushed at PUSHED is due, in ns from NOW:
+ * its class counts AGING_MS each, less the time it has waited. Lower is
+ * served first. */
+static int64_t wq_rank(wq_t *wq, wq_class_t class, uint64_t pushed, uint64_t now) {
+  if (wq->aging_ms <= 0) return class;
+  return class * wq->aging_ms * 1000000ll - (int64_t) (now - pushed);
+}
+
+/* Returns the list to pop from next. */
+static wq_item_t **wq_next(wq_t *wq, uint64_t now) {
+  if (wq->policy == WQ_FIFO) return &wq->heads[0];
+  wq_item_t **best = NULL;
+  int64_t best_rank = 0;
+  for (int class = 0; class < WQ_NUM_CLASSES; class++) {
+    wq_item_t *head = wq->heads[class];
+    if (!head) continue;
+    int64_t rank = wq_rank(wq, class, head->pushed, now);
+    if (!best || rank < best_rank) {
+      best = &wq->heads[class];
+      best_rank = rank;
+    }
+  }
+  return best;
+}
+
+int wq_has_cheaper(wq_t *wq, wq_class_t class, uint64_t pushed) {
+  if (wq->policy == WQ_FIFO) return 0;
+  uint64_t now = wq_now();
+  int64_t rank = wq_rank(wq, class, pushed, now);
+  for (int other = 0; other < WQ_NUM_CLASSES; other++) {
+    wq_item_t *head = wq->heads[other];
+    if (other != (int) class && head && wq_rank(wq, other, head->pushed, now) < rank)
+      return 1;
+  }
+  return 0;
+}
+
 /* Remove an item from the WQ. This function should block until there
  * is at least one item on the queue. */
-int wq_pop(wq_t *wq) {
+int wq_pop(wq_t *wq, void **data) {
 
   /* TODO: Make me blocking and thread-safe! */
 
-  wq_item_t *wq_item = wq->head;
-  int client_socket_fd = wq->head->client_socket_fd;
+  uint64_t now = wq_now();
+  wq_item_t **head = wq_next(wq, now);
+  wq_item_t *wq_item = *head;
+  int client_socket_fd = wq_item->client_socket_fd;
+  if (data) *data = wq_item->data;
   wq->size--;
-  DL_DELETE(wq->head, wq->head);
+  DL_DELETE(*head, wq_item);
 
-  free(wq_item);
+  wq_class_t class = wq_item->class;
+  uint64_t waited = now - wq_item->pushed;
+  stats_add(wq_jobs_counters[class], 1);
+  stats_add(wq_wait_counters[class], waited / 1000);
+  if (waited > WQ_SLOW_NS) stats_add(wq_slow_counters[class], 1);
+  if (wq->policy == WQ_SJF)
+    for (int cheaper = 0; cheaper < (int) class; cheaper++)
+      if (wq->heads[cheaper]) {
+        stats_add(STAT_QUEUE_AGED, 1);
+        break;
+      }
+
+  /* Keep the item for the next push instead of freeing it. */
+  LL_PREPEND(wq->free_items, wq_item);
   return client_socket_fd;
 }
 
 /* Add ITEM to WQ. */
 void wq_push(wq_t *wq, int client_socket_fd) {
+  wq_push_data(wq, client_socket_fd, NULL);
+}
+
+/* Add ITEM to WQ along with the state needed to carry on serving it. */
+void wq_push_data(wq_t *wq, int client_socket_fd, void *data) {
+  wq_push_class(wq, client_socket_fd, data, WQ_SMALL);
+}
+
+/* Add ITEM to WQ, to be scheduled as costing CLASS. */
+void wq_push_class(wq_t *wq, int client_socket_fd, void *data, wq_class_t class) {
+  wq_push_at(wq, client_socket_fd, data, class, wq_now());
+}
+
+/* Add ITEM to WQ, to be scheduled as costing CLASS and waiting since PUSHED. */
+void wq_push_at(wq_t *wq, int client_socket_fd, void *data, wq_class_t class,
+    uint64_t pushed) {
 
   /* TODO: Make me thread-safe! */
 
-  wq_item_t *wq_item = calloc(1, sizeof(wq_item_t));
+  wq_item_t *wq_item = wq->free_items;
+  if (wq_item)
+    LL_DELETE(wq->free_items, wq_item);
+  else
+    wq_item = calloc(1, sizeof(wq_item_t));
   wq_item->client_socket_fd = client_socket_fd;
-  DL_APPEND(wq->head, wq_item);
+  wq_item->data = data;
+  wq_item->class = class;
+  wq_item->pushed = pushed;
+  /* Keep each list in the order items started waiting, which requeued
+   * items may be older than the newest. Searching from the tail, as new
+   * items go there, finds the spot straight away for them. */
+  wq_item_t **head = &wq->heads[wq->policy == WQ_SJF ? class : 0];
+  wq_item_t *after = *head ? (*head)->prev : NULL;
+  while (after && after->pushed > pushed) after = after == *head ? NULL : after->prev;
+  if (!after)
+    DL_PREPEND(*head, wq_item);
+  else if (!after->next)
+    DL_APPEND(*head, wq_item);
+  else
+    DL_PREPEND_ELEM(*head, after->next, wq_item);
   wq->size++;
 }
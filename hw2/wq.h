@@ -2,27 +2,72 @@
 #define __WQ__
 
 #include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
 
 /* WQ defines a work queue which will be used to store accepted client sockets
- * waiting to be served. */
+ * waiting to be served.
+ *
+ * Items carry a cost class, from the bytes they are expected to send. The
+ * FIFO policy serves them in push order. The SJF policy keeps a list per
+ * class and serves the cheapest class first, so small responses don't wait
+ * behind large ones; to keep large ones from starving, every AGING_MS an
+ * item has waited counts as one class cheaper. Either way the time items
+ * wait is counted per class in the stats. */
+
+typedef enum wq_policy {
+  WQ_FIFO,
+  WQ_SJF,
+} wq_policy_t;
+
+typedef enum wq_class {
+  WQ_SMALL,             // New connections, whose cost is unknown, and small sends.
+  WQ_MEDIUM,
+  WQ_LARGE,
+  WQ_NUM_CLASSES
+} wq_class_t;
+
+#define WQ_SMALL_COST (256 * 1024)        // Most bytes left to send for WQ_SMALL.
+#define WQ_MEDIUM_COST (8 * 1024 * 1024)
 
 typedef struct wq_item {
   int client_socket_fd; // Client socket to be served.
+  void *data;           // Connection state to resume it with, or NULL.
+  wq_class_t class;
+  uint64_t pushed;      // Monotonic time in ns.
   struct wq_item *next;
   struct wq_item *prev;
 } wq_item_t;
 
 typedef struct wq {
   int size;
-  wq_item_t *head;
+  wq_item_t *heads[WQ_NUM_CLASSES];  // FIFO keeps every item in the first.
+  wq_item_t *free_items;  // Popped items, reused by later pushes.
+  wq_policy_t policy;
+  int aging_ms;
   /* TODO: More stuff here, maybe? */
   pthread_mutex_t lock;
   pthread_cond_t cv;
   int shutdown;
 } wq_t;
 
+/* Returns the monotonic time in ns that items are pushed at. */
+uint64_t wq_now(void);
 void wq_init(wq_t *wq);
+/* Switches to POLICY. AGING_MS of 0 never promotes waiting items. */
+void wq_set_policy(wq_t *wq, wq_policy_t policy, int aging_ms);
+/* Returns the class of an item expected to send BYTES. */
+wq_class_t wq_class_for_cost(size_t bytes);
 void wq_push(wq_t *wq, int client_socket_fd);
-int wq_pop(wq_t *wq);
+void wq_push_data(wq_t *wq, int client_socket_fd, void *data);
+void wq_push_class(wq_t *wq, int client_socket_fd, void *data, wq_class_t class);
+/* Pushes as if at PUSHED, so that work put back keeps the age it had. */
+void wq_push_at(wq_t *wq, int client_socket_fd, void *data, wq_class_t class,
+    uint64_t pushed);
+/* Returns 1 if the policy would serve a waiting item before one of CLASS
+ * pushed at PUSHED. */
+int wq_has_cheaper(wq_t *wq, wq_class_t class, uint64_t pushed);
+/* Returns the next socket, storing its data in *data if data isn't NULL. */
+int wq_pop(wq_t *wq, void **data);
 
 #endif